@@ -0,0 +1,197 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "deque.h"
+
+
+#define DEQUE_INITIAL_SIZE  256
+
+
+DEQUE_ARRAY* _deque_array_create(
+    int64_t size)
+{
+  DEQUE_ARRAY* array = (DEQUE_ARRAY*) malloc(
+      sizeof(DEQUE_ARRAY) + (size - 1) * sizeof(void*));
+
+  if (array != NULL)
+  {
+    array->size = size;
+    array->previous = NULL;
+  }
+
+  return array;
+}
+
+
+int deque_init(
+    DEQUE* deque)
+{
+  deque->top = 0;
+  deque->bottom = 0;
+  deque->array = _deque_array_create(DEQUE_INITIAL_SIZE);
+
+  if (deque->array == NULL)
+    return ENOMEM;
+
+  return 0;
+}
+
+
+void deque_destroy(
+    DEQUE* deque)
+{
+  DEQUE_ARRAY* array = deque->array;
+  DEQUE_ARRAY* previous;
+
+  while (array != NULL)
+  {
+    previous = array->previous;
+    free(array);
+    array = previous;
+  }
+
+  deque->array = NULL;
+}
+
+
+//
+// deque_push
+//
+// Adds an item at the bottom of the deque, growing it if it's full.
+//
+
+int deque_push(
+    DEQUE* deque,
+    void* item)
+{
+  DEQUE_ARRAY* array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+  DEQUE_ARRAY* new_array;
+
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  int64_t i;
+
+  if (bottom - top > array->size - 1)
+  {
+    new_array = _deque_array_create(array->size * 2);
+
+    if (new_array == NULL)
+      return ENOMEM;
+
+    for (i = top; i < bottom; i++)
+      new_array->items[i % new_array->size] = array->items[i % array->size];
+
+    new_array->previous = array;
+    __atomic_store_n(&deque->array, new_array, __ATOMIC_RELEASE);
+    array = new_array;
+  }
+
+  __atomic_store_n(
+      &array->items[bottom % array->size], item, __ATOMIC_RELAXED);
+
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+
+  return 0;
+}
+
+
+//
+// deque_pop
+//
+// Removes the item at the bottom of the deque, the one pushed most
+// recently. Returns DEQUE_EMPTY if the deque is empty.
+//
+
+void* deque_pop(
+    DEQUE* deque)
+{
+  DEQUE_ARRAY* array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  int64_t top;
+
+  void* item = DEQUE_EMPTY;
+
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+  if (top <= bottom)
+  {
+    item = __atomic_load_n(
+        &array->items[bottom % array->size], __ATOMIC_RELAXED);
+
+    // This is the last item, a thief could be stealing it right now.
+
+    if (top == bottom)
+    {
+      if (!__atomic_compare_exchange_n(
+              &deque->top, &top, top + 1, 0,
+              __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        item = DEQUE_EMPTY;
+
+      __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+  }
+  else
+  {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+
+  return item;
+}
+
+
+//
+// deque_steal
+//
+// Removes the item at the top of the deque, the oldest one. Returns
+// DEQUE_EMPTY if the deque is empty, or DEQUE_ABORT if another thread took
+// the item first, in which case the caller can try again.
+//
+
+void* deque_steal(
+    DEQUE* deque)
+{
+  DEQUE_ARRAY* array;
+
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  int64_t bottom;
+
+  void* item;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+  if (top >= bottom)
+    return DEQUE_EMPTY;
+
+  array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+  item = __atomic_load_n(&array->items[top % array->size], __ATOMIC_RELAXED);
+
+  if (!__atomic_compare_exchange_n(
+          &deque->top, &top, top + 1, 0,
+          __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return DEQUE_ABORT;
+
+  return item;
+}
@@ -0,0 +1,71 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <stdint.h>
+
+
+// Lock-free work-stealing deque (Chase and Lev, "Dynamic Circular
+// Work-Stealing Deque"). The thread owning the deque pushes and pops items
+// at the bottom, other threads steal items from the top. Only the owner can
+// call deque_push and deque_pop, any thread can call deque_steal.
+
+typedef struct _DEQUE_ARRAY
+{
+  int64_t size;
+
+  // Arrays replaced by a larger one are kept until the deque is destroyed,
+  // as other threads could still be stealing from them.
+  struct _DEQUE_ARRAY* previous;
+
+  void* items[1];
+
+} DEQUE_ARRAY;
+
+
+typedef struct _DEQUE
+{
+  int64_t top;
+  int64_t bottom;
+
+  DEQUE_ARRAY* array;
+
+} DEQUE;
+
+
+#define DEQUE_EMPTY   ((void*) 0)
+#define DEQUE_ABORT   ((void*) 1)
+
+
+int deque_init(
+    DEQUE* deque);
+
+void deque_destroy(
+    DEQUE* deque);
+
+int deque_push(
+    DEQUE* deque,
+    void* item);
+
+void* deque_pop(
+    DEQUE* deque);
+
+void* deque_steal(
+    DEQUE* deque);
+
+#endif
@@ -56,10 +56,10 @@ YR_API int yr_compiler_create(
   new_compiler->namespaces_count = 0;
   new_compiler->current_rule = NULL;
 
-  result = yr_hash_table_create(10007, &new_compiler->rules_table);
+  result = yr_hash_table_create(1024, &new_compiler->rules_table);
 
   if (result == ERROR_SUCCESS)
-    result = yr_hash_table_create(10007, &new_compiler->objects_table);
+    result = yr_hash_table_create(1024, &new_compiler->objects_table);
 
   if (result == ERROR_SUCCESS)
     result = yr_hash_table_create(101, &new_compiler->strings_table);
@@ -579,6 +579,9 @@ YR_API int yr_compiler_get_rules(
   yara_rules->transition_table = rules_file_header->transition_table;
   yara_rules->code_start = rules_file_header->code_start;
   yara_rules->tidx_mask = 0;
+  yara_rules->mappings_cache = NULL;
+  yara_rules->old_mappings_cache = NULL;
+  yara_rules->mappings_key_state = 0;
 
   FAIL_ON_ERROR_WITH_CLEANUP(
       yr_mutex_create(&yara_rules->mutex),
@@ -93,19 +93,23 @@ typedef union _STACK_ITEM {
 
 
 #define function_read(type, endianess) \
-    int64_t read_##type##_##endianess(YR_MEMORY_BLOCK* block, size_t offset) \
+    int64_t read_##type##_##endianess( \
+        YR_MEMORY_BLOCK_ITERATOR* iterator, size_t offset) \
     { \
+      YR_MEMORY_BLOCK* block = iterator->first(iterator); \
+      type result; \
       while (block != NULL) \
       { \
         if (offset >= block->base && \
             block->size >= sizeof(type) && \
-            offset <= block->base + block->size - sizeof(type)) \
+            offset <= block->base + block->size - sizeof(type) && \
+            yr_memory_block_read_data( \
+                block, offset - block->base, &result, sizeof(type))) \
         { \
-          type result = *(type *)(block->data + offset - block->base); \
           result = endianess##_##type(result); \
           return result; \
         } \
-        block = block->next; \
+        block = iterator->next(iterator); \
       } \
       return UNDEFINED; \
     };
@@ -445,13 +449,19 @@ int yr_execute_code(
         break;
 
       case OP_OBJ_FIELD:
-        identifier = *(char**)(ip + 1);
+        i = (int) *(uint64_t*)(ip + 1);
         ip += sizeof(uint64_t);
 
         pop(r1);
         ensure_defined(r1);
 
-        r1.o = yr_object_lookup_field(r1.o, identifier);
+        result = yr_object_structure_load_member(r1.o, i, &r1.o);
+
+        if (result != ERROR_SUCCESS)
+        {
+          stop = TRUE;
+          break;
+        }
 
         assert(r1.o != NULL);
         push(r1);
@@ -737,73 +747,73 @@ int yr_execute_code(
 
       case OP_INT8:
         pop(r1);
-        r1.i = read_int8_t_little_endian(context->mem_block, (size_t) r1.i);
+        r1.i = read_int8_t_little_endian(context->iterator, (size_t) r1.i);
         push(r1);
         break;
 
       case OP_INT16:
         pop(r1);
-        r1.i = read_int16_t_little_endian(context->mem_block, (size_t) r1.i);
+        r1.i = read_int16_t_little_endian(context->iterator, (size_t) r1.i);
         push(r1);
         break;
 
       case OP_INT32:
         pop(r1);
-        r1.i = read_int32_t_little_endian(context->mem_block, (size_t) r1.i);
+        r1.i = read_int32_t_little_endian(context->iterator, (size_t) r1.i);
         push(r1);
         break;
 
       case OP_UINT8:
         pop(r1);
-        r1.i = read_uint8_t_little_endian(context->mem_block, (size_t) r1.i);
+        r1.i = read_uint8_t_little_endian(context->iterator, (size_t) r1.i);
         push(r1);
         break;
 
       case OP_UINT16:
         pop(r1);
-        r1.i = read_uint16_t_little_endian(context->mem_block, (size_t) r1.i);
+        r1.i = read_uint16_t_little_endian(context->iterator, (size_t) r1.i);
         push(r1);
         break;
 
       case OP_UINT32:
         pop(r1);
-        r1.i = read_uint32_t_little_endian(context->mem_block, (size_t) r1.i);
+        r1.i = read_uint32_t_little_endian(context->iterator, (size_t) r1.i);
         push(r1);
         break;
 
       case OP_INT8BE:
         pop(r1);
-        r1.i = read_int8_t_big_endian(context->mem_block, (size_t) r1.i);
+        r1.i = read_int8_t_big_endian(context->iterator, (size_t) r1.i);
         push(r1);
         break;
 
       case OP_INT16BE:
         pop(r1);
-        r1.i = read_int16_t_big_endian(context->mem_block, (size_t) r1.i);
+        r1.i = read_int16_t_big_endian(context->iterator, (size_t) r1.i);
         push(r1);
         break;
 
       case OP_INT32BE:
         pop(r1);
-        r1.i = read_int32_t_big_endian(context->mem_block, (size_t) r1.i);
+        r1.i = read_int32_t_big_endian(context->iterator, (size_t) r1.i);
         push(r1);
         break;
 
       case OP_UINT8BE:
         pop(r1);
-        r1.i = read_uint8_t_big_endian(context->mem_block, (size_t) r1.i);
+        r1.i = read_uint8_t_big_endian(context->iterator, (size_t) r1.i);
         push(r1);
         break;
 
       case OP_UINT16BE:
         pop(r1);
-        r1.i = read_uint16_t_big_endian(context->mem_block, (size_t) r1.i);
+        r1.i = read_uint16_t_big_endian(context->iterator, (size_t) r1.i);
         push(r1);
         break;
 
       case OP_UINT32BE:
         pop(r1);
-        r1.i = read_uint32_t_big_endian(context->mem_block, (size_t) r1.i);
+        r1.i = read_uint32_t_big_endian(context->iterator, (size_t) r1.i);
         push(r1);
         break;
 
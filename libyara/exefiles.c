@@ -19,6 +19,7 @@ limitations under the License.
 #include <yara/pe.h>
 #include <yara/elf.h>
 #include <yara/exec.h>
+#include <yara/exefiles.h>
 
 #ifndef NULL
 #define NULL 0
@@ -74,6 +75,101 @@ PIMAGE_NT_HEADERS32 yr_get_pe_header(
 }
 
 
+//
+// yr_pe_section_table_build
+//
+// Fills the table with the first max_sections sections of the PE, sorted by
+// virtual address. Sections with the same virtual address are kept in the
+// same order they have in the file. The buffer_length argument is the
+// number of bytes available starting at pe_header. Returns FALSE if some of
+// the section headers lie beyond that limit.
+//
+
+int yr_pe_section_table_build(
+    PIMAGE_NT_HEADERS32 pe_header,
+    size_t buffer_length,
+    int max_sections,
+    YR_PE_SECTION_TABLE* table)
+{
+  PIMAGE_SECTION_HEADER section = IMAGE_FIRST_SECTION(pe_header);
+  YR_PE_SECTION entry;
+
+  int count = MIN(pe_header->FileHeader.NumberOfSections, max_sections);
+  int i, j;
+
+  count = MIN(count, MAX_PE_SECTIONS);
+  table->count = 0;
+
+  for (i = 0; i < count; i++)
+  {
+    if ((uint8_t*) (section + 1) - (uint8_t*) pe_header > buffer_length)
+      return FALSE;
+
+    entry.virtual_address = section->VirtualAddress;
+    entry.raw_data_offset = section->PointerToRawData;
+    entry.raw_data_size = section->SizeOfRawData;
+
+    // Insertion sort, there are only a few sections and they are usually
+    // sorted already.
+
+    j = table->count;
+
+    while (j > 0 &&
+           table->sections[j - 1].virtual_address > entry.virtual_address)
+    {
+      table->sections[j] = table->sections[j - 1];
+      j--;
+    }
+
+    table->sections[j] = entry;
+    table->count++;
+
+    section++;
+  }
+
+  return TRUE;
+}
+
+
+//
+// yr_pe_section_table_lookup
+//
+// Returns the index of the section with the highest virtual address not
+// above rva, or -1 if rva is below the virtual address of every section.
+// If several sections share that virtual address the last one of them is
+// returned.
+//
+
+int yr_pe_section_table_lookup(
+    YR_PE_SECTION_TABLE* table,
+    uint64_t rva)
+{
+  int lo = 0;
+  int hi = table->count;
+
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+
+    if (table->sections[mid].virtual_address <= rva)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo - 1;
+}
+
+
+//
+// yr_pe_rva_to_offset
+//
+// Translates a single RVA, as needed for the entry point. Walking the
+// section headers once is cheaper than building a section table for just
+// one lookup. The pe module, which translates many RVAs per file, builds
+// its table once per scan instead.
+//
+
 uint64_t yr_pe_rva_to_offset(
     PIMAGE_NT_HEADERS32 pe_header,
     uint64_t rva,
@@ -21,11 +21,158 @@ limitations under the License.
 #else
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <errno.h>
 #include <unistd.h>
 #endif
 
 #include <yara/filemap.h>
 #include <yara/error.h>
+#include <yara/libyara.h>
+#include <yara/mem.h>
+#include <yara/threading.h>
+
+
+YR_THREAD_STORAGE_KEY file_buffer_key;
+
+// Whether file_buffer_key has been created. Any value, including zero, can
+// be a valid key, so the key itself can't tell.
+
+static int file_buffer_key_created = FALSE;
+
+
+//
+// yr_filemap_initialize
+//
+// Should be called by main thread before any other
+// function from this module.
+//
+
+int yr_filemap_initialize(void)
+{
+  FAIL_ON_ERROR(yr_thread_storage_create(&file_buffer_key));
+
+  file_buffer_key_created = TRUE;
+  return ERROR_SUCCESS;
+}
+
+
+//
+// yr_filemap_finalize
+//
+// Should be called by main thread after every other thread
+// stopped using functions from this module.
+//
+
+int yr_filemap_finalize(void)
+{
+  if (file_buffer_key_created)
+    yr_thread_storage_destroy(&file_buffer_key);
+
+  file_buffer_key_created = FALSE;
+  return ERROR_SUCCESS;
+}
+
+
+void _yr_filemap_free_buffer(
+    YR_FILE_BUFFER* buffer)
+{
+  if (buffer->data != NULL)
+    yr_free(buffer->data);
+
+  yr_free(buffer);
+}
+
+
+//
+// yr_filemap_finalize_thread
+//
+// Should be called by every thread using this module
+// before exiting.
+//
+
+int yr_filemap_finalize_thread(void)
+{
+  YR_FILE_BUFFER* buffer;
+
+  if (!file_buffer_key_created)
+    return ERROR_SUCCESS;
+
+  buffer = (YR_FILE_BUFFER*) yr_thread_storage_get_value(&file_buffer_key);
+
+  if (buffer != NULL)
+    _yr_filemap_free_buffer(buffer);
+
+  return yr_thread_storage_set_value(&file_buffer_key, NULL);
+}
+
+
+//
+// _yr_filemap_get_buffer
+//
+// Takes the current thread's buffer, making sure that it can hold at least
+// size bytes. The buffer belongs to the caller until it's given back with
+// _yr_filemap_release_buffer, a new one is created if the thread's buffer
+// is already taken, like when mapping several files at once.
+//
+
+YR_FILE_BUFFER* _yr_filemap_get_buffer(
+    size_t size)
+{
+  YR_FILE_BUFFER* buffer = NULL;
+  uint8_t* data;
+
+  if (file_buffer_key_created)
+  {
+    buffer = (YR_FILE_BUFFER*) yr_thread_storage_get_value(&file_buffer_key);
+    yr_thread_storage_set_value(&file_buffer_key, NULL);
+  }
+
+  if (buffer == NULL)
+  {
+    buffer = (YR_FILE_BUFFER*) yr_malloc(sizeof(YR_FILE_BUFFER));
+
+    if (buffer == NULL)
+      return NULL;
+
+    buffer->data = NULL;
+    buffer->size = 0;
+  }
+
+  if (buffer->size < size)
+  {
+    data = (uint8_t*) yr_realloc(buffer->data, size);
+
+    if (data == NULL)
+    {
+      _yr_filemap_free_buffer(buffer);
+      return NULL;
+    }
+
+    buffer->data = data;
+    buffer->size = size;
+  }
+
+  return buffer;
+}
+
+
+//
+// _yr_filemap_release_buffer
+//
+// Gives a buffer taken with _yr_filemap_get_buffer back to the current
+// thread, or destroys it if the thread already has another one.
+//
+
+void _yr_filemap_release_buffer(
+    YR_FILE_BUFFER* buffer)
+{
+  if (file_buffer_key_created &&
+      yr_thread_storage_get_value(&file_buffer_key) == NULL &&
+      yr_thread_storage_set_value(&file_buffer_key, buffer) == ERROR_SUCCESS)
+    return;
+
+  _yr_filemap_free_buffer(buffer);
+}
 
 
 //
@@ -55,7 +202,8 @@ YR_API int yr_filemap_map(
 //
 // yr_filemap_map_fd
 //
-// Maps a portion of a file (specified by descriptor) into memory.
+// Maps a portion of a file (specified by descriptor) into memory. The
+// descriptor is never closed by this function, not even if it fails.
 //
 // Args:
 //    YR_FILE_DESCRIPTOR file      - File descriptor representing the file to
@@ -92,6 +240,7 @@ YR_API int yr_filemap_map_fd(
   pmapped_file->mapping = NULL;
   pmapped_file->data = NULL;
   pmapped_file->size = 0;
+  pmapped_file->buffer = NULL;
 
   // Ensure that offset is aligned to 1MB
   if (offset >> 20 << 20 != offset)
@@ -107,8 +256,6 @@ YR_API int yr_filemap_map_fd(
   }
   else
   {
-    CloseHandle(pmapped_file->file);
-    pmapped_file->file = INVALID_HANDLE_VALUE;
     return ERROR_COULD_NOT_OPEN_FILE;
   }
 
@@ -131,11 +278,7 @@ YR_API int yr_filemap_map_fd(
         NULL);
 
     if (pmapped_file->mapping == NULL)
-    {
-      CloseHandle(pmapped_file->file);
-      pmapped_file->file = INVALID_HANDLE_VALUE;
       return ERROR_COULD_NOT_MAP_FILE;
-    }
 
     pmapped_file->data = (uint8_t*) MapViewOfFile(
         pmapped_file->mapping,
@@ -147,8 +290,6 @@ YR_API int yr_filemap_map_fd(
     if (pmapped_file->data == NULL)
     {
       CloseHandle(pmapped_file->mapping);
-      CloseHandle(pmapped_file->file);
-      pmapped_file->file = INVALID_HANDLE_VALUE;
       pmapped_file->mapping = NULL;
       return ERROR_COULD_NOT_MAP_FILE;
     }
@@ -164,6 +305,61 @@ YR_API int yr_filemap_map_fd(
 
 #else // POSIX
 
+//
+// _yr_filemap_read_fd
+//
+// Reads a portion of a file into a per-thread buffer, as an alternative
+// to mapping it. For small files this is cheaper than setting up the
+// mapping and tearing it down later. Returns ERROR_SUCCESS with no data if
+// the file can't be read, in which case it must be mapped instead.
+//
+
+int _yr_filemap_read_fd(
+    YR_FILE_DESCRIPTOR file,
+    off_t offset,
+    YR_MAPPED_FILE* pmapped_file)
+{
+  YR_FILE_BUFFER* buffer = _yr_filemap_get_buffer(pmapped_file->size);
+
+  size_t total = 0;
+  ssize_t read;
+
+  if (buffer == NULL)
+    return ERROR_INSUFICIENT_MEMORY;
+
+  while (total < pmapped_file->size)
+  {
+    read = pread(
+        file,
+        buffer->data + total,
+        pmapped_file->size - total,
+        offset + total);
+
+    if (read == -1 && errno == EINTR)
+      continue;
+
+    if (read == -1)
+    {
+      _yr_filemap_release_buffer(buffer);
+      return ERROR_SUCCESS;
+    }
+
+    // The file was truncated after getting its size.
+
+    if (read == 0)
+      break;
+
+    total += (size_t) read;
+  }
+
+  pmapped_file->buffer = buffer;
+  pmapped_file->data = buffer->data;
+  pmapped_file->size = total;
+
+  return ERROR_SUCCESS;
+}
+
+
 YR_API int yr_filemap_map_fd(
     YR_FILE_DESCRIPTOR file,
     off_t offset,
@@ -171,10 +367,12 @@ YR_API int yr_filemap_map_fd(
     YR_MAPPED_FILE* pmapped_file)
 {
   struct stat st;
+  uint32_t read_threshold = 0;
 
   pmapped_file->file = file;
   pmapped_file->data = NULL;
   pmapped_file->size = 0;
+  pmapped_file->buffer = NULL;
 
   // Ensure that offset is aligned to 1MB
   if (offset >> 20 << 20 != offset)
@@ -191,6 +389,22 @@ YR_API int yr_filemap_map_fd(
 
   pmapped_file->size = yr_min(size, (size_t) (st.st_size - offset));
 
+  yr_get_configuration(YR_CONFIG_FILE_READ_THRESHOLD, &read_threshold);
+
+  if (pmapped_file->size != 0 &&
+      pmapped_file->size <= read_threshold &&
+      S_ISREG(st.st_mode))
+  {
+    if (_yr_filemap_read_fd(file, offset, pmapped_file) != ERROR_SUCCESS)
+    {
+      pmapped_file->size = 0;
+      return ERROR_INSUFICIENT_MEMORY;
+    }
+
+    if (pmapped_file->data != NULL)
+      return ERROR_SUCCESS;
+  }
+
   if (pmapped_file->size != 0)
   {
     pmapped_file->data = (uint8_t*) mmap(
@@ -203,11 +417,8 @@ YR_API int yr_filemap_map_fd(
 
     if (pmapped_file->data == MAP_FAILED)
     {
-      close(pmapped_file->file);
-
       pmapped_file->data = NULL;
       pmapped_file->size = 0;
-      pmapped_file->file = -1;
 
       return ERROR_COULD_NOT_MAP_FILE;
     }
@@ -257,6 +468,7 @@ YR_API int yr_filemap_map_ex(
     YR_MAPPED_FILE* pmapped_file)
 {
   YR_FILE_DESCRIPTOR fd;
+  int result;
 
   if (file_path == NULL)
     return ERROR_INVALID_ARGUMENT;
@@ -273,7 +485,15 @@ YR_API int yr_filemap_map_ex(
   if (fd == INVALID_HANDLE_VALUE)
     return ERROR_COULD_NOT_OPEN_FILE;
 
-  return yr_filemap_map_fd(fd, offset, size, pmapped_file);
+  result = yr_filemap_map_fd(fd, offset, size, pmapped_file);
+
+  if (result != ERROR_SUCCESS)
+  {
+    CloseHandle(fd);
+    pmapped_file->file = INVALID_HANDLE_VALUE;
+  }
+
+  return result;
 }
 
 #else // POSIX
@@ -285,6 +505,7 @@ YR_API int yr_filemap_map_ex(
     YR_MAPPED_FILE* pmapped_file)
 {
   YR_FILE_DESCRIPTOR fd;
+  int result;
 
   if (file_path == NULL)
     return ERROR_INVALID_ARGUMENT;
@@ -294,7 +515,15 @@ YR_API int yr_filemap_map_ex(
   if (fd == -1)
     return ERROR_COULD_NOT_OPEN_FILE;
 
-  return yr_filemap_map_fd(fd, offset, size, pmapped_file);
+  result = yr_filemap_map_fd(fd, offset, size, pmapped_file);
+
+  if (result != ERROR_SUCCESS)
+  {
+    close(fd);
+    pmapped_file->file = -1;
+  }
+
+  return result;
 }
 
 #endif
@@ -342,9 +571,12 @@ YR_API void yr_filemap_unmap(
 YR_API void yr_filemap_unmap_fd(
     YR_MAPPED_FILE* pmapped_file)
 {
-  if (pmapped_file->data != NULL)
+  if (pmapped_file->buffer != NULL)
+    _yr_filemap_release_buffer(pmapped_file->buffer);
+  else if (pmapped_file->data != NULL)
     munmap(pmapped_file->data, pmapped_file->size);
 
+  pmapped_file->buffer = NULL;
   pmapped_file->data = NULL;
   pmapped_file->size = 0;
 }
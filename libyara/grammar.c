@@ -2284,22 +2284,22 @@ yyreduce:
         if ((yyvsp[(1) - (3)].expression).type == EXPRESSION_TYPE_OBJECT &&
             (yyvsp[(1) - (3)].expression).value.object->type == OBJECT_TYPE_STRUCTURE)
         {
-          field = yr_object_lookup_field((yyvsp[(1) - (3)].expression).value.object, (yyvsp[(3) - (3)].c_string));
+          int index = yr_object_structure_member_index(
+              (yyvsp[(1) - (3)].expression).value.object, (yyvsp[(3) - (3)].c_string));
 
-          if (field != NULL)
+          if (index >= 0)
           {
-            char* ident;
+            // Fields are accessed by slot index at scan time, the index is
+            // the same for every instance of the structure.
 
-            compiler->last_result = yr_arena_write_string(
-              compiler->sz_arena, (yyvsp[(3) - (3)].c_string), &ident);
+            field = yr_object_structure_get_member((yyvsp[(1) - (3)].expression).value.object, index);
 
-            if (compiler->last_result == ERROR_SUCCESS)
-              compiler->last_result = yr_parser_emit_with_arg_reloc(
-                  yyscanner,
-                  OP_OBJ_FIELD,
-                  PTR_TO_INT64(ident),
-                  NULL,
-                  NULL);
+            compiler->last_result = yr_parser_emit_with_arg(
+                yyscanner,
+                OP_OBJ_FIELD,
+                index,
+                NULL,
+                NULL);
 
             (yyval.expression).type = EXPRESSION_TYPE_OBJECT;
             (yyval.expression).value.object = field;
@@ -638,22 +638,22 @@ identifier
         if ($1.type == EXPRESSION_TYPE_OBJECT &&
             $1.value.object->type == OBJECT_TYPE_STRUCTURE)
         {
-          field = yr_object_lookup_field($1.value.object, $3);
+          int index = yr_object_structure_member_index(
+              $1.value.object, $3);
 
-          if (field != NULL)
+          if (index >= 0)
           {
-            char* ident;
+            // Fields are accessed by slot index at scan time, the index is
+            // the same for every instance of the structure.
 
-            compiler->last_result = yr_arena_write_string(
-              compiler->sz_arena, $3, &ident);
+            field = yr_object_structure_get_member($1.value.object, index);
 
-            if (compiler->last_result == ERROR_SUCCESS)
-              compiler->last_result = yr_parser_emit_with_arg_reloc(
-                  yyscanner,
-                  OP_OBJ_FIELD,
-                  PTR_TO_INT64(ident),
-                  NULL,
-                  NULL);
+            compiler->last_result = yr_parser_emit_with_arg(
+                yyscanner,
+                OP_OBJ_FIELD,
+                index,
+                NULL,
+                NULL);
 
             $$.type = EXPRESSION_TYPE_OBJECT;
             $$.value.object = field;
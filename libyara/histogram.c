@@ -0,0 +1,78 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <string.h>
+
+#include <yara/histogram.h>
+
+
+// Below this length clearing and merging the partial tables costs more
+// than what is saved while counting.
+
+#define MULTI_TABLE_MIN_LENGTH  1024
+
+
+//
+// yr_histogram_update
+//
+// Adds the number of occurrences of each byte value in data to the
+// 256-entry histogram. Long buffers are counted into four separate tables
+// that are merged at the end, so that runs of the same byte don't
+// serialize on increments of a single counter, and are read eight bytes
+// at a time.
+//
+
+YR_API void yr_histogram_update(
+    uint32_t* histogram,
+    const uint8_t* data,
+    size_t length)
+{
+  uint32_t counts[4][256];
+  uint64_t word;
+
+  size_t i = 0;
+  int j;
+
+  if (length < MULTI_TABLE_MIN_LENGTH)
+  {
+    for (i = 0; i < length; i++)
+      histogram[data[i]]++;
+
+    return;
+  }
+
+  memset(counts, 0, sizeof(counts));
+
+  for (; i + 8 <= length; i += 8)
+  {
+    memcpy(&word, data + i, sizeof(word));
+
+    counts[0][word & 0xFF]++;
+    counts[1][(word >> 8) & 0xFF]++;
+    counts[2][(word >> 16) & 0xFF]++;
+    counts[3][(word >> 24) & 0xFF]++;
+    counts[0][(word >> 32) & 0xFF]++;
+    counts[1][(word >> 40) & 0xFF]++;
+    counts[2][(word >> 48) & 0xFF]++;
+    counts[3][word >> 56]++;
+  }
+
+  for (; i < length; i++)
+    counts[0][data[i]]++;
+
+  for (j = 0; j < 256; j++)
+    histogram[j] += counts[0][j] + counts[1][j] + counts[2][j] + counts[3][j];
+}
@@ -26,5 +26,7 @@ limitations under the License.
 #include "yara/error.h"
 #include "yara/stream.h"
 #include "yara/hash.h"
+#include "yara/cuckoo.h"
+#include "yara/scan_cache.h"
 
 #endif
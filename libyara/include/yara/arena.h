@@ -24,7 +24,7 @@ limitations under the License.
 
 #define ARENA_FLAGS_FIXED_SIZE   1
 #define ARENA_FLAGS_COALESCED    2
-#define ARENA_FILE_VERSION       10
+#define ARENA_FILE_VERSION       11
 
 #define EOL ((size_t) -1)
 
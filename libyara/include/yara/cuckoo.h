@@ -0,0 +1,72 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef YR_CUCKOO_H
+#define YR_CUCKOO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <yara/utils.h>
+
+
+// A YR_CUCKOO_REPORT can be passed as the cuckoo module's data, with
+// sizeof(YR_CUCKOO_REPORT) as its size, instead of the report's JSON.
+// The report is parsed and indexed only once and can then be shared by
+// any number of scans, from any number of threads.
+
+#define CUCKOO_REPORT_SIGNATURE   "\0YRCKOO"
+
+#define CUCKOO_METHOD_GET         0x01
+#define CUCKOO_METHOD_POST        0x02
+
+
+typedef struct _YR_CUCKOO_TABLE
+{
+  int count;
+
+  char** strings;
+  size_t* lengths;
+  char* buffer;
+
+} YR_CUCKOO_TABLE;
+
+
+typedef struct _YR_CUCKOO_REPORT
+{
+  char signature[8];
+
+  YR_CUCKOO_TABLE dns_lookups;
+  YR_CUCKOO_TABLE http_requests;
+  YR_CUCKOO_TABLE registry_keys;
+  YR_CUCKOO_TABLE files;
+  YR_CUCKOO_TABLE mutexes;
+
+  uint8_t* http_methods;
+
+} YR_CUCKOO_REPORT;
+
+
+YR_API int yr_cuckoo_report_create(
+    const uint8_t* json_data,
+    size_t json_data_size,
+    YR_CUCKOO_REPORT** report);
+
+
+YR_API void yr_cuckoo_report_destroy(
+    YR_CUCKOO_REPORT* report);
+
+#endif
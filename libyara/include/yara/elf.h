@@ -89,6 +89,21 @@ typedef uint64_t elf64_xword_t;
 
 #define ELF_SHN_LORESERVE    0xFF00
 
+#define ELF_STT_NOTYPE       0     // Symbol type is unspecified
+#define ELF_STT_OBJECT       1     // Symbol is a data object
+#define ELF_STT_FUNC         2     // Symbol is a code object
+#define ELF_STT_SECTION      3     // Symbol associated with a section
+#define ELF_STT_FILE         4     // Symbol's name is file name
+#define ELF_STT_COMMON       5     // Symbol is a common data object
+#define ELF_STT_TLS          6     // Symbol is thread-local data object
+
+#define ELF_STB_LOCAL        0     // Local symbol
+#define ELF_STB_GLOBAL       1     // Global symbol
+#define ELF_STB_WEAK         2     // Weak symbol
+
+#define ELF_ST_BIND(info)    ((info) >> 4)
+#define ELF_ST_TYPE(info)    ((info) & 0xf)
+
 #define ELF_PT_NULL          0     // The array element is unused
 #define ELF_PT_LOAD          1     // Loadable segment
 #define ELF_PT_DYNAMIC       2     // Segment contains dynamic linking info
@@ -220,6 +235,30 @@ typedef struct
 } elf64_section_header_t;
 
 
+typedef struct
+{
+  elf32_word_t    name;
+  elf32_addr_t    value;
+  elf32_word_t    size;
+  uint8_t         info;
+  uint8_t         other;
+  elf32_half_t    shndx;
+
+} elf32_sym_t;
+
+
+typedef struct
+{
+  elf64_word_t    name;
+  uint8_t         info;
+  uint8_t         other;
+  elf64_half_t    shndx;
+  elf64_addr_t    value;
+  elf64_xword_t   size;
+
+} elf64_sym_t;
+
+
 #pragma pack(pop)
 
 #endif
\ No newline at end of file
@@ -17,6 +17,47 @@ limitations under the License.
 #ifndef YR_EXEFILES_H
 #define YR_EXEFILES_H
 
+#include <yara/pe.h>
+
+
+#define MAX_PE_SECTIONS              96
+
+
+//
+// Sections of a PE file sorted by virtual address, used for translating
+// RVAs to file offsets with a binary search instead of walking the section
+// headers for every translation.
+//
+
+typedef struct _YR_PE_SECTION
+{
+  uint32_t virtual_address;
+  uint32_t raw_data_offset;
+  uint32_t raw_data_size;
+
+} YR_PE_SECTION;
+
+
+typedef struct _YR_PE_SECTION_TABLE
+{
+  int count;
+  YR_PE_SECTION sections[MAX_PE_SECTIONS];
+
+} YR_PE_SECTION_TABLE;
+
+
+int yr_pe_section_table_build(
+    PIMAGE_NT_HEADERS32 pe_header,
+    size_t buffer_length,
+    int max_sections,
+    YR_PE_SECTION_TABLE* table);
+
+
+int yr_pe_section_table_lookup(
+    YR_PE_SECTION_TABLE* table,
+    uint64_t rva);
+
+
 uint64_t yr_get_entry_point_offset(
     uint8_t* buffer,
     size_t buffer_length);
@@ -36,6 +36,17 @@ limitations under the License.
 #include <yara/utils.h>
 
 
+// Buffer where small files are read instead of being mapped. Each thread
+// keeps one for reusing it with the next file.
+
+typedef struct _YR_FILE_BUFFER
+{
+  uint8_t*            data;
+  size_t              size;
+
+} YR_FILE_BUFFER;
+
+
 typedef struct _YR_MAPPED_FILE
 {
   YR_FILE_DESCRIPTOR  file;
@@ -45,6 +56,9 @@ typedef struct _YR_MAPPED_FILE
   HANDLE              mapping;
   #endif
 
+  // Buffer holding the data if the file was read instead of mapped.
+  YR_FILE_BUFFER*     buffer;
+
 } YR_MAPPED_FILE;
 
 
@@ -74,4 +88,13 @@ YR_API void yr_filemap_unmap(
 YR_API void yr_filemap_unmap_fd(
     YR_MAPPED_FILE* pmapped_file);
 
+
+int yr_filemap_initialize(void);
+
+
+int yr_filemap_finalize(void);
+
+
+int yr_filemap_finalize_thread(void);
+
 #endif
@@ -17,24 +17,45 @@ limitations under the License.
 #ifndef YR_HASH_H
 #define YR_HASH_H
 
+#include <stdint.h>
+
 #include <yara/utils.h>
 
+// Keys and namespaces up to this size (including their null terminators) are
+// stored inside the table entry, longer ones are copied into the heap.
+
+#define YR_HASH_TABLE_INLINE_DATA_SIZE  32
+
+
 typedef struct _YR_HASH_TABLE_ENTRY
 {
-  char* key;
-  char* ns;
+  uint32_t hash;
+
+  uint32_t key_length;
+
+  // Length of the namespace plus one, zero if the entry has no namespace.
+  // The namespace is stored right after the key's null terminator.
+  uint32_t ns_length;
+
+  // Zero for unused entries. Keys can be empty, so key_length can't tell.
+  uint32_t occupied;
+
   void* value;
 
-  struct _YR_HASH_TABLE_ENTRY* next;
+  char* data;
+  char inline_data[YR_HASH_TABLE_INLINE_DATA_SIZE];
 
 } YR_HASH_TABLE_ENTRY;
 
 
 typedef struct _YR_HASH_TABLE
 {
+  // Number of entries, always a power of two. The table is grown before it
+  // is three quarters full.
   int size;
+  int used;
 
-  YR_HASH_TABLE_ENTRY* buckets[1];
+  YR_HASH_TABLE_ENTRY* entries;
 
 } YR_HASH_TABLE;
 
@@ -0,0 +1,31 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef YR_HISTOGRAM_H
+#define YR_HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <yara/utils.h>
+
+
+YR_API void yr_histogram_update(
+    uint32_t* histogram,
+    const uint8_t* data,
+    size_t length);
+
+#endif
@@ -37,6 +37,14 @@ limitations under the License.
 typedef enum _YR_CONFIG_NAME
 {
   YR_CONFIG_STACK_SIZE,
+  YR_CONFIG_MAX_MAGIC_BYTES,
+
+  // A string with path prefixes separated by colons, memory regions whose
+  // path in /proc/<pid>/maps starts with any of them are not scanned. The
+  // string is copied, changes take effect in the next process scanned.
+  YR_CONFIG_PROCESS_EXCLUDED_PATHS,
+
+  YR_CONFIG_FILE_READ_THRESHOLD,
   YR_CONFIG_MAX
 
 } YR_CONFIG_NAME;
@@ -44,6 +52,15 @@ typedef enum _YR_CONFIG_NAME
 
 #define DEFAULT_STACK_SIZE 16384
 
+// Maximum number of bytes from the beginning of the data that the magic
+// module hands to libmagic.
+#define DEFAULT_MAX_MAGIC_BYTES 1048576
+
+// Files up to this size are read into a per-thread buffer instead of being
+// mapped into memory, which is cheaper for small files. Zero means always
+// mapping files.
+#define DEFAULT_FILE_READ_THRESHOLD 65536
+
 
 YR_API int yr_initialize(void);
 
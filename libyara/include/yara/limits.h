@@ -48,5 +48,23 @@ limitations under the License.
 #define STRING_CHAINING_THRESHOLD       200
 #define LEX_BUF_SIZE                    8192
 
+// Process memory regions are read in chunks of at most this size. Chunks of
+// the same region overlap so that matches crossing a chunk boundary are not
+// lost, as long as they are shorter than the overlap.
+
+#define PROCESS_MEMORY_CHUNK_SIZE       (64 * 1024 * 1024)
+#define PROCESS_MEMORY_CHUNK_OVERLAP    (64 * 1024)
+
+// Small regions are read together with a single system call, as long as the
+// batch doesn't exceed PROCESS_MEMORY_BATCH_SIZE blocks or a chunk's size.
+
+#define PROCESS_MEMORY_BATCH_SIZE       64
+
+// Number of file-backed mappings whose matches are kept by the YR_RULES
+// object when scanning with SCAN_FLAGS_PROCESS_CACHE_MAPPINGS before the
+// least recently found ones are discarded. Up to twice as many can be kept.
+
+#define PROCESS_MAPPINGS_CACHE_SIZE     16384
+
 
 #endif
@@ -131,6 +131,38 @@ limitations under the License.
   }
 
 
+// Constants are declared with their values, which are set only once in the
+// module's prototype instead of being set again by module_load in every scan.
+
+#define declare_integer_constant(name, value) { \
+    YR_OBJECT* constant; \
+    FAIL_ON_ERROR(yr_object_create( \
+        OBJECT_TYPE_INTEGER, \
+        name, \
+        stack[stack_top], \
+        &constant)); \
+    FAIL_ON_ERROR(yr_object_set_integer( \
+        value, \
+        constant, \
+        NULL)); \
+  }
+
+
+#define declare_string_constant(name, value) { \
+    YR_OBJECT* constant; \
+    FAIL_ON_ERROR(yr_object_create( \
+        OBJECT_TYPE_STRING, \
+        name, \
+        stack[stack_top], \
+        &constant)); \
+    FAIL_ON_ERROR(yr_object_set_string( \
+        value, \
+        strlen(value), \
+        constant, \
+        NULL)); \
+  }
+
+
 #define declare_integer_array(name) { \
     YR_OBJECT* array; \
     FAIL_ON_ERROR(yr_object_create( \
@@ -280,13 +312,17 @@ limitations under the License.
 
 
 #define foreach_memory_block(context, block) \
-  for (block = (context)->mem_block; \
+  for (block = (context)->iterator->first((context)->iterator); \
        block != NULL; \
-       block = block->next) \
+       block = (context)->iterator->next((context)->iterator)) \
 
 
 #define first_memory_block(context) \
-      (context)->mem_block
+      (context)->iterator->first((context)->iterator)
+
+
+#define fetch_memory_block_data(block) \
+      yr_memory_block_fetch_data(block)
 
 
 #define is_undefined(object, ...) \
@@ -325,6 +361,65 @@ limitations under the License.
     set_sized_string(value, strlen(value), object, __VA_ARGS__)
 
 
+// Index-based accessors. A member's slot index within its structure is
+// obtained once with member_index and can be used afterwards with any
+// instance of that structure, including array and dictionary items, which
+// avoids parsing field descriptors for every value set. The prototype of
+// an array or dictionary (get_prototype) can be used to obtain the slot
+// indexes of its items before any item is created.
+
+#define member_index(object, name) \
+    yr_object_structure_member_index(object, name)
+
+
+#define get_member(object, index) \
+    yr_object_structure_get_member(object, index)
+
+
+#define get_prototype(object) \
+    (((YR_OBJECT_ARRAY*) (object))->prototype_item)
+
+
+#define get_item(object, index) \
+    yr_object_array_get_item(object, 0, index)
+
+
+#define create_item(object, index) \
+    yr_object_array_get_item(object, OBJECT_CREATE, index)
+
+
+#define get_integer_member(object, index) \
+    yr_object_get_integer(get_member(object, index), NULL)
+
+
+#define get_string_member(object, index) \
+    yr_object_get_string(get_member(object, index), NULL)
+
+
+#define set_integer_member(value, object, index) \
+    yr_object_set_integer(value, get_member(object, index), NULL)
+
+
+#define set_float_member(value, object, index) \
+    yr_object_set_float(value, get_member(object, index), NULL)
+
+
+#define set_sized_string_member(value, len, object, index) \
+    yr_object_set_string(value, len, get_member(object, index), NULL)
+
+
+#define set_string_member(value, object, index) \
+    set_sized_string_member(value, strlen(value), object, index)
+
+
+// Members whose values are expensive to compute can be populated on demand.
+// A loader set with set_loader, usually from module_load, is called the first
+// time a rule accesses the member during the scan, and only if it does.
+
+#define set_loader(loader, object, index) \
+    yr_object_structure_set_loader(object, index, loader)
+
+
 #define return_integer(integer) { \
       assertf( \
           __function_obj->return_obj->type == OBJECT_TYPE_INTEGER, \
@@ -400,6 +495,11 @@ typedef struct _YR_MODULE
   YR_EXT_INITIALIZE_FUNC initialize;
   YR_EXT_FINALIZE_FUNC finalize;
 
+  // Object tree built from the module's declarations when the library is
+  // initialized. Every scan importing the module gets a copy of it.
+
+  YR_OBJECT* prototype;
+
 } YR_MODULE;
 
 
@@ -72,11 +72,38 @@ void yr_object_destroy(
     YR_OBJECT* object);
 
 
+int yr_object_copy(
+    YR_OBJECT* object,
+    YR_OBJECT** object_copy);
+
+
 YR_OBJECT* yr_object_lookup_field(
     YR_OBJECT* object,
     const char* field_name);
 
 
+int yr_object_structure_member_index(
+    YR_OBJECT* object,
+    const char* field_name);
+
+
+YR_OBJECT* yr_object_structure_get_member(
+    YR_OBJECT* object,
+    int index);
+
+
+int yr_object_structure_set_loader(
+    YR_OBJECT* object,
+    int index,
+    YR_OBJECT_LOADER loader);
+
+
+int yr_object_structure_load_member(
+    YR_OBJECT* object,
+    int index,
+    YR_OBJECT** member);
+
+
 YR_OBJECT* yr_object_lookup(
     YR_OBJECT* root,
     int flags,
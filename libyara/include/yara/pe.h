@@ -14,6 +14,9 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#ifndef YR_PE_H
+#define YR_PE_H
+
 #pragma pack(push, 1)
 
 #if defined(_WIN32) || defined(__CYGWIN__)
@@ -474,3 +477,5 @@ typedef struct _RICH_DATA {
 } RICH_DATA, *PRICH_DATA;
 
 #pragma pack(pop)
+
+#endif
@@ -17,10 +17,143 @@ limitations under the License.
 #ifndef YR_PROC_H
 #define YR_PROC_H
 
+#include <stdio.h>
+
+#include <yara/limits.h>
 #include <yara/types.h>
 
+
+#define PROCESS_REGION_READ       1
+#define PROCESS_REGION_WRITE      2
+#define PROCESS_REGION_EXECUTE    4
+#define PROCESS_REGION_SHARED     8
+
+
+// Describes a memory region as listed in /proc/<pid>/maps. Regions backed by
+// a file have a non-zero inode, anonymous ones have inode zero and a path
+// that is either empty or a pseudo-path like [heap] or [stack].
+
+typedef struct _YR_PROCESS_REGION
+{
+  size_t begin;
+  size_t end;
+  int flags;
+
+  uint64_t offset;
+  uint64_t device;
+  uint64_t inode;
+
+  char path[MAX_PATH];
+
+} YR_PROCESS_REGION;
+
+
+// A block that is going to be read along with other blocks in a single
+// process_vm_readv call.
+
+typedef struct _YR_PROCESS_BATCH_ENTRY
+{
+  size_t begin;
+  size_t length;
+  size_t read;
+  size_t buffer_offset;
+  int loaded;
+
+  YR_MEMORY_BLOCK* block;
+  YR_PROCESS_REGION region;
+
+  // Position in /proc/<pid>/maps following the line describing the region.
+  long maps_offset;
+
+} YR_PROCESS_BATCH_ENTRY;
+
+
+typedef struct _YR_PROCESS_MEMORY
+{
+  int pid;
+  int flags;
+
+  // Region where the block last returned by yr_process_next_memory_block
+  // lives, or NULL if that information is not available.
+  YR_PROCESS_REGION* current_region;
+
+  // Blocks found so far, in the order they were found. They are owned by
+  // this structure. The iterator returned by yr_process_get_iterator walks
+  // these blocks first, next_block is the index of the next one to return.
+  YR_MEMORY_BLOCK** blocks;
+  int blocks_count;
+  int blocks_size;
+  int next_block;
+
+  // TRUE when there are no more blocks to find.
+  int complete;
+
+  YR_MEMORY_BLOCK_ITERATOR iterator;
+
+#if !defined(_WIN32) && !defined(__CYGWIN__) && !defined(__MACH__)
+
+  FILE* maps;
+  int mem;
+  int attached;
+  int use_pread;
+
+  // Prefixes of the paths whose regions are skipped, separated by colons.
+  char* excluded_paths;
+
+  // Region being read, and the address where the next block begins.
+  YR_PROCESS_REGION region;
+  size_t region_cursor;
+
+  // Blocks read by the last batch, batch_next is the one that
+  // yr_process_next_memory_block will return.
+  YR_PROCESS_BATCH_ENTRY batch[PROCESS_MEMORY_BATCH_SIZE];
+  int batch_count;
+  int batch_next;
+
+  // Buffer where the data for every batch is read, and the block whose data
+  // is currently in the buffer when it was read on its own.
+  uint8_t* buffer;
+  size_t buffer_size;
+  YR_MEMORY_BLOCK* loaded_block;
+
+#endif
+
+} YR_PROCESS_MEMORY;
+
+
+#if defined(_WIN32) || defined(__CYGWIN__) || defined(__MACH__)
+
 int yr_process_get_memory(
     int pid,
-    YR_MEMORY_BLOCK** first_block);
+    YR_PROCESS_MEMORY* memory);
+
+#endif
+
+
+int yr_process_add_memory_block(
+    YR_PROCESS_MEMORY* memory,
+    size_t base,
+    size_t size,
+    uint8_t* data,
+    YR_MEMORY_BLOCK** block);
+
+
+int yr_process_open_memory(
+    int pid,
+    int flags,
+    YR_PROCESS_MEMORY** memory);
+
+
+int yr_process_next_memory_block(
+    YR_PROCESS_MEMORY* memory,
+    YR_MEMORY_BLOCK** block);
+
+
+YR_MEMORY_BLOCK_ITERATOR* yr_process_get_iterator(
+    YR_PROCESS_MEMORY* memory);
+
+
+void yr_process_close_memory(
+    YR_PROCESS_MEMORY* memory);
 
 #endif
@@ -20,6 +20,7 @@ limitations under the License.
 #include <yara/types.h>
 #include <yara/utils.h>
 #include <yara/filemap.h>
+#include <yara/scan_cache.h>
 
 
 #define CALLBACK_MSG_RULE_MATCHING              1
@@ -66,6 +67,15 @@ YR_API int yr_rules_scan_mem(
     int timeout);
 
 
+YR_API int yr_rules_scan_mem_blocks(
+    YR_RULES* rules,
+    YR_MEMORY_BLOCK_ITERATOR* iterator,
+    int flags,
+    YR_CALLBACK_FUNC callback,
+    void* user_data,
+    int timeout);
+
+
 YR_API int yr_rules_scan_file(
     YR_RULES* rules,
     const char* filename,
@@ -84,6 +94,26 @@ YR_API int yr_rules_scan_fd(
     int timeout);
 
 
+YR_API int yr_rules_scan_fd_cached(
+    YR_RULES* rules,
+    YR_SCAN_CACHE* cache,
+    YR_FILE_DESCRIPTOR fd,
+    int flags,
+    YR_CALLBACK_FUNC callback,
+    void* user_data,
+    int timeout);
+
+
+YR_API int yr_rules_scan_file_cached(
+    YR_RULES* rules,
+    YR_SCAN_CACHE* cache,
+    const char* filename,
+    int flags,
+    YR_CALLBACK_FUNC callback,
+    void* user_data,
+    int timeout);
+
+
 YR_API int yr_rules_scan_proc(
     YR_RULES* rules,
     int pid,
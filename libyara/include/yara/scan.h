@@ -20,8 +20,39 @@ limitations under the License.
 #include <yara/types.h>
 
 // Bitmasks for flags.
-#define SCAN_FLAGS_FAST_MODE         1
-#define SCAN_FLAGS_PROCESS_MEMORY    2
+#define SCAN_FLAGS_FAST_MODE                  1
+#define SCAN_FLAGS_PROCESS_MEMORY             2
+
+// Flags for yr_rules_scan_proc selecting which memory regions are scanned.
+// They are only honored on Linux.
+#define SCAN_FLAGS_PROCESS_SKIP_ANONYMOUS     4
+#define SCAN_FLAGS_PROCESS_SKIP_FILE_BACKED   8
+#define SCAN_FLAGS_PROCESS_WRITABLE_ONLY      16
+#define SCAN_FLAGS_PROCESS_EXECUTABLE_ONLY    32
+
+// Reuse the matches found in read-only file-backed mappings across all the
+// processes scanned with the same rules (see yr_rules_scan_proc).
+#define SCAN_FLAGS_PROCESS_CACHE_MAPPINGS     64
+
+
+YR_API uint8_t* yr_memory_block_fetch_data(
+    YR_MEMORY_BLOCK* block);
+
+
+YR_API int yr_memory_block_read_data(
+    YR_MEMORY_BLOCK* block,
+    size_t offset,
+    void* buffer,
+    size_t length);
+
+
+int yr_scan_add_match(
+    YR_SCAN_CONTEXT* context,
+    YR_STRING* string,
+    int64_t base,
+    int64_t offset,
+    int32_t length,
+    uint8_t* data);
 
 
 int yr_scan_verify_match(
@@ -0,0 +1,148 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef YR_SCAN_CACHE_H
+#define YR_SCAN_CACHE_H
+
+#include <stdint.h>
+
+#include <yara/filemap.h>
+#include <yara/types.h>
+#include <yara/utils.h>
+
+
+// Maximum number of matching rules stored for a file, files matching more
+// rules than this are not cached.
+#define YR_SCAN_CACHE_MAX_MATCHES    8
+
+// Number of slots probed when looking up or storing a file.
+#define YR_SCAN_CACHE_MAX_PROBES     8
+
+#define YR_SCAN_CACHE_VERSION        2
+
+#define DEFAULT_SCAN_CACHE_CAPACITY  (1 << 20)
+
+// Files changed less than this number of seconds ago are not cached. They
+// could be changed again without updating their modification time, because
+// some file systems store times with a resolution of a second or more.
+#define DEFAULT_SCAN_CACHE_RECENT_CHANGE_SECONDS  2
+
+
+// Identity of a scanned file. A file whose device, inode, size, and
+// modification and status change times are the same than when it was
+// scanned is assumed to have the same content. Times are in nanoseconds.
+// The flags used for scanning the file are part of the key too, because
+// fast mode can change the results, and so is a hash of the values of the
+// external variables, which can be changed after opening the cache.
+
+typedef struct _YR_SCAN_CACHE_KEY
+{
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  int64_t mtime;
+  int64_t ctime;
+  uint64_t externals;
+  uint32_t flags;
+  uint32_t reserved;
+
+} YR_SCAN_CACHE_KEY;
+
+
+// A slot of the hash table stored in the cache file. The sequence number
+// is zero in slots never used, and odd while the slot is being written.
+// Readers take a copy of the slot and discard it if the sequence number
+// changed meanwhile, or if the checksum doesn't match, so that slots can be
+// shared by threads and processes without locks. A slot that stays odd for
+// too long was left by a writer that died, and is taken over by the next
+// one.
+
+typedef struct _YR_SCAN_CACHE_ENTRY
+{
+  uint32_t sequence;
+  uint32_t matches_count;
+
+  // Time when the slot was last locked for writing, in seconds since the
+  // epoch.
+  int64_t write_time;
+
+  // Hash of the key, the matches and their count.
+  uint64_t checksum;
+
+  YR_SCAN_CACHE_KEY key;
+
+  // Indexes of the matching rules in the rules list.
+  uint32_t matches[YR_SCAN_CACHE_MAX_MATCHES];
+
+} YR_SCAN_CACHE_ENTRY;
+
+
+typedef struct _YR_SCAN_CACHE_HEADER
+{
+  char magic[4];
+  uint32_t version;
+  uint64_t fingerprint;
+  uint32_t capacity;
+  uint32_t reserved;
+
+} YR_SCAN_CACHE_HEADER;
+
+
+typedef struct _YR_SCAN_CACHE
+{
+  YR_FILE_DESCRIPTOR file;
+
+  YR_SCAN_CACHE_HEADER* header;
+  YR_SCAN_CACHE_ENTRY* entries;
+
+  size_t size;
+
+  // Files changed less than this number of seconds ago are not cached, set
+  // to DEFAULT_SCAN_CACHE_RECENT_CHANGE_SECONDS when the cache is opened.
+  int recent_change_seconds;
+
+} YR_SCAN_CACHE;
+
+
+YR_API int yr_scan_cache_open(
+    const char* file_path,
+    YR_RULES* rules,
+    uint32_t capacity,
+    YR_SCAN_CACHE** cache);
+
+
+YR_API void yr_scan_cache_close(
+    YR_SCAN_CACHE* cache);
+
+
+int yr_scan_cache_get_key(
+    YR_RULES* rules,
+    YR_FILE_DESCRIPTOR fd,
+    int flags,
+    YR_SCAN_CACHE_KEY* key);
+
+
+int yr_scan_cache_lookup(
+    YR_SCAN_CACHE* cache,
+    YR_SCAN_CACHE_KEY* key,
+    YR_SCAN_CACHE_ENTRY* entry);
+
+
+void yr_scan_cache_store(
+    YR_SCAN_CACHE* cache,
+    YR_SCAN_CACHE_ENTRY* entry);
+
+#endif
@@ -357,20 +357,85 @@ typedef struct _YR_RULES {
   YR_AC_TRANSITION_TABLE transition_table;
   YR_AC_MATCH_TABLE match_table;
 
+  // Matches found in processes' file-backed mappings, see
+  // yr_rules_scan_proc. Mappings found recently are in mappings_cache, the
+  // rest in old_mappings_cache, which is discarded when mappings_cache gets
+  // full. The checksums of the mappings' data are keyed with mappings_key,
+  // mappings_key_state is 1 once the key is generated and -1 if it couldn't
+  // be generated, in which case mappings are never cached.
+  YR_HASH_TABLE* mappings_cache;
+  YR_HASH_TABLE* old_mappings_cache;
+  uint64_t mappings_key[2];
+  int mappings_key_state;
+
 } YR_RULES;
 
 
+struct _YR_MEMORY_BLOCK;
+struct _YR_MEMORY_BLOCK_ITERATOR;
+
+
+typedef uint8_t* (*YR_MEMORY_BLOCK_FETCH_DATA_FUNC)(
+    struct _YR_MEMORY_BLOCK* block);
+
+
+typedef int (*YR_MEMORY_BLOCK_READ_DATA_FUNC)(
+    struct _YR_MEMORY_BLOCK* block,
+    size_t offset,
+    void* buffer,
+    size_t length);
+
+
+typedef struct _YR_MEMORY_BLOCK* (*YR_MEMORY_BLOCK_ITERATOR_FUNC)(
+    struct _YR_MEMORY_BLOCK_ITERATOR* iterator);
+
+
 typedef struct _YR_MEMORY_BLOCK
 {
   uint8_t* data;
   size_t size;
   size_t base;
 
-  struct _YR_MEMORY_BLOCK* next;
+  // Blocks with a NULL data pointer are read on demand by fetch_data, which
+  // receives the block itself and can use "context" for its own purposes.
+  // Use yr_memory_block_fetch_data instead of accessing "data" directly.
+  // A non-NULL data pointer must remain valid until the scan finishes, as
+  // matches and modules point into it, while fetched data is copied.
+
+  YR_MEMORY_BLOCK_FETCH_DATA_FUNC fetch_data;
+
+  // Optionally, they can also provide read_data, which copies "length" bytes
+  // starting at "offset" within the block into "buffer", and returns FALSE
+  // if they can't be read. Functions like uint32() use it for reading a few
+  // bytes without fetching the whole block. Must be NULL if not provided.
+
+  YR_MEMORY_BLOCK_READ_DATA_FUNC read_data;
+  void* context;
 
 } YR_MEMORY_BLOCK;
 
 
+// Provides the blocks to be scanned one at a time. "first" starts over and
+// returns the first block, "next" returns the block following the one
+// returned by the previous call, both return NULL when there are no more
+// blocks. The block returned, and the data fetched for it, only need to be
+// valid until the next call to "first" or "next", so blocks can be created
+// and read on demand. Iterations are never nested, and the same blocks must
+// be returned every time. If "first" or "next" return NULL because of an
+// error they set last_error, which must be ERROR_SUCCESS otherwise.
+
+typedef struct _YR_MEMORY_BLOCK_ITERATOR
+{
+  void* context;
+
+  YR_MEMORY_BLOCK_ITERATOR_FUNC first;
+  YR_MEMORY_BLOCK_ITERATOR_FUNC next;
+
+  int last_error;
+
+} YR_MEMORY_BLOCK_ITERATOR;
+
+
 typedef int (*YR_CALLBACK_FUNC)(
     int message,
     void* message_data,
@@ -385,9 +450,14 @@ typedef struct _YR_SCAN_CONTEXT
   int flags;
   int tidx;
 
+  // TRUE while searching a block whose data is fetched on demand, which is
+  // only valid until the next block is fetched, so the data of its matches
+  // must be copied.
+  int copy_match_data;
+
   void* user_data;
 
-  YR_MEMORY_BLOCK*  mem_block;
+  YR_MEMORY_BLOCK_ITERATOR*  iterator;
   YR_HASH_TABLE*  objects_table;
   YR_CALLBACK_FUNC  callback;
 
@@ -447,7 +517,7 @@ typedef struct _YR_OBJECT_REGEXP
 typedef struct _YR_OBJECT_STRUCTURE
 {
   OBJECT_COMMON_FIELDS
-  struct _YR_STRUCTURE_MEMBER* members;
+  struct _YR_STRUCTURE_MEMBERS* members;
 
 } YR_OBJECT_STRUCTURE;
 
@@ -493,12 +563,30 @@ typedef struct _YR_OBJECT_FUNCTION
 } YR_OBJECT_FUNCTION;
 
 
-typedef struct _YR_STRUCTURE_MEMBER
+// A loader is a function that populates a structure member on demand, it's
+// called the first time the member is accessed by a rule.
+
+typedef int (*YR_OBJECT_LOADER)(
+    YR_OBJECT* object);
+
+
+// Structure members are kept in declaration order, the position of a member
+// within the objects array is its slot index. Slot indexes are assigned
+// when the module is declared and they are the same for every copy of the
+// structure, which allows the compiler to emit index-based field accesses.
+// The loaders array, when not NULL, runs parallel to the objects array and
+// holds the pending loader for each slot.
+
+typedef struct _YR_STRUCTURE_MEMBERS
 {
-  YR_OBJECT* object;
-  struct _YR_STRUCTURE_MEMBER* next;
+  int used;
+  int free;
 
-} YR_STRUCTURE_MEMBER;
+  YR_OBJECT_LOADER* loaders;
+
+  YR_OBJECT* objects[1];
+
+} YR_STRUCTURE_MEMBERS;
 
 
 typedef struct _YR_ARRAY_ITEMS
@@ -514,6 +602,14 @@ typedef struct _YR_DICTIONARY_ITEMS
   int used;
   int free;
 
+  // Open addressing hash table mapping keys to slots in "objects". Each
+  // bucket holds a slot number plus one, zero means that the bucket is
+  // empty. The number of buckets is a power of two, at least twice the
+  // number of slots.
+
+  int buckets_count;
+  int* buckets;
+
   struct {
 
     char* key;
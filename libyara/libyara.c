@@ -19,6 +19,7 @@ limitations under the License.
 #include <ctype.h>
 
 #include <yara/error.h>
+#include <yara/filemap.h>
 #include <yara/re.h>
 #include <yara/modules.h>
 #include <yara/mem.h>
@@ -94,6 +95,8 @@ void locking_function(
 YR_API int yr_initialize(void)
 {
   uint32_t def_stack_size = DEFAULT_STACK_SIZE;
+  uint32_t def_max_magic_bytes = DEFAULT_MAX_MAGIC_BYTES;
+  uint32_t def_file_read_threshold = DEFAULT_FILE_READ_THRESHOLD;
   int i;
 
   if (init_count > 0)
@@ -132,10 +135,15 @@ YR_API int yr_initialize(void)
   #endif
 
   FAIL_ON_ERROR(yr_re_initialize());
+  FAIL_ON_ERROR(yr_filemap_initialize());
   FAIL_ON_ERROR(yr_modules_initialize());
 
   // Initialize default configuration options
   FAIL_ON_ERROR(yr_set_configuration(YR_CONFIG_STACK_SIZE, &def_stack_size));
+  FAIL_ON_ERROR(yr_set_configuration(
+      YR_CONFIG_MAX_MAGIC_BYTES, &def_max_magic_bytes));
+  FAIL_ON_ERROR(yr_set_configuration(
+      YR_CONFIG_FILE_READ_THRESHOLD, &def_file_read_threshold));
 
   init_count++;
 
@@ -152,6 +160,7 @@ YR_API int yr_initialize(void)
 YR_API void yr_finalize_thread(void)
 {
   yr_re_finalize_thread();
+  yr_filemap_finalize_thread();
 }
 
 
@@ -170,6 +179,7 @@ YR_API int yr_finalize(void)
   #endif
 
   yr_re_finalize_thread();
+  yr_filemap_finalize_thread();
 
   if (--init_count > 0)
     return ERROR_SUCCESS;
@@ -186,7 +196,15 @@ YR_API int yr_finalize(void)
   FAIL_ON_ERROR(yr_thread_storage_destroy(&tidx_key));
   FAIL_ON_ERROR(yr_thread_storage_destroy(&recovery_state_key));
   FAIL_ON_ERROR(yr_re_finalize());
+  FAIL_ON_ERROR(yr_filemap_finalize());
   FAIL_ON_ERROR(yr_modules_finalize());
+
+  if (yr_cfgs[YR_CONFIG_PROCESS_EXCLUDED_PATHS].str != NULL)
+  {
+    yr_free(yr_cfgs[YR_CONFIG_PROCESS_EXCLUDED_PATHS].str);
+    yr_cfgs[YR_CONFIG_PROCESS_EXCLUDED_PATHS].str = NULL;
+  }
+
   FAIL_ON_ERROR(yr_heap_free());
 
   return ERROR_SUCCESS;
@@ -230,15 +248,31 @@ YR_API int yr_set_configuration(
     YR_CONFIG_NAME cfgname,
     void *src)
 {
+  char* str;
+
   if (src == NULL)
     return ERROR_INTERNAL_FATAL_ERROR;
 
   switch (cfgname)
   { // lump all the cases using same types together in one cascade
     case YR_CONFIG_STACK_SIZE:
+    case YR_CONFIG_MAX_MAGIC_BYTES:
+    case YR_CONFIG_FILE_READ_THRESHOLD:
       yr_cfgs[cfgname].ui32 = *(uint32_t*) src;
       break;
 
+    case YR_CONFIG_PROCESS_EXCLUDED_PATHS:
+      str = yr_strdup((char*) src);
+
+      if (str == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+
+      if (yr_cfgs[cfgname].str != NULL)
+        yr_free(yr_cfgs[cfgname].str);
+
+      yr_cfgs[cfgname].str = str;
+      break;
+
     default:
       return ERROR_INTERNAL_FATAL_ERROR;
   }
@@ -257,9 +291,15 @@ YR_API int yr_get_configuration(
   switch (cfgname)
   { // lump all the cases using same types together in one cascade
     case YR_CONFIG_STACK_SIZE:
+    case YR_CONFIG_MAX_MAGIC_BYTES:
+    case YR_CONFIG_FILE_READ_THRESHOLD:
       *(uint32_t*) dest = yr_cfgs[cfgname].ui32;
       break;
 
+    case YR_CONFIG_PROCESS_EXCLUDED_PATHS:
+      *(char**) dest = yr_cfgs[cfgname].str;
+      break;
+
     default:
       return ERROR_INTERNAL_FATAL_ERROR;
   }
@@ -44,7 +44,8 @@ limitations under the License.
       name##__load, \
       name##__unload, \
       name##__initialize, \
-      name##__finalize \
+      name##__finalize, \
+      NULL \
     },
 
 YR_MODULE yr_modules_table[] =
@@ -58,16 +59,56 @@ YR_MODULE yr_modules_table[] =
 int yr_modules_initialize()
 {
   int i;
+  int result = ERROR_SUCCESS;
 
   for (i = 0; i < sizeof(yr_modules_table) / sizeof(YR_MODULE); i++)
   {
-    int result = yr_modules_table[i].initialize(&yr_modules_table[i]);
+    YR_MODULE* module = &yr_modules_table[i];
+    YR_OBJECT* prototype = NULL;
+
+    result = module->initialize(module);
 
     if (result != ERROR_SUCCESS)
-      return result;
+      break;
+
+    // Build the module's object tree only once. Scans will get a copy of
+    // it instead of running the declarations again.
+
+    result = yr_object_create(
+        OBJECT_TYPE_STRUCTURE,
+        module->name,
+        NULL,
+        &prototype);
+
+    if (result == ERROR_SUCCESS)
+      result = module->declarations(prototype);
+
+    if (result != ERROR_SUCCESS)
+    {
+      if (prototype != NULL)
+        yr_object_destroy(prototype);
+
+      module->finalize(module);
+      break;
+    }
+
+    module->prototype = prototype;
   }
 
-  return ERROR_SUCCESS;
+  // If some module failed, finalize the ones initialized before it and free
+  // their object trees.
+
+  if (result != ERROR_SUCCESS)
+  {
+    while (--i >= 0)
+    {
+      yr_modules_table[i].finalize(&yr_modules_table[i]);
+      yr_object_destroy(yr_modules_table[i].prototype);
+      yr_modules_table[i].prototype = NULL;
+    }
+  }
+
+  return result;
 }
 
 
@@ -77,10 +118,15 @@ int yr_modules_finalize()
 
   for (i = 0; i < sizeof(yr_modules_table) / sizeof(YR_MODULE); i++)
   {
-    int result = yr_modules_table[i].finalize(&yr_modules_table[i]);
+    YR_MODULE* module = &yr_modules_table[i];
+
+    int result = module->finalize(module);
 
     if (result != ERROR_SUCCESS)
       return result;
+
+    yr_object_destroy(module->prototype);
+    module->prototype = NULL;
   }
 
   return ERROR_SUCCESS;
@@ -109,6 +155,7 @@ int yr_modules_load(
 {
   int i, result;
 
+  YR_MODULE* module = NULL;
   YR_MODULE_IMPORT mi;
 
   YR_OBJECT* module_structure = (YR_OBJECT*) yr_hash_table_lookup(
@@ -124,11 +171,17 @@ int yr_modules_load(
 
   // not loaded yet
 
-  FAIL_ON_ERROR(yr_object_create(
-      OBJECT_TYPE_STRUCTURE,
-      module_name,
-      NULL,
-      &module_structure));
+  for (i = 0; i < sizeof(yr_modules_table) / sizeof(YR_MODULE); i++)
+  {
+    if (strcmp(yr_modules_table[i].name, module_name) == 0)
+    {
+      module = &yr_modules_table[i];
+      break;
+    }
+  }
+
+  if (module == NULL)
+    return ERROR_UNKNOWN_MODULE;
 
   mi.module_name = module_name;
   mi.module_data = NULL;
@@ -140,14 +193,11 @@ int yr_modules_load(
       context->user_data);
 
   if (result == CALLBACK_ERROR)
-  {
-    yr_object_destroy(module_structure);
     return ERROR_CALLBACK_ERROR;
-  }
-    
-  FAIL_ON_ERROR_WITH_CLEANUP(
-      yr_modules_do_declarations(module_name, module_structure),
-      yr_object_destroy(module_structure));
+
+  FAIL_ON_ERROR(yr_object_copy(
+      module->prototype,
+      &module_structure));
 
   FAIL_ON_ERROR_WITH_CLEANUP(
       yr_hash_table_add(
@@ -157,20 +207,14 @@ int yr_modules_load(
           module_structure),
       yr_object_destroy(module_structure));
 
-  for (i = 0; i < sizeof(yr_modules_table) / sizeof(YR_MODULE); i++)
-  {
-    if (strcmp(yr_modules_table[i].name, module_name) == 0)
-    {
-      result = yr_modules_table[i].load(
-          context,
-          module_structure,
-          mi.module_data,
-          mi.module_data_size);
-
-      if (result != ERROR_SUCCESS)
-        return result;
-    }
-  }
+  result = module->load(
+      context,
+      module_structure,
+      mi.module_data,
+      mi.module_data_size);
+
+  if (result != ERROR_SUCCESS)
+    return result;
 
   result = context->callback(
       CALLBACK_MSG_MODULE_IMPORTED,
@@ -18,6 +18,9 @@ limitations under the License.
 #include <jansson.h>
 
 
+#include <yara/cuckoo.h>
+#include <yara/globals.h>
+#include <yara/mem.h>
 #include <yara/re.h>
 #include <yara/modules.h>
 
@@ -27,69 +30,377 @@ limitations under the License.
 
 #define MODULE_NAME cuckoo
 
+#define MAX_PREFILTER_LENGTH  32
 
-define_function(network_dns_lookup)
+
+//
+// cuckoo_entry_string
+//
+// Returns the string stored in an entry of a report's array, which is
+// either the entry itself or, if key is not NULL, the entry's member named
+// key. Returns NULL if there's no such string.
+//
+
+const char* cuckoo_entry_string(
+    json_t* entry,
+    const char* key)
 {
-  YR_OBJECT* network_obj = parent();
+  if (key != NULL)
+    entry = json_object_get(entry, key);
+
+  return json_string_value(entry);
+}
+
 
-  json_t* network_json = (json_t*) network_obj->data;
-  json_t* dns_json = json_object_get(network_json, "dns");
+//
+// cuckoo_table_build
+//
+// Copies the strings found in a report's array into a table, all of them
+// stored contiguously in a single buffer.
+//
+
+int cuckoo_table_build(
+    json_t* array,
+    const char* key,
+    YR_CUCKOO_TABLE* table)
+{
   json_t* value;
 
-  uint64_t result = 0;
+  const char* string;
+  char* next;
+
+  size_t buffer_size = 0;
   size_t index;
 
-  char* ip;
-  char* hostname;
+  int count = 0;
 
-  json_array_foreach(dns_json, index, value)
+  json_array_foreach(array, index, value)
   {
-    json_unpack(value, "{s:s, s:s}", "ip", &ip, "hostname", &hostname);
+    string = cuckoo_entry_string(value, key);
 
-    if (yr_re_match(regexp_argument(1), hostname) > 0)
+    if (string != NULL)
     {
-      result = 1;
-      break;
+      buffer_size += strlen(string) + 1;
+      count++;
+    }
+  }
+
+  table->count = 0;
+  table->strings = (char**) yr_malloc((count + 1) * sizeof(char*));
+  table->lengths = (size_t*) yr_malloc((count + 1) * sizeof(size_t));
+  table->buffer = (char*) yr_malloc(buffer_size + 1);
+
+  if (table->strings == NULL ||
+      table->lengths == NULL ||
+      table->buffer == NULL)
+  {
+    return ERROR_INSUFICIENT_MEMORY;
+  }
+
+  next = table->buffer;
+
+  json_array_foreach(array, index, value)
+  {
+    string = cuckoo_entry_string(value, key);
+
+    if (string != NULL)
+    {
+      size_t length = strlen(string);
+
+      memcpy(next, string, length + 1);
+
+      table->strings[table->count] = next;
+      table->lengths[table->count] = length;
+      table->count++;
+
+      next += length + 1;
     }
   }
 
-  return_integer(result);
+  return ERROR_SUCCESS;
 }
 
 
-#define METHOD_GET    0x01
-#define METHOD_POST   0x02
+void cuckoo_table_destroy(
+    YR_CUCKOO_TABLE* table)
+{
+  yr_free(table->strings);
+  yr_free(table->lengths);
+  yr_free(table->buffer);
+}
 
 
-uint64_t http_request(
-    YR_OBJECT* network_obj,
-    RE_CODE uri_regexp,
-    int methods)
+YR_API int yr_cuckoo_report_create(
+    const uint8_t* json_data,
+    size_t json_data_size,
+    YR_CUCKOO_REPORT** report)
 {
-  json_t* network_json = (json_t*) network_obj->data;
-  json_t* http_json = json_object_get(network_json, "http");
+  YR_CUCKOO_REPORT* new_report;
+
+  json_error_t json_error;
+
+  json_t* json;
+  json_t* network_json;
+  json_t* summary_json;
   json_t* value;
 
-  uint64_t result = 0;
   size_t index;
+  int i = 0;
+  int result;
+
+  json = json_loadb(
+      (const char*) json_data,
+      json_data_size,
+      0,
+      &json_error);
 
-  char* method;
-  char* uri;
+  if (json == NULL)
+    return ERROR_INVALID_FILE;
 
-  json_array_foreach(http_json, index, value)
+  new_report = (YR_CUCKOO_REPORT*) yr_calloc(1, sizeof(YR_CUCKOO_REPORT));
+
+  if (new_report == NULL)
+  {
+    json_decref(json);
+    return ERROR_INSUFICIENT_MEMORY;
+  }
+
+  memcpy(
+      new_report->signature,
+      CUCKOO_REPORT_SIGNATURE,
+      sizeof(new_report->signature));
+
+  network_json = json_object_get(json, "network");
+  summary_json = json_object_get(
+      json_object_get(json, "behavior"), "summary");
+
+  result = cuckoo_table_build(
+      json_object_get(network_json, "dns"),
+      "hostname",
+      &new_report->dns_lookups);
+
+  if (result == ERROR_SUCCESS)
+    result = cuckoo_table_build(
+        json_object_get(network_json, "http"),
+        "uri",
+        &new_report->http_requests);
+
+  if (result == ERROR_SUCCESS)
+    result = cuckoo_table_build(
+        json_object_get(summary_json, "keys"),
+        NULL,
+        &new_report->registry_keys);
+
+  if (result == ERROR_SUCCESS)
+    result = cuckoo_table_build(
+        json_object_get(summary_json, "files"),
+        NULL,
+        &new_report->files);
+
+  if (result == ERROR_SUCCESS)
+    result = cuckoo_table_build(
+        json_object_get(summary_json, "mutexes"),
+        NULL,
+        &new_report->mutexes);
+
+  if (result == ERROR_SUCCESS)
   {
-    json_unpack(value, "{s:s, s:s}", "uri", &uri, "method", &method);
+    new_report->http_methods = (uint8_t*) yr_calloc(
+        new_report->http_requests.count + 1, sizeof(uint8_t));
+
+    if (new_report->http_methods == NULL)
+      result = ERROR_INSUFICIENT_MEMORY;
+  }
 
-    if (((methods & METHOD_GET && strcasecmp(method, "get") == 0) ||
-         (methods & METHOD_POST && strcasecmp(method, "post") == 0)) &&
-         yr_re_match(uri_regexp, uri) > 0)
+  if (result == ERROR_SUCCESS)
+  {
+    // Entries without an uri were left out of the table, skip them here
+    // too so that methods stay parallel to the table's strings.
+
+    json_array_foreach(json_object_get(network_json, "http"), index, value)
     {
-      result = 1;
+      const char* method = cuckoo_entry_string(value, "method");
+
+      if (cuckoo_entry_string(value, "uri") == NULL)
+        continue;
+
+      if (method != NULL && strcasecmp(method, "get") == 0)
+        new_report->http_methods[i] = CUCKOO_METHOD_GET;
+      else if (method != NULL && strcasecmp(method, "post") == 0)
+        new_report->http_methods[i] = CUCKOO_METHOD_POST;
+
+      i++;
+    }
+  }
+
+  json_decref(json);
+
+  if (result != ERROR_SUCCESS)
+  {
+    yr_cuckoo_report_destroy(new_report);
+    return result;
+  }
+
+  *report = new_report;
+
+  return ERROR_SUCCESS;
+}
+
+
+YR_API void yr_cuckoo_report_destroy(
+    YR_CUCKOO_REPORT* report)
+{
+  cuckoo_table_destroy(&report->dns_lookups);
+  cuckoo_table_destroy(&report->http_requests);
+  cuckoo_table_destroy(&report->registry_keys);
+  cuckoo_table_destroy(&report->files);
+  cuckoo_table_destroy(&report->mutexes);
+
+  yr_free(report->http_methods);
+  yr_free(report);
+}
+
+
+//
+// cuckoo_prefilter_extract
+//
+// Extracts the sequence of literal characters the regular expression's
+// code begins with. Any match must contain those characters, so strings
+// not containing them can be discarded without running the regexp. For
+// each character nocase[i] tells whether it's matched case-insensitively.
+//
+
+int cuckoo_prefilter_extract(
+    RE_CODE re_code,
+    uint8_t* literal,
+    uint8_t* nocase)
+{
+  int length = 0;
+
+  while (length < MAX_PREFILTER_LENGTH)
+  {
+    if (*re_code == RE_OPCODE_LITERAL)
+      nocase[length] = FALSE;
+    else if (*re_code == RE_OPCODE_LITERAL_NO_CASE)
+      nocase[length] = TRUE;
+    else
       break;
+
+    literal[length++] = *(re_code + 1);
+    re_code += 2;
+  }
+
+  return length;
+}
+
+
+int cuckoo_prefilter_match(
+    const uint8_t* literal,
+    const uint8_t* nocase,
+    int literal_length,
+    const char* string,
+    size_t string_length)
+{
+  size_t i;
+  int j;
+
+  for (i = 0; i + literal_length <= string_length; i++)
+  {
+    for (j = 0; j < literal_length; j++)
+    {
+      uint8_t c = (uint8_t) string[i + j];
+
+      if (nocase[j] ? lowercase[c] != lowercase[literal[j]] : c != literal[j])
+        break;
     }
+
+    if (j == literal_length)
+      return TRUE;
   }
 
-  return result;
+  return FALSE;
+}
+
+
+//
+// cuckoo_table_match
+//
+// Returns 1 if any of the table's strings matches the regexp. If methods
+// is not NULL only strings whose corresponding method is in method_mask
+// are considered.
+//
+
+uint64_t cuckoo_table_match(
+    YR_CUCKOO_TABLE* table,
+    RE_CODE re_code,
+    uint8_t* methods,
+    int method_mask)
+{
+  uint8_t literal[MAX_PREFILTER_LENGTH];
+  uint8_t nocase[MAX_PREFILTER_LENGTH];
+
+  int literal_length = cuckoo_prefilter_extract(re_code, literal, nocase);
+  int i;
+
+  for (i = 0; i < table->count; i++)
+  {
+    if (methods != NULL && !(methods[i] & method_mask))
+      continue;
+
+    if (literal_length > 0 &&
+        !cuckoo_prefilter_match(
+            literal,
+            nocase,
+            literal_length,
+            table->strings[i],
+            table->lengths[i]))
+      continue;
+
+    if (yr_re_exec(
+            re_code,
+            (uint8_t*) table->strings[i],
+            table->lengths[i],
+            RE_FLAGS_SCAN,
+            NULL,
+            NULL) > 0)
+      return 1;
+  }
+
+  return 0;
+}
+
+
+define_function(network_dns_lookup)
+{
+  YR_CUCKOO_REPORT* report = (YR_CUCKOO_REPORT*) parent()->data;
+
+  if (report == NULL)
+    return_integer(0);
+
+  return_integer(
+      cuckoo_table_match(
+          &report->dns_lookups,
+          regexp_argument(1),
+          NULL,
+          0));
+}
+
+
+uint64_t http_request(
+    YR_OBJECT* network_obj,
+    RE_CODE uri_regexp,
+    int methods)
+{
+  YR_CUCKOO_REPORT* report = (YR_CUCKOO_REPORT*) network_obj->data;
+
+  if (report == NULL)
+    return 0;
+
+  return cuckoo_table_match(
+      &report->http_requests,
+      uri_regexp,
+      report->http_methods,
+      methods);
 }
 
 
@@ -99,7 +410,7 @@ define_function(network_http_request)
       http_request(
           parent(),
           regexp_argument(1),
-          METHOD_GET | METHOD_POST));
+          CUCKOO_METHOD_GET | CUCKOO_METHOD_POST));
 }
 
 
@@ -109,7 +420,7 @@ define_function(network_http_get)
       http_request(
           parent(),
           regexp_argument(1),
-          METHOD_GET));
+          CUCKOO_METHOD_GET));
 }
 
 
@@ -119,77 +430,55 @@ define_function(network_http_post)
       http_request(
           parent(),
           regexp_argument(1),
-          METHOD_POST));
+          CUCKOO_METHOD_POST));
 }
 
 
 define_function(registry_key_access)
 {
-  YR_OBJECT* registry_obj = parent();
+  YR_CUCKOO_REPORT* report = (YR_CUCKOO_REPORT*) parent()->data;
 
-  json_t* keys_json = (json_t*) registry_obj->data;
-  json_t* value;
-
-  uint64_t result = 0;
-  size_t index;
-
-  json_array_foreach(keys_json, index, value)
-  {
-    if (yr_re_match(regexp_argument(1), json_string_value(value)) > 0)
-    {
-      result = 1;
-      break;
-    }
-  }
+  if (report == NULL)
+    return_integer(0);
 
-  return_integer(result);
+  return_integer(
+      cuckoo_table_match(
+          &report->registry_keys,
+          regexp_argument(1),
+          NULL,
+          0));
 }
 
 
 define_function(filesystem_file_access)
 {
-  YR_OBJECT* filesystem_obj = parent();
-
-  json_t* files_json = (json_t*) filesystem_obj->data;
-  json_t* value;
+  YR_CUCKOO_REPORT* report = (YR_CUCKOO_REPORT*) parent()->data;
 
-  uint64_t result = 0;
-  size_t index;
+  if (report == NULL)
+    return_integer(0);
 
-  json_array_foreach(files_json, index, value)
-  {
-    if (yr_re_match(regexp_argument(1), json_string_value(value)) > 0)
-    {
-      result = 1;
-      break;
-    }
-  }
-
-  return_integer(result);
+  return_integer(
+      cuckoo_table_match(
+          &report->files,
+          regexp_argument(1),
+          NULL,
+          0));
 }
 
 
-
 define_function(sync_mutex)
 {
-  YR_OBJECT* sync_obj = parent();
+  YR_CUCKOO_REPORT* report = (YR_CUCKOO_REPORT*) parent()->data;
 
-  json_t* mutexes_json = (json_t*) sync_obj->data;
-  json_t* value;
-
-  uint64_t result = 0;
-  size_t index;
+  if (report == NULL)
+    return_integer(0);
 
-  json_array_foreach(mutexes_json, index, value)
-  {
-    if (yr_re_match(regexp_argument(1), json_string_value(value)) > 0)
-    {
-      result = 1;
-      break;
-    }
-  }
-
-  return_integer(result);
+  return_integer(
+      cuckoo_table_match(
+          &report->mutexes,
+          regexp_argument(1),
+          NULL,
+          0));
 }
 
 
@@ -237,43 +526,36 @@ int module_load(
     void* module_data,
     size_t module_data_size)
 {
-  YR_OBJECT* network_obj;
-  YR_OBJECT* registry_obj;
-  YR_OBJECT* filesystem_obj;
-  YR_OBJECT* sync_obj;
-
-  json_error_t json_error;
-
-  json_t* summary_json;
-  json_t* json;
+  YR_CUCKOO_REPORT* report;
 
   if (module_data == NULL)
     return ERROR_SUCCESS;
 
-  json = json_loadb(
-      (const char*) module_data,
-      module_data_size,
-      0,
-      &json_error);
-
-  if (json == NULL)
-    return ERROR_INVALID_FILE;
-
-  module_object->data = (void*) json;
+  // The module data is either an already indexed report shared with other
+  // scans, or the report's JSON, indexed here and owned by this scan.
 
-  network_obj = get_object(module_object, "network");
-  registry_obj = get_object(module_object, "registry");
-  filesystem_obj = get_object(module_object, "filesystem");
-  sync_obj = get_object(module_object, "sync");
-
-  network_obj->data = (void*) json_object_get(json, "network");
+  if (module_data_size == sizeof(YR_CUCKOO_REPORT) &&
+      memcmp(
+          module_data,
+          CUCKOO_REPORT_SIGNATURE,
+          sizeof(report->signature)) == 0)
+  {
+    report = (YR_CUCKOO_REPORT*) module_data;
+  }
+  else
+  {
+    FAIL_ON_ERROR(yr_cuckoo_report_create(
+        (const uint8_t*) module_data,
+        module_data_size,
+        &report));
 
-  json = json_object_get(json, "behavior");
-  summary_json = json_object_get(json, "summary");
+    module_object->data = (void*) report;
+  }
 
-  registry_obj->data = (void*) json_object_get(summary_json, "keys");
-  filesystem_obj->data = (void*) json_object_get(summary_json, "files");
-  sync_obj->data = (void*) json_object_get(summary_json, "mutexes");
+  get_object(module_object, "network")->data = (void*) report;
+  get_object(module_object, "registry")->data = (void*) report;
+  get_object(module_object, "filesystem")->data = (void*) report;
+  get_object(module_object, "sync")->data = (void*) report;
 
   return ERROR_SUCCESS;
 }
@@ -282,7 +564,7 @@ int module_load(
 int module_unload(YR_OBJECT* module)
 {
   if (module->data != NULL)
-    json_decref((json_t*) module->data);
+    yr_cuckoo_report_destroy((YR_CUCKOO_REPORT*) module->data);
 
   return ERROR_SUCCESS;
 }
@@ -15,8 +15,10 @@ limitations under the License.
 */
 
 #include <limits.h>
+#include <string.h>
 
 #include <yara/elf.h>
+#include <yara/hash.h>
 #include <yara/modules.h>
 #include <yara/mem.h>
 
@@ -24,6 +26,26 @@ limitations under the License.
 #define MODULE_NAME elf
 
 
+typedef struct _ELF
+{
+  uint8_t* data;
+  size_t data_size;
+
+  // Copy of the data when it comes from a block read on demand, which is
+  // only valid until another block is read.
+  uint8_t* data_copy;
+
+  int _class;
+  int symbols_parsed;
+
+  // Symbol names from .symtab and .dynsym, built the first time
+  // has_symbol is called.
+
+  YR_HASH_TABLE* symbols_index;
+
+} ELF;
+
+
 int get_elf_type(
     uint8_t* buffer,
     size_t buffer_length)
@@ -109,6 +131,10 @@ void parse_elf_header_##bits(                                                  \
   elf##bits##_section_header_t* section;                                       \
   elf##bits##_program_header_t* segment;                                       \
                                                                                \
+  YR_OBJECT* sections = get_object(elf_obj, "sections");                       \
+  YR_OBJECT* segments = get_object(elf_obj, "segments");                       \
+  YR_OBJECT* item;                                                             \
+                                                                               \
   set_integer(elf->type, elf_obj, "type");                                     \
   set_integer(elf->machine, elf_obj, "machine");                               \
   set_integer(elf->sh_offset, elf_obj, "sh_offset");                           \
@@ -135,6 +161,14 @@ void parse_elf_header_##bits(                                                  \
   {                                                                            \
     char* str_table = NULL;                                                    \
                                                                                \
+    YR_OBJECT* prototype = get_prototype(sections);                            \
+                                                                               \
+    int type_index = member_index(prototype, "type");                          \
+    int flags_index = member_index(prototype, "flags");                        \
+    int name_index = member_index(prototype, "name");                          \
+    int size_index = member_index(prototype, "size");                          \
+    int offset_index = member_index(prototype, "offset");                      \
+                                                                               \
     section = (elf##bits##_section_header_t*)                                  \
        ((uint8_t*) elf + elf->sh_offset);                                      \
                                                                                \
@@ -143,16 +177,21 @@ void parse_elf_header_##bits(                                                  \
                                                                                \
     for (i = 0; i < elf->sh_entry_count; i++)                                  \
     {                                                                          \
-      set_integer(section->type, elf_obj, "sections[%i].type", i);             \
-      set_integer(section->flags, elf_obj, "sections[%i].flags", i);           \
-      set_integer(section->size, elf_obj, "sections[%i].size", i);             \
-      set_integer(section->offset, elf_obj, "sections[%i].offset", i);         \
+      item = create_item(sections, i);                                         \
+                                                                               \
+      if (item == NULL)                                                        \
+        break;                                                                 \
+                                                                               \
+      set_integer_member(section->type, item, type_index);                     \
+      set_integer_member(section->flags, item, flags_index);                   \
+      set_integer_member(section->size, item, size_index);                     \
+      set_integer_member(section->offset, item, offset_index);                 \
                                                                                \
       if (section->name < elf_size &&                                          \
           str_table > (char*) elf &&                                           \
           str_table + section->name < (char*) elf + elf_size)                  \
       {                                                                        \
-        set_string(str_table + section->name, elf_obj, "sections[%i].name", i);\
+        set_string_member(str_table + section->name, item, name_index);        \
       }                                                                        \
                                                                                \
       section++;                                                               \
@@ -165,27 +204,35 @@ void parse_elf_header_##bits(                                                  \
       elf->ph_offset + elf->ph_entry_count *                                   \
         sizeof(elf##bits##_program_header_t) <= elf_size)                      \
   {                                                                            \
+    YR_OBJECT* prototype = get_prototype(segments);                            \
+                                                                               \
+    int type_index = member_index(prototype, "type");                          \
+    int flags_index = member_index(prototype, "flags");                        \
+    int offset_index = member_index(prototype, "offset");                      \
+    int virt_addr_index = member_index(prototype, "virtual_address");          \
+    int phys_addr_index = member_index(prototype, "physical_address");         \
+    int file_size_index = member_index(prototype, "file_size");                \
+    int mem_size_index = member_index(prototype, "memory_size");               \
+    int alignment_index = member_index(prototype, "alignment");                \
+                                                                               \
     segment = (elf##bits##_program_header_t*)                                  \
         ((uint8_t*) elf + elf->ph_offset);                                     \
                                                                                \
     for (i = 0; i < elf->ph_entry_count; i++)                                  \
     {                                                                          \
-      set_integer(                                                             \
-          segment->type, elf_obj, "segments[%i].type", i);                     \
-      set_integer(                                                             \
-          segment->flags, elf_obj, "segments[%i].flags", i);                   \
-      set_integer(                                                             \
-          segment->offset, elf_obj, "segments[%i].offset", i);                 \
-      set_integer(                                                             \
-          segment->virt_addr, elf_obj, "segments[%i].virtual_address", i);     \
-      set_integer(                                                             \
-          segment->phys_addr, elf_obj, "segments[%i].physical_address", i);    \
-      set_integer(                                                             \
-          segment->file_size, elf_obj, "segments[%i].file_size", i);           \
-      set_integer(                                                             \
-          segment->mem_size, elf_obj, "segments[%i].memory_size", i);          \
-      set_integer(                                                             \
-          segment->alignment, elf_obj, "segments[%i].alignment", i);           \
+      item = create_item(segments, i);                                         \
+                                                                               \
+      if (item == NULL)                                                        \
+        break;                                                                 \
+                                                                               \
+      set_integer_member(segment->type, item, type_index);                     \
+      set_integer_member(segment->flags, item, flags_index);                   \
+      set_integer_member(segment->offset, item, offset_index);                 \
+      set_integer_member(segment->virt_addr, item, virt_addr_index);           \
+      set_integer_member(segment->phys_addr, item, phys_addr_index);           \
+      set_integer_member(segment->file_size, item, file_size_index);           \
+      set_integer_member(segment->mem_size, item, mem_size_index);             \
+      set_integer_member(segment->alignment, item, alignment_index);           \
                                                                                \
       segment++;                                                               \
     }                                                                          \
@@ -193,6 +240,144 @@ void parse_elf_header_##bits(                                                  \
 }
 
 
+#define PARSE_ELF_SYMBOLS(bits)                                                \
+int parse_elf_symbols_##bits(                                                  \
+  elf##bits##_header_t* elf,                                                   \
+  size_t elf_size,                                                             \
+  YR_OBJECT* elf_obj,                                                          \
+  YR_HASH_TABLE* symbols_index)                                                \
+{                                                                              \
+  int i;                                                                       \
+  int count = 0;                                                               \
+                                                                               \
+  elf##bits##_section_header_t* sections;                                      \
+  elf##bits##_section_header_t* section;                                       \
+  elf##bits##_section_header_t* str_section;                                   \
+                                                                               \
+  YR_OBJECT* symbols = NULL;                                                   \
+  YR_OBJECT* prototype;                                                        \
+  YR_OBJECT* item;                                                             \
+                                                                               \
+  int name_index = 0;                                                          \
+  int value_index = 0;                                                         \
+  int size_index = 0;                                                          \
+  int type_index = 0;                                                          \
+  int bind_index = 0;                                                          \
+  int shndx_index = 0;                                                         \
+                                                                               \
+  if (elf->sh_entry_count >= ELF_SHN_LORESERVE ||                              \
+      elf->sh_offset >= elf_size ||                                            \
+      elf->sh_offset + elf->sh_entry_count *                                   \
+         sizeof(elf##bits##_section_header_t) > elf_size)                      \
+  {                                                                            \
+    return ERROR_SUCCESS;                                                      \
+  }                                                                            \
+                                                                               \
+  if (elf_obj != NULL)                                                         \
+  {                                                                            \
+    symbols = get_object(elf_obj, "symbols");                                  \
+    prototype = get_prototype(symbols);                                        \
+                                                                               \
+    name_index = member_index(prototype, "name");                              \
+    value_index = member_index(prototype, "value");                            \
+    size_index = member_index(prototype, "size");                              \
+    type_index = member_index(prototype, "type");                              \
+    bind_index = member_index(prototype, "bind");                              \
+    shndx_index = member_index(prototype, "shndx");                            \
+  }                                                                            \
+                                                                               \
+  sections = (elf##bits##_section_header_t*)                                   \
+      ((uint8_t*) elf + elf->sh_offset);                                       \
+                                                                               \
+  for (i = 0; i < elf->sh_entry_count; i++)                                    \
+  {                                                                            \
+    elf##bits##_sym_t* symbol;                                                 \
+    char* str_table;                                                           \
+                                                                               \
+    uint64_t j;                                                                \
+    uint64_t symbols_count;                                                    \
+                                                                               \
+    section = &sections[i];                                                    \
+                                                                               \
+    if (section->type != ELF_SHT_SYMTAB && section->type != ELF_SHT_DYNSYM)    \
+      continue;                                                                \
+                                                                               \
+    if (section->entry_size < sizeof(elf##bits##_sym_t) ||                     \
+        section->link >= elf->sh_entry_count ||                                \
+        section->offset >= elf_size ||                                         \
+        section->size > elf_size - section->offset)                            \
+    {                                                                          \
+      continue;                                                                \
+    }                                                                          \
+                                                                               \
+    str_section = &sections[section->link];                                    \
+                                                                               \
+    if (str_section->offset >= elf_size ||                                     \
+        str_section->size > elf_size - str_section->offset)                    \
+    {                                                                          \
+      continue;                                                                \
+    }                                                                          \
+                                                                               \
+    str_table = (char*) elf + str_section->offset;                             \
+    symbols_count = section->size / section->entry_size;                       \
+                                                                               \
+    for (j = 0; j < symbols_count; j++)                                        \
+    {                                                                          \
+      size_t name_length;                                                      \
+                                                                               \
+      symbol = (elf##bits##_sym_t*) ((uint8_t*) elf +                          \
+          section->offset + j * section->entry_size);                          \
+                                                                               \
+      if (symbol->name >= str_section->size)                                   \
+        continue;                                                              \
+                                                                               \
+      name_length = strnlen(                                                   \
+          str_table + symbol->name,                                            \
+          str_section->size - symbol->name);                                   \
+                                                                               \
+      if (name_length == 0 ||                                                  \
+          name_length == str_section->size - symbol->name)                     \
+      {                                                                        \
+        continue;                                                              \
+      }                                                                        \
+                                                                               \
+      if (symbols_index != NULL &&                                             \
+          yr_hash_table_lookup(                                                \
+              symbols_index, str_table + symbol->name, NULL) == NULL)          \
+      {                                                                        \
+        FAIL_ON_ERROR(yr_hash_table_add(                                       \
+            symbols_index,                                                     \
+            str_table + symbol->name,                                          \
+            NULL,                                                              \
+            (void*) symbol));                                                  \
+      }                                                                        \
+                                                                               \
+      if (symbols != NULL)                                                     \
+      {                                                                        \
+        item = create_item(symbols, count);                                    \
+                                                                               \
+        if (item == NULL)                                                      \
+          return ERROR_INSUFICIENT_MEMORY;                                     \
+                                                                               \
+        set_sized_string_member(                                               \
+            str_table + symbol->name, name_length, item, name_index);          \
+        set_integer_member(symbol->value, item, value_index);                  \
+        set_integer_member(symbol->size, item, size_index);                    \
+        set_integer_member(ELF_ST_TYPE(symbol->info), item, type_index);       \
+        set_integer_member(ELF_ST_BIND(symbol->info), item, bind_index);       \
+        set_integer_member(symbol->shndx, item, shndx_index);                  \
+      }                                                                        \
+                                                                               \
+      count++;                                                                 \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  if (elf_obj != NULL)                                                         \
+    set_integer(count, elf_obj, "number_of_symbols");                          \
+                                                                               \
+  return ERROR_SUCCESS;                                                        \
+}
+
 ELF_RVA_TO_OFFSET(32);
 ELF_RVA_TO_OFFSET(64);
 
@@ -201,45 +386,128 @@ PARSE_ELF_HEADER(32);
 PARSE_ELF_HEADER(64);
 
 
+PARSE_ELF_SYMBOLS(32);
+PARSE_ELF_SYMBOLS(64);
+
+
+//
+// elf_parse_symbols
+//
+// Walks the symbol tables of the ELF file, populating the symbols array
+// if elf_obj is not NULL and adding symbol names to symbols_index if it's
+// not NULL.
+//
+
+int elf_parse_symbols(
+    ELF* elf,
+    YR_OBJECT* elf_obj,
+    YR_HASH_TABLE* symbols_index)
+{
+  switch(elf->_class)
+  {
+    case ELF_CLASS_32:
+      return parse_elf_symbols_32(
+          (elf32_header_t*) elf->data,
+          elf->data_size,
+          elf_obj,
+          symbols_index);
+
+    case ELF_CLASS_64:
+      return parse_elf_symbols_64(
+          (elf64_header_t*) elf->data,
+          elf->data_size,
+          elf_obj,
+          symbols_index);
+  }
+
+  return ERROR_SUCCESS;
+}
+
+
+//
+// elf_load_symbols
+//
+// Loader for the symbols and number_of_symbols fields, which are only
+// populated if some rule uses them.
+//
+
+int elf_load_symbols(
+    YR_OBJECT* object)
+{
+  YR_OBJECT* elf_obj = yr_object_get_root(object);
+  ELF* elf = (ELF*) elf_obj->data;
+
+  if (elf == NULL || elf->data == NULL || elf->symbols_parsed)
+    return ERROR_SUCCESS;
+
+  elf->symbols_parsed = TRUE;
+
+  return elf_parse_symbols(elf, elf_obj, NULL);
+}
+
+
+define_function(has_symbol)
+{
+  SIZED_STRING* name = sized_string_argument(1);
+  ELF* elf = (ELF*) module()->data;
+
+  if (elf == NULL || elf->data == NULL)
+    return_integer(UNDEFINED);
+
+  if (name->length == 0)
+    return_integer(0);
+
+  if (elf->symbols_index == NULL)
+  {
+    FAIL_ON_ERROR(yr_hash_table_create(1021, &elf->symbols_index));
+    FAIL_ON_ERROR(elf_parse_symbols(elf, NULL, elf->symbols_index));
+  }
+
+  return_integer(
+      yr_hash_table_lookup(
+          elf->symbols_index, name->c_string, NULL) != NULL ? 1 : 0);
+}
+
+
 begin_declarations;
 
-  declare_integer("ET_NONE");
-  declare_integer("ET_REL");
-  declare_integer("ET_EXEC");
-  declare_integer("ET_DYN");
-  declare_integer("ET_CORE");
-
-  declare_integer("EM_NONE");
-  declare_integer("EM_M32");
-  declare_integer("EM_SPARC");
-  declare_integer("EM_386");
-  declare_integer("EM_68K");
-  declare_integer("EM_88K");
-  declare_integer("EM_860");
-  declare_integer("EM_MIPS");
-  declare_integer("EM_MIPS_RS3_LE");
-  declare_integer("EM_PPC");
-  declare_integer("EM_PPC64");
-  declare_integer("EM_ARM");
-  declare_integer("EM_X86_64");
-  declare_integer("EM_AARCH64");
-
-  declare_integer("SHT_NULL");
-  declare_integer("SHT_PROGBITS");
-  declare_integer("SHT_SYMTAB");
-  declare_integer("SHT_STRTAB");
-  declare_integer("SHT_RELA");
-  declare_integer("SHT_HASH");
-  declare_integer("SHT_DYNAMIC");
-  declare_integer("SHT_NOTE");
-  declare_integer("SHT_NOBITS");
-  declare_integer("SHT_REL");
-  declare_integer("SHT_SHLIB");
-  declare_integer("SHT_DYNSYM");
-
-  declare_integer("SHF_WRITE");
-  declare_integer("SHF_ALLOC");
-  declare_integer("SHF_EXECINSTR");
+  declare_integer_constant("ET_NONE", ELF_ET_NONE);
+  declare_integer_constant("ET_REL", ELF_ET_REL);
+  declare_integer_constant("ET_EXEC", ELF_ET_EXEC);
+  declare_integer_constant("ET_DYN", ELF_ET_DYN);
+  declare_integer_constant("ET_CORE", ELF_ET_CORE);
+
+  declare_integer_constant("EM_NONE", ELF_EM_NONE);
+  declare_integer_constant("EM_M32", ELF_EM_M32);
+  declare_integer_constant("EM_SPARC", ELF_EM_SPARC);
+  declare_integer_constant("EM_386", ELF_EM_386);
+  declare_integer_constant("EM_68K", ELF_EM_68K);
+  declare_integer_constant("EM_88K", ELF_EM_88K);
+  declare_integer_constant("EM_860", ELF_EM_860);
+  declare_integer_constant("EM_MIPS", ELF_EM_MIPS);
+  declare_integer_constant("EM_MIPS_RS3_LE", ELF_EM_MIPS_RS3_LE);
+  declare_integer_constant("EM_PPC", ELF_EM_PPC);
+  declare_integer_constant("EM_PPC64", ELF_EM_PPC64);
+  declare_integer_constant("EM_ARM", ELF_EM_ARM);
+  declare_integer_constant("EM_X86_64", ELF_EM_X86_64);
+  declare_integer_constant("EM_AARCH64", ELF_EM_AARCH64);
+
+  declare_integer_constant("SHT_NULL", ELF_SHT_NULL);
+  declare_integer_constant("SHT_PROGBITS", ELF_SHT_PROGBITS);
+  declare_integer_constant("SHT_SYMTAB", ELF_SHT_SYMTAB);
+  declare_integer_constant("SHT_STRTAB", ELF_SHT_STRTAB);
+  declare_integer_constant("SHT_RELA", ELF_SHT_RELA);
+  declare_integer_constant("SHT_HASH", ELF_SHT_HASH);
+  declare_integer_constant("SHT_DYNAMIC", ELF_SHT_DYNAMIC);
+  declare_integer_constant("SHT_NOTE", ELF_SHT_NOTE);
+  declare_integer_constant("SHT_NOBITS", ELF_SHT_NOBITS);
+  declare_integer_constant("SHT_REL", ELF_SHT_REL);
+  declare_integer_constant("SHT_SHLIB", ELF_SHT_SHLIB);
+  declare_integer_constant("SHT_DYNSYM", ELF_SHT_DYNSYM);
+
+  declare_integer_constant("SHF_WRITE", ELF_SHF_WRITE);
+  declare_integer_constant("SHF_ALLOC", ELF_SHF_ALLOC);
+  declare_integer_constant("SHF_EXECINSTR", ELF_SHF_EXECINSTR);
 
   declare_integer("type");
   declare_integer("machine");
@@ -261,20 +529,20 @@ begin_declarations;
     declare_integer("offset");
   end_struct_array("sections");
 
-  declare_integer("PT_NULL");
-  declare_integer("PT_LOAD");
-  declare_integer("PT_DYNAMIC");
-  declare_integer("PT_INTERP");
-  declare_integer("PT_NOTE");
-  declare_integer("PT_SHLIB");
-  declare_integer("PT_PHDR");
-  declare_integer("PT_TLS");
-  declare_integer("PT_GNU_EH_FRAME");
-  declare_integer("PT_GNU_STACK");
-
-  declare_integer("PF_X");
-  declare_integer("PF_W");
-  declare_integer("PF_R");
+  declare_integer_constant("PT_NULL", ELF_PT_NULL);
+  declare_integer_constant("PT_LOAD", ELF_PT_LOAD);
+  declare_integer_constant("PT_DYNAMIC", ELF_PT_DYNAMIC);
+  declare_integer_constant("PT_INTERP", ELF_PT_INTERP);
+  declare_integer_constant("PT_NOTE", ELF_PT_NOTE);
+  declare_integer_constant("PT_SHLIB", ELF_PT_SHLIB);
+  declare_integer_constant("PT_PHDR", ELF_PT_PHDR);
+  declare_integer_constant("PT_TLS", ELF_PT_TLS);
+  declare_integer_constant("PT_GNU_EH_FRAME", ELF_PT_GNU_EH_FRAME);
+  declare_integer_constant("PT_GNU_STACK", ELF_PT_GNU_STACK);
+
+  declare_integer_constant("PF_X", ELF_PF_X);
+  declare_integer_constant("PF_W", ELF_PF_W);
+  declare_integer_constant("PF_R", ELF_PF_R);
 
   begin_struct_array("segments");
     declare_integer("type");
@@ -287,6 +555,31 @@ begin_declarations;
     declare_integer("alignment");
   end_struct_array("segments");
 
+  declare_integer_constant("STT_NOTYPE", ELF_STT_NOTYPE);
+  declare_integer_constant("STT_OBJECT", ELF_STT_OBJECT);
+  declare_integer_constant("STT_FUNC", ELF_STT_FUNC);
+  declare_integer_constant("STT_SECTION", ELF_STT_SECTION);
+  declare_integer_constant("STT_FILE", ELF_STT_FILE);
+  declare_integer_constant("STT_COMMON", ELF_STT_COMMON);
+  declare_integer_constant("STT_TLS", ELF_STT_TLS);
+
+  declare_integer_constant("STB_LOCAL", ELF_STB_LOCAL);
+  declare_integer_constant("STB_GLOBAL", ELF_STB_GLOBAL);
+  declare_integer_constant("STB_WEAK", ELF_STB_WEAK);
+
+  declare_integer("number_of_symbols");
+
+  begin_struct_array("symbols");
+    declare_string("name");
+    declare_integer("value");
+    declare_integer("size");
+    declare_integer("type");
+    declare_integer("bind");
+    declare_integer("shndx");
+  end_struct_array("symbols");
+
+  declare_function("has_symbol", "s", "i", has_symbol);
+
 end_declarations;
 
 
@@ -304,6 +597,44 @@ int module_finalize(
 }
 
 
+//
+// elf_set_data
+//
+// Keeps the data of the block where the ELF was found, used later for
+// parsing its symbols.
+//
+
+int elf_set_data(
+    ELF* elf,
+    YR_MEMORY_BLOCK* block,
+    uint8_t* block_data,
+    int _class)
+{
+  if (elf->data_copy != NULL)
+  {
+    yr_free(elf->data_copy);
+    elf->data_copy = NULL;
+  }
+
+  if (block->data == NULL)
+  {
+    elf->data_copy = (uint8_t*) yr_malloc(block->size);
+
+    if (elf->data_copy == NULL)
+      return ERROR_INSUFICIENT_MEMORY;
+
+    memcpy(elf->data_copy, block_data, block->size);
+    block_data = elf->data_copy;
+  }
+
+  elf->data = block_data;
+  elf->data_size = block->size;
+  elf->_class = _class;
+
+  return ERROR_SUCCESS;
+}
+
+
 int module_load(
     YR_SCAN_CONTEXT* context,
     YR_OBJECT* module_object,
@@ -312,71 +643,49 @@ int module_load(
 {
   YR_MEMORY_BLOCK* block;
 
+  uint8_t* block_data;
+
   elf32_header_t* elf_header32;
   elf64_header_t* elf_header64;
 
-  set_integer(ELF_ET_NONE, module_object, "ET_NONE");
-  set_integer(ELF_ET_REL, module_object, "ET_REL");
-  set_integer(ELF_ET_EXEC, module_object, "ET_EXEC");
-  set_integer(ELF_ET_DYN, module_object, "ET_DYN");
-  set_integer(ELF_ET_CORE, module_object, "ET_CORE");
-
-  set_integer(ELF_EM_NONE, module_object, "EM_NONE");
-  set_integer(ELF_EM_M32, module_object, "EM_M32");
-  set_integer(ELF_EM_SPARC, module_object, "EM_SPARC");
-  set_integer(ELF_EM_386, module_object, "EM_386");
-  set_integer(ELF_EM_68K, module_object, "EM_68K");
-  set_integer(ELF_EM_88K, module_object, "EM_88K");
-  set_integer(ELF_EM_860, module_object, "EM_860");
-  set_integer(ELF_EM_MIPS, module_object, "EM_MIPS");
-  set_integer(ELF_EM_MIPS_RS3_LE, module_object, "EM_MIPS_RS3_LE");
-  set_integer(ELF_EM_PPC, module_object, "EM_PPC");
-  set_integer(ELF_EM_PPC64, module_object, "EM_PPC64");
-  set_integer(ELF_EM_ARM, module_object, "EM_ARM");
-  set_integer(ELF_EM_X86_64, module_object, "EM_X86_64");
-  set_integer(ELF_EM_AARCH64, module_object, "EM_AARCH64");
-
-  set_integer(ELF_SHT_NULL, module_object, "SHT_NULL");
-  set_integer(ELF_SHT_PROGBITS, module_object, "SHT_PROGBITS");
-  set_integer(ELF_SHT_SYMTAB, module_object, "SHT_SYMTAB");
-  set_integer(ELF_SHT_STRTAB, module_object, "SHT_STRTAB");
-  set_integer(ELF_SHT_RELA, module_object, "SHT_RELA");
-  set_integer(ELF_SHT_HASH, module_object, "SHT_HASH");
-  set_integer(ELF_SHT_DYNAMIC, module_object, "SHT_DYNAMIC");
-  set_integer(ELF_SHT_NOTE, module_object, "SHT_NOTE");
-  set_integer(ELF_SHT_NOBITS, module_object, "SHT_NOBITS");
-  set_integer(ELF_SHT_REL, module_object, "SHT_REL");
-  set_integer(ELF_SHT_SHLIB, module_object, "SHT_SHLIB");
-  set_integer(ELF_SHT_DYNSYM, module_object, "SHT_DYNSYM");
-
-  set_integer(ELF_SHF_WRITE, module_object, "SHF_WRITE");
-  set_integer(ELF_SHF_ALLOC, module_object, "SHF_ALLOC");
-  set_integer(ELF_SHF_EXECINSTR, module_object, "SHF_EXECINSTR");
-
-  set_integer(ELF_PT_NULL, module_object, "PT_NULL");
-  set_integer(ELF_PT_LOAD, module_object, "PT_LOAD");
-  set_integer(ELF_PT_DYNAMIC, module_object, "PT_DYNAMIC");
-  set_integer(ELF_PT_INTERP, module_object, "PT_INTERP");
-  set_integer(ELF_PT_NOTE, module_object, "PT_NOTE");
-  set_integer(ELF_PT_SHLIB, module_object, "PT_SHLIB");
-  set_integer(ELF_PT_PHDR, module_object, "PT_PHDR");
-  set_integer(ELF_PT_TLS, module_object, "PT_TLS");
-  set_integer(ELF_PT_GNU_EH_FRAME, module_object, "PT_GNU_EH_FRAME");
-  set_integer(ELF_PT_GNU_STACK, module_object, "PT_GNU_STACK");
-
-  set_integer(ELF_PF_X, module_object, "PF_X");
-  set_integer(ELF_PF_W, module_object, "PF_W");
-  set_integer(ELF_PF_R, module_object, "PF_R");
+  ELF* elf = (ELF*) yr_malloc(sizeof(ELF));
+
+  if (elf == NULL)
+    return ERROR_INSUFICIENT_MEMORY;
+
+  elf->data = NULL;
+  elf->data_size = 0;
+  elf->data_copy = NULL;
+  elf->_class = ELF_CLASS_NONE;
+  elf->symbols_parsed = FALSE;
+  elf->symbols_index = NULL;
+
+  module_object->data = elf;
+
+  FAIL_ON_ERROR(set_loader(
+      elf_load_symbols,
+      module_object,
+      member_index(module_object, "symbols")));
+
+  FAIL_ON_ERROR(set_loader(
+      elf_load_symbols,
+      module_object,
+      member_index(module_object, "number_of_symbols")));
 
   foreach_memory_block(context, block)
   {
-    switch(get_elf_type(block->data, block->size))
+    block_data = fetch_memory_block_data(block);
+
+    if (block_data == NULL)
+      continue;
+
+    switch(get_elf_type(block_data, block->size))
     {
       case ELF_CLASS_32:
 
         if (block->size > sizeof(elf32_header_t))
         {
-          elf_header32 = (elf32_header_t*) block->data;
+          elf_header32 = (elf32_header_t*) block_data;
 
           if (!(context->flags & SCAN_FLAGS_PROCESS_MEMORY) ||
               elf_header32->type == ELF_ET_EXEC)
@@ -387,6 +696,9 @@ int module_load(
                 block->size,
                 context->flags,
                 module_object);
+
+            FAIL_ON_ERROR(elf_set_data(
+                elf, block, block_data, ELF_CLASS_32));
           }
         }
 
@@ -396,7 +708,7 @@ int module_load(
 
         if (block->size > sizeof(elf64_header_t))
         {
-          elf_header64 = (elf64_header_t*) block->data;
+          elf_header64 = (elf64_header_t*) block_data;
 
           if (!(context->flags & SCAN_FLAGS_PROCESS_MEMORY) ||
               elf_header64->type == ELF_ET_EXEC)
@@ -407,6 +719,9 @@ int module_load(
                 block->size,
                 context->flags,
                 module_object);
+
+            FAIL_ON_ERROR(elf_set_data(
+                elf, block, block_data, ELF_CLASS_64));
           }
         }
 
@@ -420,5 +735,18 @@ int module_load(
 
 int module_unload(YR_OBJECT* module_object)
 {
+  ELF* elf = (ELF*) module_object->data;
+
+  if (elf != NULL)
+  {
+    if (elf->symbols_index != NULL)
+      yr_hash_table_destroy(elf->symbols_index, NULL);
+
+    if (elf->data_copy != NULL)
+      yr_free(elf->data_copy);
+
+    yr_free(elf);
+  }
+
   return ERROR_SUCCESS;
 }
@@ -24,6 +24,8 @@ limitations under the License.
 #include <inttypes.h>
 #endif
 
+#include <yara/hash.h>
+#include <yara/mem.h>
 #include <yara/modules.h>
 
 #define MODULE_NAME hash
@@ -111,108 +113,125 @@ define_function(string_checksum32)
 }
 
 
-define_function(data_md5)
-{
-  MD5_CTX md5_context;
-
-  unsigned char digest[MD5_DIGEST_LENGTH];
-  char digest_ascii[MD5_DIGEST_LENGTH * 2 + 1];
-
-  int past_first_block = FALSE;
-
-  YR_SCAN_CONTEXT* context = scan_context();
-  YR_MEMORY_BLOCK* block = NULL;
-
-  int64_t offset = integer_argument(1);   // offset where to start
-  int64_t length = integer_argument(2);   // length of bytes we want hash on
+//
+// Digests over ranges of the scanned data are cached for the whole scan,
+// keyed by offset and length, so that a condition like
+// hash.md5(0, filesize) referenced by many rules walks the data only once.
+// Every pass over a range computes all the algorithms that were requested
+// so far during the scan, which means that rules asking for several digests
+// of the same range end up computing them together.
+//
 
-  MD5_Init(&md5_context);
+#define HASH_MD5          0x01
+#define HASH_SHA1         0x02
+#define HASH_SHA256       0x04
+#define HASH_CHECKSUM32   0x08
 
-  if (offset < 0 || length < 0 || offset < context->mem_block->base)
-  {
-    return ERROR_WRONG_ARGUMENTS;
-  }
+#define HASH_RANGE_KEY_LENGTH   48
 
-  foreach_memory_block(context, block)
-  {
-    // if desired block within current block
 
-    if (offset >= block->base &&
-        offset < block->base + block->size)
-    {
-      size_t data_offset = (size_t) (offset - block->base);
-      size_t data_len = (size_t) yr_min(
-          length, (size_t) (block->size - data_offset));
+typedef struct _HASH_RANGE
+{
+  int computed;
+  int undefined;
 
-      offset += data_len;
-      length -= data_len;
+  char md5[MD5_DIGEST_LENGTH * 2 + 1];
+  char sha1[SHA_DIGEST_LENGTH * 2 + 1];
+  char sha256[SHA256_DIGEST_LENGTH * 2 + 1];
 
-      MD5_Update(&md5_context, block->data + data_offset, data_len);
+  uint32_t checksum32;
 
-      past_first_block = TRUE;
-    }
-    else if (past_first_block)
-    {
-      // If offset is not within current block and we already
-      // past the first block then the we are trying to compute
-      // the checksum over a range of non contiguos blocks. As
-      // range contains gaps of undefined data the checksum is
-      // undefined.
+} HASH_RANGE;
 
-      return_string(UNDEFINED);
-    }
 
-    if (block->base + block->size > offset + length)
-      break;
-  }
+typedef struct _HASH_CACHE
+{
+  int requested;
 
-  if (!past_first_block)
-    return_string(UNDEFINED);
+  YR_HASH_TABLE* ranges;
 
-  MD5_Final(digest, &md5_context);
+} HASH_CACHE;
 
-  digest_to_ascii(digest, digest_ascii, MD5_DIGEST_LENGTH);
 
-  return_string(digest_ascii);
+int hash_range_free(
+    void* range)
+{
+  yr_free(range);
+  return ERROR_SUCCESS;
 }
 
 
-define_function(data_sha1)
+//
+// hash_range_compute
+//
+// Computes the digests indicated by algorithms over the range
+// [offset, offset + length) in a single pass over the memory blocks.
+//
+
+void hash_range_compute(
+    YR_SCAN_CONTEXT* context,
+    int64_t offset,
+    int64_t length,
+    int algorithms,
+    HASH_RANGE* range)
 {
+  MD5_CTX md5_context;
   SHA_CTX sha_context;
+  SHA256_CTX sha256_context;
 
-  unsigned char digest[SHA_DIGEST_LENGTH];
-  char digest_ascii[SHA_DIGEST_LENGTH * 2 + 1];
+  unsigned char digest[SHA256_DIGEST_LENGTH];
 
-  int past_first_block = FALSE;
+  YR_MEMORY_BLOCK* block = NULL;
 
-  int64_t offset = integer_argument(1);   // offset where to start
-  int64_t length = integer_argument(2);   // length of bytes we want hash on
+  uint32_t checksum = 0;
+  int past_first_block = FALSE;
 
-  YR_SCAN_CONTEXT* context = scan_context();
-  YR_MEMORY_BLOCK* block = NULL;
+  if (algorithms & HASH_MD5)
+    MD5_Init(&md5_context);
 
-  SHA1_Init(&sha_context);
+  if (algorithms & HASH_SHA1)
+    SHA1_Init(&sha_context);
 
-  if (offset < 0 || length < 0 || offset < context->mem_block->base)
-  {
-    return ERROR_WRONG_ARGUMENTS;
-  }
+  if (algorithms & HASH_SHA256)
+    SHA256_Init(&sha256_context);
 
   foreach_memory_block(context, block)
   {
     // if desired block within current block
+
     if (offset >= block->base &&
         offset < block->base + block->size)
     {
+      size_t i;
+
       size_t data_offset = (size_t) (offset - block->base);
       size_t data_len = (size_t) yr_min(
-          length, (size_t) block->size - data_offset);
+          length, (size_t) (block->size - data_offset));
+
+      uint8_t* data = fetch_memory_block_data(block);
 
+      if (data == NULL)
+      {
+        range->undefined = TRUE;
+        return;
+      }
+
+      data += data_offset;
       offset += data_len;
       length -= data_len;
 
-      SHA1_Update(&sha_context, block->data + data_offset, data_len);
+      if (algorithms & HASH_MD5)
+        MD5_Update(&md5_context, data, data_len);
+
+      if (algorithms & HASH_SHA1)
+        SHA1_Update(&sha_context, data, data_len);
+
+      if (algorithms & HASH_SHA256)
+        SHA256_Update(&sha256_context, data, data_len);
+
+      if (algorithms & HASH_CHECKSUM32)
+        for (i = 0; i < data_len; i++)
+          checksum += data[i];
 
       past_first_block = TRUE;
     }
@@ -224,7 +243,8 @@ define_function(data_sha1)
       // range contains gaps of undefined data the checksum is
       // undefined.
 
-      return_string(UNDEFINED);
+      range->undefined = TRUE;
+      return;
     }
 
     if (block->base + block->size > offset + length)
@@ -232,133 +252,173 @@ define_function(data_sha1)
   }
 
   if (!past_first_block)
-    return_string(UNDEFINED);
+  {
+    range->undefined = TRUE;
+    return;
+  }
 
-  SHA1_Final(digest, &sha_context);
+  if (algorithms & HASH_MD5)
+  {
+    MD5_Final(digest, &md5_context);
+    digest_to_ascii(digest, range->md5, MD5_DIGEST_LENGTH);
+  }
 
-  digest_to_ascii(digest, digest_ascii, SHA_DIGEST_LENGTH);
+  if (algorithms & HASH_SHA1)
+  {
+    SHA1_Final(digest, &sha_context);
+    digest_to_ascii(digest, range->sha1, SHA_DIGEST_LENGTH);
+  }
 
-  return_string(digest_ascii);
+  if (algorithms & HASH_SHA256)
+  {
+    SHA256_Final(digest, &sha256_context);
+    digest_to_ascii(digest, range->sha256, SHA256_DIGEST_LENGTH);
+  }
+
+  if (algorithms & HASH_CHECKSUM32)
+    range->checksum32 = checksum;
+
+  range->computed |= algorithms;
 }
 
 
-define_function(data_sha256)
+//
+// hash_range_get
+//
+// Returns the cached digests for the range [offset, offset + length),
+// computing the requested algorithm if it isn't already in the cache.
+//
+
+int hash_range_get(
+    YR_SCAN_CONTEXT* context,
+    YR_OBJECT* module_object,
+    int64_t offset,
+    int64_t length,
+    int algorithm,
+    HASH_RANGE** range)
 {
-  SHA256_CTX sha256_context;
+  HASH_CACHE* cache = (HASH_CACHE*) module_object->data;
+  HASH_RANGE* cached_range;
 
-  unsigned char digest[SHA256_DIGEST_LENGTH];
-  char digest_ascii[SHA256_DIGEST_LENGTH * 2 + 1];
+  YR_MEMORY_BLOCK* block = first_memory_block(context);
 
-  int past_first_block = FALSE;
+  char key[HASH_RANGE_KEY_LENGTH];
+  int result;
 
-  int64_t offset = integer_argument(1);   // offset where to start
-  int64_t length = integer_argument(2);   // length of bytes we want hash on
+  if (block == NULL || offset < 0 || length < 0 || offset < block->base)
+    return ERROR_WRONG_ARGUMENTS;
 
-  YR_SCAN_CONTEXT* context = scan_context();
-  YR_MEMORY_BLOCK* block = NULL;
+  cache->requested |= algorithm;
 
-  SHA256_Init(&sha256_context);
+  snprintf(
+      key,
+      sizeof(key),
+      "%llx:%llx",
+      (unsigned long long) offset,
+      (unsigned long long) length);
 
-  if (offset < 0 || length < 0 || offset < context->mem_block->base)
-  {
-    return ERROR_WRONG_ARGUMENTS;
-  }
+  cached_range = (HASH_RANGE*) yr_hash_table_lookup(cache->ranges, key, NULL);
 
-  foreach_memory_block(context, block)
+  if (cached_range == NULL)
   {
-    // if desired block within current block
-    if (offset >= block->base &&
-        offset < block->base + block->size)
-    {
-      size_t data_offset = (size_t) (offset - block->base);
-      size_t data_len = (size_t) yr_min(length, block->size - data_offset);
+    cached_range = (HASH_RANGE*) yr_malloc(sizeof(HASH_RANGE));
 
-      offset += data_len;
-      length -= data_len;
+    if (cached_range == NULL)
+      return ERROR_INSUFICIENT_MEMORY;
 
-      SHA256_Update(&sha256_context, block->data + data_offset, data_len);
+    cached_range->computed = 0;
+    cached_range->undefined = FALSE;
 
-      past_first_block = TRUE;
-    }
-    else if (past_first_block)
-    {
-      // If offset is not within current block and we already
-      // past the first block then the we are trying to compute
-      // the checksum over a range of non contiguos blocks. As
-      // range contains gaps of undefined data the checksum is
-      // undefined.
+    result = yr_hash_table_add(cache->ranges, key, NULL, cached_range);
 
-      return_string(UNDEFINED);
+    if (result != ERROR_SUCCESS)
+    {
+      yr_free(cached_range);
+      return result;
     }
+  }
 
-    if (block->base + block->size > offset + length)
-      break;
+  if (!cached_range->undefined && !(cached_range->computed & algorithm))
+  {
+    hash_range_compute(
+        context,
+        offset,
+        length,
+        cache->requested & ~cached_range->computed,
+        cached_range);
   }
 
-  if (!past_first_block)
-    return_string(UNDEFINED);
+  *range = cached_range;
 
-  SHA256_Final(digest, &sha256_context);
+  return ERROR_SUCCESS;
+}
 
-  digest_to_ascii(digest, digest_ascii, SHA256_DIGEST_LENGTH);
 
-  return_string(digest_ascii);
+define_function(data_md5)
+{
+  HASH_RANGE* range;
+
+  int64_t offset = integer_argument(1);   // offset where to start
+  int64_t length = integer_argument(2);   // length of bytes we want hash on
+
+  FAIL_ON_ERROR(hash_range_get(
+      scan_context(), module(), offset, length, HASH_MD5, &range));
+
+  if (range->undefined)
+    return_string(UNDEFINED);
+
+  return_string(range->md5);
 }
 
 
-define_function(data_checksum32)
+define_function(data_sha1)
 {
+  HASH_RANGE* range;
+
   int64_t offset = integer_argument(1);   // offset where to start
   int64_t length = integer_argument(2);   // length of bytes we want hash on
 
-  YR_SCAN_CONTEXT* context = scan_context();
-  YR_MEMORY_BLOCK* block = NULL;
+  FAIL_ON_ERROR(hash_range_get(
+      scan_context(), module(), offset, length, HASH_SHA1, &range));
 
-  uint32_t checksum = 0;
-  int past_first_block = FALSE;
+  if (range->undefined)
+    return_string(UNDEFINED);
 
-  if (offset < 0 || length < 0 || offset < context->mem_block->base)
-  {
-    return ERROR_WRONG_ARGUMENTS;
-  }
+  return_string(range->sha1);
+}
 
-  foreach_memory_block(context, block)
-  {
-    if (offset >= block->base &&
-        offset < block->base + block->size)
-    {
-      size_t i;
 
-      size_t data_offset = (size_t) (offset - block->base);
-      size_t data_len = (size_t) yr_min(length, block->size - data_offset);
+define_function(data_sha256)
+{
+  HASH_RANGE* range;
 
-      offset += data_len;
-      length -= data_len;
+  int64_t offset = integer_argument(1);   // offset where to start
+  int64_t length = integer_argument(2);   // length of bytes we want hash on
 
-      for (i = 0; i < data_len; i++)
-        checksum += *(block->data + data_offset + i);
+  FAIL_ON_ERROR(hash_range_get(
+      scan_context(), module(), offset, length, HASH_SHA256, &range));
 
-      past_first_block = TRUE;
-    }
-    else if (past_first_block)
-    {
-      // If offset is not within current block and we already
-      // past the first block then the we are trying to compute
-      // the checksum over a range of non contiguos blocks. As
-      // range contains gaps of undefined data the checksum is
-      // undefined.
+  if (range->undefined)
+    return_string(UNDEFINED);
 
-      return_integer(UNDEFINED);
-    }
+  return_string(range->sha256);
+}
 
-    if (block->base + block->size > offset + length)
-      break;
-  }
 
-  if (!past_first_block)
+define_function(data_checksum32)
+{
+  HASH_RANGE* range;
+
+  int64_t offset = integer_argument(1);   // offset where to start
+  int64_t length = integer_argument(2);   // length of bytes we want hash on
+
+  FAIL_ON_ERROR(hash_range_get(
+      scan_context(), module(), offset, length, HASH_CHECKSUM32, &range));
+
+  if (range->undefined)
     return_integer(UNDEFINED);
 
-  return_integer(checksum);
+  return_integer(range->checksum32);
 }
 
 
@@ -400,6 +460,20 @@ int module_load(
     void* module_data,
     size_t module_data_size)
 {
+  HASH_CACHE* cache = (HASH_CACHE*) yr_malloc(sizeof(HASH_CACHE));
+
+  if (cache == NULL)
+    return ERROR_INSUFICIENT_MEMORY;
+
+  cache->requested = 0;
+
+  if (yr_hash_table_create(17, &cache->ranges) != ERROR_SUCCESS)
+  {
+    yr_free(cache);
+    return ERROR_INSUFICIENT_MEMORY;
+  }
+
+  module_object->data = cache;
 
   return ERROR_SUCCESS;
 }
@@ -408,5 +482,13 @@ int module_load(
 int module_unload(
     YR_OBJECT* module_object)
 {
+  HASH_CACHE* cache = (HASH_CACHE*) module_object->data;
+
+  if (cache != NULL)
+  {
+    yr_hash_table_destroy(cache->ranges, hash_range_free);
+    yr_free(cache);
+  }
+
   return ERROR_SUCCESS;
 }
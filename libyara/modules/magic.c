@@ -20,68 +20,316 @@ The original idea and inspiration for this module comes from Armin Buescher.
 
 */
 
+#include <string.h>
+#include <time.h>
+
+#include <yara/libyara.h>
+#include <yara/mem.h>
 #include <yara/modules.h>
+#include <yara/threading.h>
 #include <magic.h>
 
 #define MODULE_NAME magic
 
+// Number of results kept across scans. Files are identified by a hash of
+// the bytes handed to libmagic, so scanning the same file, or files that
+// only differ beyond the prefix given to libmagic, reuses the result.
+
+#define MAGIC_CACHE_SIZE  256
+
+#define ROTATE_INT64(x, shift) \
+    (((x) << (shift)) | ((x) >> (64 - (shift))))
+
+
+typedef struct _MAGIC_CACHE_ENTRY
+{
+  int used;
+
+  uint64_t hash;
+  size_t length;
+  uint64_t last_used;
+
+  char* type;
+  char* mime_type;
+
+} MAGIC_CACHE_ENTRY;
+
+
 magic_t magic_cookie[MAX_THREADS];
 
-const char* cached_types[MAX_THREADS];
-const char* cached_mime_types[MAX_THREADS];
+char* cached_types[MAX_THREADS];
+char* cached_mime_types[MAX_THREADS];
+
+uint64_t prefix_hash[MAX_THREADS];
+int prefix_hashed[MAX_THREADS];
+
+MAGIC_CACHE_ENTRY magic_cache[MAGIC_CACHE_SIZE];
+YR_MUTEX magic_cache_mutex;
+
+uint64_t magic_cache_clock;
+uint64_t magic_hash_seed;
+
+
+//
+// magic_hash
+//
+// Fast non-cryptographic 64-bit hash of the data handed to libmagic. The
+// seed is chosen when the module is initialized so that colliding inputs
+// can't be crafted beforehand.
+//
+
+uint64_t magic_hash(
+    const uint8_t* data,
+    size_t length)
+{
+  uint64_t hash = magic_hash_seed ^ (length * 0x9E3779B97F4A7C15ULL);
+  uint64_t word;
+
+  size_t i;
+
+  for (i = 0; i + 8 <= length; i += 8)
+  {
+    memcpy(&word, data + i, sizeof(word));
+
+    hash ^= ROTATE_INT64(word * 0x87C37B91114253D5ULL, 31) *
+            0x4CF5AD432745937FULL;
+    hash = ROTATE_INT64(hash, 27) * 5 + 0x52DCE729;
+  }
+
+  for (; i < length; i++)
+    hash = (hash ^ data[i]) * 0x100000001B3ULL;
+
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+  hash *= 0xC4CEB9FE1A85EC53ULL;
+  hash ^= hash >> 33;
+
+  return hash;
+}
+
+
+//
+// magic_cache_find
+//
+// Returns the cache entry for the given hash and length, or NULL. Must be
+// called with magic_cache_mutex held.
+//
+
+MAGIC_CACHE_ENTRY* magic_cache_find(
+    uint64_t hash,
+    size_t length)
+{
+  int i;
+
+  for (i = 0; i < MAGIC_CACHE_SIZE; i++)
+  {
+    MAGIC_CACHE_ENTRY* entry = &magic_cache[i];
+
+    if (entry->used && entry->hash == hash && entry->length == length)
+    {
+      entry->last_used = ++magic_cache_clock;
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+
+//
+// magic_cache_insert
+//
+// Returns an entry for the given hash and length, evicting the least
+// recently used one if the cache is full. Must be called with
+// magic_cache_mutex held.
+//
+
+MAGIC_CACHE_ENTRY* magic_cache_insert(
+    uint64_t hash,
+    size_t length)
+{
+  MAGIC_CACHE_ENTRY* entry = magic_cache_find(hash, length);
+  MAGIC_CACHE_ENTRY* victim = &magic_cache[0];
+
+  int i;
+
+  if (entry != NULL)
+    return entry;
+
+  for (i = 0; i < MAGIC_CACHE_SIZE; i++)
+  {
+    if (!magic_cache[i].used)
+    {
+      victim = &magic_cache[i];
+      break;
+    }
+
+    if (magic_cache[i].last_used < victim->last_used)
+      victim = &magic_cache[i];
+  }
+
+  if (victim->type != NULL)
+    yr_free(victim->type);
+
+  if (victim->mime_type != NULL)
+    yr_free(victim->mime_type);
+
+  victim->used = TRUE;
+  victim->hash = hash;
+  victim->length = length;
+  victim->last_used = ++magic_cache_clock;
+  victim->type = NULL;
+  victim->mime_type = NULL;
+
+  return victim;
+}
+
+
+void magic_cache_clean()
+{
+  int i;
+
+  for (i = 0; i < MAGIC_CACHE_SIZE; i++)
+  {
+    if (magic_cache[i].type != NULL)
+      yr_free(magic_cache[i].type);
+
+    if (magic_cache[i].mime_type != NULL)
+      yr_free(magic_cache[i].mime_type);
+
+    magic_cache[i].used = FALSE;
+    magic_cache[i].type = NULL;
+    magic_cache[i].mime_type = NULL;
+  }
+}
+
+
+//
+// magic_get
+//
+// Describes the first memory block with libmagic using the given flags
+// (0 or MAGIC_MIME_TYPE), looking up the result in the cache first. At
+// most YR_CONFIG_MAX_MAGIC_BYTES bytes are handed to libmagic. The
+// returned string is owned by the caller.
+//
+
+char* magic_get(
+    YR_SCAN_CONTEXT* context,
+    int flags)
+{
+  YR_MEMORY_BLOCK* block = first_memory_block(context);
+  MAGIC_CACHE_ENTRY* entry;
+
+  const char* description;
+  char* result = NULL;
+
+  uint8_t* block_data;
+
+  uint32_t max_bytes;
+  size_t length;
+
+  int tidx = context->tidx;
+
+  if (block == NULL)
+    return NULL;
+
+  block_data = fetch_memory_block_data(block);
+
+  if (block_data == NULL)
+    return NULL;
+
+  yr_get_configuration(YR_CONFIG_MAX_MAGIC_BYTES, &max_bytes);
+
+  length = yr_min(block->size, (size_t) max_bytes);
+
+  if (!prefix_hashed[tidx])
+  {
+    prefix_hash[tidx] = magic_hash(block_data, length);
+    prefix_hashed[tidx] = TRUE;
+  }
+
+  yr_mutex_lock(&magic_cache_mutex);
+
+  entry = magic_cache_find(prefix_hash[tidx], length);
+
+  if (entry != NULL)
+  {
+    description = (flags & MAGIC_MIME_TYPE) ? entry->mime_type : entry->type;
+
+    if (description != NULL)
+      result = yr_strdup(description);
+  }
+
+  yr_mutex_unlock(&magic_cache_mutex);
+
+  if (result != NULL)
+    return result;
+
+  magic_setflags(magic_cookie[tidx], flags);
+
+  description = magic_buffer(magic_cookie[tidx], block_data, length);
+
+  if (description == NULL)
+    return NULL;
+
+  result = yr_strdup(description);
+
+  if (result == NULL)
+    return NULL;
+
+  yr_mutex_lock(&magic_cache_mutex);
+
+  entry = magic_cache_insert(prefix_hash[tidx], length);
+
+  if (flags & MAGIC_MIME_TYPE)
+  {
+    if (entry->mime_type == NULL)
+      entry->mime_type = yr_strdup(result);
+  }
+  else
+  {
+    if (entry->type == NULL)
+      entry->type = yr_strdup(result);
+  }
+
+  yr_mutex_unlock(&magic_cache_mutex);
+
+  return result;
+}
 
 
 define_function(magic_mime_type)
 {
-  YR_MEMORY_BLOCK* block;
   YR_SCAN_CONTEXT* context = scan_context();
 
   if (context->flags & SCAN_FLAGS_PROCESS_MEMORY)
     return_string(UNDEFINED);
 
   if (cached_mime_types[context->tidx] == NULL)
-  {
-    block = first_memory_block(context);
-
-    magic_setflags(magic_cookie[context->tidx], MAGIC_MIME_TYPE);
-
-    cached_mime_types[context->tidx] = magic_buffer(
-        magic_cookie[context->tidx],
-        block->data,
-        block->size);
-  }
+    cached_mime_types[context->tidx] = magic_get(context, MAGIC_MIME_TYPE);
 
   if (cached_mime_types[context->tidx] == NULL)
     return_string(UNDEFINED);
 
-  return_string((char*) cached_mime_types[context->tidx]);
+  return_string(cached_mime_types[context->tidx]);
 }
 
 
 define_function(magic_type)
 {
-  YR_MEMORY_BLOCK* block;
   YR_SCAN_CONTEXT* context = scan_context();
 
   if (context->flags & SCAN_FLAGS_PROCESS_MEMORY)
     return_string(UNDEFINED);
 
   if (cached_types[context->tidx] == NULL)
-  {
-    block = first_memory_block(context);
-
-    magic_setflags(magic_cookie[context->tidx], 0);
-
-    cached_types[context->tidx] = magic_buffer(
-        magic_cookie[context->tidx],
-        block->data,
-        block->size);
-  }
+    cached_types[context->tidx] = magic_get(context, 0);
 
   if (cached_types[context->tidx] == NULL)
     return_string(UNDEFINED);
 
-  return_string((char*) cached_types[context->tidx]);
+  return_string(cached_types[context->tidx]);
 }
 
 begin_declarations;
@@ -96,9 +344,18 @@ int module_initialize(
     YR_MODULE* module)
 {
   for (int i = 0; i < MAX_THREADS; i++)
+  {
     magic_cookie[i] = NULL;
+    cached_types[i] = NULL;
+    cached_mime_types[i] = NULL;
+  }
 
-  return ERROR_SUCCESS;
+  memset(magic_cache, 0, sizeof(magic_cache));
+
+  magic_cache_clock = 0;
+  magic_hash_seed = (uint64_t) time(NULL) ^ (uint64_t) (size_t) &magic_cache;
+
+  return yr_mutex_create(&magic_cache_mutex);
 }
 
 
@@ -106,10 +363,20 @@ int module_finalize(
     YR_MODULE* module)
 {
   for (int i = 0; i < MAX_THREADS; i++)
+  {
     if (magic_cookie[i] != NULL)
       magic_close(magic_cookie[i]);
 
-  return ERROR_SUCCESS;
+    if (cached_types[i] != NULL)
+      yr_free(cached_types[i]);
+
+    if (cached_mime_types[i] != NULL)
+      yr_free(cached_mime_types[i]);
+  }
+
+  magic_cache_clean();
+
+  return yr_mutex_destroy(&magic_cache_mutex);
 }
 
 
@@ -119,8 +386,15 @@ int module_load(
     void* module_data,
     size_t module_data_size)
 {
+  if (cached_types[context->tidx] != NULL)
+    yr_free(cached_types[context->tidx]);
+
+  if (cached_mime_types[context->tidx] != NULL)
+    yr_free(cached_mime_types[context->tidx]);
+
   cached_types[context->tidx] = NULL;
   cached_mime_types[context->tidx] = NULL;
+  prefix_hashed[context->tidx] = FALSE;
 
   if (magic_cookie[context->tidx] == NULL)
   {
@@ -15,7 +15,9 @@ limitations under the License.
 */
 
 #include <math.h>
+#include <string.h>
 
+#include <yara/histogram.h>
 #include <yara/modules.h>
 #include <yara/mem.h>
 
@@ -45,11 +47,7 @@ define_function(string_entropy)
   if (data == NULL)
     return_float(UNDEFINED);
 
-  for (i = 0; i < s->length; i++)
-  {
-    uint8_t c = s->c_string[i];
-    data[c] += 1;
-  }
+  yr_histogram_update(data, (uint8_t*) s->c_string, s->length);
 
   for (i = 0; i < 256; i++)
   {
@@ -65,29 +63,273 @@ define_function(string_entropy)
 }
 
 
-define_function(data_entropy)
+//
+// Histogram-based functions over ranges of the scanned data are answered
+// from blockwise cumulative histograms when the same memory block is queried
+// more than once. Each entry of the index holds the byte counts (and the sum
+// of products of adjacent bytes, used by serial_correlation) for the data
+// preceding a block boundary, so a range query costs O(256) plus the bytes
+// between the range ends and the nearest preceding boundaries.
+//
+// Each entry takes 1032 bytes, so with boundaries every 16 KB the index
+// takes about 6% of the block's size, and boundaries are spread further
+// apart in blocks larger than 64 MB so that the index never exceeds about
+// 4 MB. Finer boundaries would make queries cheaper at the cost of memory:
+// with 4 KB the index took a quarter of the block's size. Even so, it's not
+// built for the first query, which is answered by reading the range, and it
+// only covers the part of the block queried so far.
+//
+
+#define MATH_BLOCK_SIZE           16384
+#define MATH_INDEX_MAX_ENTRIES    4096
+#define MATH_INDEX_MIN_BLOCKS     4
+#define MATH_INDEX_MIN_LENGTH     (MATH_INDEX_MIN_BLOCKS * MATH_BLOCK_SIZE)
+#define MATH_INDEX_MIN_QUERIES    2
+
+
+typedef struct _MATH_INDEX
 {
-  int past_first_block = FALSE;
-  double entropy = 0.0;
+  size_t base;
+  size_t size;
+
+  // Distance between boundaries, MATH_BLOCK_SIZE or a larger power of two.
+  size_t block_size;
+
+  // Number of queries long enough to use the index received for the block.
+  int queries;
+
+  // Number of entries computed and allocated. Entries are computed as far
+  // as the queried ranges require.
+  size_t count;
+  size_t capacity;
+
+  uint32_t* histograms;
+  uint64_t* pair_sums;
+
+  struct _MATH_INDEX* next;
+
+} MATH_INDEX;
+
+
+typedef struct _MATH_STATS
+{
+  uint32_t histogram[256];
+
+  size_t total_len;
+  uint64_t pair_sum;
+  uint8_t last;
+
+} MATH_STATS;
 
-  size_t total_len = 0;
+
+//
+// math_index_extend
+//
+// Computes the entries of the index up to the one describing the first
+// position bytes of the block, rounded down to a block boundary. Entry k of
+// the index describes the first k * block_size bytes of the block.
+// Returns FALSE if there is not enough memory.
+//
+
+int math_index_extend(
+    MATH_INDEX* index,
+    uint8_t* block_data,
+    size_t position)
+{
+  size_t block_size = index->block_size;
+  size_t needed = position / block_size + 1;
   size_t i;
 
-  uint32_t* data;
+  if (needed <= index->count)
+    return TRUE;
 
-  int64_t offset = integer_argument(1);   // offset where to start
-  int64_t length = integer_argument(2);   // length of bytes we want entropy on
+  if (needed > index->capacity)
+  {
+    size_t capacity = yr_max(needed, index->capacity * 2);
+    uint32_t* histograms;
+    uint64_t* pair_sums;
 
-  YR_SCAN_CONTEXT* context = scan_context();
-  YR_MEMORY_BLOCK* block = NULL;
-  
-  if (offset < 0 || length < 0 || offset < context->mem_block->base)
-    return_float(UNDEFINED);
+    capacity = yr_min(capacity, index->size / block_size + 1);
 
-  data = (uint32_t*) yr_calloc(256, sizeof(uint32_t));
+    histograms = (uint32_t*) yr_realloc(
+        index->histograms, capacity * 256 * sizeof(uint32_t));
 
-  if (data == NULL)
-    return_float(UNDEFINED);
+    if (histograms == NULL)
+      return FALSE;
+
+    index->histograms = histograms;
+
+    pair_sums = (uint64_t*) yr_realloc(
+        index->pair_sums, capacity * sizeof(uint64_t));
+
+    if (pair_sums == NULL)
+      return FALSE;
+
+    index->pair_sums = pair_sums;
+    index->capacity = capacity;
+  }
+
+  if (index->count == 0)
+  {
+    memset(index->histograms, 0, 256 * sizeof(uint32_t));
+    index->pair_sums[0] = 0;
+    index->count = 1;
+  }
+
+  while (index->count < needed)
+  {
+    size_t k = index->count;
+
+    uint8_t* data = block_data + (k - 1) * block_size;
+    uint32_t* histogram = index->histograms + k * 256;
+    uint64_t pair_sum = index->pair_sums[k - 1];
+
+    memcpy(histogram, histogram - 256, 256 * sizeof(uint32_t));
+    yr_histogram_update(histogram, data, block_size);
+
+    for (i = (k > 1) ? 0 : 1; i < block_size; i++)
+      pair_sum += (uint64_t) data[i - 1] * data[i];
+
+    index->pair_sums[k] = pair_sum;
+    index->count++;
+  }
+
+  return TRUE;
+}
+
+
+void math_index_destroy(
+    MATH_INDEX* index)
+{
+  while (index != NULL)
+  {
+    MATH_INDEX* next = index->next;
+
+    yr_free(index->histograms);
+    yr_free(index->pair_sums);
+    yr_free(index);
+
+    index = next;
+  }
+}
+
+
+//
+// math_index_prefix
+//
+// Adds (sign = 1) or subtracts (sign = -1) to stats the byte counts and
+// adjacent byte products for the first position bytes of the block.
+//
+
+void math_index_prefix(
+    MATH_INDEX* index,
+    uint8_t* data,
+    size_t position,
+    int sign,
+    MATH_STATS* stats)
+{
+  size_t block_size = index->block_size;
+  size_t k = position / block_size;
+  size_t i;
+
+  uint32_t* histogram = index->histograms + k * 256;
+  uint32_t partial[256];
+  uint64_t pair_sum = index->pair_sums[k];
+
+  memset(partial, 0, sizeof(partial));
+
+  yr_histogram_update(
+      partial,
+      data + k * block_size,
+      position - k * block_size);
+
+  for (i = 0; i < 256; i++)
+    stats->histogram[i] += sign * (histogram[i] + partial[i]);
+
+  for (i = (k > 0) ? k * block_size : 1; i < position; i++)
+    pair_sum += (uint64_t) data[i - 1] * data[i];
+
+  if (sign > 0)
+    stats->pair_sum += pair_sum;
+  else
+    stats->pair_sum -= pair_sum;
+}
+
+
+//
+// math_index_get
+//
+// Returns the index for the given memory block, creating an empty one if
+// needed. Indexes are identified by the block's base and size, as the same
+// block can be provided by a different YR_MEMORY_BLOCK every time.
+//
+
+MATH_INDEX* math_index_get(
+    YR_OBJECT* module_object,
+    YR_MEMORY_BLOCK* block)
+{
+  MATH_INDEX* index = (MATH_INDEX*) module_object->data;
+
+  while (index != NULL)
+  {
+    if (index->base == block->base && index->size == block->size)
+      break;
+
+    index = index->next;
+  }
+
+  if (index == NULL && block->size <= UINT32_MAX)
+  {
+    index = (MATH_INDEX*) yr_malloc(sizeof(MATH_INDEX));
+
+    if (index == NULL)
+      return NULL;
+
+    index->base = block->base;
+    index->size = block->size;
+    index->block_size = MATH_BLOCK_SIZE;
+    index->queries = 0;
+    index->count = 0;
+    index->capacity = 0;
+    index->histograms = NULL;
+    index->pair_sums = NULL;
+    index->next = (MATH_INDEX*) module_object->data;
+
+    module_object->data = index;
+
+    while (index->size / index->block_size > MATH_INDEX_MAX_ENTRIES)
+      index->block_size *= 2;
+  }
+
+  return index;
+}
+
+
+//
+// math_range_stats
+//
+// Computes the byte histogram of the range [offset, offset + length) and,
+// if with_pairs is TRUE, the sum of the products of adjacent bytes within
+// the range. Returns FALSE if the statistics are undefined for that range.
+//
+
+int math_range_stats(
+    YR_SCAN_CONTEXT* context,
+    YR_OBJECT* module_object,
+    int64_t offset,
+    int64_t length,
+    int with_pairs,
+    MATH_STATS* stats)
+{
+  YR_MEMORY_BLOCK* block = first_memory_block(context);
+
+  int past_first_block = FALSE;
+  size_t i;
+
+  memset(stats, 0, sizeof(MATH_STATS));
+
+  if (block == NULL || offset < 0 || length < 0 || offset < block->base)
+    return FALSE;
 
   foreach_memory_block(context, block)
   {
@@ -98,16 +340,65 @@ define_function(data_entropy)
       size_t data_len = (size_t) yr_min(
           length, (size_t) (block->size - data_offset));
 
-      total_len += data_len;
-      offset += data_len;
-      length -= data_len;
+      uint8_t* block_data = fetch_memory_block_data(block);
+      MATH_INDEX* index = NULL;
 
-      for (i = 0; i < data_len; i++)
+      if (block_data == NULL)
+        return FALSE;
+
+      // The index can only be used for the block where the range begins.
+      // If the range continues in the next block the pair crossing the
+      // boundary is accounted for there, using stats->last.
+
+      if (data_len >= MATH_INDEX_MIN_LENGTH && !past_first_block)
       {
-        uint8_t c = *(block->data + data_offset + i);
-        data[c] += 1;
+        index = math_index_get(module_object, block);
+
+        // Ranges spanning only a few boundaries are cheaper to read than
+        // the partial blocks at both ends.
+
+        if (index != NULL &&
+            data_len < MATH_INDEX_MIN_BLOCKS * index->block_size)
+          index = NULL;
+
+        if (index != NULL &&
+            (++index->queries < MATH_INDEX_MIN_QUERIES ||
+             !math_index_extend(index, block_data, data_offset + data_len)))
+        {
+          index = NULL;
+        }
       }
 
+      if (index != NULL)
+      {
+        math_index_prefix(index, block_data, data_offset + data_len, 1, stats);
+        math_index_prefix(index, block_data, data_offset + 1, -1, stats);
+
+        stats->histogram[block_data[data_offset]]++;
+      }
+      else
+      {
+        uint8_t* data = block_data + data_offset;
+
+        yr_histogram_update(stats->histogram, data, data_len);
+
+        if (with_pairs && data_len > 0)
+        {
+          if (past_first_block)
+            stats->pair_sum += (uint64_t) stats->last * data[0];
+
+          for (i = 1; i < data_len; i++)
+            stats->pair_sum += (uint64_t) data[i - 1] * data[i];
+        }
+      }
+
+      if (data_len > 0)
+        stats->last = block_data[data_offset + data_len - 1];
+
+      stats->total_len += data_len;
+      offset += data_len;
+      length -= data_len;
+
       past_first_block = TRUE;
     }
     else if (past_first_block)
@@ -118,34 +409,45 @@ define_function(data_entropy)
       // range contains gaps of undefined data the checksum is
       // undefined.
 
-      yr_free(data);
-      return_float(UNDEFINED);
+      return FALSE;
     }
 
     if (block->base + block->size > offset + length)
       break;
   }
 
-  if (!past_first_block)
-  {
-    yr_free(data);
+  return past_first_block;
+}
+
+
+define_function(data_entropy)
+{
+  MATH_STATS stats;
+
+  double entropy = 0.0;
+  size_t i;
+
+  int64_t offset = integer_argument(1);   // offset where to start
+  int64_t length = integer_argument(2);   // length of bytes we want entropy on
+
+  if (!math_range_stats(
+          scan_context(), module(), offset, length, FALSE, &stats))
     return_float(UNDEFINED);
-  }
 
   for (i = 0; i < 256; i++)
   {
-    if (data[i] != 0)
+    if (stats.histogram[i] != 0)
     {
-      double x = (double) (data[i]) / total_len;
+      double x = (double) (stats.histogram[i]) / stats.total_len;
       entropy -= x * log2(x);
     }
   }
 
-  yr_free(data);
   return_float(entropy);
 }
 
 
+
 define_function(string_deviation)
 {
   SIZED_STRING* s = sized_string_argument(1);
@@ -163,8 +465,8 @@ define_function(string_deviation)
 
 
 define_function(data_deviation)
-{  
-  int past_first_block = FALSE;
+{
+  MATH_STATS stats;
 
   int64_t offset = integer_argument(1);
   int64_t length = integer_argument(2);
@@ -172,54 +474,20 @@ define_function(data_deviation)
   double mean = float_argument(3);
   double sum = 0.0;
 
-  size_t total_len = 0;
   size_t i;
 
-  YR_SCAN_CONTEXT* context = scan_context();
-  YR_MEMORY_BLOCK* block = NULL;
-
-  if (offset < 0 || length < 0 || offset < context->mem_block->base)
+  if (!math_range_stats(
+          scan_context(), module(), offset, length, FALSE, &stats))
     return_float(UNDEFINED);
- 
-  foreach_memory_block(context, block)
-  {
-    if (offset >= block->base &&
-        offset < block->base + block->size)
-    {
-      size_t data_offset = (size_t) (offset - block->base);
-      size_t data_len = (size_t) yr_min(
-          length, (size_t) (block->size - data_offset));
-
-      total_len += data_len;
-      offset += data_len;
-      length -= data_len;
-
-      for (i = 0; i < data_len; i++)
-        sum += fabs(((double) *(block->data + data_offset + i)) - mean);
-
-      past_first_block = TRUE;
-    }
-    else if (past_first_block)
-    {
-      // If offset is not within current block and we already
-      // past the first block then the we are trying to compute
-      // the checksum over a range of non contiguos blocks. As
-      // range contains gaps of undefined data the checksum is
-      // undefined.
-      return_float(UNDEFINED);
-    }
 
-    if (block->base + block->size > offset + length)
-      break;
-  }
-
-  if (!past_first_block)
-    return_float(UNDEFINED);
+  for (i = 0; i < 256; i++)
+    sum += fabs(((double) i) - mean) * stats.histogram[i];
 
-  return_float(sum / total_len);
+  return_float(sum / stats.total_len);
 }
 
 
+
 define_function(string_mean)
 {
   size_t i;
@@ -235,139 +503,65 @@ define_function(string_mean)
 
 
 define_function(data_mean)
-{  
-  int past_first_block = FALSE;
-  double sum = 0.0;
+{
+  MATH_STATS stats;
 
   int64_t offset = integer_argument(1);
   int64_t length = integer_argument(2);
 
-  YR_SCAN_CONTEXT* context = scan_context();
-  YR_MEMORY_BLOCK* block = NULL;
-
-  size_t total_len = 0;
+  double sum = 0.0;
   size_t i;
 
-  if (offset < 0 || length < 0 || offset < context->mem_block->base)
+  if (!math_range_stats(
+          scan_context(), module(), offset, length, FALSE, &stats))
     return_float(UNDEFINED);
- 
-  foreach_memory_block(context, block)
-  {
-    if (offset >= block->base &&
-        offset < block->base + block->size)
-    {
-      size_t data_offset = (size_t) (offset - block->base);
-      size_t data_len = (size_t) yr_min(
-          length, (size_t) (block->size - data_offset));
-
-      total_len += data_len;
-      offset += data_len;
-      length -= data_len;
-
-      for (i = 0; i < data_len; i++)
-        sum += (double) *(block->data + data_offset + i);
-
-      past_first_block = TRUE;
-    }
-    else if (past_first_block)
-    {
-      // If offset is not within current block and we already
-      // past the first block then the we are trying to compute
-      // the checksum over a range of non contiguos blocks. As
-      // range contains gaps of undefined data the checksum is
-      // undefined.
-      return_float(UNDEFINED);
-    }
-
-    if (block->base + block->size > offset + length)
-      break;
-  }
 
-  if (!past_first_block)
-    return_float(UNDEFINED);
+  for (i = 0; i < 256; i++)
+    sum += (double) i * stats.histogram[i];
 
-  return_float(sum / total_len);
+  return_float(sum / stats.total_len);
 }
 
 
+
 define_function(data_serial_correlation)
 {
-  int past_first_block = FALSE;
-
-  size_t total_len = 0;
-  size_t i;
+  MATH_STATS stats;
 
   int64_t offset = integer_argument(1);
   int64_t length = integer_argument(2);
 
-  YR_SCAN_CONTEXT* context = scan_context();
-  YR_MEMORY_BLOCK* block = NULL;
-
-  double sccun = 0;
-  double scclast = 0;
   double scct1 = 0;
   double scct2 = 0;
   double scct3 = 0;
   double scc = 0;
 
-  if (offset < 0 || length < 0 || offset < context->mem_block->base)
-    return_float(UNDEFINED);
- 
-  foreach_memory_block(context, block)
-  {
-    if (offset >= block->base &&
-        offset < block->base + block->size)
-    {
-      size_t data_offset = (size_t) (offset - block->base);
-      size_t data_len = (size_t) yr_min(
-          length, (size_t) (block->size - data_offset));
-
-      total_len += data_len;
-      offset += data_len;
-      length -= data_len;
-
-      for (i = 0; i < data_len; i++)
-      {
-        sccun = (double) *(block->data + data_offset + i);
-        scct1 += scclast * sccun;
-        scct2 += sccun;
-        scct3 += sccun * sccun;
-        scclast = sccun;
-      }
+  size_t i;
 
-      past_first_block = TRUE;
-    }
-    else if (past_first_block)
-    {
-      // If offset is not within current block and we already
-      // past the first block then the we are trying to compute
-      // the checksum over a range of non contiguos blocks. As
-      // range contains gaps of undefined data the checksum is
-      // undefined.
-      return_float(UNDEFINED);
-    }
+  if (!math_range_stats(scan_context(), module(), offset, length, TRUE, &stats))
+    return_float(UNDEFINED);
 
-    if (block->base + block->size > offset + length)
-      break;
+  for (i = 0; i < 256; i++)
+  {
+    scct2 += (double) i * stats.histogram[i];
+    scct3 += (double) (i * i) * stats.histogram[i];
   }
 
-  if (!past_first_block)
-    return_float(UNDEFINED);
-
-  scct1 += scclast * sccun;
+  scct1 = (double) stats.pair_sum + (double) stats.last * stats.last;
   scct2 *= scct2;
 
-  scc = total_len * scct3 - scct2;
+  scc = stats.total_len * scct3 - scct2;
 
   if (scc == 0)
     scc = -100000;
   else
-    scc = (total_len * scct1 - scct2) / scc;
+    scc = (stats.total_len * scct1 - scct2) / scc;
 
   return_float(scc);
 }
 
 
+
 define_function(string_serial_correlation)
 {
   SIZED_STRING* s = sized_string_argument(1);
@@ -419,9 +613,9 @@ define_function(data_monte_carlo_pi)
   int64_t length = integer_argument(2);
 
   YR_SCAN_CONTEXT* context = scan_context();
-  YR_MEMORY_BLOCK* block = NULL;
+  YR_MEMORY_BLOCK* block = first_memory_block(context);
 
-  if (offset < 0 || length < 0 || offset < context->mem_block->base)
+  if (block == NULL || offset < 0 || length < 0 || offset < block->base)
     return_float(UNDEFINED);
  
   foreach_memory_block(context, block)
@@ -435,12 +629,17 @@ define_function(data_monte_carlo_pi)
       size_t data_len = (size_t) yr_min(
           length, (size_t) (block->size - data_offset));
 
+      uint8_t* block_data = fetch_memory_block_data(block);
+
+      if (block_data == NULL)
+        return_float(UNDEFINED);
+
       offset += data_len;
       length -= data_len;
 
       for (i = 0; i < data_len; i++)
       {
-        monte[i % 6] = (unsigned int) *(block->data + data_offset + i);
+        monte[i % 6] = (unsigned int) *(block_data + data_offset + i);
 
         if (i % 6 == 5)
         { 
@@ -585,5 +784,6 @@ int module_load(
 int module_unload(
     YR_OBJECT* module_object)
 {
+  math_index_destroy((MATH_INDEX*) module_object->data);
   return ERROR_SUCCESS;
 }
@@ -32,8 +32,10 @@ limitations under the License.
 #endif
 
 #include <yara/pe.h>
+#include <yara/exefiles.h>
 #include <yara/modules.h>
 #include <yara/mem.h>
+#include <yara/hash.h>
 #include <yara/strutils.h>
 
 #include "pe_utils.c"
@@ -72,9 +74,9 @@ limitations under the License.
 #define RESOURCE_ITERATOR_ABORTED    1
 
 
-#define MAX_PE_SECTIONS              96
 #define MAX_PE_IMPORTS               16384
 #define MAX_PE_EXPORTS               65535
+#define MAX_PE_NAME_LENGTH           512
 
 
 #define IS_RESOURCE_SUBDIRECTORY(entry) \
@@ -146,6 +148,10 @@ typedef struct _PE
   uint8_t* data;
   size_t data_size;
 
+  // Copy of the data when it comes from a block read on demand, which is
+  // only valid until another block is read.
+  uint8_t* data_copy;
+
   union {
     PIMAGE_NT_HEADERS32 header;
     PIMAGE_NT_HEADERS64 header64;
@@ -155,6 +161,30 @@ typedef struct _PE
   IMPORTED_DLL* imported_dlls;
   uint32_t resources;
 
+  // Sections sorted by virtual address, used by pe_rva_to_offset. If some
+  // section header lies outside the file sections_table_ok is FALSE and no
+  // RVA can be translated.
+
+  YR_PE_SECTION_TABLE sections_table;
+  int sections_table_ok;
+
+  // Indexes used by the imports and exports functions, keys are lowercase
+  // except for exports. Imported functions are keyed by function name or
+  // ordinal, with the DLL name as namespace.
+
+  YR_HASH_TABLE* imported_dlls_index;
+  YR_HASH_TABLE* imported_functions_index;
+  YR_HASH_TABLE* imported_ordinals_index;
+  YR_HASH_TABLE* exports_index;
+
+  #if defined(HAVE_LIBCRYPTO)
+  char imphash[MD5_DIGEST_LENGTH * 2 + 1];
+  #endif
+
+  size_t base_address;
+  int scan_flags;
+  int parsed_parts;
+
 } PE;
 
 
@@ -381,70 +411,53 @@ int64_t pe_rva_to_offset(
     PE* pe,
     uint64_t rva)
 {
-  PIMAGE_SECTION_HEADER section = IMAGE_FIRST_SECTION(pe->header);
+  YR_PE_SECTION* section;
 
-  DWORD lowest_section_rva = 0xffffffff;
   DWORD section_rva = 0;
   DWORD section_offset = 0;
   DWORD section_raw_size = 0;
 
   int64_t result;
+  int i;
+
+  if (!pe->sections_table_ok)
+    return -1;
 
-  int i = 0;
+  i = yr_pe_section_table_lookup(&pe->sections_table, rva);
 
-  while(i < yr_min(pe->header->FileHeader.NumberOfSections, MAX_PE_SECTIONS))
+  if (i >= 0)
   {
-    if (struct_fits_in_pe(pe, section, IMAGE_SECTION_HEADER))
+    section = &pe->sections_table.sections[i];
+
+    section_rva = section->virtual_address;
+    section_offset = section->raw_data_offset;
+    section_raw_size = section->raw_data_size;
+
+    // Round section_offset
+    //
+    // Rounding everything less than 0x200 to 0 as discussed in
+    // https://code.google.com/archive/p/corkami/wikis/PE.wiki#PointerToRawData
+    // does not work for PE32_FILE from the test suite and for
+    // some tinype samples where File Alignment = 4
+    // (http://www.phreedom.org/research/tinype/).
+    //
+    // If FileAlignment is >= 0x200, it is apparently ignored (see
+    // Ero Carreras's pefile.py, PE.adjust_FileAlignment).
+    int alignment = yr_min(OptionalHeader(pe, FileAlignment), 0x200);
+
+    if (alignment)
     {
-      if (lowest_section_rva > section->VirtualAddress)
-      {
-        lowest_section_rva = section->VirtualAddress;
-      }
-
-      if (rva >= section->VirtualAddress &&
-          section_rva <= section->VirtualAddress)
-      {
-        section_rva = section->VirtualAddress;
-        section_offset = section->PointerToRawData;
-        section_raw_size = section->SizeOfRawData;
-
-        // Round section_offset
-        //
-        // Rounding everything less than 0x200 to 0 as discussed in
-        // https://code.google.com/archive/p/corkami/wikis/PE.wiki#PointerToRawData
-        // does not work for PE32_FILE from the test suite and for
-        // some tinype samples where File Alignment = 4
-        // (http://www.phreedom.org/research/tinype/).
-        //
-        // If FileAlignment is >= 0x200, it is apparently ignored (see
-        // Ero Carreras's pefile.py, PE.adjust_FileAlignment).
-        int alignment = yr_min(OptionalHeader(pe, FileAlignment), 0x200);
-
-        if (alignment)
-        {
-          int rest = section_offset % alignment;
+      int rest = section_offset % alignment;
 
-          if (rest)
-            section_offset -= rest;
-        }
-      }
-
-      section++;
-      i++;
-    }
-    else
-    {
-      return -1;
+      if (rest)
+        section_offset -= rest;
     }
   }
-
-  // Everything before the first section seems to get mapped straight
-  // relative to ImageBase.
-
-  if (rva < lowest_section_rva)
+  else
   {
-    section_rva = 0;
-    section_offset = 0;
+    // Everything before the first section seems to get mapped straight
+    // relative to ImageBase.
+
     section_raw_size = pe->data_size;
   }
 
@@ -782,6 +795,29 @@ void pe_parse_version_info(
 }
 
 
+//
+// State of pe_collect_resources, with the slot indexes of the members of
+// the resources array, which are looked up once per file instead of once
+// per resource.
+//
+
+typedef struct _RESOURCE_COLLECTOR
+{
+  PE* pe;
+  YR_OBJECT* resources;
+
+  int offset_index;
+  int length_index;
+  int type_index;
+  int id_index;
+  int language_index;
+  int type_string_index;
+  int name_string_index;
+  int language_string_index;
+
+} RESOURCE_COLLECTOR;
+
+
 int pe_collect_resources(
     PIMAGE_RESOURCE_DATA_ENTRY rsrc_data,
     int rsrc_type,
@@ -790,8 +826,10 @@ int pe_collect_resources(
     uint8_t* type_string,
     uint8_t* name_string,
     uint8_t* lang_string,
-    PE* pe)
+    RESOURCE_COLLECTOR* collector)
 {
+  PE* pe = collector->pe;
+  YR_OBJECT* resource;
   DWORD length;
 
   int64_t offset = pe_rva_to_offset(pe, rsrc_data->OffsetToData);
@@ -799,17 +837,13 @@ int pe_collect_resources(
   if (offset < 0 || !fits_in_pe(pe, pe->data + offset, rsrc_data->Size))
     return RESOURCE_CALLBACK_CONTINUE;
 
-  set_integer(
-        offset,
-        pe->object,
-        "resources[%i].offset",
-        pe->resources);
+  resource = create_item(collector->resources, pe->resources);
 
-  set_integer(
-        rsrc_data->Size,
-        pe->object,
-        "resources[%i].length",
-        pe->resources);
+  if (resource == NULL)
+    return RESOURCE_CALLBACK_ABORT;
+
+  set_integer_member(offset, resource, collector->offset_index);
+  set_integer_member(rsrc_data->Size, resource, collector->length_index);
 
   if (type_string)
   {
@@ -817,17 +851,13 @@ int pe_collect_resources(
     length = ((DWORD) *type_string) * 2;
     type_string += 2;
 
-    set_sized_string(
-        (char*) type_string, length, pe->object,
-        "resources[%i].type_string", pe->resources);
+    set_sized_string_member(
+        (char*) type_string, length,
+        resource, collector->type_string_index);
   }
   else
   {
-    set_integer(
-          rsrc_type,
-          pe->object,
-          "resources[%i].type",
-          pe->resources);
+    set_integer_member(rsrc_type, resource, collector->type_index);
   }
 
   if (name_string)
@@ -835,17 +865,14 @@ int pe_collect_resources(
     // Multiply by 2 because it is a Unicode string.
     length = ((DWORD) *name_string) * 2;
     name_string += 2;
-    set_sized_string(
-        (char*) name_string, length, pe->object,
-        "resources[%i].name_string", pe->resources);
+
+    set_sized_string_member(
+        (char*) name_string, length,
+        resource, collector->name_string_index);
   }
   else
   {
-    set_integer(
-        rsrc_id,
-        pe->object,
-        "resources[%i].id",
-        pe->resources);
+    set_integer_member(rsrc_id, resource, collector->id_index);
   }
 
   if (lang_string)
@@ -853,17 +880,14 @@ int pe_collect_resources(
     // Multiply by 2 because it is a Unicode string.
     length = ((DWORD) *lang_string) * 2;
     lang_string += 2;
-    set_sized_string(
-        (char*) lang_string, length, pe->object,
-        "resources[%i].language_string", pe->resources);
+
+    set_sized_string_member(
+        (char*) lang_string, length,
+        resource, collector->language_string_index);
   }
   else
   {
-    set_integer(
-        rsrc_language,
-        pe->object,
-        "resources[%i].language",
-        pe->resources);
+    set_integer_member(rsrc_language, resource, collector->language_index);
   }
 
   // Resources we do extra parsing on
@@ -922,7 +946,7 @@ IMPORTED_FUNCTION* pe_parse_import_descriptor(
           {
             name = (char *) yr_strndup(
                 (char*) import->Name,
-                yr_min(available_space(pe, import->Name), 512));
+                yr_min(available_space(pe, import->Name), MAX_PE_NAME_LENGTH));
           }
         }
       }
@@ -989,7 +1013,7 @@ IMPORTED_FUNCTION* pe_parse_import_descriptor(
           {
             name = (char *) yr_strndup(
                 (char*) import->Name,
-                yr_min(available_space(pe, import->Name), 512));
+                yr_min(available_space(pe, import->Name), MAX_PE_NAME_LENGTH));
           }
         }
       }
@@ -1143,6 +1167,206 @@ IMPORTED_DLL* pe_parse_imports(
 }
 
 
+//
+// Copies a lowercase version of str into buffer. If buffer is not large
+// enough a new string is allocated, which must be freed by the caller
+// when different from buffer. Returns NULL if the allocation fails.
+//
+
+char* pe_lowercase(
+    const char* str,
+    char* buffer,
+    size_t buffer_size)
+{
+  size_t i, len = strlen(str);
+
+  if (len >= buffer_size)
+  {
+    buffer = (char*) yr_malloc(len + 1);
+
+    if (buffer == NULL)
+      return NULL;
+  }
+
+  for (i = 0; i < len; i++)
+    buffer[i] = tolower((unsigned char) str[i]);
+
+  buffer[len] = '\0';
+
+  return buffer;
+}
+
+
+//
+// Builds hash indexes of imported DLLs and functions so that each call to
+// the imports functions is a single lookup instead of a walk through all
+// the imports.
+//
+
+int pe_index_imports(
+    PE* pe)
+{
+  IMPORTED_DLL* dll;
+  IMPORTED_FUNCTION* func;
+
+  char dll_name[MAX_PE_NAME_LENGTH + 1];
+  char func_name[MAX_PE_NAME_LENGTH + 1];
+  char ordinal[8];
+  char* dll_key;
+
+  int result = ERROR_SUCCESS;
+  int count = 0;
+
+  for (dll = pe->imported_dlls; dll != NULL; dll = dll->next)
+    for (func = dll->functions; func != NULL; func = func->next)
+      count++;
+
+  FAIL_ON_ERROR(yr_hash_table_create(
+      yr_max(count, 16), &pe->imported_functions_index));
+
+  FAIL_ON_ERROR(yr_hash_table_create(
+      yr_max(count, 16), &pe->imported_ordinals_index));
+
+  FAIL_ON_ERROR(yr_hash_table_create(
+      16, &pe->imported_dlls_index));
+
+  for (dll = pe->imported_dlls; dll != NULL; dll = dll->next)
+  {
+    dll_key = pe_lowercase(dll->name, dll_name, sizeof(dll_name));
+
+    if (dll_key == NULL)
+      return ERROR_INSUFICIENT_MEMORY;
+
+    result = yr_hash_table_add(pe->imported_dlls_index, dll_key, NULL, dll);
+
+    for (func = dll->functions;
+         func != NULL && result == ERROR_SUCCESS;
+         func = func->next)
+    {
+      if (func->name != NULL && func->name[0] != '\0')
+      {
+        result = yr_hash_table_add(
+            pe->imported_functions_index,
+            pe_lowercase(func->name, func_name, sizeof(func_name)),
+            dll_key,
+            func);
+      }
+
+      if (func->has_ordinal && result == ERROR_SUCCESS)
+      {
+        sprintf(ordinal, "%u", func->ordinal);
+
+        result = yr_hash_table_add(
+            pe->imported_ordinals_index,
+            ordinal,
+            dll_key,
+            func);
+      }
+    }
+
+    if (dll_key != dll_name)
+      yr_free(dll_key);
+
+    if (result != ERROR_SUCCESS)
+      break;
+  }
+
+  return result;
+}
+
+
+//
+// Builds a hash index of exported function names. If the PE doesn't export
+// any functions the index is left as NULL.
+//
+
+int pe_index_exports(
+    PE* pe)
+{
+  PIMAGE_DATA_DIRECTORY directory;
+  PIMAGE_EXPORT_DIRECTORY exports;
+  DWORD* names;
+
+  int64_t offset;
+  uint32_t i;
+  size_t remaining;
+
+  int result;
+
+  directory = pe_get_directory_entry(
+      pe, IMAGE_DIRECTORY_ENTRY_EXPORT);
+
+  if (directory->VirtualAddress == 0)
+    return ERROR_SUCCESS;
+
+  offset = pe_rva_to_offset(pe, directory->VirtualAddress);
+
+  if (offset < 0)
+    return ERROR_SUCCESS;
+
+  exports = (PIMAGE_EXPORT_DIRECTORY) \
+      (pe->data + offset);
+
+  if (!struct_fits_in_pe(pe, exports, IMAGE_EXPORT_DIRECTORY))
+    return ERROR_SUCCESS;
+
+  offset = pe_rva_to_offset(pe, exports->AddressOfNames);
+
+  if (offset < 0)
+    return ERROR_SUCCESS;
+
+  if (exports->NumberOfNames > MAX_PE_EXPORTS ||
+      exports->NumberOfNames * sizeof(DWORD) > pe->data_size - offset)
+    return ERROR_SUCCESS;
+
+  FAIL_ON_ERROR(yr_hash_table_create(
+      yr_max(exports->NumberOfNames, 16), &pe->exports_index));
+
+  names = (DWORD*)(pe->data + offset);
+
+  for (i = 0; i < exports->NumberOfNames; i++)
+  {
+    char* name;
+    size_t name_len;
+
+    offset = pe_rva_to_offset(pe, names[i]);
+
+    if (offset < 0)
+      break;
+
+    remaining = pe->data_size - (size_t) offset;
+    name = (char*)(pe->data + offset);
+    name_len = strnlen(name, remaining);
+
+    if (name_len == 0)
+      continue;
+
+    // Names that are not null-terminated before the end of the file are
+    // truncated at the end of the file.
+
+    if (name_len == remaining)
+    {
+      name = yr_strndup(name, name_len);
+
+      if (name == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+
+      result = yr_hash_table_add(pe->exports_index, name, NULL, pe);
+      yr_free(name);
+    }
+    else
+    {
+      result = yr_hash_table_add(pe->exports_index, name, NULL, pe);
+    }
+
+    if (result != ERROR_SUCCESS)
+      return result;
+  }
+
+  return ERROR_SUCCESS;
+}
+
+
 #if defined(HAVE_LIBCRYPTO)
 
 void pe_parse_certificates(
@@ -1357,19 +1581,106 @@ void pe_parse_certificates(
   set_integer(counter, pe->object, "number_of_signatures");
 }
 
-#endif  // defined(HAVE_LIBCRYPTO)
 
+//
+// Feeds len bytes of str to the MD5 context, converted to lowercase.
+//
 
-void pe_parse_header(
-    PE* pe,
-    size_t base_address,
-    int flags)
+void pe_md5_update_lowercase(
+    MD5_CTX* ctx,
+    const char* str,
+    size_t len)
 {
-  PIMAGE_SECTION_HEADER section;
+  char buffer[64];
+  size_t i, n;
 
-  char section_name[IMAGE_SIZEOF_SHORT_NAME + 1];
-  int i, scount;
+  while (len > 0)
+  {
+    n = yr_min(len, sizeof(buffer));
+
+    for (i = 0; i < n; i++)
+      buffer[i] = tolower((unsigned char) str[i]);
+
+    MD5_Update(ctx, buffer, n);
+
+    str += n;
+    len -= n;
+  }
+}
+
+
+//
+// Generate an import hash:
+// https://www.mandiant.com/blog/tracking-malware-import-hashing/
+// The hash is computed directly from the parsed import structures without
+// copying the names, which are lowercased on the fly.
+//
+
+void pe_compute_imphash(
+    PE* pe)
+{
+  IMPORTED_DLL* dll;
+  IMPORTED_FUNCTION* func;
+  MD5_CTX ctx;
+
+  unsigned char digest[MD5_DIGEST_LENGTH];
+  int i, first = TRUE;
+
+  MD5_Init(&ctx);
+
+  for (dll = pe->imported_dlls; dll != NULL; dll = dll->next)
+  {
+    size_t dll_name_len;
+
+    // If extension is 'ocx', 'sys' or 'dll', chop it.
+
+    char* ext = strstr(dll->name, ".");
+
+    if (ext && (strncasecmp(ext, ".ocx", 4) == 0 ||
+                strncasecmp(ext, ".sys", 4) == 0 ||
+                strncasecmp(ext, ".dll", 4) == 0))
+    {
+      dll_name_len = (ext - dll->name);
+    }
+    else
+    {
+      dll_name_len = strlen(dll->name);
+    }
+
+    for (func = dll->functions; func != NULL; func = func->next)
+    {
+      if (func->name == NULL)
+        continue;
+
+      if (!first)
+        MD5_Update(&ctx, ",", 1);
+
+      pe_md5_update_lowercase(&ctx, dll->name, dll_name_len);
+      MD5_Update(&ctx, ".", 1);
+      pe_md5_update_lowercase(&ctx, func->name, strlen(func->name));
 
+      first = FALSE;
+    }
+  }
+
+  MD5_Final(digest, &ctx);
+
+  // Transform the binary digest to ascii
+
+  for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+  {
+    sprintf(pe->imphash + (i * 2), "%02x", digest[i]);
+  }
+
+  pe->imphash[MD5_DIGEST_LENGTH * 2] = '\0';
+}
+
+#endif  // defined(HAVE_LIBCRYPTO)
+
+
+void pe_parse_header(
+    PE* pe)
+{
   set_integer(
       pe->header->FileHeader.Machine,
       pe->object, "machine");
@@ -1387,8 +1698,8 @@ void pe_parse_header(
       pe->object, "characteristics");
 
   set_integer(
-      flags & SCAN_FLAGS_PROCESS_MEMORY ?
-        base_address + OptionalHeader(pe, AddressOfEntryPoint) :
+      pe->scan_flags & SCAN_FLAGS_PROCESS_MEMORY ?
+        pe->base_address + OptionalHeader(pe, AddressOfEntryPoint) :
         pe_rva_to_offset(pe, OptionalHeader(pe, AddressOfEntryPoint)),
       pe->object, "entry_point");
 
@@ -1431,52 +1742,230 @@ void pe_parse_header(
   set_integer(
       OptionalHeader(pe, Subsystem),
       pe->object, "subsystem");
+}
+
+
+void pe_parse_resources(
+    PE* pe)
+{
+  RESOURCE_COLLECTOR collector;
+  YR_OBJECT* prototype;
+
+  collector.pe = pe;
+  collector.resources = get_object(pe->object, "resources");
+
+  prototype = get_prototype(collector.resources);
+
+  collector.offset_index = member_index(prototype, "offset");
+  collector.length_index = member_index(prototype, "length");
+  collector.type_index = member_index(prototype, "type");
+  collector.id_index = member_index(prototype, "id");
+  collector.language_index = member_index(prototype, "language");
+  collector.type_string_index = member_index(prototype, "type_string");
+  collector.name_string_index = member_index(prototype, "name_string");
+  collector.language_string_index = member_index(
+      prototype, "language_string");
 
   pe_iterate_resources(
       pe,
       (RESOURCE_CALLBACK_FUNC) pe_collect_resources,
-      (void*) pe);
+      (void*) &collector);
 
   set_integer(pe->resources, pe->object, "number_of_resources");
+}
 
-  section = IMAGE_FIRST_SECTION(pe->header);
-
-  scount = yr_min(pe->header->FileHeader.NumberOfSections, MAX_PE_SECTIONS);
+
+void pe_parse_sections(
+    PE* pe)
+{
+  PIMAGE_SECTION_HEADER section;
+
+  YR_OBJECT* sections = get_object(pe->object, "sections");
+  YR_OBJECT* section_obj;
+  YR_OBJECT* prototype = get_prototype(sections);
+
+  int name_index = member_index(prototype, "name");
+  int characteristics_index = member_index(prototype, "characteristics");
+  int raw_data_size_index = member_index(prototype, "raw_data_size");
+  int raw_data_offset_index = member_index(prototype, "raw_data_offset");
+  int virtual_address_index = member_index(prototype, "virtual_address");
+  int virtual_size_index = member_index(prototype, "virtual_size");
+
+  char section_name[IMAGE_SIZEOF_SHORT_NAME + 1];
+  int i, scount;
+
+  section = IMAGE_FIRST_SECTION(pe->header);
+
+  scount = yr_min(pe->header->FileHeader.NumberOfSections, MAX_PE_SECTIONS);
 
   for (i = 0; i < scount; i++)
   {
     if (!struct_fits_in_pe(pe, section, IMAGE_SECTION_HEADER))
       break;
 
+    section_obj = create_item(sections, i);
+
+    if (section_obj == NULL)
+      break;
+
     strncpy(section_name, (char*) section->Name, IMAGE_SIZEOF_SHORT_NAME);
     section_name[IMAGE_SIZEOF_SHORT_NAME] = '\0';
 
-    set_string(
+    set_string_member(
         section_name,
-        pe->object, "sections[%i].name", i);
+        section_obj, name_index);
 
-    set_integer(
+    set_integer_member(
         section->Characteristics,
-        pe->object, "sections[%i].characteristics", i);
+        section_obj, characteristics_index);
 
-    set_integer(section->SizeOfRawData,
-        pe->object, "sections[%i].raw_data_size", i);
+    set_integer_member(section->SizeOfRawData,
+        section_obj, raw_data_size_index);
 
-    set_integer(section->PointerToRawData,
-        pe->object, "sections[%i].raw_data_offset", i);
+    set_integer_member(section->PointerToRawData,
+        section_obj, raw_data_offset_index);
 
-    set_integer(section->VirtualAddress,
-        pe->object, "sections[%i].virtual_address", i);
+    set_integer_member(section->VirtualAddress,
+        section_obj, virtual_address_index);
 
-    set_integer(
+    set_integer_member(
         section->Misc.VirtualSize,
-        pe->object, "sections[%i].virtual_size", i);
+        section_obj, virtual_size_index);
 
     section++;
   }
 }
 
 
+//
+// Parts of the PE that are parsed only when needed, either because a rule
+// accessed one of the fields listed in pe_lazy_fields or because a function
+// requires them. Each part is parsed at most once per file.
+//
+
+#define PE_PART_SECTIONS         0x01
+#define PE_PART_RESOURCES        0x02
+#define PE_PART_RICH_SIGNATURE   0x04
+#define PE_PART_CERTIFICATES     0x08
+#define PE_PART_IMPORTS          0x10
+#define PE_PART_IMPORTS_INDEX    0x20
+#define PE_PART_EXPORTS_INDEX    0x40
+#define PE_PART_IMPHASH          0x80
+
+
+static struct
+{
+  const char* field;
+  int part;
+
+} pe_lazy_fields[] = {
+  { "sections",             PE_PART_SECTIONS },
+  { "version_info",         PE_PART_RESOURCES },
+  { "resource_timestamp",   PE_PART_RESOURCES },
+  { "resource_version",     PE_PART_RESOURCES },
+  { "resources",            PE_PART_RESOURCES },
+  { "number_of_resources",  PE_PART_RESOURCES },
+  { "rich_signature",       PE_PART_RICH_SIGNATURE },
+  #if defined(HAVE_LIBCRYPTO)
+  { "signatures",           PE_PART_CERTIFICATES },
+  { "number_of_signatures", PE_PART_CERTIFICATES },
+  #endif
+  { NULL,                   0 }
+};
+
+
+int pe_parse_part(
+    PE* pe,
+    int part)
+{
+  int result = ERROR_SUCCESS;
+
+  if (pe->parsed_parts & part)
+    return ERROR_SUCCESS;
+
+  switch(part)
+  {
+    case PE_PART_SECTIONS:
+      pe_parse_sections(pe);
+      break;
+
+    case PE_PART_RESOURCES:
+      pe_parse_resources(pe);
+      break;
+
+    case PE_PART_RICH_SIGNATURE:
+      pe_parse_rich_signature(pe, pe->base_address);
+      break;
+
+    #if defined(HAVE_LIBCRYPTO)
+    case PE_PART_CERTIFICATES:
+      pe_parse_certificates(pe);
+      break;
+
+    case PE_PART_IMPHASH:
+      result = pe_parse_part(pe, PE_PART_IMPORTS);
+
+      if (result == ERROR_SUCCESS)
+        pe_compute_imphash(pe);
+      break;
+    #endif
+
+    case PE_PART_IMPORTS:
+      pe->imported_dlls = pe_parse_imports(pe);
+      break;
+
+    case PE_PART_IMPORTS_INDEX:
+      result = pe_parse_part(pe, PE_PART_IMPORTS);
+
+      if (result == ERROR_SUCCESS)
+        result = pe_index_imports(pe);
+      break;
+
+    case PE_PART_EXPORTS_INDEX:
+      result = pe_index_exports(pe);
+      break;
+  }
+
+  if (result == ERROR_SUCCESS)
+  {
+    pe->parsed_parts |= part;
+  }
+  else if (part == PE_PART_IMPORTS_INDEX)
+  {
+    yr_hash_table_destroy(pe->imported_dlls_index, NULL);
+    yr_hash_table_destroy(pe->imported_functions_index, NULL);
+    yr_hash_table_destroy(pe->imported_ordinals_index, NULL);
+
+    pe->imported_dlls_index = NULL;
+    pe->imported_functions_index = NULL;
+    pe->imported_ordinals_index = NULL;
+  }
+  else if (part == PE_PART_EXPORTS_INDEX)
+  {
+    yr_hash_table_destroy(pe->exports_index, NULL);
+    pe->exports_index = NULL;
+  }
+
+  return result;
+}
+
+
+int pe_load_field(
+    YR_OBJECT* object)
+{
+  PE* pe = (PE*) yr_object_get_root(object)->data;
+  int i;
+
+  for (i = 0; pe_lazy_fields[i].field != NULL; i++)
+  {
+    if (strcmp(pe_lazy_fields[i].field, object->identifier) == 0)
+      return pe_parse_part(pe, pe_lazy_fields[i].part);
+  }
+
+  return ERROR_SUCCESS;
+}
+
+
 //
 // Given a posix timestamp argument, make sure not_before <= arg <= not_after
 //
@@ -1507,6 +1996,12 @@ define_function(section_index_addr)
   YR_OBJECT* module = module();
   YR_SCAN_CONTEXT* context = scan_context();
 
+  YR_OBJECT* sections = get_object(module, "sections");
+  YR_OBJECT* section_obj;
+
+  int offset_index;
+  int size_index;
+
   int64_t i;
   int64_t offset;
   int64_t size;
@@ -1517,18 +2012,28 @@ define_function(section_index_addr)
   if (is_undefined(module, "number_of_sections"))
     return_integer(UNDEFINED);
 
+  pe_parse_part((PE*) module->data, PE_PART_SECTIONS);
+
+  if (context->flags & SCAN_FLAGS_PROCESS_MEMORY)
+  {
+    offset_index = member_index(get_prototype(sections), "virtual_address");
+    size_index = member_index(get_prototype(sections), "virtual_size");
+  }
+  else
+  {
+    offset_index = member_index(get_prototype(sections), "raw_data_offset");
+    size_index = member_index(get_prototype(sections), "raw_data_size");
+  }
+
   for (i = 0; i < yr_min(n, MAX_PE_SECTIONS); i++)
   {
-    if (context->flags & SCAN_FLAGS_PROCESS_MEMORY)
-    {
-      offset = get_integer(module, "sections[%i].virtual_address", i);
-      size = get_integer(module, "sections[%i].virtual_size", i);
-    }
-    else
-    {
-      offset = get_integer(module, "sections[%i].raw_data_offset", i);
-      size = get_integer(module, "sections[%i].raw_data_size", i);
-    }
+    section_obj = get_item(sections, (int) i);
+
+    if (section_obj == NULL)
+      continue;
+
+    offset = get_integer_member(section_obj, offset_index);
+    size = get_integer_member(section_obj, size_index);
 
     if (addr >= offset && addr < offset + size)
       return_integer(i);
@@ -1541,18 +2046,31 @@ define_function(section_index_addr)
 define_function(section_index_name)
 {
   YR_OBJECT* module = module();
+  YR_OBJECT* sections = get_object(module, "sections");
+  YR_OBJECT* section_obj;
 
   char* name = string_argument(1);
 
+  int name_index = member_index(get_prototype(sections), "name");
+
   int64_t n = get_integer(module, "number_of_sections");
   int64_t i;
 
   if (is_undefined(module, "number_of_sections"))
     return_integer(UNDEFINED);
 
+  pe_parse_part((PE*) module->data, PE_PART_SECTIONS);
+
   for (i = 0; i < yr_min(n, MAX_PE_SECTIONS); i++)
   {
-    SIZED_STRING* sect = get_string(module, "sections[%i].name", i);
+    SIZED_STRING* sect;
+
+    section_obj = get_item(sections, (int) i);
+
+    if (section_obj == NULL)
+      continue;
+
+    sect = get_string_member(section_obj, name_index);
 
     if (sect != NULL && strcmp(name, sect->c_string) == 0)
       return_integer(i);
@@ -1569,91 +2087,33 @@ define_function(exports)
   YR_OBJECT* module = module();
   PE* pe = (PE*) module->data;
 
-  PIMAGE_DATA_DIRECTORY directory;
-  PIMAGE_EXPORT_DIRECTORY exports;
-  DWORD* names;
-
-  int64_t offset;
-  uint32_t i;
-  size_t remaining;
-
   // If not a PE file, return UNDEFINED
 
   if (pe == NULL)
     return_integer(UNDEFINED);
 
-  directory = pe_get_directory_entry(
-      pe, IMAGE_DIRECTORY_ENTRY_EXPORT);
+  FAIL_ON_ERROR(pe_parse_part(pe, PE_PART_EXPORTS_INDEX));
 
   // If the PE doesn't export any functions, return FALSE
 
-  if (directory->VirtualAddress == 0)
-    return_integer(0);
-
-  offset = pe_rva_to_offset(pe, directory->VirtualAddress);
-
-  if (offset < 0)
-    return_integer(0);
-
-  exports = (PIMAGE_EXPORT_DIRECTORY) \
-      (pe->data + offset);
-
-  if (!struct_fits_in_pe(pe, exports, IMAGE_EXPORT_DIRECTORY))
-    return_integer(0);
-
-  offset = pe_rva_to_offset(pe, exports->AddressOfNames);
-
-  if (offset < 0)
-    return_integer(0);
-
-  if (exports->NumberOfNames > MAX_PE_EXPORTS ||
-      exports->NumberOfNames * sizeof(DWORD) > pe->data_size - offset)
+  if (pe->exports_index == NULL || function_name->length == 0)
     return_integer(0);
 
-  names = (DWORD*)(pe->data + offset);
-
-  for (i = 0; i < exports->NumberOfNames; i++)
-  {
-    char* name;
-    offset = pe_rva_to_offset(pe, names[i]);
-
-    if (offset < 0)
-      return_integer(0);
-
-    remaining = pe->data_size - (size_t) offset;
-    name = (char*)(pe->data + offset);
-
-    if (remaining >= function_name->length &&
-        strncmp(name, function_name->c_string, remaining) == 0)
-    {
-      return_integer(1);
-    }
-  }
-
-  return_integer(0);
+  return_integer(yr_hash_table_lookup(
+      pe->exports_index, function_name->c_string, NULL) != NULL);
 }
 
 
 #if defined(HAVE_LIBCRYPTO)
 
 //
-// Generate an import hash:
-// https://www.mandiant.com/blog/tracking-malware-import-hashing/
-// It is important to make duplicates of the strings as we don't want
-// to alter the contents of the parsed import structures.
+// The import hash is computed only once per file, the first time this
+// function is called.
 //
 
 define_function(imphash)
 {
   YR_OBJECT* module = module();
-
-  IMPORTED_DLL* dll;
-  MD5_CTX ctx;
-
-  unsigned char digest[MD5_DIGEST_LENGTH];
-  char digest_ascii[MD5_DIGEST_LENGTH * 2 + 1];
-  int i, first = TRUE;
-
   PE* pe = (PE*) module->data;
 
   // If not a PE, return UNDEFINED.
@@ -1661,88 +2121,9 @@ define_function(imphash)
   if (!pe)
     return_string(UNDEFINED);
 
-  MD5_Init(&ctx);
-
-  dll = pe->imported_dlls;
-
-  while (dll)
-  {
-    IMPORTED_FUNCTION* func;
-
-    size_t dll_name_len;
-    char* dll_name;
-
-    // If extension is 'ocx', 'sys' or 'dll', chop it.
-
-    char* ext = strstr(dll->name, ".");
-
-    if (ext && (strncasecmp(ext, ".ocx", 4) == 0 ||
-                strncasecmp(ext, ".sys", 4) == 0 ||
-                strncasecmp(ext, ".dll", 4) == 0))
-    {
-      dll_name_len = (ext - dll->name);
-    }
-    else
-    {
-      dll_name_len = strlen(dll->name);
-    }
-
-    // Allocate a new string to hold the dll name.
-
-    dll_name = (char *) yr_malloc(dll_name_len + 1);
-
-    if (!dll_name)
-      return ERROR_INSUFICIENT_MEMORY;
-
-    strlcpy(dll_name, dll->name, dll_name_len + 1);
-
-    func = dll->functions;
-
-    while (func)
-    {
-      char* final_name;
-      size_t final_name_len = dll_name_len + strlen(func->name) + 1;
-
-      if (!first)
-        final_name_len++;   // Additional byte to accommodate the extra comma
-
-      final_name = (char*) yr_malloc(final_name_len + 1);
-
-      if (final_name == NULL)
-        break;
-
-      sprintf(final_name, first ? "%s.%s": ",%s.%s", dll_name, func->name);
-
-      // Lowercase the whole thing.
-
-      for (i = 0; i < final_name_len; i++)
-        final_name[i] = tolower(final_name[i]);
-
-      MD5_Update(&ctx, final_name, final_name_len);
-
-      yr_free(final_name);
-
-      func = func->next;
-      first = FALSE;
-    }
-
-    yr_free(dll_name);
-
-    dll = dll->next;
-  }
-
-  MD5_Final(digest, &ctx);
-
-  // Transform the binary digest to ascii
-
-  for (i = 0; i < MD5_DIGEST_LENGTH; i++)
-  {
-    sprintf(digest_ascii + (i * 2), "%02x", digest[i]);
-  }
+  FAIL_ON_ERROR(pe_parse_part(pe, PE_PART_IMPHASH));
 
-  digest_ascii[MD5_DIGEST_LENGTH * 2] = '\0';
-
-  return_string(digest_ascii);
+  return_string(pe->imphash);
 }
 
 #endif  // defined(HAVE_LIBCRYPTO)
@@ -1756,35 +2137,43 @@ define_function(imports)
   YR_OBJECT* module = module();
   PE* pe = (PE*) module->data;
 
-  IMPORTED_DLL* imported_dll;
+  char dll_buffer[MAX_PE_NAME_LENGTH + 1];
+  char function_buffer[MAX_PE_NAME_LENGTH + 1];
+  char* dll_key;
+
+  int found;
 
   if (!pe)
     return_integer(UNDEFINED);
 
-  imported_dll = pe->imported_dlls;
+  FAIL_ON_ERROR(pe_parse_part(pe, PE_PART_IMPORTS_INDEX));
+
+  // Imported function names are never longer than MAX_PE_NAME_LENGTH.
 
-  while (imported_dll != NULL)
+  if (dll_name[0] == '\0' ||
+      function_name[0] == '\0' ||
+      strlen(function_name) > MAX_PE_NAME_LENGTH)
   {
-    if (strcasecmp(imported_dll->name, dll_name) == 0)
-    {
-      IMPORTED_FUNCTION* imported_func = imported_dll->functions;
+    return_integer(0);
+  }
 
-      while (imported_func != NULL)
-      {
-        if (imported_func->name &&
-            strcasecmp(imported_func->name, function_name) == 0)
-          return_integer(1);
+  dll_key = pe_lowercase(dll_name, dll_buffer, sizeof(dll_buffer));
 
-        imported_func = imported_func->next;
-      }
-    }
+  if (dll_key == NULL)
+    return ERROR_INSUFICIENT_MEMORY;
 
-    imported_dll = imported_dll->next;
-  }
+  found = yr_hash_table_lookup(
+      pe->imported_functions_index,
+      pe_lowercase(function_name, function_buffer, sizeof(function_buffer)),
+      dll_key) != NULL;
 
-  return_integer(0);
+  if (dll_key != dll_buffer)
+    yr_free(dll_key);
+
+  return_integer(found);
 }
 
+
 define_function(imports_ordinal)
 {
   char* dll_name = string_argument(1);
@@ -1793,34 +2182,41 @@ define_function(imports_ordinal)
   YR_OBJECT* module = module();
   PE* pe = (PE*) module->data;
 
-  IMPORTED_DLL* imported_dll;
+  char dll_buffer[MAX_PE_NAME_LENGTH + 1];
+  char ordinal_key[8];
+  char* dll_key;
+
+  int found;
 
   if (!pe)
     return_integer(UNDEFINED);
 
-  imported_dll = pe->imported_dlls;
+  FAIL_ON_ERROR(pe_parse_part(pe, PE_PART_IMPORTS_INDEX));
 
-  while (imported_dll != NULL)
-  {
-    if (strcasecmp(imported_dll->name, dll_name) == 0)
-    {
-      IMPORTED_FUNCTION* imported_func = imported_dll->functions;
+  // Ordinals are 16-bits values.
 
-      while (imported_func != NULL)
-      {
-        if (imported_func->has_ordinal && imported_func->ordinal == ordinal)
-          return_integer(1);
+  if (dll_name[0] == '\0' || ordinal > 0xFFFF)
+    return_integer(0);
 
-        imported_func = imported_func->next;
-      }
-    }
+  dll_key = pe_lowercase(dll_name, dll_buffer, sizeof(dll_buffer));
 
-    imported_dll = imported_dll->next;
-  }
+  if (dll_key == NULL)
+    return ERROR_INSUFICIENT_MEMORY;
 
-  return_integer(0);
+  sprintf(ordinal_key, "%u", (unsigned int) ordinal);
+
+  found = yr_hash_table_lookup(
+      pe->imported_ordinals_index,
+      ordinal_key,
+      dll_key) != NULL;
+
+  if (dll_key != dll_buffer)
+    yr_free(dll_key);
+
+  return_integer(found);
 }
 
+
 define_function(imports_dll)
 {
   char* dll_name = string_argument(1);
@@ -1828,24 +2224,33 @@ define_function(imports_dll)
   YR_OBJECT* module = module();
   PE* pe = (PE*) module->data;
 
-  IMPORTED_DLL* imported_dll;
+  char dll_buffer[MAX_PE_NAME_LENGTH + 1];
+  char* dll_key;
+
+  int found;
 
   if (!pe)
     return_integer(UNDEFINED);
 
-  imported_dll = pe->imported_dlls;
+  FAIL_ON_ERROR(pe_parse_part(pe, PE_PART_IMPORTS_INDEX));
 
-  while (imported_dll != NULL)
-  {
-    if (strcasecmp(imported_dll->name, dll_name) == 0)
-    {
-      return_integer(1);
-    }
+  if (dll_name[0] == '\0')
+    return_integer(0);
 
-    imported_dll = imported_dll->next;
-  }
+  dll_key = pe_lowercase(dll_name, dll_buffer, sizeof(dll_buffer));
 
-  return_integer(0);
+  if (dll_key == NULL)
+    return ERROR_INSUFICIENT_MEMORY;
+
+  found = yr_hash_table_lookup(
+      pe->imported_dlls_index,
+      dll_key,
+      NULL) != NULL;
+
+  if (dll_key != dll_buffer)
+    yr_free(dll_key);
+
+  return_integer(found);
 }
 
 define_function(locale)
@@ -1856,14 +2261,16 @@ define_function(locale)
   uint64_t locale = integer_argument(1);
   int64_t n, i;
 
-  if (is_undefined(module, "number_of_resources"))
-    return_integer(UNDEFINED);
-
   // If not a PE file, return UNDEFINED
 
   if (pe == NULL)
     return_integer(UNDEFINED);
 
+  pe_parse_part(pe, PE_PART_RESOURCES);
+
+  if (is_undefined(module, "number_of_resources"))
+    return_integer(UNDEFINED);
+
   n = get_integer(module, "number_of_resources");
 
   for (i = 0; i < n; i++)
@@ -1887,14 +2294,16 @@ define_function(language)
   uint64_t language = integer_argument(1);
   int64_t n, i;
 
-  if (is_undefined(module, "number_of_resources"))
-    return_integer(UNDEFINED);
-
   // If not a PE file, return UNDEFINED
 
   if (pe == NULL)
     return_integer(UNDEFINED);
 
+  pe_parse_part(pe, PE_PART_RESOURCES);
+
+  if (is_undefined(module, "number_of_resources"))
+    return_integer(UNDEFINED);
+
   n = get_integer(module, "number_of_resources");
 
   for (i = 0; i < n; i++)
@@ -1958,6 +2367,13 @@ static uint64_t rich_internal(
   PRICH_SIGNATURE clear_rich_signature;
   SIZED_STRING* rich_string;
 
+  PE* pe = (PE*) module->data;
+
+  if (pe == NULL)
+    return UNDEFINED;
+
+  pe_parse_part(pe, PE_PART_RICH_SIGNATURE);
+
   // Check if the required fields are set
   if (is_undefined(module, "rich_signature.length"))
       return UNDEFINED;
@@ -2039,88 +2455,103 @@ define_function(rich_toolid_version)
 
 begin_declarations;
 
-  declare_integer("MACHINE_UNKNOWN");
-  declare_integer("MACHINE_AM33");
-  declare_integer("MACHINE_AMD64");
-  declare_integer("MACHINE_ARM");
-  declare_integer("MACHINE_ARMNT");
-  declare_integer("MACHINE_ARM64");
-  declare_integer("MACHINE_EBC");
-  declare_integer("MACHINE_I386");
-  declare_integer("MACHINE_IA64");
-  declare_integer("MACHINE_M32R");
-  declare_integer("MACHINE_MIPS16");
-  declare_integer("MACHINE_MIPSFPU");
-  declare_integer("MACHINE_MIPSFPU16");
-  declare_integer("MACHINE_POWERPC");
-  declare_integer("MACHINE_POWERPCFP");
-  declare_integer("MACHINE_R4000");
-  declare_integer("MACHINE_SH3");
-  declare_integer("MACHINE_SH3DSP");
-  declare_integer("MACHINE_SH4");
-  declare_integer("MACHINE_SH5");
-  declare_integer("MACHINE_THUMB");
-  declare_integer("MACHINE_WCEMIPSV2");
-
-  declare_integer("SUBSYSTEM_UNKNOWN");
-  declare_integer("SUBSYSTEM_NATIVE");
-  declare_integer("SUBSYSTEM_WINDOWS_GUI");
-  declare_integer("SUBSYSTEM_WINDOWS_CUI");
-  declare_integer("SUBSYSTEM_OS2_CUI");
-  declare_integer("SUBSYSTEM_POSIX_CUI");
-  declare_integer("SUBSYSTEM_NATIVE_WINDOWS");
-
-  declare_integer("RELOCS_STRIPPED");
-  declare_integer("EXECUTABLE_IMAGE");
-  declare_integer("LINE_NUMS_STRIPPED");
-  declare_integer("LOCAL_SYMS_STRIPPED");
-  declare_integer("AGGRESIVE_WS_TRIM");
-  declare_integer("LARGE_ADDRESS_AWARE");
-  declare_integer("BYTES_REVERSED_LO");
-  declare_integer("MACHINE_32BIT");
-  declare_integer("DEBUG_STRIPPED");
-  declare_integer("REMOVABLE_RUN_FROM_SWAP");
-  declare_integer("NET_RUN_FROM_SWAP");
-  declare_integer("SYSTEM");
-  declare_integer("DLL");
-  declare_integer("UP_SYSTEM_ONLY");
-  declare_integer("BYTES_REVERSED_HI");
-
-  declare_integer("SECTION_CNT_CODE");
-  declare_integer("SECTION_CNT_INITIALIZED_DATA");
-  declare_integer("SECTION_CNT_UNINITIALIZED_DATA");
-  declare_integer("SECTION_GPREL");
-  declare_integer("SECTION_MEM_16BIT");
-  declare_integer("SECTION_LNK_NRELOC_OVFL");
-  declare_integer("SECTION_MEM_DISCARDABLE");
-  declare_integer("SECTION_MEM_NOT_CACHED");
-  declare_integer("SECTION_MEM_NOT_PAGED");
-  declare_integer("SECTION_MEM_SHARED");
-  declare_integer("SECTION_MEM_EXECUTE");
-  declare_integer("SECTION_MEM_READ");
-  declare_integer("SECTION_MEM_WRITE");
-
-  declare_integer("RESOURCE_TYPE_CURSOR");
-  declare_integer("RESOURCE_TYPE_BITMAP");
-  declare_integer("RESOURCE_TYPE_ICON");
-  declare_integer("RESOURCE_TYPE_MENU");
-  declare_integer("RESOURCE_TYPE_DIALOG");
-  declare_integer("RESOURCE_TYPE_STRING");
-  declare_integer("RESOURCE_TYPE_FONTDIR");
-  declare_integer("RESOURCE_TYPE_FONT");
-  declare_integer("RESOURCE_TYPE_ACCELERATOR");
-  declare_integer("RESOURCE_TYPE_RCDATA");
-  declare_integer("RESOURCE_TYPE_MESSAGETABLE");
-  declare_integer("RESOURCE_TYPE_GROUP_CURSOR");
-  declare_integer("RESOURCE_TYPE_GROUP_ICON");
-  declare_integer("RESOURCE_TYPE_VERSION");
-  declare_integer("RESOURCE_TYPE_DLGINCLUDE");
-  declare_integer("RESOURCE_TYPE_PLUGPLAY");
-  declare_integer("RESOURCE_TYPE_VXD");
-  declare_integer("RESOURCE_TYPE_ANICURSOR");
-  declare_integer("RESOURCE_TYPE_ANIICON");
-  declare_integer("RESOURCE_TYPE_HTML");
-  declare_integer("RESOURCE_TYPE_MANIFEST");
+  declare_integer_constant("MACHINE_UNKNOWN", IMAGE_FILE_MACHINE_UNKNOWN);
+  declare_integer_constant("MACHINE_AM33", IMAGE_FILE_MACHINE_AM33);
+  declare_integer_constant("MACHINE_AMD64", IMAGE_FILE_MACHINE_AMD64);
+  declare_integer_constant("MACHINE_ARM", IMAGE_FILE_MACHINE_ARM);
+  declare_integer_constant("MACHINE_ARMNT", IMAGE_FILE_MACHINE_ARMNT);
+  declare_integer_constant("MACHINE_ARM64", IMAGE_FILE_MACHINE_ARM64);
+  declare_integer_constant("MACHINE_EBC", IMAGE_FILE_MACHINE_EBC);
+  declare_integer_constant("MACHINE_I386", IMAGE_FILE_MACHINE_I386);
+  declare_integer_constant("MACHINE_IA64", IMAGE_FILE_MACHINE_IA64);
+  declare_integer_constant("MACHINE_M32R", IMAGE_FILE_MACHINE_M32R);
+  declare_integer_constant("MACHINE_MIPS16", IMAGE_FILE_MACHINE_MIPS16);
+  declare_integer_constant("MACHINE_MIPSFPU", IMAGE_FILE_MACHINE_MIPSFPU);
+  declare_integer_constant("MACHINE_MIPSFPU16", IMAGE_FILE_MACHINE_MIPSFPU16);
+  declare_integer_constant("MACHINE_POWERPC", IMAGE_FILE_MACHINE_POWERPC);
+  declare_integer_constant("MACHINE_POWERPCFP", IMAGE_FILE_MACHINE_POWERPCFP);
+  declare_integer_constant("MACHINE_R4000", IMAGE_FILE_MACHINE_R4000);
+  declare_integer_constant("MACHINE_SH3", IMAGE_FILE_MACHINE_SH3);
+  declare_integer_constant("MACHINE_SH3DSP", IMAGE_FILE_MACHINE_SH3DSP);
+  declare_integer_constant("MACHINE_SH4", IMAGE_FILE_MACHINE_SH4);
+  declare_integer_constant("MACHINE_SH5", IMAGE_FILE_MACHINE_SH5);
+  declare_integer_constant("MACHINE_THUMB", IMAGE_FILE_MACHINE_THUMB);
+  declare_integer_constant("MACHINE_WCEMIPSV2", IMAGE_FILE_MACHINE_WCEMIPSV2);
+
+  declare_integer_constant("SUBSYSTEM_UNKNOWN", IMAGE_SUBSYSTEM_UNKNOWN);
+  declare_integer_constant("SUBSYSTEM_NATIVE", IMAGE_SUBSYSTEM_NATIVE);
+  declare_integer_constant(
+      "SUBSYSTEM_WINDOWS_GUI", IMAGE_SUBSYSTEM_WINDOWS_GUI);
+  declare_integer_constant(
+      "SUBSYSTEM_WINDOWS_CUI", IMAGE_SUBSYSTEM_WINDOWS_CUI);
+  declare_integer_constant("SUBSYSTEM_OS2_CUI", IMAGE_SUBSYSTEM_OS2_CUI);
+  declare_integer_constant("SUBSYSTEM_POSIX_CUI", IMAGE_SUBSYSTEM_POSIX_CUI);
+  declare_integer_constant(
+      "SUBSYSTEM_NATIVE_WINDOWS", IMAGE_SUBSYSTEM_NATIVE_WINDOWS);
+
+  declare_integer_constant("RELOCS_STRIPPED", IMAGE_FILE_RELOCS_STRIPPED);
+  declare_integer_constant("EXECUTABLE_IMAGE", IMAGE_FILE_EXECUTABLE_IMAGE);
+  declare_integer_constant("LINE_NUMS_STRIPPED", IMAGE_FILE_LINE_NUMS_STRIPPED);
+  declare_integer_constant(
+      "LOCAL_SYMS_STRIPPED", IMAGE_FILE_LOCAL_SYMS_STRIPPED);
+  declare_integer_constant("AGGRESIVE_WS_TRIM", IMAGE_FILE_AGGRESIVE_WS_TRIM);
+  declare_integer_constant(
+      "LARGE_ADDRESS_AWARE", IMAGE_FILE_LARGE_ADDRESS_AWARE);
+  declare_integer_constant("BYTES_REVERSED_LO", IMAGE_FILE_BYTES_REVERSED_LO);
+  declare_integer_constant("MACHINE_32BIT", IMAGE_FILE_32BIT_MACHINE);
+  declare_integer_constant("DEBUG_STRIPPED", IMAGE_FILE_DEBUG_STRIPPED);
+  declare_integer_constant(
+      "REMOVABLE_RUN_FROM_SWAP", IMAGE_FILE_REMOVABLE_RUN_FROM_SWAP);
+  declare_integer_constant("NET_RUN_FROM_SWAP", IMAGE_FILE_NET_RUN_FROM_SWAP);
+  declare_integer_constant("SYSTEM", IMAGE_FILE_SYSTEM);
+  declare_integer_constant("DLL", IMAGE_FILE_DLL);
+  declare_integer_constant("UP_SYSTEM_ONLY", IMAGE_FILE_UP_SYSTEM_ONLY);
+  declare_integer_constant("BYTES_REVERSED_HI", IMAGE_FILE_BYTES_REVERSED_HI);
+
+  declare_integer_constant("SECTION_CNT_CODE", IMAGE_SCN_CNT_CODE);
+  declare_integer_constant(
+      "SECTION_CNT_INITIALIZED_DATA", IMAGE_SCN_CNT_INITIALIZED_DATA);
+  declare_integer_constant(
+      "SECTION_CNT_UNINITIALIZED_DATA", IMAGE_SCN_CNT_UNINITIALIZED_DATA);
+  declare_integer_constant("SECTION_GPREL", IMAGE_SCN_GPREL);
+  declare_integer_constant("SECTION_MEM_16BIT", IMAGE_SCN_MEM_16BIT);
+  declare_integer_constant(
+      "SECTION_LNK_NRELOC_OVFL", IMAGE_SCN_LNK_NRELOC_OVFL);
+  declare_integer_constant(
+      "SECTION_MEM_DISCARDABLE", IMAGE_SCN_MEM_DISCARDABLE);
+  declare_integer_constant("SECTION_MEM_NOT_CACHED", IMAGE_SCN_MEM_NOT_CACHED);
+  declare_integer_constant("SECTION_MEM_NOT_PAGED", IMAGE_SCN_MEM_NOT_PAGED);
+  declare_integer_constant("SECTION_MEM_SHARED", IMAGE_SCN_MEM_SHARED);
+  declare_integer_constant("SECTION_MEM_EXECUTE", IMAGE_SCN_MEM_EXECUTE);
+  declare_integer_constant("SECTION_MEM_READ", IMAGE_SCN_MEM_READ);
+  declare_integer_constant("SECTION_MEM_WRITE", IMAGE_SCN_MEM_WRITE);
+
+  declare_integer_constant("RESOURCE_TYPE_CURSOR", RESOURCE_TYPE_CURSOR);
+  declare_integer_constant("RESOURCE_TYPE_BITMAP", RESOURCE_TYPE_BITMAP);
+  declare_integer_constant("RESOURCE_TYPE_ICON", RESOURCE_TYPE_ICON);
+  declare_integer_constant("RESOURCE_TYPE_MENU", RESOURCE_TYPE_MENU);
+  declare_integer_constant("RESOURCE_TYPE_DIALOG", RESOURCE_TYPE_DIALOG);
+  declare_integer_constant("RESOURCE_TYPE_STRING", RESOURCE_TYPE_STRING);
+  declare_integer_constant("RESOURCE_TYPE_FONTDIR", RESOURCE_TYPE_FONTDIR);
+  declare_integer_constant("RESOURCE_TYPE_FONT", RESOURCE_TYPE_FONT);
+  declare_integer_constant(
+      "RESOURCE_TYPE_ACCELERATOR", RESOURCE_TYPE_ACCELERATOR);
+  declare_integer_constant("RESOURCE_TYPE_RCDATA", RESOURCE_TYPE_RCDATA);
+  declare_integer_constant(
+      "RESOURCE_TYPE_MESSAGETABLE", RESOURCE_TYPE_MESSAGETABLE);
+  declare_integer_constant(
+      "RESOURCE_TYPE_GROUP_CURSOR", RESOURCE_TYPE_GROUP_CURSOR);
+  declare_integer_constant(
+      "RESOURCE_TYPE_GROUP_ICON", RESOURCE_TYPE_GROUP_ICON);
+  declare_integer_constant("RESOURCE_TYPE_VERSION", RESOURCE_TYPE_VERSION);
+  declare_integer_constant(
+      "RESOURCE_TYPE_DLGINCLUDE", RESOURCE_TYPE_DLGINCLUDE);
+  declare_integer_constant("RESOURCE_TYPE_PLUGPLAY", RESOURCE_TYPE_PLUGPLAY);
+  declare_integer_constant("RESOURCE_TYPE_VXD", RESOURCE_TYPE_VXD);
+  declare_integer_constant("RESOURCE_TYPE_ANICURSOR", RESOURCE_TYPE_ANICURSOR);
+  declare_integer_constant("RESOURCE_TYPE_ANIICON", RESOURCE_TYPE_ANIICON);
+  declare_integer_constant("RESOURCE_TYPE_HTML", RESOURCE_TYPE_HTML);
+  declare_integer_constant("RESOURCE_TYPE_MANIFEST", RESOURCE_TYPE_MANIFEST);
 
   declare_integer("machine");
   declare_integer("number_of_sections");
@@ -2250,249 +2681,17 @@ int module_load(
     size_t module_data_size)
 {
   YR_MEMORY_BLOCK* block;
-
-  set_integer(
-      IMAGE_FILE_MACHINE_UNKNOWN, module_object,
-      "MACHINE_UNKNOWN");
-  set_integer(
-      IMAGE_FILE_MACHINE_AM33, module_object,
-      "MACHINE_AM33");
-  set_integer(
-      IMAGE_FILE_MACHINE_AMD64, module_object,
-      "MACHINE_AMD64");
-  set_integer(
-      IMAGE_FILE_MACHINE_ARM, module_object,
-      "MACHINE_ARM");
-  set_integer(
-      IMAGE_FILE_MACHINE_ARMNT, module_object,
-      "MACHINE_ARMNT");
-  set_integer(
-      IMAGE_FILE_MACHINE_ARM64, module_object,
-      "MACHINE_ARM64");
-  set_integer(
-      IMAGE_FILE_MACHINE_EBC, module_object,
-      "MACHINE_EBC");
-  set_integer(
-      IMAGE_FILE_MACHINE_I386, module_object,
-      "MACHINE_I386");
-  set_integer(
-      IMAGE_FILE_MACHINE_IA64, module_object,
-      "MACHINE_IA64");
-  set_integer(
-      IMAGE_FILE_MACHINE_M32R, module_object,
-      "MACHINE_M32R");
-  set_integer(
-      IMAGE_FILE_MACHINE_MIPS16, module_object,
-      "MACHINE_MIPS16");
-  set_integer(
-      IMAGE_FILE_MACHINE_MIPSFPU, module_object,
-      "MACHINE_MIPSFPU");
-  set_integer(
-      IMAGE_FILE_MACHINE_MIPSFPU16, module_object,
-      "MACHINE_MIPSFPU16");
-  set_integer(
-      IMAGE_FILE_MACHINE_POWERPC, module_object,
-      "MACHINE_POWERPC");
-  set_integer(
-      IMAGE_FILE_MACHINE_POWERPCFP, module_object,
-      "MACHINE_POWERPCFP");
-  set_integer(
-      IMAGE_FILE_MACHINE_R4000, module_object,
-      "MACHINE_R4000");
-  set_integer(
-      IMAGE_FILE_MACHINE_SH3, module_object,
-      "MACHINE_SH3");
-  set_integer(
-      IMAGE_FILE_MACHINE_SH3DSP, module_object,
-      "MACHINE_SH3DSP");
-  set_integer(
-      IMAGE_FILE_MACHINE_SH4, module_object,
-      "MACHINE_SH4");
-  set_integer(
-      IMAGE_FILE_MACHINE_SH5, module_object,
-      "MACHINE_SH5");
-  set_integer(
-      IMAGE_FILE_MACHINE_THUMB, module_object,
-      "MACHINE_THUMB");
-  set_integer(
-      IMAGE_FILE_MACHINE_WCEMIPSV2, module_object,
-      "MACHINE_WCEMIPSV2");
-
-  set_integer(
-      IMAGE_SUBSYSTEM_UNKNOWN, module_object,
-      "SUBSYSTEM_UNKNOWN");
-  set_integer(
-      IMAGE_SUBSYSTEM_NATIVE, module_object,
-      "SUBSYSTEM_NATIVE");
-  set_integer(
-      IMAGE_SUBSYSTEM_WINDOWS_GUI, module_object,
-      "SUBSYSTEM_WINDOWS_GUI");
-  set_integer(
-      IMAGE_SUBSYSTEM_WINDOWS_CUI, module_object,
-      "SUBSYSTEM_WINDOWS_CUI");
-  set_integer(
-      IMAGE_SUBSYSTEM_OS2_CUI, module_object,
-      "SUBSYSTEM_OS2_CUI");
-  set_integer(
-      IMAGE_SUBSYSTEM_POSIX_CUI, module_object,
-      "SUBSYSTEM_POSIX_CUI");
-  set_integer(
-      IMAGE_SUBSYSTEM_NATIVE_WINDOWS, module_object,
-      "SUBSYSTEM_NATIVE_WINDOWS");
-
-  set_integer(
-      IMAGE_FILE_RELOCS_STRIPPED, module_object,
-      "RELOCS_STRIPPED");
-  set_integer(
-      IMAGE_FILE_EXECUTABLE_IMAGE, module_object,
-      "EXECUTABLE_IMAGE");
-  set_integer(
-      IMAGE_FILE_LINE_NUMS_STRIPPED, module_object,
-      "LINE_NUMS_STRIPPED");
-  set_integer(
-      IMAGE_FILE_LOCAL_SYMS_STRIPPED, module_object,
-      "LOCAL_SYMS_STRIPPED");
-  set_integer(
-      IMAGE_FILE_AGGRESIVE_WS_TRIM, module_object,
-      "AGGRESIVE_WS_TRIM");
-  set_integer(
-      IMAGE_FILE_LARGE_ADDRESS_AWARE, module_object,
-      "LARGE_ADDRESS_AWARE");
-  set_integer(
-      IMAGE_FILE_BYTES_REVERSED_LO, module_object,
-      "BYTES_REVERSED_LO");
-  set_integer(
-      IMAGE_FILE_32BIT_MACHINE, module_object,
-      "MACHINE_32BIT");
-  set_integer(
-      IMAGE_FILE_DEBUG_STRIPPED, module_object,
-      "DEBUG_STRIPPED");
-  set_integer(
-      IMAGE_FILE_REMOVABLE_RUN_FROM_SWAP, module_object,
-      "REMOVABLE_RUN_FROM_SWAP");
-  set_integer(
-      IMAGE_FILE_NET_RUN_FROM_SWAP, module_object,
-      "NET_RUN_FROM_SWAP");
-  set_integer(
-      IMAGE_FILE_SYSTEM, module_object,
-      "SYSTEM");
-  set_integer(
-      IMAGE_FILE_DLL, module_object,
-      "DLL");
-  set_integer(
-      IMAGE_FILE_UP_SYSTEM_ONLY, module_object,
-      "UP_SYSTEM_ONLY");
-  set_integer(
-      IMAGE_FILE_BYTES_REVERSED_HI, module_object,
-      "BYTES_REVERSED_HI");
-
-  set_integer(
-      IMAGE_SCN_CNT_CODE, module_object,
-      "SECTION_CNT_CODE");
-  set_integer(
-      IMAGE_SCN_CNT_INITIALIZED_DATA, module_object,
-      "SECTION_CNT_INITIALIZED_DATA");
-  set_integer(
-      IMAGE_SCN_CNT_UNINITIALIZED_DATA, module_object,
-      "SECTION_CNT_UNINITIALIZED_DATA");
-  set_integer(
-      IMAGE_SCN_GPREL, module_object,
-      "SECTION_GPREL");
-  set_integer(
-      IMAGE_SCN_MEM_16BIT, module_object,
-      "SECTION_MEM_16BIT");
-  set_integer(
-      IMAGE_SCN_LNK_NRELOC_OVFL, module_object,
-      "SECTION_LNK_NRELOC_OVFL");
-  set_integer(
-      IMAGE_SCN_MEM_DISCARDABLE, module_object,
-      "SECTION_MEM_DISCARDABLE");
-  set_integer(
-      IMAGE_SCN_MEM_NOT_CACHED, module_object,
-      "SECTION_MEM_NOT_CACHED");
-  set_integer(
-      IMAGE_SCN_MEM_NOT_PAGED, module_object,
-      "SECTION_MEM_NOT_PAGED");
-  set_integer(
-      IMAGE_SCN_MEM_SHARED, module_object,
-      "SECTION_MEM_SHARED");
-  set_integer(
-      IMAGE_SCN_MEM_EXECUTE, module_object,
-      "SECTION_MEM_EXECUTE");
-  set_integer(
-      IMAGE_SCN_MEM_READ, module_object,
-      "SECTION_MEM_READ");
-  set_integer(
-      IMAGE_SCN_MEM_WRITE, module_object,
-      "SECTION_MEM_WRITE");
-
-  set_integer(
-      RESOURCE_TYPE_CURSOR, module_object,
-      "RESOURCE_TYPE_CURSOR");
-  set_integer(
-      RESOURCE_TYPE_BITMAP, module_object,
-      "RESOURCE_TYPE_BITMAP");
-  set_integer(
-      RESOURCE_TYPE_ICON, module_object,
-      "RESOURCE_TYPE_ICON");
-  set_integer(
-      RESOURCE_TYPE_MENU, module_object,
-      "RESOURCE_TYPE_MENU");
-  set_integer(
-      RESOURCE_TYPE_DIALOG, module_object,
-      "RESOURCE_TYPE_DIALOG");
-  set_integer(
-      RESOURCE_TYPE_STRING, module_object,
-      "RESOURCE_TYPE_STRING");
-  set_integer(
-      RESOURCE_TYPE_FONTDIR, module_object,
-      "RESOURCE_TYPE_FONTDIR");
-  set_integer(
-      RESOURCE_TYPE_FONT, module_object,
-      "RESOURCE_TYPE_FONT");
-  set_integer(
-      RESOURCE_TYPE_ACCELERATOR, module_object,
-      "RESOURCE_TYPE_ACCELERATOR");
-  set_integer(
-      RESOURCE_TYPE_RCDATA, module_object,
-      "RESOURCE_TYPE_RCDATA");
-  set_integer(
-      RESOURCE_TYPE_MESSAGETABLE, module_object,
-      "RESOURCE_TYPE_MESSAGETABLE");
-  set_integer(
-      RESOURCE_TYPE_GROUP_CURSOR, module_object,
-      "RESOURCE_TYPE_GROUP_CURSOR");
-  set_integer(
-      RESOURCE_TYPE_GROUP_ICON, module_object,
-      "RESOURCE_TYPE_GROUP_ICON");
-  set_integer(
-      RESOURCE_TYPE_VERSION, module_object,
-      "RESOURCE_TYPE_VERSION");
-  set_integer(
-      RESOURCE_TYPE_DLGINCLUDE, module_object,
-      "RESOURCE_TYPE_DLGINCLUDE");
-  set_integer(
-      RESOURCE_TYPE_PLUGPLAY, module_object,
-      "RESOURCE_TYPE_PLUGPLAY");
-  set_integer(
-      RESOURCE_TYPE_VXD, module_object,
-      "RESOURCE_TYPE_VXD");
-  set_integer(
-      RESOURCE_TYPE_ANICURSOR, module_object,
-      "RESOURCE_TYPE_ANICURSOR");
-  set_integer(
-      RESOURCE_TYPE_ANIICON, module_object,
-      "RESOURCE_TYPE_ANIICON");
-  set_integer(
-      RESOURCE_TYPE_HTML, module_object,
-      "RESOURCE_TYPE_HTML");
-  set_integer(
-      RESOURCE_TYPE_MANIFEST, module_object,
-      "RESOURCE_TYPE_MANIFEST");
+  int i;
 
   foreach_memory_block(context, block)
   {
-    PIMAGE_NT_HEADERS32 pe_header = pe_get_header(block->data, block->size);
+    uint8_t* block_data = fetch_memory_block_data(block);
+    PIMAGE_NT_HEADERS32 pe_header;
+
+    if (block_data == NULL)
+      continue;
+
+    pe_header = pe_get_header(block_data, block->size);
 
     if (pe_header != NULL)
     {
@@ -2506,22 +2705,62 @@ int module_load(
         if (pe == NULL)
           return ERROR_INSUFICIENT_MEMORY;
 
-        pe->data = block->data;
+        pe->data_copy = NULL;
+
+        // Most of the PE is parsed lazily, so the data of blocks read on
+        // demand must be copied before another block is read.
+
+        if (block->data == NULL)
+        {
+          pe->data_copy = (uint8_t*) yr_malloc(block->size);
+
+          if (pe->data_copy == NULL)
+          {
+            yr_free(pe);
+            return ERROR_INSUFICIENT_MEMORY;
+          }
+
+          memcpy(pe->data_copy, block_data, block->size);
+
+          pe_header = (PIMAGE_NT_HEADERS32) (
+              pe->data_copy + ((uint8_t*) pe_header - block_data));
+
+          block_data = pe->data_copy;
+        }
+
+        pe->data = block_data;
         pe->data_size = block->size;
         pe->header = pe_header;
         pe->object = module_object;
+        pe->imported_dlls = NULL;
+        pe->imported_dlls_index = NULL;
+        pe->imported_functions_index = NULL;
+        pe->imported_ordinals_index = NULL;
+        pe->exports_index = NULL;
         pe->resources = 0;
+        pe->base_address = block->base;
+        pe->scan_flags = context->flags;
+        pe->parsed_parts = 0;
+
+        pe->sections_table_ok = yr_pe_section_table_build(
+            pe->header,
+            pe->data_size - ((uint8_t*) pe->header - pe->data),
+            MAX_PE_SECTIONS,
+            &pe->sections_table);
 
         module_object->data = pe;
 
-        pe_parse_header(pe, block->base, context->flags);
-        pe_parse_rich_signature(pe, block->base);
+        pe_parse_header(pe);
 
-        #if defined(HAVE_LIBCRYPTO)
-        pe_parse_certificates(pe);
-        #endif
+        // Everything else is parsed when a rule needs it.
 
-        pe->imported_dlls = pe_parse_imports(pe);
+        for (i = 0; pe_lazy_fields[i].field != NULL; i++)
+        {
+          FAIL_ON_ERROR(set_loader(
+              pe_load_field,
+              module_object,
+              member_index(module_object, pe_lazy_fields[i].field)));
+        }
 
         break;
       }
@@ -2569,6 +2808,14 @@ int module_unload(
     dll = next_dll;
   }
 
+  yr_hash_table_destroy(pe->imported_dlls_index, NULL);
+  yr_hash_table_destroy(pe->imported_functions_index, NULL);
+  yr_hash_table_destroy(pe->imported_ordinals_index, NULL);
+  yr_hash_table_destroy(pe->exports_index, NULL);
+
+  if (pe->data_copy != NULL)
+    yr_free(pe->data_copy);
+
   yr_free(pe);
 
   return ERROR_SUCCESS;
@@ -14,6 +14,8 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#include <stdio.h>
+
 #include <yara/modules.h>
 
 #define MODULE_NAME tests
@@ -128,6 +130,9 @@ int module_load(
     void* module_data,
     size_t module_data_size)
 {
+  char key[16];
+  int i;
+
   set_integer(1, module_object, "constants.one");
   set_integer(2, module_object, "constants.two");
   set_string("foo", module_object, "constants.foo");
@@ -138,6 +143,7 @@ int module_load(
   set_integer(0, module_object, "integer_array[%i]", 0);
   set_integer(1, module_object, "integer_array[%i]", 1);
   set_integer(2, module_object, "integer_array[%i]", 2);
+  set_integer(256, module_object, "integer_array[%i]", 256);
 
   set_string("foo", module_object, "string_array[%i]", 0);
   set_string("bar", module_object, "string_array[%i]", 1);
@@ -148,6 +154,12 @@ int module_load(
   set_string("foo", module_object, "string_dict[%s]", "foo");
   set_string("bar", module_object, "string_dict[\"bar\"]");
 
+  for (i = 0; i < 1000; i++)
+  {
+    snprintf(key, sizeof(key), "k%d", i);
+    set_integer(i, module_object, "integer_dict[%s]", key);
+  }
+
   set_string("foo", module_object, "struct_dict[%s].s", "foo");
   set_integer(1, module_object, "struct_dict[%s].i", "foo");
 
@@ -16,7 +16,9 @@ limitations under the License.
 
 
 #include <assert.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -307,8 +309,7 @@ int yr_object_from_external_variable(
 void yr_object_destroy(
     YR_OBJECT* object)
 {
-  YR_STRUCTURE_MEMBER* member;
-  YR_STRUCTURE_MEMBER* next_member;
+  YR_STRUCTURE_MEMBERS* members;
   YR_ARRAY_ITEMS* array_items;
   YR_DICTIONARY_ITEMS* dict_items;
 
@@ -322,15 +323,17 @@ void yr_object_destroy(
   switch(object->type)
   {
     case OBJECT_TYPE_STRUCTURE:
-      member = ((YR_OBJECT_STRUCTURE*) object)->members;
+      members = ((YR_OBJECT_STRUCTURE*) object)->members;
 
-      while (member != NULL)
+      if (members != NULL)
       {
-        next_member = member->next;
-        yr_object_destroy(member->object);
-        yr_free(member);
-        member = next_member;
+        for (i = 0; i < members->used; i++)
+          yr_object_destroy(members->objects[i]);
+
+        yr_free(members->loaders);
       }
+
+      yr_free(members);
       break;
 
     case OBJECT_TYPE_STRING:
@@ -377,6 +380,9 @@ void yr_object_destroy(
           if (dict_items->objects[i].obj != NULL)
             yr_object_destroy(dict_items->objects[i].obj);
         }
+
+        if (dict_items->buckets != NULL)
+          yr_free(dict_items->buckets);
       }
 
       yr_free(dict_items);
@@ -396,22 +402,134 @@ YR_OBJECT* yr_object_lookup_field(
     YR_OBJECT* object,
     const char* field_name)
 {
-  YR_STRUCTURE_MEMBER* member;
+  int index = yr_object_structure_member_index(object, field_name);
+
+  if (index < 0)
+    return NULL;
+
+  return ((YR_OBJECT_STRUCTURE*) object)->members->objects[index];
+}
+
+
+//
+// yr_object_structure_member_index
+//
+// Returns the slot index of the structure member with the given name, or -1
+// if the structure doesn't have such member. Slot indexes are assigned in
+// declaration order, so the index obtained for a member is valid for every
+// copy of the same structure.
+//
+
+int yr_object_structure_member_index(
+    YR_OBJECT* object,
+    const char* field_name)
+{
+  YR_STRUCTURE_MEMBERS* members;
+  int i;
 
   assert(object != NULL);
   assert(object->type == OBJECT_TYPE_STRUCTURE);
 
-  member = ((YR_OBJECT_STRUCTURE*) object)->members;
+  members = ((YR_OBJECT_STRUCTURE*) object)->members;
+
+  if (members == NULL)
+    return -1;
 
-  while (member != NULL)
+  for (i = 0; i < members->used; i++)
   {
-    if (strcmp(member->object->identifier, field_name) == 0)
-      return member->object;
+    if (strcmp(members->objects[i]->identifier, field_name) == 0)
+      return i;
+  }
+
+  return -1;
+}
+
+
+YR_OBJECT* yr_object_structure_get_member(
+    YR_OBJECT* object,
+    int index)
+{
+  YR_STRUCTURE_MEMBERS* members;
+
+  assert(object->type == OBJECT_TYPE_STRUCTURE);
+
+  members = ((YR_OBJECT_STRUCTURE*) object)->members;
+
+  assert(members != NULL);
+  assert(index >= 0 && index < members->used);
+
+  return members->objects[index];
+}
+
+
+//
+// yr_object_structure_set_loader
+//
+// Sets a function that will populate the member at the given slot index the
+// first time it's accessed with yr_object_structure_load_member. Loaders
+// are not copied by yr_object_copy.
+//
+
+int yr_object_structure_set_loader(
+    YR_OBJECT* object,
+    int index,
+    YR_OBJECT_LOADER loader)
+{
+  YR_STRUCTURE_MEMBERS* members;
+
+  assert(object->type == OBJECT_TYPE_STRUCTURE);
+
+  members = ((YR_OBJECT_STRUCTURE*) object)->members;
+
+  assert(members != NULL);
+  assert(index >= 0 && index < members->used);
+
+  if (members->loaders == NULL)
+  {
+    members->loaders = (YR_OBJECT_LOADER*) yr_malloc(
+        (members->used + members->free) * sizeof(YR_OBJECT_LOADER));
+
+    if (members->loaders == NULL)
+      return ERROR_INSUFICIENT_MEMORY;
 
-    member = member->next;
+    memset(
+        members->loaders, 0,
+        (members->used + members->free) * sizeof(YR_OBJECT_LOADER));
   }
 
-  return NULL;
+  members->loaders[index] = loader;
+
+  return ERROR_SUCCESS;
+}
+
+
+//
+// yr_object_structure_load_member
+//
+// Like yr_object_structure_get_member, but if the member has a pending
+// loader the loader is called before returning the member. Each loader is
+// called at most once.
+//
+
+int yr_object_structure_load_member(
+    YR_OBJECT* object,
+    int index,
+    YR_OBJECT** member)
+{
+  YR_STRUCTURE_MEMBERS* members;
+  YR_OBJECT_LOADER loader;
+
+  *member = yr_object_structure_get_member(object, index);
+
+  members = ((YR_OBJECT_STRUCTURE*) object)->members;
+
+  if (members->loaders == NULL || members->loaders[index] == NULL)
+    return ERROR_SUCCESS;
+
+  loader = members->loaders[index];
+  members->loaders[index] = NULL;
+
+  return loader(*member);
 }
 
 
@@ -540,6 +658,15 @@ YR_OBJECT* yr_object_lookup(
 }
 
 
+//
+// yr_object_copy
+//
+// Creates a deep copy of an object. The values of integers, floats and
+// strings are copied too, which allows copying trees where some values
+// (like module constants) were set beforehand. The items of arrays and
+// dictionaries are not copied, only their prototypes.
+//
+
 int yr_object_copy(
     YR_OBJECT* object,
     YR_OBJECT** object_copy)
@@ -547,9 +674,11 @@ int yr_object_copy(
   YR_OBJECT* copy;
   YR_OBJECT* o;
 
-  YR_STRUCTURE_MEMBER* structure_member;
+  YR_STRUCTURE_MEMBERS* members;
+  YR_STRUCTURE_MEMBERS* members_copy;
   YR_OBJECT_FUNCTION* func;
   YR_OBJECT_FUNCTION* func_copy;
+  SIZED_STRING* str;
 
   int i;
 
@@ -564,11 +693,22 @@ int yr_object_copy(
   switch(object->type)
   {
     case OBJECT_TYPE_INTEGER:
-      ((YR_OBJECT_INTEGER*) copy)->value = UNDEFINED;
+      ((YR_OBJECT_INTEGER*) copy)->value = \
+          ((YR_OBJECT_INTEGER*) object)->value;
+      break;
+
+    case OBJECT_TYPE_FLOAT:
+      ((YR_OBJECT_DOUBLE*) copy)->value = \
+          ((YR_OBJECT_DOUBLE*) object)->value;
       break;
 
     case OBJECT_TYPE_STRING:
-      ((YR_OBJECT_STRING*) copy)->value = NULL;
+      str = ((YR_OBJECT_STRING*) object)->value;
+
+      if (str != NULL)
+        FAIL_ON_ERROR_WITH_CLEANUP(
+            yr_object_set_string(str->c_string, str->length, copy, NULL),
+            yr_object_destroy(copy));
       break;
 
     case OBJECT_TYPE_REGEXP:
@@ -584,6 +724,8 @@ int yr_object_copy(
         yr_object_copy(func->return_obj, &func_copy->return_obj),
         yr_object_destroy(copy));
 
+      func_copy->return_obj->parent = copy;
+
       for (i = 0; i < MAX_OVERLOADED_FUNCTIONS; i++)
         func_copy->prototypes[i] = func->prototypes[i];
 
@@ -591,41 +733,64 @@ int yr_object_copy(
 
     case OBJECT_TYPE_STRUCTURE:
 
-      structure_member = ((YR_OBJECT_STRUCTURE*) object)->members;
+      members = ((YR_OBJECT_STRUCTURE*) object)->members;
+
+      if (members == NULL)
+        break;
+
+      // The members array is allocated with the exact size of the original
+      // one and members are copied in the same order, so slot indexes remain
+      // valid for the copy. The original structure can't have duplicated
+      // members, so there's no need to check for them here.
 
-      while (structure_member != NULL)
+      members_copy = (YR_STRUCTURE_MEMBERS*) yr_malloc(
+          sizeof(YR_STRUCTURE_MEMBERS) + members->used * sizeof(YR_OBJECT*));
+
+      if (members_copy == NULL)
       {
-        FAIL_ON_ERROR_WITH_CLEANUP(
-            yr_object_copy(structure_member->object, &o),
-            yr_object_destroy(copy));
+        yr_object_destroy(copy);
+        return ERROR_INSUFICIENT_MEMORY;
+      }
+
+      members_copy->used = 0;
+      members_copy->free = members->used;
+      members_copy->loaders = NULL;
 
+      ((YR_OBJECT_STRUCTURE*) copy)->members = members_copy;
+
+      for (i = 0; i < members->used; i++)
+      {
         FAIL_ON_ERROR_WITH_CLEANUP(
-            yr_object_structure_set_member(copy, o),
-            yr_free(o);
+            yr_object_copy(members->objects[i], &o),
             yr_object_destroy(copy));
 
-        structure_member = structure_member->next;
+        o->parent = copy;
+
+        members_copy->objects[members_copy->used++] = o;
+        members_copy->free--;
       }
 
       break;
 
     case OBJECT_TYPE_ARRAY:
 
-      yr_object_copy(
-        ((YR_OBJECT_ARRAY *) object)->prototype_item,
-        &o);
+      FAIL_ON_ERROR_WITH_CLEANUP(
+          yr_object_copy(((YR_OBJECT_ARRAY*) object)->prototype_item, &o),
+          yr_object_destroy(copy));
 
-      ((YR_OBJECT_ARRAY *)copy)->prototype_item = o;
+      o->parent = copy;
+      ((YR_OBJECT_ARRAY*) copy)->prototype_item = o;
 
       break;
 
     case OBJECT_TYPE_DICTIONARY:
 
-      yr_object_copy(
-        ((YR_OBJECT_DICTIONARY *) object)->prototype_item,
-        &o);
+      FAIL_ON_ERROR_WITH_CLEANUP(
+          yr_object_copy(((YR_OBJECT_DICTIONARY*) object)->prototype_item, &o),
+          yr_object_destroy(copy));
 
-      ((YR_OBJECT_DICTIONARY *)copy)->prototype_item = o;
+      o->parent = copy;
+      ((YR_OBJECT_DICTIONARY*) copy)->prototype_item = o;
 
       break;
 
@@ -644,7 +809,10 @@ int yr_object_structure_set_member(
     YR_OBJECT* object,
     YR_OBJECT* member)
 {
-  YR_STRUCTURE_MEMBER* sm;
+  YR_OBJECT_STRUCTURE* structure;
+  YR_STRUCTURE_MEMBERS* members;
+
+  int count;
 
   assert(object->type == OBJECT_TYPE_STRUCTURE);
 
@@ -653,16 +821,58 @@ int yr_object_structure_set_member(
   if (yr_object_lookup_field(object,  member->identifier) != NULL)
     return ERROR_DUPLICATED_STRUCTURE_MEMBER;
 
-  sm = (YR_STRUCTURE_MEMBER*) yr_malloc(sizeof(YR_STRUCTURE_MEMBER));
+  structure = (YR_OBJECT_STRUCTURE*) object;
 
-  if (sm == NULL)
-    return ERROR_INSUFICIENT_MEMORY;
+  if (structure->members == NULL)
+  {
+    count = 8;
+
+    structure->members = (YR_STRUCTURE_MEMBERS*) yr_malloc(
+        sizeof(YR_STRUCTURE_MEMBERS) + count * sizeof(YR_OBJECT*));
+
+    if (structure->members == NULL)
+      return ERROR_INSUFICIENT_MEMORY;
+
+    structure->members->used = 0;
+    structure->members->free = count;
+    structure->members->loaders = NULL;
+  }
+  else if (structure->members->free == 0)
+  {
+    count = structure->members->used * 2;
+
+    if (structure->members->loaders != NULL)
+    {
+      YR_OBJECT_LOADER* loaders = (YR_OBJECT_LOADER*) yr_realloc(
+          structure->members->loaders,
+          count * sizeof(YR_OBJECT_LOADER));
+
+      if (loaders == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+
+      memset(
+          loaders + structure->members->used, 0,
+          (count - structure->members->used) * sizeof(YR_OBJECT_LOADER));
+
+      structure->members->loaders = loaders;
+    }
+
+    members = (YR_STRUCTURE_MEMBERS*) yr_realloc(
+        structure->members,
+        sizeof(YR_STRUCTURE_MEMBERS) + count * sizeof(YR_OBJECT*));
+
+    if (members == NULL)
+      return ERROR_INSUFICIENT_MEMORY;
+
+    members->free = count - members->used;
+    structure->members = members;
+  }
 
   member->parent = object;
-  sm->object = member;
-  sm->next = ((YR_OBJECT_STRUCTURE*) object)->members;
 
-  ((YR_OBJECT_STRUCTURE*) object)->members = sm;
+  structure->members->objects[structure->members->used] = member;
+  structure->members->used++;
+  structure->members->free--;
 
   return ERROR_SUCCESS;
 }
@@ -690,8 +900,12 @@ YR_OBJECT* yr_object_array_get_item(
   {
     yr_object_copy(array->prototype_item, &result);
 
-    if (result != NULL)
-      yr_object_array_set_item(object, result, index);
+    if (result != NULL &&
+        yr_object_array_set_item(object, result, index) != ERROR_SUCCESS)
+    {
+      yr_object_destroy(result);
+      result = NULL;
+    }
   }
 
   return result;
@@ -704,18 +918,31 @@ int yr_object_array_set_item(
     int index)
 {
   YR_OBJECT_ARRAY* array;
+  YR_ARRAY_ITEMS* items;
+
+  // The number of items is stored in an int and the size of the items must
+  // fit in a size_t, indexes beyond that are rejected instead of overflowing
+  // the computations below.
 
+  size_t max_count = yr_min(
+      (size_t) INT_MAX,
+      (SIZE_MAX - sizeof(YR_ARRAY_ITEMS)) / sizeof(YR_OBJECT*));
+
+  size_t count;
   int i;
-  int count;
 
   assert(index >= 0);
   assert(object->type == OBJECT_TYPE_ARRAY);
 
+  if ((size_t) index >= max_count)
+    return ERROR_INVALID_ARGUMENT;
+
   array = ((YR_OBJECT_ARRAY*) object);
 
   if (array->items == NULL)
   {
-    count = yr_max(64, (index + 1) * 2);
+    count = yr_max(64, (size_t) index * 2 + 2);
+    count = yr_min(count, max_count);
 
     array->items = (YR_ARRAY_ITEMS*) yr_malloc(
         sizeof(YR_ARRAY_ITEMS) + count * sizeof(YR_OBJECT*));
@@ -725,22 +952,33 @@ int yr_object_array_set_item(
 
     memset(array->items->objects, 0, count * sizeof(YR_OBJECT*));
 
-    array->items->count = count;
+    array->items->count = (int) count;
   }
   else if (index >= array->items->count)
   {
-    count = array->items->count * 2;
-    array->items = (YR_ARRAY_ITEMS*) yr_realloc(
+    // Grow geometrically so that filling an array one item at a time has
+    // amortized constant cost, but make sure that the new size covers the
+    // requested index, which can be far beyond the current size.
+
+    count = array->items->count;
+
+    while (count <= (size_t) index)
+      count *= 2;
+
+    count = yr_min(count, max_count);
+
+    items = (YR_ARRAY_ITEMS*) yr_realloc(
         array->items,
         sizeof(YR_ARRAY_ITEMS) + count * sizeof(YR_OBJECT*));
 
-    if (array->items == NULL)
+    if (items == NULL)
       return ERROR_INSUFICIENT_MEMORY;
 
-    for (i = array->items->count; i < count; i++)
-      array->items->objects[i] = NULL;
+    for (i = items->count; i < (int) count; i++)
+      items->objects[i] = NULL;
 
-    array->items->count = count;
+    items->count = (int) count;
+    array->items = items;
   }
 
   item->parent = object;
@@ -750,12 +988,101 @@ int yr_object_array_set_item(
 }
 
 
+//
+// _yr_object_dict_hash
+//
+// FNV-1a hash of a dictionary key.
+//
+
+static uint32_t _yr_object_dict_hash(
+    const char* key)
+{
+  uint32_t hash = 2166136261U;
+
+  while (*key)
+  {
+    hash ^= (uint8_t) *key++;
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+
+//
+// _yr_object_dict_find_bucket
+//
+// Returns the bucket where the given key is stored, or the empty bucket where
+// it should be inserted if the key is not in the dictionary.
+//
+
+static int _yr_object_dict_find_bucket(
+    YR_DICTIONARY_ITEMS* items,
+    const char* key)
+{
+  int mask = items->buckets_count - 1;
+  int bucket = _yr_object_dict_hash(key) & mask;
+  int slot;
+
+  while ((slot = items->buckets[bucket]) != 0)
+  {
+    if (strcmp(items->objects[slot - 1].key, key) == 0)
+      break;
+
+    bucket = (bucket + 1) & mask;
+  }
+
+  return bucket;
+}
+
+
+//
+// _yr_object_dict_rehash
+//
+// Allocates a bucket array big enough for "count" slots and inserts every
+// used slot in it. The current buckets are kept if the allocation fails.
+// Slots are inserted in order, so if the same key appears more than once
+// the last slot wins, as with a linear search.
+//
+
+static int _yr_object_dict_rehash(
+    YR_DICTIONARY_ITEMS* items,
+    int count)
+{
+  int* buckets;
+  int buckets_count = 16;
+  int i;
+
+  while (buckets_count < count * 2)
+    buckets_count *= 2;
+
+  buckets = (int*) yr_malloc(buckets_count * sizeof(int));
+
+  if (buckets == NULL)
+    return ERROR_INSUFICIENT_MEMORY;
+
+  memset(buckets, 0, buckets_count * sizeof(int));
+
+  if (items->buckets != NULL)
+    yr_free(items->buckets);
+
+  items->buckets = buckets;
+  items->buckets_count = buckets_count;
+
+  for (i = 0; i < items->used; i++)
+    items->buckets[
+        _yr_object_dict_find_bucket(items, items->objects[i].key)] = i + 1;
+
+  return ERROR_SUCCESS;
+}
+
+
 YR_OBJECT* yr_object_dict_get_item(
     YR_OBJECT* object,
     int flags,
     const char* key)
 {
-  int i;
+  int slot;
 
   YR_OBJECT* result = NULL;
   YR_OBJECT_DICTIONARY* dict;
@@ -766,11 +1093,11 @@ YR_OBJECT* yr_object_dict_get_item(
 
   if (dict->items != NULL)
   {
-    for (i = 0; i < dict->items->used; i++)
-    {
-      if (strcmp(dict->items->objects[i].key, key) == 0)
-        result = dict->items->objects[i].obj;
-    }
+    slot = dict->items->buckets[
+        _yr_object_dict_find_bucket(dict->items, key)];
+
+    if (slot != 0)
+      result = dict->items->objects[slot - 1].obj;
   }
 
   if (result == NULL && flags & OBJECT_CREATE)
@@ -791,6 +1118,9 @@ int yr_object_dict_set_item(
     const char* key)
 {
   YR_OBJECT_DICTIONARY* dict;
+  YR_DICTIONARY_ITEMS* items;
+
+  char* key_copy;
 
   int i;
   int count;
@@ -813,34 +1143,55 @@ int yr_object_dict_set_item(
 
     dict->items->free = count;
     dict->items->used = 0;
+    dict->items->buckets = NULL;
+    dict->items->buckets_count = 0;
+
+    if (_yr_object_dict_rehash(dict->items, count) != ERROR_SUCCESS)
+    {
+      yr_free(dict->items);
+      dict->items = NULL;
+      return ERROR_INSUFICIENT_MEMORY;
+    }
   }
   else if (dict->items->free == 0)
   {
     count = dict->items->used * 2;
-    dict->items = (YR_DICTIONARY_ITEMS*) yr_realloc(
+    items = (YR_DICTIONARY_ITEMS*) yr_realloc(
         dict->items,
         sizeof(YR_DICTIONARY_ITEMS) + count * sizeof(dict->items->objects[0]));
 
-    if (dict->items == NULL)
+    if (items == NULL)
       return ERROR_INSUFICIENT_MEMORY;
 
-    for (i = dict->items->used; i < count; i++)
+    for (i = items->used; i < count; i++)
     {
-      dict->items->objects[i].key = NULL;
-      dict->items->objects[i].obj = NULL;
+      items->objects[i].key = NULL;
+      items->objects[i].obj = NULL;
     }
 
-    dict->items->free = dict->items->used;
+    dict->items = items;
+
+    FAIL_ON_ERROR(_yr_object_dict_rehash(items, count));
+
+    items->free = count - items->used;
   }
 
+  key_copy = yr_strdup(key);
+
+  if (key_copy == NULL)
+    return ERROR_INSUFICIENT_MEMORY;
+
   item->parent = object;
 
-  dict->items->objects[dict->items->used].key = yr_strdup(key);
+  dict->items->objects[dict->items->used].key = key_copy;
   dict->items->objects[dict->items->used].obj = item;
 
   dict->items->used++;
   dict->items->free--;
 
+  dict->items->buckets[
+      _yr_object_dict_find_bucket(dict->items, key)] = dict->items->used;
+
   return ERROR_SUCCESS;
 }
 
@@ -1053,6 +1404,7 @@ int yr_object_set_string(
     string_obj->value->flags = 0;
 
     memcpy(string_obj->value->c_string, value, len);
+    string_obj->value->c_string[len] = '\0';
   }
   else
   {
@@ -1081,7 +1433,7 @@ YR_API void yr_object_print_data(
 {
   YR_DICTIONARY_ITEMS* dict_items;
   YR_ARRAY_ITEMS* array_items;
-  YR_STRUCTURE_MEMBER* member;
+  YR_STRUCTURE_MEMBERS* members;
 
   char indent_spaces[32];
   int i;
@@ -1130,16 +1482,21 @@ YR_API void yr_object_print_data(
 
     case OBJECT_TYPE_STRUCTURE:
 
-      member = ((YR_OBJECT_STRUCTURE*) object)->members;
+      members = ((YR_OBJECT_STRUCTURE*) object)->members;
 
-      while (member != NULL)
+      for (i = 0; members != NULL && i < members->used; i++)
       {
-        if (member->object->type != OBJECT_TYPE_FUNCTION)
+        YR_OBJECT* member;
+
+        // Members populated on demand must be loaded before printing them.
+
+        yr_object_structure_load_member(object, i, &member);
+
+        if (member->type != OBJECT_TYPE_FUNCTION)
         {
           printf("\n");
-          yr_object_print_data(member->object, indent + 1, 1);
+          yr_object_print_data(member, indent + 1, 1);
         }
-        member = member->next;
       }
 
       break;
@@ -24,7 +24,7 @@ limitations under the License.
 
 int yr_process_get_memory(
     int pid,
-    YR_MEMORY_BLOCK** first_block)
+    YR_PROCESS_MEMORY* memory)
 {
   PVOID address;
   SIZE_T read;
@@ -36,7 +36,6 @@ int yr_process_get_memory(
   MEMORY_BASIC_INFORMATION mbi;
 
   YR_MEMORY_BLOCK* new_block;
-  YR_MEMORY_BLOCK* current_block = NULL;
 
   TOKEN_PRIVILEGES tokenPriv;
   LUID luidDebug;
@@ -64,8 +63,6 @@ int yr_process_get_memory(
       FALSE,
       pid);
 
-  *first_block = NULL;
-
   if (hProcess == NULL)
   {
     if (hToken != NULL)
@@ -98,27 +95,18 @@ int yr_process_get_memory(
               mbi.RegionSize,
               &read))
       {
-        new_block = (YR_MEMORY_BLOCK*) yr_malloc(sizeof(YR_MEMORY_BLOCK));
-
-        if (new_block == NULL)
+        result = yr_process_add_memory_block(
+            memory,
+            (size_t) mbi.BaseAddress,
+            mbi.RegionSize,
+            data,
+            &new_block);
+
+        if (result != ERROR_SUCCESS)
         {
           yr_free(data);
-          result = ERROR_INSUFICIENT_MEMORY;
           break;
         }
-
-        if (*first_block == NULL)
-          *first_block = new_block;
-
-        new_block->base = (size_t) mbi.BaseAddress;
-        new_block->size = mbi.RegionSize;
-        new_block->data = data;
-        new_block->next = NULL;
-
-        if (current_block != NULL)
-          current_block->next = new_block;
-
-        current_block = new_block;
       }
       else
       {
@@ -143,7 +131,7 @@ int yr_process_get_memory(
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__) || \
     defined(__OpenBSD__) || defined(__MACH__)
 #else
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #endif
 
 #include <fcntl.h>
@@ -171,7 +159,7 @@ int yr_process_get_memory(
 
 int yr_process_get_memory(
     pid_t pid,
-    YR_MEMORY_BLOCK** first_block)
+    YR_PROCESS_MEMORY* memory)
 {
   task_t task;
   kern_return_t kr;
@@ -183,11 +171,9 @@ int yr_process_get_memory(
   mach_port_t object;
 
   unsigned char* data;
+  int result;
 
   YR_MEMORY_BLOCK* new_block;
-  YR_MEMORY_BLOCK* current_block = NULL;
-
-  *first_block = NULL;
 
   if ((kr = task_for_pid(mach_task_self(), pid, &task)) != KERN_SUCCESS)
     return ERROR_COULD_NOT_ATTACH_TO_PROCESS;
@@ -220,26 +206,14 @@ int yr_process_get_memory(
               data,
               &size) == KERN_SUCCESS)
       {
-        new_block = (YR_MEMORY_BLOCK*) yr_malloc(sizeof(YR_MEMORY_BLOCK));
+        result = yr_process_add_memory_block(
+            memory, address, size, data, &new_block);
 
-        if (new_block == NULL)
+        if (result != ERROR_SUCCESS)
         {
           yr_free(data);
-          return ERROR_INSUFICIENT_MEMORY;
+          return result;
         }
-
-        if (*first_block == NULL)
-          *first_block = new_block;
-
-        new_block->base = address;
-        new_block->size = size;
-        new_block->data = data;
-        new_block->next = NULL;
-
-        if (current_block != NULL)
-          current_block->next = new_block;
-
-        current_block = new_block;
       }
       else
       {
@@ -261,120 +235,767 @@ int yr_process_get_memory(
 #else
 
 #include <errno.h>
-
-int yr_process_get_memory(
-    pid_t pid,
-    YR_MEMORY_BLOCK** first_block)
+#include <string.h>
+#include <sys/uio.h>
+
+#include <yara/libyara.h>
+#include <yara/limits.h>
+#include <yara/scan.h>
+#include <yara/strutils.h>
+#include <yara/utils.h>
+
+
+//
+// _yr_process_fetch_memory_block_data
+//
+// Returns the data for a block if it's still in the buffer where the last
+// batch was read, or reads it into the buffer otherwise. In the latter case
+// the data of the batch is lost, the blocks in the batch are read again one
+// at a time if they are needed.
+//
+
+uint8_t* _yr_process_fetch_memory_block_data(
+    YR_MEMORY_BLOCK* block)
 {
-  char buffer[256];
-  unsigned char* data = NULL;
-  size_t begin, end, length;
+  YR_PROCESS_MEMORY* memory = (YR_PROCESS_MEMORY*) block->context;
+  YR_PROCESS_BATCH_ENTRY* entry;
 
-  YR_MEMORY_BLOCK* new_block;
-  YR_MEMORY_BLOCK* current_block = NULL;
+  int i;
 
-  FILE *maps = NULL;
+  for (i = 0; i < memory->batch_count; i++)
+  {
+    entry = &memory->batch[i];
 
-  int mem = -1;
-  int result;
-  int attached = 0;
+    if (entry->block == block && entry->loaded)
+      return memory->buffer + entry->buffer_offset;
+  }
 
-  *first_block = NULL;
+  if (memory->loaded_block == block)
+    return memory->buffer;
 
-  snprintf(buffer, sizeof(buffer), "/proc/%u/maps", pid);
+  for (i = 0; i < memory->batch_count; i++)
+    memory->batch[i].loaded = FALSE;
+
+  memory->loaded_block = NULL;
+
+  if (pread(memory->mem, memory->buffer, block->size, block->base) !=
+      (ssize_t) block->size)
+    return NULL;
 
-  maps = fopen(buffer, "r");
+  memory->loaded_block = block;
 
-  if (maps == NULL)
+  return memory->buffer;
+}
+
+
+//
+// _yr_process_read_memory_block_data
+//
+// Copies part of a block's data from the buffer if the block is there, or
+// reads just that part from the process otherwise, leaving the buffer
+// untouched. Conditions reading a few bytes from blocks other than the one
+// being scanned don't cause whole blocks to be read again.
+//
+
+int _yr_process_read_memory_block_data(
+    YR_MEMORY_BLOCK* block,
+    size_t offset,
+    void* buffer,
+    size_t length)
+{
+  YR_PROCESS_MEMORY* memory = (YR_PROCESS_MEMORY*) block->context;
+  YR_PROCESS_BATCH_ENTRY* entry;
+
+  int i;
+
+  for (i = 0; i < memory->batch_count; i++)
   {
-    result = ERROR_COULD_NOT_ATTACH_TO_PROCESS;
-    goto _exit;
+    entry = &memory->batch[i];
+
+    if (entry->block == block && entry->loaded)
+    {
+      memcpy(buffer, memory->buffer + entry->buffer_offset + offset, length);
+      return TRUE;
+    }
   }
 
-  snprintf(buffer, sizeof(buffer), "/proc/%u/mem", pid);
+  if (memory->loaded_block == block)
+  {
+    memcpy(buffer, memory->buffer + offset, length);
+    return TRUE;
+  }
 
-  mem = open(buffer, O_RDONLY);
+  return pread(memory->mem, buffer, length, block->base + offset) ==
+      (ssize_t) length;
+}
+
+
+//
+// _yr_process_skip_region
+//
+// Returns TRUE if the region must not be scanned, either because it can't
+// be read or because it's excluded by the scan flags or the paths in
+// YR_CONFIG_PROCESS_EXCLUDED_PATHS.
+//
+
+int _yr_process_skip_region(
+    YR_PROCESS_MEMORY* memory,
+    YR_PROCESS_REGION* region)
+{
+  const char* prefix = memory->excluded_paths;
+  size_t prefix_length;
 
-  if (mem == -1)
+  // Regions without read permission are reserved address space, like guard
+  // pages or the gaps between the segments of a shared library.
+
+  if (!(region->flags & PROCESS_REGION_READ))
+    return TRUE;
+
+  if (region->inode == 0)
   {
-    result = ERROR_COULD_NOT_ATTACH_TO_PROCESS;
-    goto _exit;
+    if (memory->flags & SCAN_FLAGS_PROCESS_SKIP_ANONYMOUS)
+      return TRUE;
   }
-
-  if (ptrace(PTRACE_ATTACH, pid, NULL, 0) != -1)
+  else if (memory->flags & SCAN_FLAGS_PROCESS_SKIP_FILE_BACKED)
   {
-    attached = 1;
+    return TRUE;
   }
-  else
+
+  if (memory->flags & SCAN_FLAGS_PROCESS_WRITABLE_ONLY &&
+      !(region->flags & PROCESS_REGION_WRITE))
+    return TRUE;
+
+  if (memory->flags & SCAN_FLAGS_PROCESS_EXECUTABLE_ONLY &&
+      !(region->flags & PROCESS_REGION_EXECUTE))
+    return TRUE;
+
+  while (prefix != NULL && *prefix != '\0')
   {
-    result = ERROR_COULD_NOT_ATTACH_TO_PROCESS;
-    goto _exit;
+    prefix_length = strcspn(prefix, ":");
+
+    if (prefix_length > 0 &&
+        strncmp(region->path, prefix, prefix_length) == 0)
+      return TRUE;
+
+    prefix += prefix_length;
+
+    if (*prefix == ':')
+      prefix++;
   }
 
-  wait(NULL);
+  return FALSE;
+}
+
 
-  while (fgets(buffer, sizeof(buffer), maps) != NULL)
+//
+// _yr_process_next_region
+//
+// Parses lines from /proc/<pid>/maps until finding a region that must be
+// scanned, which is left in memory->region. Returns FALSE if there are no
+// more regions.
+//
+
+int _yr_process_next_region(
+    YR_PROCESS_MEMORY* memory)
+{
+  YR_PROCESS_REGION* region = &memory->region;
+
+  char line[MAX_PATH + 128];
+  char perms[5];
+
+  unsigned long long offset;
+  unsigned long long inode;
+  unsigned int major;
+  unsigned int minor;
+
+  size_t length;
+  int path_start;
+  int c;
+
+  while (fgets(line, sizeof(line), memory->maps) != NULL)
   {
-    sscanf(buffer, "%zx-%zx", &begin, &end);
+    length = strlen(line);
+
+    // The rest of a line that doesn't fit in the buffer is discarded, only
+    // the path can be that long.
+
+    if (length > 0 && line[length - 1] == '\n')
+      line[length - 1] = '\0';
+    else
+      while ((c = fgetc(memory->maps)) != EOF && c != '\n') {}
+
+    path_start = 0;
+
+    if (sscanf(line, "%zx-%zx %4s %llx %x:%x %llu %n",
+               &region->begin, &region->end, perms, &offset,
+               &major, &minor, &inode, &path_start) < 7 || path_start == 0)
+      continue;
+
+    region->offset = offset;
+    region->device = ((uint64_t) major << 32) | minor;
+    region->inode = inode;
+    region->flags = 0;
+
+    if (perms[0] == 'r')
+      region->flags |= PROCESS_REGION_READ;
+
+    if (perms[1] == 'w')
+      region->flags |= PROCESS_REGION_WRITE;
+
+    if (perms[2] == 'x')
+      region->flags |= PROCESS_REGION_EXECUTE;
+
+    if (perms[3] == 's')
+      region->flags |= PROCESS_REGION_SHARED;
+
+    strlcpy(region->path, line + path_start, sizeof(region->path));
+
+    if (!_yr_process_skip_region(memory, region))
+    {
+      memory->region_cursor = region->begin;
+      return TRUE;
+    }
+  }
+
+  memory->region_cursor = region->end;
+
+  return FALSE;
+}
+
+
+//
+// _yr_process_read_batch
+//
+// Reads the data for all the blocks in the batch. With process_vm_readv the
+// whole batch is read with a single system call, unless some block can't be
+// read, in which case the call is repeated for the remaining blocks. If
+// process_vm_readv is not available or not allowed, each block is read with
+// pread from /proc/<pid>/mem.
+//
+
+void _yr_process_read_batch(
+    YR_PROCESS_MEMORY* memory)
+{
+  YR_PROCESS_BATCH_ENTRY* entry;
 
-    length = end - begin;
+  ssize_t read;
+  int first = 0;
 
-    data = yr_malloc(length);
+  #ifdef HAVE_PROCESS_VM_READV
 
-    if (data == NULL)
+  struct iovec local[PROCESS_MEMORY_BATCH_SIZE];
+  struct iovec remote[PROCESS_MEMORY_BATCH_SIZE];
+
+  int count;
+  int i;
+
+  while (!memory->use_pread && first < memory->batch_count)
+  {
+    count = memory->batch_count - first;
+
+    for (i = 0; i < count; i++)
     {
-      result = ERROR_INSUFICIENT_MEMORY;
-      goto _exit;
+      entry = &memory->batch[first + i];
+
+      local[i].iov_base = memory->buffer + entry->buffer_offset;
+      local[i].iov_len = entry->length;
+      remote[i].iov_base = (void*) entry->begin;
+      remote[i].iov_len = entry->length;
     }
 
-    if (pread(mem, data, length, begin) != -1)
+    read = process_vm_readv(memory->pid, local, count, remote, count, 0);
+
+    if (read == -1)
     {
-      new_block = (YR_MEMORY_BLOCK*) yr_malloc(sizeof(YR_MEMORY_BLOCK));
+      // EFAULT means that the first block can't be read, any other error
+      // means that process_vm_readv can't be used at all.
 
-      if (new_block == NULL)
+      if (errno != EFAULT)
       {
-        result = ERROR_INSUFICIENT_MEMORY;
-        goto _exit;
+        memory->use_pread = TRUE;
+        break;
       }
 
-      if (*first_block == NULL)
-        *first_block = new_block;
+      read = 0;
+    }
 
-      new_block->base = begin;
-      new_block->size = length;
-      new_block->data = data;
-      new_block->next = NULL;
+    while (first < memory->batch_count &&
+           (size_t) read >= memory->batch[first].length)
+    {
+      entry = &memory->batch[first++];
+      entry->read = entry->length;
+      entry->loaded = TRUE;
+      read -= entry->length;
+    }
 
-      if (current_block != NULL)
-        current_block->next = new_block;
+    // Reading stops at the first block that can't be read completely, that
+    // block is truncated or skipped and the rest of the batch is read again.
 
-      current_block = new_block;
+    if (first < memory->batch_count)
+    {
+      entry = &memory->batch[first++];
+      entry->read = (size_t) read;
+      entry->loaded = (read > 0);
     }
+  }
+
+  #endif
+
+  for (; first < memory->batch_count; first++)
+  {
+    entry = &memory->batch[first];
+
+    read = pread(
+        memory->mem,
+        memory->buffer + entry->buffer_offset,
+        entry->length,
+        entry->begin);
+
+    if (read > 0)
+    {
+      entry->read = (size_t) read;
+      entry->loaded = TRUE;
+    }
+  }
+}
+
+
+//
+// _yr_process_read_next_batch
+//
+// Splits the next regions in blocks and reads a batch of them into the
+// buffer. The batch is empty if there are no more regions.
+//
+
+int _yr_process_read_next_batch(
+    YR_PROCESS_MEMORY* memory)
+{
+  YR_PROCESS_BATCH_ENTRY* entry;
+  uint8_t* new_buffer;
+
+  size_t total = 0;
+  size_t length;
+
+  int i;
+
+  memory->batch_count = 0;
+  memory->batch_next = 0;
+  memory->loaded_block = NULL;
+
+  while (memory->batch_count < PROCESS_MEMORY_BATCH_SIZE)
+  {
+    if (memory->region_cursor >= memory->region.end &&
+        !_yr_process_next_region(memory))
+      break;
+
+    length = yr_min(
+        memory->region.end - memory->region_cursor,
+        (size_t) PROCESS_MEMORY_CHUNK_SIZE);
+
+    if (memory->batch_count > 0 && total + length > PROCESS_MEMORY_CHUNK_SIZE)
+      break;
+
+    entry = &memory->batch[memory->batch_count++];
+    entry->begin = memory->region_cursor;
+    entry->length = length;
+    entry->read = 0;
+    entry->loaded = FALSE;
+    entry->buffer_offset = total;
+    entry->block = NULL;
+
+    memcpy(&entry->region, &memory->region, sizeof(YR_PROCESS_REGION));
+
+    entry->maps_offset = ftell(memory->maps);
+
+    total += length;
+
+    if (entry->begin + length < memory->region.end)
+      memory->region_cursor = entry->begin + length -
+          PROCESS_MEMORY_CHUNK_OVERLAP;
     else
+      memory->region_cursor = memory->region.end;
+  }
+
+  if (total > memory->buffer_size)
+  {
+    new_buffer = (uint8_t*) yr_realloc(memory->buffer, total);
+
+    if (new_buffer == NULL)
     {
-      yr_free(data);
-      data = NULL;
+      memory->batch_count = 0;
+      return ERROR_INSUFICIENT_MEMORY;
     }
+
+    memory->buffer = new_buffer;
+    memory->buffer_size = total;
   }
 
-  result = ERROR_SUCCESS;
+  _yr_process_read_batch(memory);
 
-_exit:
+  // When a block is read partially the rest of its chunk isn't skipped, the
+  // batch ends with that block and the next one starts at the first byte
+  // that couldn't be read, going back to its region in the maps file.
 
-  if (attached)
-    ptrace(PTRACE_DETACH, pid, NULL, 0);
+  for (i = 0; i < memory->batch_count; i++)
+  {
+    entry = &memory->batch[i];
 
-  if (mem != -1)
-    close(mem);
+    if (entry->read > 0 && entry->read < entry->length &&
+        fseek(memory->maps, entry->maps_offset, SEEK_SET) == 0)
+    {
+      memcpy(&memory->region, &entry->region, sizeof(YR_PROCESS_REGION));
+      memory->region_cursor = entry->begin + entry->read;
+      memory->batch_count = i + 1;
+      break;
+    }
+  }
 
-  if (maps != NULL)
-    fclose(maps);
+  return ERROR_SUCCESS;
+}
 
-  if (data != NULL)
-    yr_free(data);
 
-  return result;
+int yr_process_open_memory(
+    int pid,
+    int flags,
+    YR_PROCESS_MEMORY** memory)
+{
+  YR_PROCESS_MEMORY* new_memory;
+  char* excluded_paths;
+  char buffer[256];
+
+  new_memory = (YR_PROCESS_MEMORY*) yr_malloc(sizeof(YR_PROCESS_MEMORY));
+
+  if (new_memory == NULL)
+    return ERROR_INSUFICIENT_MEMORY;
+
+  memset(new_memory, 0, sizeof(YR_PROCESS_MEMORY));
+
+  new_memory->pid = pid;
+  new_memory->flags = flags;
+  new_memory->mem = -1;
+
+  yr_get_configuration(
+      YR_CONFIG_PROCESS_EXCLUDED_PATHS,
+      (void*) &excluded_paths);
+
+  *memory = new_memory;
+
+  if (excluded_paths != NULL)
+  {
+    new_memory->excluded_paths = yr_strdup(excluded_paths);
+
+    if (new_memory->excluded_paths == NULL)
+      return ERROR_INSUFICIENT_MEMORY;
+  }
+
+  snprintf(buffer, sizeof(buffer), "/proc/%u/maps", pid);
+
+  new_memory->maps = fopen(buffer, "r");
+
+  if (new_memory->maps == NULL)
+    return ERROR_COULD_NOT_ATTACH_TO_PROCESS;
+
+  snprintf(buffer, sizeof(buffer), "/proc/%u/mem", pid);
+
+  new_memory->mem = open(buffer, O_RDONLY);
+
+  if (new_memory->mem == -1)
+    return ERROR_COULD_NOT_ATTACH_TO_PROCESS;
+
+  if (ptrace(PTRACE_ATTACH, pid, NULL, 0) == -1)
+    return ERROR_COULD_NOT_ATTACH_TO_PROCESS;
+
+  new_memory->attached = 1;
+
+  waitpid(pid, NULL, 0);
+
+  return ERROR_SUCCESS;
+}
+
+
+//
+// _yr_process_find_next_block
+//
+// Finds the next block of the process memory and adds it to memory->blocks,
+// *block is NULL if there are no more blocks. Each memory region is a block,
+// except those larger than PROCESS_MEMORY_CHUNK_SIZE, which are split in
+// chunks overlapping by PROCESS_MEMORY_CHUNK_OVERLAP bytes. Blocks are read
+// in batches into a buffer shared by all blocks, use
+// yr_memory_block_fetch_data for getting their data. After the call
+// memory->current_region describes the region where the block lives.
+//
+
+int _yr_process_find_next_block(
+    YR_PROCESS_MEMORY* memory,
+    YR_MEMORY_BLOCK** block)
+{
+  YR_PROCESS_BATCH_ENTRY* entry;
+  YR_MEMORY_BLOCK* new_block;
+
+  *block = NULL;
+
+  while (TRUE)
+  {
+    if (memory->batch_next == memory->batch_count)
+    {
+      FAIL_ON_ERROR(_yr_process_read_next_batch(memory));
+
+      if (memory->batch_count == 0)
+      {
+        memory->complete = TRUE;
+        return ERROR_SUCCESS;
+      }
+    }
+
+    entry = &memory->batch[memory->batch_next++];
+
+    // Regions that can't be read, like [vvar], are skipped altogether.
+
+    if (entry->read == 0)
+      continue;
+
+    FAIL_ON_ERROR(yr_process_add_memory_block(
+        memory,
+        entry->begin,
+        entry->read,
+        NULL,
+        &new_block));
+
+    new_block->fetch_data = _yr_process_fetch_memory_block_data;
+    new_block->read_data = _yr_process_read_memory_block_data;
+
+    memory->current_region = &entry->region;
+
+    entry->block = new_block;
+
+    *block = new_block;
+
+    return ERROR_SUCCESS;
+  }
+}
+
+
+void _yr_process_close_memory(
+    YR_PROCESS_MEMORY* memory)
+{
+  if (memory->attached)
+    ptrace(PTRACE_DETACH, memory->pid, NULL, 0);
+
+  if (memory->mem != -1)
+    close(memory->mem);
+
+  if (memory->maps != NULL)
+    fclose(memory->maps);
+
+  if (memory->buffer != NULL)
+    yr_free(memory->buffer);
+
+  if (memory->excluded_paths != NULL)
+    yr_free(memory->excluded_paths);
 }
 
 #endif
 #endif
+
+
+#if defined(_WIN32) || defined(__CYGWIN__) || defined(__MACH__)
+
+//
+// On these platforms the whole process memory is read beforehand by
+// yr_process_get_memory, so there are no more blocks to find afterwards.
+//
+
+int yr_process_open_memory(
+    int pid,
+    int flags,
+    YR_PROCESS_MEMORY** memory)
+{
+  YR_PROCESS_MEMORY* new_memory;
+
+  new_memory = (YR_PROCESS_MEMORY*) yr_malloc(sizeof(YR_PROCESS_MEMORY));
+
+  if (new_memory == NULL)
+    return ERROR_INSUFICIENT_MEMORY;
+
+  memset(new_memory, 0, sizeof(YR_PROCESS_MEMORY));
+
+  new_memory->pid = pid;
+  new_memory->flags = flags;
+
+  *memory = new_memory;
+
+  FAIL_ON_ERROR(yr_process_get_memory(pid, new_memory));
+
+  new_memory->complete = TRUE;
+
+  return ERROR_SUCCESS;
+}
+
+
+int _yr_process_find_next_block(
+    YR_PROCESS_MEMORY* memory,
+    YR_MEMORY_BLOCK** block)
+{
+  *block = NULL;
+
+  return ERROR_SUCCESS;
+}
+
+
+void _yr_process_close_memory(
+    YR_PROCESS_MEMORY* memory)
+{
+}
+
+#endif
+
+
+//
+// yr_process_add_memory_block
+//
+// Creates a new block and appends it to memory->blocks. The data, if not
+// NULL, is owned by the block from now on.
+//
+
+int yr_process_add_memory_block(
+    YR_PROCESS_MEMORY* memory,
+    size_t base,
+    size_t size,
+    uint8_t* data,
+    YR_MEMORY_BLOCK** block)
+{
+  YR_MEMORY_BLOCK** new_blocks;
+  YR_MEMORY_BLOCK* new_block;
+
+  int new_size;
+
+  if (memory->blocks_count == memory->blocks_size)
+  {
+    new_size = memory->blocks_size == 0 ? 64 : memory->blocks_size * 2;
+    new_blocks = (YR_MEMORY_BLOCK**) yr_realloc(
+        memory->blocks, new_size * sizeof(YR_MEMORY_BLOCK*));
+
+    if (new_blocks == NULL)
+      return ERROR_INSUFICIENT_MEMORY;
+
+    memory->blocks = new_blocks;
+    memory->blocks_size = new_size;
+  }
+
+  new_block = (YR_MEMORY_BLOCK*) yr_malloc(sizeof(YR_MEMORY_BLOCK));
+
+  if (new_block == NULL)
+    return ERROR_INSUFICIENT_MEMORY;
+
+  new_block->base = base;
+  new_block->size = size;
+  new_block->data = data;
+  new_block->fetch_data = NULL;
+  new_block->read_data = NULL;
+  new_block->context = memory;
+
+  memory->blocks[memory->blocks_count++] = new_block;
+
+  *block = new_block;
+
+  return ERROR_SUCCESS;
+}
+
+
+//
+// yr_process_next_memory_block
+//
+// Returns the next block of the process memory in *block, or NULL if there
+// are no more blocks. Blocks already found are returned again after the
+// iterator is rewound, in which case memory->current_region is NULL. New
+// blocks are found on demand once those are exhausted.
+//
+
+int yr_process_next_memory_block(
+    YR_PROCESS_MEMORY* memory,
+    YR_MEMORY_BLOCK** block)
+{
+  memory->current_region = NULL;
+
+  if (memory->next_block < memory->blocks_count)
+  {
+    *block = memory->blocks[memory->next_block++];
+    return ERROR_SUCCESS;
+  }
+
+  *block = NULL;
+
+  if (memory->complete)
+    return ERROR_SUCCESS;
+
+  FAIL_ON_ERROR(_yr_process_find_next_block(memory, block));
+
+  if (*block != NULL)
+    memory->next_block++;
+
+  return ERROR_SUCCESS;
+}
+
+
+YR_MEMORY_BLOCK* _yr_process_iterator_next(
+    YR_MEMORY_BLOCK_ITERATOR* iterator)
+{
+  YR_PROCESS_MEMORY* memory = (YR_PROCESS_MEMORY*) iterator->context;
+  YR_MEMORY_BLOCK* block;
+
+  iterator->last_error = yr_process_next_memory_block(memory, &block);
+
+  return block;
+}
+
+
+YR_MEMORY_BLOCK* _yr_process_iterator_first(
+    YR_MEMORY_BLOCK_ITERATOR* iterator)
+{
+  YR_PROCESS_MEMORY* memory = (YR_PROCESS_MEMORY*) iterator->context;
+
+  memory->next_block = 0;
+
+  return _yr_process_iterator_next(iterator);
+}
+
+
+//
+// yr_process_get_iterator
+//
+// Returns an iterator over the blocks of the process memory, valid until the
+// memory is closed.
+//
+
+YR_MEMORY_BLOCK_ITERATOR* yr_process_get_iterator(
+    YR_PROCESS_MEMORY* memory)
+{
+  memory->iterator.context = memory;
+  memory->iterator.first = _yr_process_iterator_first;
+  memory->iterator.next = _yr_process_iterator_next;
+  memory->iterator.last_error = ERROR_SUCCESS;
+
+  return &memory->iterator;
+}
+
+
+void yr_process_close_memory(
+    YR_PROCESS_MEMORY* memory)
+{
+  int i;
+
+  _yr_process_close_memory(memory);
+
+  for (i = 0; i < memory->blocks_count; i++)
+  {
+    if (memory->blocks[i]->data != NULL)
+      yr_free(memory->blocks[i]->data);
+
+    yr_free(memory->blocks[i]);
+  }
+
+  if (memory->blocks != NULL)
+    yr_free(memory->blocks);
+
+  yr_free(memory);
+}
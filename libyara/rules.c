@@ -19,6 +19,11 @@ limitations under the License.
 #include <time.h>
 #include <ctype.h>
 
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include <yara/ahocorasick.h>
 #include <yara/arena.h>
 #include <yara/error.h>
@@ -34,6 +39,7 @@ limitations under the License.
 #include <yara/globals.h>
 #include <yara/libyara.h>
 #include <yara/scan.h>
+#include <yara/scan_cache.h>
 #include <yara/modules.h>
 
 #include "exception.h"
@@ -216,6 +222,7 @@ void yr_rules_print_profiling_info(
 int _yr_rules_scan_mem_block(
     YR_RULES* rules,
     YR_MEMORY_BLOCK* block,
+    uint8_t* data,
     YR_SCAN_CONTEXT* context,
     int timeout,
     time_t start_time)
@@ -247,7 +254,7 @@ int _yr_rules_scan_mem_block(
         FAIL_ON_ERROR(yr_scan_verify_match(
             context,
             match,
-            block->data,
+            data,
             block->size,
             block->base,
             i - match->backtrack));
@@ -256,7 +263,7 @@ int _yr_rules_scan_mem_block(
       match = match->next;
     }
 
-    index = block->data[i++] + 1;
+    index = data[i++] + 1;
     transition = transition_table[state + index];
 
     while (YR_AC_INVALID_TRANSITION(transition, index))
@@ -287,7 +294,7 @@ int _yr_rules_scan_mem_block(
       FAIL_ON_ERROR(yr_scan_verify_match(
           context,
           match,
-          block->data,
+          data,
           block->size,
           block->base,
           i - match->backtrack));
@@ -302,28 +309,40 @@ int _yr_rules_scan_mem_block(
 }
 
 
+//
+// _yr_rules_scan_begin
+//
+// Initializes a scan context, reserving a thread index in the rules and
+// creating the objects for external variables. The context must be passed
+// to _yr_rules_scan_end afterwards, even if this function fails.
+//
 
-
-YR_API int yr_rules_scan_mem_blocks(
+int _yr_rules_scan_begin(
     YR_RULES* rules,
-    YR_MEMORY_BLOCK* block,
+    YR_SCAN_CONTEXT* context,
+    YR_MEMORY_BLOCK_ITERATOR* iterator,
     int flags,
     YR_CALLBACK_FUNC callback,
-    void* user_data,
-    int timeout)
+    void* user_data)
 {
   YR_EXTERNAL_VARIABLE* external;
-  YR_RULE* rule;
-  YR_SCAN_CONTEXT context;
 
-  time_t start_time;
   tidx_mask_t bit = 1;
 
   int tidx = 0;
   int result = ERROR_SUCCESS;
 
-  if (block == NULL)
-    return ERROR_SUCCESS;
+  context->tidx = -1;
+  context->flags = flags;
+  context->copy_match_data = FALSE;
+  context->callback = callback;
+  context->user_data = user_data;
+  context->file_size = 0;
+  context->iterator = iterator;
+  context->entry_point = UNDEFINED;
+  context->objects_table = NULL;
+  context->matches_arena = NULL;
+  context->matching_strings_arena = NULL;
 
   yr_mutex_lock(&rules->mutex);
 
@@ -343,33 +362,13 @@ YR_API int yr_rules_scan_mem_blocks(
   if (result != ERROR_SUCCESS)
     return result;
 
-  context.tidx = tidx;
-  context.flags = flags;
-  context.callback = callback;
-  context.user_data = user_data;
-  context.file_size = block->size;
-  context.mem_block = block;
-  context.entry_point = UNDEFINED;
-  context.objects_table = NULL;
-  context.matches_arena = NULL;
-  context.matching_strings_arena = NULL;
+  context->tidx = tidx;
 
   yr_set_tidx(tidx);
 
-  result = yr_arena_create(1024, 0, &context.matches_arena);
-
-  if (result != ERROR_SUCCESS)
-    goto _exit;
-
-  result = yr_arena_create(8, 0, &context.matching_strings_arena);
-
-  if (result != ERROR_SUCCESS)
-    goto _exit;
-
-  result = yr_hash_table_create(64, &context.objects_table);
-
-  if (result != ERROR_SUCCESS)
-    goto _exit;
+  FAIL_ON_ERROR(yr_arena_create(1024, 0, &context->matches_arena));
+  FAIL_ON_ERROR(yr_arena_create(8, 0, &context->matching_strings_arena));
+  FAIL_ON_ERROR(yr_hash_table_create(64, &context->objects_table));
 
   external = rules->externals_list_head;
 
@@ -377,63 +376,130 @@ YR_API int yr_rules_scan_mem_blocks(
   {
     YR_OBJECT* object;
 
-    result = yr_object_from_external_variable(
+    FAIL_ON_ERROR(yr_object_from_external_variable(
         external,
-        &object);
+        &object));
 
-    if (result == ERROR_SUCCESS)
-      result = yr_hash_table_add(
-          context.objects_table,
-          external->identifier,
-          NULL,
-          (void*) object);
-
-    if (result != ERROR_SUCCESS)
-      goto _exit;
+    FAIL_ON_ERROR_WITH_CLEANUP(
+        yr_hash_table_add(
+            context->objects_table,
+            external->identifier,
+            NULL,
+            (void*) object),
+        yr_object_destroy(object));
 
     external++;
   }
 
-  start_time = time(NULL);
+  return ERROR_SUCCESS;
+}
 
-  while (block != NULL)
-  {
-    if (context.entry_point == UNDEFINED)
-    {
-      YR_TRYCATCH({
-          if (flags & SCAN_FLAGS_PROCESS_MEMORY)
-            context.entry_point = yr_get_entry_point_address(
-                block->data,
-                block->size,
-                block->base);
-          else
-            context.entry_point = yr_get_entry_point_offset(
-                block->data,
-                block->size);
-        },{});
-    }
 
-    YR_TRYCATCH({
-        result = _yr_rules_scan_mem_block(
-            rules,
-            block,
-            &context,
-            timeout,
-            start_time);
-      },{
-        result = ERROR_COULD_NOT_MAP_FILE;
-      });
+//
+// _yr_rules_setup_block
+//
+// Prepares the context for searching a block, and computes the entry point
+// from the block's data if not done yet. Match data is copied only for
+// blocks read on demand, the data of other blocks must outlive the scan.
+//
 
-    if (result != ERROR_SUCCESS)
-      goto _exit;
+void _yr_rules_setup_block(
+    YR_SCAN_CONTEXT* context,
+    YR_MEMORY_BLOCK* block,
+    uint8_t* data)
+{
+  context->copy_match_data = (block->data == NULL);
 
-    block = block->next;
-  }
+  if (data == NULL || context->entry_point != UNDEFINED)
+    return;
+
+  YR_TRYCATCH({
+      if (context->flags & SCAN_FLAGS_PROCESS_MEMORY)
+        context->entry_point = yr_get_entry_point_address(
+            data,
+            block->size,
+            block->base);
+      else
+        context->entry_point = yr_get_entry_point_offset(
+            data,
+            block->size);
+    },{});
+}
+
+
+int _yr_rules_search_block(
+    YR_RULES* rules,
+    YR_SCAN_CONTEXT* context,
+    YR_MEMORY_BLOCK* block,
+    uint8_t* data,
+    int timeout,
+    time_t start_time)
+{
+  int result = ERROR_SUCCESS;
+
+  YR_TRYCATCH({
+      result = _yr_rules_scan_mem_block(
+          rules,
+          block,
+          data,
+          context,
+          timeout,
+          start_time);
+    },{
+      result = ERROR_COULD_NOT_MAP_FILE;
+    });
+
+  return result;
+}
+
+
+//
+// _yr_rules_scan_block
+//
+// Searches for strings in a memory block, see _yr_rules_setup_block.
+//
+
+int _yr_rules_scan_block(
+    YR_RULES* rules,
+    YR_SCAN_CONTEXT* context,
+    YR_MEMORY_BLOCK* block,
+    int timeout,
+    time_t start_time)
+{
+  uint8_t* data = yr_memory_block_fetch_data(block);
+
+  _yr_rules_setup_block(context, block, data);
+
+  if (data == NULL)
+    return ERROR_SUCCESS;
+
+  return _yr_rules_search_block(
+      rules, context, block, data, timeout, start_time);
+}
+
+
+//
+// _yr_rules_scan_finish
+//
+// Evaluates the rules' conditions once the strings have been searched in all
+// the blocks, and invokes the callback for each rule.
+//
+
+int _yr_rules_scan_finish(
+    YR_RULES* rules,
+    YR_SCAN_CONTEXT* context,
+    int timeout,
+    time_t start_time)
+{
+  YR_RULE* rule;
+
+  int tidx = context->tidx;
+  int result = ERROR_SUCCESS;
 
   YR_TRYCATCH({
       result = yr_execute_code(
           rules,
-          &context,
+          context,
           timeout,
           start_time);
     },{
@@ -441,7 +507,7 @@ YR_API int yr_rules_scan_mem_blocks(
     });
 
   if (result != ERROR_SUCCESS)
-    goto _exit;
+    return result;
 
   yr_rules_foreach(rules, rule)
   {
@@ -459,48 +525,125 @@ YR_API int yr_rules_scan_mem_blocks(
 
     if (!RULE_IS_PRIVATE(rule))
     {
-      switch (callback(message, rule, user_data))
+      switch (context->callback(message, rule, context->user_data))
       {
         case CALLBACK_ABORT:
-          result = ERROR_SUCCESS;
-          goto _exit;
+          return ERROR_SUCCESS;
 
         case CALLBACK_ERROR:
-          result = ERROR_CALLBACK_ERROR;
-          goto _exit;
+          return ERROR_CALLBACK_ERROR;
       }
     }
   }
 
-  callback(CALLBACK_MSG_SCAN_FINISHED, NULL, user_data);
+  context->callback(CALLBACK_MSG_SCAN_FINISHED, NULL, context->user_data);
 
-_exit:
+  return ERROR_SUCCESS;
+}
 
-  _yr_rules_clean_matches(rules, &context);
 
-  yr_modules_unload_all(&context);
+void _yr_rules_scan_end(
+    YR_RULES* rules,
+    YR_SCAN_CONTEXT* context)
+{
+  if (context->tidx == -1)
+    return;
 
-  if (context.matches_arena != NULL)
-    yr_arena_destroy(context.matches_arena);
+  if (context->matching_strings_arena != NULL)
+    _yr_rules_clean_matches(rules, context);
 
-  if (context.matching_strings_arena != NULL)
-    yr_arena_destroy(context.matching_strings_arena);
+  yr_modules_unload_all(context);
 
-  if (context.objects_table != NULL)
+  if (context->matches_arena != NULL)
+    yr_arena_destroy(context->matches_arena);
+
+  if (context->matching_strings_arena != NULL)
+    yr_arena_destroy(context->matching_strings_arena);
+
+  if (context->objects_table != NULL)
     yr_hash_table_destroy(
-        context.objects_table,
+        context->objects_table,
         (YR_HASH_TABLE_FREE_VALUE_FUNC) yr_object_destroy);
 
   yr_mutex_lock(&rules->mutex);
-  rules->tidx_mask &= ~(1 << tidx);
+  rules->tidx_mask &= ~(1 << context->tidx);
   yr_mutex_unlock(&rules->mutex);
 
   yr_set_tidx(-1);
+}
+
+
+//
+// yr_rules_scan_mem_blocks
+//
+// Scans the blocks provided by the iterator. The size of the first block is
+// used as the file size.
+//
+
+YR_API int yr_rules_scan_mem_blocks(
+    YR_RULES* rules,
+    YR_MEMORY_BLOCK_ITERATOR* iterator,
+    int flags,
+    YR_CALLBACK_FUNC callback,
+    void* user_data,
+    int timeout)
+{
+  YR_SCAN_CONTEXT context;
+  YR_MEMORY_BLOCK* block;
+
+  time_t start_time;
+
+  int result;
+
+  iterator->last_error = ERROR_SUCCESS;
+
+  block = iterator->first(iterator);
+
+  if (block == NULL)
+    return iterator->last_error;
+
+  result = _yr_rules_scan_begin(
+      rules, &context, iterator, flags, callback, user_data);
+
+  context.file_size = block->size;
+
+  start_time = time(NULL);
+
+  while (block != NULL && result == ERROR_SUCCESS)
+  {
+    result = _yr_rules_scan_block(
+        rules, &context, block, timeout, start_time);
+
+    if (result == ERROR_SUCCESS)
+    {
+      block = iterator->next(iterator);
+      result = iterator->last_error;
+    }
+  }
+
+  if (result == ERROR_SUCCESS)
+    result = _yr_rules_scan_finish(rules, &context, timeout, start_time);
+
+  _yr_rules_scan_end(rules, &context);
 
   return result;
 }
 
 
+YR_MEMORY_BLOCK* _yr_get_first_block(
+    YR_MEMORY_BLOCK_ITERATOR* iterator)
+{
+  return (YR_MEMORY_BLOCK*) iterator->context;
+}
+
+
+YR_MEMORY_BLOCK* _yr_get_next_block(
+    YR_MEMORY_BLOCK_ITERATOR* iterator)
+{
+  return NULL;
+}
+
+
 YR_API int yr_rules_scan_mem(
     YR_RULES* rules,
     uint8_t* buffer,
@@ -511,15 +654,23 @@ YR_API int yr_rules_scan_mem(
     int timeout)
 {
   YR_MEMORY_BLOCK block;
+  YR_MEMORY_BLOCK_ITERATOR iterator;
 
   block.data = buffer;
   block.size = buffer_size;
   block.base = 0;
-  block.next = NULL;
+  block.fetch_data = NULL;
+  block.read_data = NULL;
+  block.context = NULL;
+
+  iterator.context = &block;
+  iterator.first = _yr_get_first_block;
+  iterator.next = _yr_get_next_block;
+  iterator.last_error = ERROR_SUCCESS;
 
   return yr_rules_scan_mem_blocks(
       rules,
-      &block,
+      &iterator,
       flags,
       callback,
       user_data,
@@ -585,6 +736,699 @@ YR_API int yr_rules_scan_fd(
   return result;
 }
 
+
+//
+// State of a scan whose results are going to be stored in a scan cache. The
+// matching rules are recorded while they are passed to the user's callback.
+//
+
+typedef struct _YR_CACHED_SCAN
+{
+  YR_RULES* rules;
+  YR_CALLBACK_FUNC callback;
+  void* user_data;
+
+  YR_SCAN_CACHE_ENTRY entry;
+
+  // Set once all the rules were reported, which doesn't happen if the
+  // callback aborts the scan.
+  int complete;
+
+} YR_CACHED_SCAN;
+
+
+int _yr_rules_cached_scan_callback(
+    int message,
+    void* message_data,
+    void* user_data)
+{
+  YR_CACHED_SCAN* scan = (YR_CACHED_SCAN*) user_data;
+  YR_SCAN_CACHE_ENTRY* entry = &scan->entry;
+
+  if (message == CALLBACK_MSG_RULE_MATCHING)
+  {
+    if (entry->matches_count < YR_SCAN_CACHE_MAX_MATCHES)
+      entry->matches[entry->matches_count] = (uint32_t)
+          ((YR_RULE*) message_data - scan->rules->rules_list_head);
+
+    // The count keeps growing past the maximum, entries with a larger count
+    // are not stored.
+    entry->matches_count++;
+  }
+  else if (message == CALLBACK_MSG_SCAN_FINISHED)
+  {
+    scan->complete = TRUE;
+  }
+
+  return scan->callback(message, message_data, scan->user_data);
+}
+
+
+//
+// _yr_rules_replay_scan
+//
+// Invokes the callback as a scan would do, but taking the matching rules
+// from a cache entry. Strings have no matches in the rules reported.
+//
+
+int _yr_rules_replay_scan(
+    YR_RULES* rules,
+    YR_SCAN_CACHE_ENTRY* entry,
+    int flags,
+    YR_CALLBACK_FUNC callback,
+    void* user_data)
+{
+  YR_SCAN_CONTEXT context;
+  YR_RULE* rule;
+
+  int result = _yr_rules_scan_begin(
+      rules, &context, NULL, flags, callback, user_data);
+
+  if (result != ERROR_SUCCESS)
+    goto _exit;
+
+  yr_rules_foreach(rules, rule)
+  {
+    uint32_t index = (uint32_t) (rule - rules->rules_list_head);
+    int message = CALLBACK_MSG_RULE_NOT_MATCHING;
+
+    if (RULE_IS_PRIVATE(rule))
+      continue;
+
+    for (uint32_t i = 0; i < entry->matches_count; i++)
+    {
+      if (entry->matches[i] == index)
+        message = CALLBACK_MSG_RULE_MATCHING;
+    }
+
+    switch (callback(message, rule, user_data))
+    {
+      case CALLBACK_ABORT:
+        goto _exit;
+
+      case CALLBACK_ERROR:
+        result = ERROR_CALLBACK_ERROR;
+        goto _exit;
+    }
+  }
+
+  callback(CALLBACK_MSG_SCAN_FINISHED, NULL, user_data);
+
+_exit:
+
+  _yr_rules_scan_end(rules, &context);
+
+  return result;
+}
+
+
+//
+// yr_rules_scan_fd_cached
+//
+// Like yr_rules_scan_fd, but the file is not scanned if its results are
+// found in the cache. The callback receives the cached results instead,
+// without string matches. Otherwise the file is scanned and its results are
+// stored in the cache. The cache can be NULL, then this function is
+// equivalent to yr_rules_scan_fd.
+//
+
+YR_API int yr_rules_scan_fd_cached(
+    YR_RULES* rules,
+    YR_SCAN_CACHE* cache,
+    YR_FILE_DESCRIPTOR fd,
+    int flags,
+    YR_CALLBACK_FUNC callback,
+    void* user_data,
+    int timeout)
+{
+  YR_CACHED_SCAN scan;
+  YR_SCAN_CACHE_KEY key;
+
+  int result;
+
+  if (cache == NULL ||
+      yr_scan_cache_get_key(rules, fd, flags, &key) != ERROR_SUCCESS)
+    return yr_rules_scan_fd(rules, fd, flags, callback, user_data, timeout);
+
+  if (yr_scan_cache_lookup(cache, &key, &scan.entry))
+    return _yr_rules_replay_scan(
+        rules, &scan.entry, flags, callback, user_data);
+
+  scan.rules = rules;
+  scan.callback = callback;
+  scan.user_data = user_data;
+  scan.complete = FALSE;
+  scan.entry.key = key;
+  scan.entry.sequence = 0;
+  scan.entry.matches_count = 0;
+
+  memset(scan.entry.matches, 0, sizeof(scan.entry.matches));
+
+  result = yr_rules_scan_fd(
+      rules,
+      fd,
+      flags,
+      _yr_rules_cached_scan_callback,
+      &scan,
+      timeout);
+
+  if (result == ERROR_SUCCESS && scan.complete &&
+      scan.entry.matches_count <= YR_SCAN_CACHE_MAX_MATCHES)
+    yr_scan_cache_store(cache, &scan.entry);
+
+  return result;
+}
+
+
+YR_API int yr_rules_scan_file_cached(
+    YR_RULES* rules,
+    YR_SCAN_CACHE* cache,
+    const char* filename,
+    int flags,
+    YR_CALLBACK_FUNC callback,
+    void* user_data,
+    int timeout)
+{
+  YR_FILE_DESCRIPTOR fd;
+
+  int result;
+
+  #if defined(_WIN32) || defined(__CYGWIN__)
+
+  fd = CreateFileA(
+      filename,
+      GENERIC_READ,
+      FILE_SHARE_READ | FILE_SHARE_WRITE,
+      NULL,
+      OPEN_EXISTING,
+      FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+      NULL);
+
+  if (fd == INVALID_HANDLE_VALUE)
+    return ERROR_COULD_NOT_OPEN_FILE;
+
+  #else
+
+  fd = open(filename, O_RDONLY);
+
+  if (fd == -1)
+    return ERROR_COULD_NOT_OPEN_FILE;
+
+  #endif
+
+  result = yr_rules_scan_fd_cached(
+      rules,
+      cache,
+      fd,
+      flags,
+      callback,
+      user_data,
+      timeout);
+
+  #if defined(_WIN32) || defined(__CYGWIN__)
+  CloseHandle(fd);
+  #else
+  close(fd);
+  #endif
+
+  return result;
+}
+
+//
+// Matches found in a read-only file-backed mapping, cached in the YR_RULES
+// object so that the same mapping doesn't need to be scanned again in other
+// processes. Offsets are relative to the start of the block. The checksum of
+// the data is kept too, because a mapping can be modified after being mapped
+// (i.e: relocations, or a patch made by someone who then restores the page
+// protection) even if it's read-only.
+//
+
+typedef struct _YR_CACHED_MATCH
+{
+  YR_STRING* string;
+  int64_t offset;
+  int32_t length;
+  uint8_t* data;
+
+} YR_CACHED_MATCH;
+
+
+typedef struct _YR_CACHED_MAPPING
+{
+  uint64_t checksum;
+  size_t size;
+  int count;
+  YR_CACHED_MATCH* matches;
+
+} YR_CACHED_MAPPING;
+
+
+int _yr_rules_free_cached_mapping(
+    void* mapping)
+{
+  yr_free(mapping);
+  return ERROR_SUCCESS;
+}
+
+
+#define ROTATE_INT64(x, shift) \
+    (((x) << (shift)) | ((x) >> (64 - (shift))))
+
+#define SIP_ROUND(v0, v1, v2, v3) \
+    do { \
+      v0 += v1; v1 = ROTATE_INT64(v1, 13); v1 ^= v0; \
+      v0 = ROTATE_INT64(v0, 32); \
+      v2 += v3; v3 = ROTATE_INT64(v3, 16); v3 ^= v2; \
+      v0 += v3; v3 = ROTATE_INT64(v3, 21); v3 ^= v0; \
+      v2 += v1; v1 = ROTATE_INT64(v1, 17); v1 ^= v2; \
+      v2 = ROTATE_INT64(v2, 32); \
+    } while (0)
+
+
+//
+// _yr_rules_checksum
+//
+// Computes the SipHash-2-4 of the data with a key that is generated at
+// random for each YR_RULES object, so nobody can craft modifications to a
+// mapping that keep the same checksum. Values depend on the machine's
+// endianness and are never stored anywhere.
+//
+
+uint64_t _yr_rules_checksum(
+    uint64_t key[2],
+    uint8_t* data,
+    size_t size)
+{
+  uint64_t v0 = 0x736F6D6570736575ULL ^ key[0];
+  uint64_t v1 = 0x646F72616E646F6DULL ^ key[1];
+  uint64_t v2 = 0x6C7967656E657261ULL ^ key[0];
+  uint64_t v3 = 0x7465646279746573ULL ^ key[1];
+  uint64_t word;
+
+  size_t i = 0;
+
+  for (; i + sizeof(word) <= size; i += sizeof(word))
+  {
+    memcpy(&word, data + i, sizeof(word));
+
+    v3 ^= word;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= word;
+  }
+
+  word = 0;
+  memcpy(&word, data + i, size - i);
+  word ^= (uint64_t) size << 56;
+
+  v3 ^= word;
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  v0 ^= word;
+  v2 ^= 0xFF;
+
+  for (i = 0; i < 4; i++)
+    SIP_ROUND(v0, v1, v2, v3);
+
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+
+//
+// _yr_rules_generate_mappings_key
+//
+// Generates the key for the checksums of the cached mappings the first time
+// it's needed. Returns FALSE if there is no source of random numbers, which
+// disables the cache. Must be called with the rules' mutex locked.
+//
+
+int _yr_rules_generate_mappings_key(
+    YR_RULES* rules)
+{
+  FILE* urandom;
+
+  if (rules->mappings_key_state == 0)
+  {
+    rules->mappings_key_state = -1;
+
+    urandom = fopen("/dev/urandom", "rb");
+
+    if (urandom != NULL)
+    {
+      if (fread(rules->mappings_key, sizeof(rules->mappings_key), 1,
+                urandom) == 1)
+        rules->mappings_key_state = 1;
+
+      fclose(urandom);
+    }
+  }
+
+  return rules->mappings_key_state == 1;
+}
+
+
+//
+// _yr_rules_can_cache_mappings
+//
+// Matches can be reused only if they depend on nothing but the data in the
+// block. Chained strings can have unconfirmed matches spanning several
+// blocks, and strings at a fixed offset depend on the block's address.
+// Mappings aren't cached either if the key for their checksums can't be
+// generated.
+//
+
+int _yr_rules_can_cache_mappings(
+    YR_RULES* rules)
+{
+  YR_RULE* rule;
+  YR_STRING* string;
+
+  int result;
+
+  yr_rules_foreach(rules, rule)
+  {
+    yr_rule_strings_foreach(rule, string)
+    {
+      if (STRING_IS_CHAIN_PART(string) || STRING_IS_FIXED_OFFSET(string))
+        return FALSE;
+    }
+  }
+
+  yr_mutex_lock(&rules->mutex);
+  result = _yr_rules_generate_mappings_key(rules);
+  yr_mutex_unlock(&rules->mutex);
+
+  return result;
+}
+
+
+//
+// _yr_rules_add_cached_mapping
+//
+// Adds a mapping to the cache, which owns it if the call succeeds. When the
+// cache is full the mappings not found since the last time it was full are
+// discarded. Must be called with the rules' mutex locked.
+//
+
+int _yr_rules_add_cached_mapping(
+    YR_RULES* rules,
+    const char* key,
+    YR_CACHED_MAPPING* mapping)
+{
+  if (rules->mappings_cache != NULL &&
+      rules->mappings_cache->used >= PROCESS_MAPPINGS_CACHE_SIZE)
+  {
+    yr_hash_table_destroy(
+        rules->old_mappings_cache,
+        _yr_rules_free_cached_mapping);
+
+    rules->old_mappings_cache = rules->mappings_cache;
+    rules->mappings_cache = NULL;
+  }
+
+  if (rules->mappings_cache == NULL)
+    FAIL_ON_ERROR(yr_hash_table_create(1024, &rules->mappings_cache));
+
+  return yr_hash_table_add(rules->mappings_cache, key, NULL, mapping);
+}
+
+
+//
+// _yr_rules_find_cached_mapping
+//
+// Returns the cached mapping with the given key, or NULL if there is none.
+// Mappings found in old_mappings_cache are copied to mappings_cache, so the
+// ones found frequently are never discarded. Must be called with the rules'
+// mutex locked, and the mapping is only valid while it is.
+//
+
+YR_CACHED_MAPPING* _yr_rules_find_cached_mapping(
+    YR_RULES* rules,
+    const char* key)
+{
+  YR_CACHED_MAPPING* mapping = NULL;
+  YR_CACHED_MAPPING* copy;
+
+  int i;
+
+  if (rules->mappings_cache != NULL)
+    mapping = (YR_CACHED_MAPPING*) yr_hash_table_lookup(
+        rules->mappings_cache, key, NULL);
+
+  if (mapping != NULL || rules->old_mappings_cache == NULL)
+    return mapping;
+
+  mapping = (YR_CACHED_MAPPING*) yr_hash_table_lookup(
+      rules->old_mappings_cache, key, NULL);
+
+  if (mapping == NULL)
+    return NULL;
+
+  copy = (YR_CACHED_MAPPING*) yr_malloc(mapping->size);
+
+  if (copy == NULL)
+    return NULL;
+
+  memcpy(copy, mapping, mapping->size);
+
+  copy->matches = (YR_CACHED_MATCH*) (copy + 1);
+
+  for (i = 0; i < copy->count; i++)
+    copy->matches[i].data = (uint8_t*) copy +
+        (mapping->matches[i].data - (uint8_t*) mapping);
+
+  // Adding the copy can discard old_mappings_cache, and the original with
+  // it, which is fine as only the copy is used from now on.
+
+  if (_yr_rules_add_cached_mapping(rules, key, copy) != ERROR_SUCCESS)
+  {
+    yr_free(copy);
+    return NULL;
+  }
+
+  return copy;
+}
+
+
+//
+// _yr_rules_cache_mapping
+//
+// Copies the matches found in the block into a new YR_CACHED_MAPPING and
+// adds it to the cache with the given key.
+//
+
+int _yr_rules_cache_mapping(
+    YR_RULES* rules,
+    YR_SCAN_CONTEXT* context,
+    YR_MEMORY_BLOCK* block,
+    const char* key,
+    uint64_t checksum)
+{
+  YR_CACHED_MAPPING* mapping = NULL;
+  YR_CACHED_MATCH* cached_match = NULL;
+  YR_MATCH* match;
+  YR_STRING** string;
+
+  size_t data_size = 0;
+  uint8_t* data = NULL;
+
+  int tidx = context->tidx;
+  int count = 0;
+  int result = ERROR_SUCCESS;
+
+  // Blocks are scanned in increasing address order, so the matches found in
+  // this block, if any, are at the tail of the strings' matches lists. They
+  // are cached in the same order they have in the list, which makes adding
+  // them back later faster. The first pass computes the size of the cached
+  // mapping, the second one fills it.
+
+  int pass;
+
+  for (pass = 0; pass < 2; pass++)
+  {
+    if (pass == 1)
+    {
+      mapping = (YR_CACHED_MAPPING*) yr_malloc(
+          sizeof(YR_CACHED_MAPPING) +
+          count * sizeof(YR_CACHED_MATCH) +
+          data_size);
+
+      if (mapping == NULL)
+        return ERROR_INSUFICIENT_MEMORY;
+
+      mapping->checksum = checksum;
+      mapping->size = sizeof(YR_CACHED_MAPPING) +
+          count * sizeof(YR_CACHED_MATCH) +
+          data_size;
+      mapping->count = count;
+      mapping->matches = (YR_CACHED_MATCH*) (mapping + 1);
+
+      cached_match = mapping->matches;
+      data = (uint8_t*) (mapping->matches + count);
+    }
+
+    string = (YR_STRING**) yr_arena_base_address(
+        context->matching_strings_arena);
+
+    while (string != NULL)
+    {
+      match = (*string)->matches[tidx].tail;
+
+      while (match != NULL &&
+             match->prev != NULL &&
+             match->prev->base + match->prev->offset >= block->base)
+        match = match->prev;
+
+      for (; match != NULL; match = match->next)
+      {
+        if (match->base + match->offset >= block->base &&
+            match->base + match->offset < block->base + block->size)
+        {
+          if (pass == 0)
+          {
+            count++;
+            data_size += match->length;
+          }
+          else
+          {
+            cached_match->string = *string;
+            cached_match->offset = match->base + match->offset - block->base;
+            cached_match->length = match->length;
+            cached_match->data = data;
+
+            memcpy(data, match->data, match->length);
+
+            data += match->length;
+            cached_match++;
+          }
+        }
+      }
+
+      string = (YR_STRING**) yr_arena_next_address(
+          context->matching_strings_arena,
+          string,
+          sizeof(string));
+    }
+  }
+
+  yr_mutex_lock(&rules->mutex);
+
+  // Another thread could have cached the same mapping in the meantime.
+
+  if (rules->mappings_cache == NULL ||
+      yr_hash_table_lookup(rules->mappings_cache, key, NULL) == NULL)
+  {
+    result = _yr_rules_add_cached_mapping(rules, key, mapping);
+
+    if (result == ERROR_SUCCESS)
+      mapping = NULL;
+  }
+
+  yr_mutex_unlock(&rules->mutex);
+
+  if (mapping != NULL)
+    yr_free(mapping);
+
+  return result;
+}
+
+
+//
+// _yr_rules_scan_mapping
+//
+// Like _yr_rules_scan_block, but for blocks in read-only file-backed
+// mappings. If the same data was already scanned in this or another process
+// the cached matches are added to the context instead of scanning the block,
+// otherwise the block is scanned and its matches are cached.
+//
+
+int _yr_rules_scan_mapping(
+    YR_RULES* rules,
+    YR_SCAN_CONTEXT* context,
+    YR_MEMORY_BLOCK* block,
+    YR_PROCESS_REGION* region,
+    int timeout,
+    time_t start_time)
+{
+  YR_CACHED_MAPPING* mapping;
+
+  uint8_t* data = yr_memory_block_fetch_data(block);
+  uint64_t checksum;
+
+  char key[128];
+  int cached = FALSE;
+  int result = ERROR_SUCCESS;
+  int i;
+
+  _yr_rules_setup_block(context, block, data);
+
+  if (data == NULL)
+    return ERROR_SUCCESS;
+
+  checksum = _yr_rules_checksum(rules->mappings_key, data, block->size);
+
+  snprintf(key, sizeof(key), "%llx:%llx:%llx:%llx",
+      (unsigned long long) region->device,
+      (unsigned long long) region->inode,
+      (unsigned long long) (region->offset + block->base - region->begin),
+      (unsigned long long) block->size);
+
+  // The mutex is held while adding the cached matches, as the mapping can
+  // be discarded by other threads as soon as it's released.
+
+  yr_mutex_lock(&rules->mutex);
+
+  mapping = _yr_rules_find_cached_mapping(rules, key);
+
+  if (mapping != NULL)
+  {
+    cached = TRUE;
+
+    if (mapping->checksum != checksum)
+      mapping = NULL;
+  }
+
+  for (i = 0; mapping != NULL && i < mapping->count; i++)
+  {
+    result = yr_scan_add_match(
+        context,
+        mapping->matches[i].string,
+        block->base,
+        mapping->matches[i].offset,
+        mapping->matches[i].length,
+        mapping->matches[i].data);
+
+    if (result != ERROR_SUCCESS)
+      break;
+  }
+
+  yr_mutex_unlock(&rules->mutex);
+
+  if (mapping != NULL || result != ERROR_SUCCESS)
+    return result;
+
+  FAIL_ON_ERROR(_yr_rules_search_block(
+      rules, context, block, data, timeout, start_time));
+
+  if (cached)
+    return ERROR_SUCCESS;
+
+  return _yr_rules_cache_mapping(rules, context, block, key, checksum);
+}
+
+
+//
+// yr_rules_scan_proc
+//
+// Scans the memory of a process. Blocks are read and searched for strings one
+// batch at a time, so only one batch needs to be in memory at any given
+// moment. Blocks are read again later if they are needed while evaluating
+// conditions. With SCAN_FLAGS_PROCESS_CACHE_MAPPINGS the matches found in
+// read-only file-backed mappings are kept in the YR_RULES object and reused
+// when the same mapping is found in another process, which saves scanning
+// the shared libraries mapped by every process more than once.
+//
+
 YR_API int yr_rules_scan_proc(
     YR_RULES* rules,
     int pid,
@@ -593,33 +1437,81 @@ YR_API int yr_rules_scan_proc(
     void* user_data,
     int timeout)
 {
-  YR_MEMORY_BLOCK* first_block;
-  YR_MEMORY_BLOCK* next_block;
-  YR_MEMORY_BLOCK* block;
+  YR_PROCESS_MEMORY* memory = NULL;
+  YR_MEMORY_BLOCK_ITERATOR* iterator;
+  YR_MEMORY_BLOCK* block = NULL;
+  YR_SCAN_CONTEXT context;
+
+  YR_PROCESS_REGION* region;
+
+  time_t start_time;
 
-  int result = yr_process_get_memory(pid, &first_block);
+  int cache_mappings = FALSE;
+  int result = yr_process_open_memory(pid, flags, &memory);
 
   if (result == ERROR_SUCCESS)
-    result = yr_rules_scan_mem_blocks(
-        rules,
-        first_block,
-        flags | SCAN_FLAGS_PROCESS_MEMORY,
-        callback,
-        user_data,
-        timeout);
+  {
+    iterator = yr_process_get_iterator(memory);
+    block = iterator->first(iterator);
+    result = iterator->last_error;
+  }
+
+  if (result != ERROR_SUCCESS || block == NULL)
+  {
+    if (memory != NULL)
+      yr_process_close_memory(memory);
+
+    return result;
+  }
 
-  block = first_block;
+  result = _yr_rules_scan_begin(
+      rules,
+      &context,
+      iterator,
+      flags | SCAN_FLAGS_PROCESS_MEMORY,
+      callback,
+      user_data);
+
+  context.file_size = block->size;
+
+  if (flags & SCAN_FLAGS_PROCESS_CACHE_MAPPINGS &&
+      !(flags & SCAN_FLAGS_FAST_MODE))
+    cache_mappings = _yr_rules_can_cache_mappings(rules);
+
+  start_time = time(NULL);
 
-  while (block != NULL)
+  while (block != NULL && result == ERROR_SUCCESS)
   {
-    next_block = block->next;
+    region = memory->current_region;
 
-    yr_free(block->data);
-    yr_free(block);
+    if (cache_mappings &&
+        region != NULL &&
+        region->inode != 0 &&
+        !(region->flags & PROCESS_REGION_WRITE))
+    {
+      result = _yr_rules_scan_mapping(
+          rules, &context, block, region, timeout, start_time);
+    }
+    else
+    {
+      result = _yr_rules_scan_block(
+          rules, &context, block, timeout, start_time);
+    }
 
-    block = next_block;
+    if (result == ERROR_SUCCESS)
+    {
+      block = iterator->next(iterator);
+      result = iterator->last_error;
+    }
   }
 
+  if (result == ERROR_SUCCESS)
+    result = _yr_rules_scan_finish(rules, &context, timeout, start_time);
+
+  _yr_rules_scan_end(rules, &context);
+
+  yr_process_close_memory(memory);
+
   return result;
 }
 
@@ -648,6 +1540,9 @@ YR_API int yr_rules_load_stream(
   new_rules->match_table = header->match_table;
   new_rules->transition_table = header->transition_table;
   new_rules->tidx_mask = 0;
+  new_rules->mappings_cache = NULL;
+  new_rules->old_mappings_cache = NULL;
+  new_rules->mappings_key_state = 0;
 
   FAIL_ON_ERROR_WITH_CLEANUP(
       yr_mutex_create(&new_rules->mutex),
@@ -726,6 +1621,14 @@ YR_API int yr_rules_destroy(
     external++;
   }
 
+  yr_hash_table_destroy(
+      rules->mappings_cache,
+      _yr_rules_free_cached_mapping);
+
+  yr_hash_table_destroy(
+      rules->old_mappings_cache,
+      _yr_rules_free_cached_mapping);
+
   yr_mutex_destroy(&rules->mutex);
   yr_arena_destroy(rules->arena);
   yr_free(rules);
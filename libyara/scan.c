@@ -17,6 +17,7 @@ limitations under the License.
 #include <assert.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
 
 #include <yara/globals.h>
 #include <yara/limits.h>
@@ -385,10 +386,11 @@ void _yr_scan_update_match_chain_length(
 
   while (match != NULL)
   {
-    int64_t ending_offset = match->offset + match->length;
+    int64_t ending_offset = match->base + match->offset + match->length;
+    int64_t update_offset = match_to_update->base + match_to_update->offset;
 
-    if (ending_offset + string->chain_gap_max >= match_to_update->offset &&
-        ending_offset + string->chain_gap_min <= match_to_update->offset)
+    if (ending_offset + string->chain_gap_max >= update_offset &&
+        ending_offset + string->chain_gap_min <= update_offset)
     {
       _yr_scan_update_match_chain_length(
           tidx, string->chained_to, match, chain_length + 1);
@@ -399,6 +401,59 @@ void _yr_scan_update_match_chain_length(
 }
 
 
+//
+// yr_memory_block_fetch_data
+//
+// Returns a pointer to the block's data, or NULL if it can't be read. The
+// data for blocks that are read on demand usually lives in a buffer shared
+// with other blocks, so the pointer is only valid until the data for another
+// block is fetched.
+//
+
+YR_API uint8_t* yr_memory_block_fetch_data(
+    YR_MEMORY_BLOCK* block)
+{
+  if (block->data != NULL)
+    return block->data;
+
+  if (block->fetch_data == NULL)
+    return NULL;
+
+  return block->fetch_data(block);
+}
+
+
+//
+// yr_memory_block_read_data
+//
+// Copies length bytes starting at offset within the block into buffer.
+// Returns FALSE if they can't be read. Blocks read on demand are read with
+// their read_data function if they have one, so that only the requested
+// bytes are read, and fetched as a whole otherwise.
+//
+
+YR_API int yr_memory_block_read_data(
+    YR_MEMORY_BLOCK* block,
+    size_t offset,
+    void* buffer,
+    size_t length)
+{
+  uint8_t* data;
+
+  if (block->data == NULL && block->read_data != NULL)
+    return block->read_data(block, offset, buffer, length);
+
+  data = yr_memory_block_fetch_data(block);
+
+  if (data == NULL)
+    return FALSE;
+
+  memcpy(buffer, data + offset, length);
+
+  return TRUE;
+}
+
+
 int _yr_scan_add_match_to_list(
     YR_MATCH* match,
     YR_MATCHES* matches_list,
@@ -409,9 +464,15 @@ int _yr_scan_add_match_to_list(
   if (matches_list->count == MAX_STRING_MATCHES)
     return ERROR_TOO_MANY_MATCHES;
 
+  // Matches are sorted by address, not by their offset within the block, as
+  // matches in different blocks can have the same offset. Blocks can also
+  // overlap (see yr_process_next_memory_block), in which case the same match
+  // is found in both of them but only added once.
+
   while (insertion_point != NULL)
   {
-    if (match->offset == insertion_point->offset)
+    if (match->base + match->offset ==
+        insertion_point->base + insertion_point->offset)
     {
       if (replace_if_exists)
         insertion_point->length = match->length;
@@ -419,7 +480,8 @@ int _yr_scan_add_match_to_list(
       return ERROR_SUCCESS;
     }
 
-    if (match->offset > insertion_point->offset)
+    if (match->base + match->offset >
+        insertion_point->base + insertion_point->offset)
       break;
 
     insertion_point = insertion_point->prev;
@@ -471,6 +533,101 @@ void _yr_scan_remove_match_from_list(
 }
 
 
+//
+// _yr_scan_set_match_data
+//
+// Sets the data for a match whose last byte is right before data_end. The
+// data of blocks fetched on demand, like those of process memory, is usually
+// read into a buffer which is reused for the next block, so the data is
+// copied into the matches arena instead. If only the last "available" bytes
+// of the match are in the current block (a chain of strings spanning two
+// blocks), the rest of the copy is filled with zeroes.
+//
+
+int _yr_scan_set_match_data(
+    YR_SCAN_CONTEXT* context,
+    YR_MATCH* match,
+    uint8_t* data_end,
+    int32_t available)
+{
+  uint8_t* copy;
+
+  if (!context->copy_match_data)
+  {
+    match->data = data_end - match->length;
+    return ERROR_SUCCESS;
+  }
+
+  FAIL_ON_ERROR(yr_arena_allocate_memory(
+      context->matches_arena,
+      yr_max(match->length, 1),
+      (void**) &copy));
+
+  memset(copy, 0, match->length - available);
+  memcpy(copy + match->length - available, data_end - available, available);
+
+  match->data = copy;
+
+  return ERROR_SUCCESS;
+}
+
+
+//
+// yr_scan_add_match
+//
+// Adds a match for a string which is not part of a chain. Besides being used
+// while scanning, this allows adding matches found in a previous scan of the
+// same data, like the ones cached by yr_rules_scan_proc.
+//
+
+int yr_scan_add_match(
+    YR_SCAN_CONTEXT* context,
+    YR_STRING* string,
+    int64_t base,
+    int64_t offset,
+    int32_t length,
+    uint8_t* data)
+{
+  YR_MATCH* new_match;
+
+  int tidx = context->tidx;
+
+  if (string->matches[tidx].count == 0)
+  {
+    // If this is the first match for the string, put the string in the
+    // list of strings whose flags needs to be cleared after the scan.
+
+    FAIL_ON_ERROR(yr_arena_write_data(
+        context->matching_strings_arena,
+        &string,
+        sizeof(string),
+        NULL));
+  }
+
+  FAIL_ON_ERROR(yr_arena_allocate_memory(
+      context->matches_arena,
+      sizeof(YR_MATCH),
+      (void**) &new_match));
+
+  new_match->base = base;
+  new_match->offset = offset;
+  new_match->length = length;
+  new_match->prev = NULL;
+  new_match->next = NULL;
+
+  FAIL_ON_ERROR(_yr_scan_set_match_data(
+      context,
+      new_match,
+      data + length,
+      length));
+
+  return _yr_scan_add_match_to_list(
+      new_match,
+      &string->matches[tidx],
+      STRING_IS_GREEDY_REGEXP(string));
+}
+
+
 int _yr_scan_verify_chained_string_match(
     YR_STRING* matching_string,
     YR_SCAN_CONTEXT* context,
@@ -486,6 +643,7 @@ int _yr_scan_verify_chained_string_match(
 
   uint64_t lower_offset;
   uint64_t ending_offset;
+  uint64_t match_address = match_base + match_offset;
   int32_t full_chain_length;
 
   int tidx = context->tidx;
@@ -498,16 +656,18 @@ int _yr_scan_verify_chained_string_match(
   else
   {
     if (matching_string->unconfirmed_matches[tidx].head != NULL)
-      lower_offset = matching_string->unconfirmed_matches[tidx].head->offset;
+      lower_offset = \
+          matching_string->unconfirmed_matches[tidx].head->base +
+          matching_string->unconfirmed_matches[tidx].head->offset;
     else
-      lower_offset = match_offset;
+      lower_offset = match_address;
 
     match = matching_string->chained_to->unconfirmed_matches[tidx].head;
 
     while (match != NULL)
     {
       next_match = match->next;
-      ending_offset = match->offset + match->length;
+      ending_offset = match->base + match->offset + match->length;
 
       if (ending_offset + matching_string->chain_gap_max < lower_offset)
       {
@@ -516,8 +676,8 @@ int _yr_scan_verify_chained_string_match(
       }
       else
       {
-        if (ending_offset + matching_string->chain_gap_max >= match_offset &&
-            ending_offset + matching_string->chain_gap_min <= match_offset)
+        if (ending_offset + matching_string->chain_gap_max >= match_address &&
+            ending_offset + matching_string->chain_gap_min <= match_address)
         {
           add_match = TRUE;
           break;
@@ -536,10 +696,10 @@ int _yr_scan_verify_chained_string_match(
 
       while (match != NULL)
       {
-        ending_offset = match->offset + match->length;
+        ending_offset = match->base + match->offset + match->length;
 
-        if (ending_offset + matching_string->chain_gap_max >= match_offset &&
-            ending_offset + matching_string->chain_gap_min <= match_offset)
+        if (ending_offset + matching_string->chain_gap_max >= match_address &&
+            ending_offset + matching_string->chain_gap_min <= match_address)
         {
           _yr_scan_update_match_chain_length(
               tidx, matching_string->chained_to, match, 1);
@@ -571,12 +731,18 @@ int _yr_scan_verify_chained_string_match(
               match, &string->unconfirmed_matches[tidx]);
 
           match->length = (int32_t) \
-              (match_offset - match->offset + match_length);
+              (match_address - match->base - match->offset + match_length);
 
-          match->data = match_data - match_offset + match->offset;
           match->prev = NULL;
           match->next = NULL;
 
+          FAIL_ON_ERROR(_yr_scan_set_match_data(
+              context,
+              match,
+              match_data + match_length,
+              (int32_t) yr_min(
+                  (uint64_t) match->length, match_offset + match_length)));
+
           FAIL_ON_ERROR(_yr_scan_add_match_to_list(
               match, &string->matches[tidx], FALSE));
         }
@@ -632,10 +798,8 @@ int _yr_scan_match_callback(
   CALLBACK_ARGS* callback_args = (CALLBACK_ARGS*) args;
 
   YR_STRING* string = callback_args->string;
-  YR_MATCH* new_match;
 
   int result = ERROR_SUCCESS;
-  int tidx = callback_args->context->tidx;
 
   size_t match_offset = match_data - callback_args->data;
 
@@ -680,37 +844,13 @@ int _yr_scan_match_callback(
   }
   else
   {
-    if (string->matches[tidx].count == 0)
-    {
-      // If this is the first match for the string, put the string in the
-      // list of strings whose flags needs to be cleared after the scan.
-
-      FAIL_ON_ERROR(yr_arena_write_data(
-          callback_args->context->matching_strings_arena,
-          &string,
-          sizeof(string),
-          NULL));
-    }
-
-    result = yr_arena_allocate_memory(
-        callback_args->context->matches_arena,
-        sizeof(YR_MATCH),
-        (void**) &new_match);
-
-    if (result == ERROR_SUCCESS)
-    {
-      new_match->base = callback_args->data_base;
-      new_match->offset = match_offset;
-      new_match->length = match_length;
-      new_match->data = match_data;
-      new_match->prev = NULL;
-      new_match->next = NULL;
-
-      FAIL_ON_ERROR(_yr_scan_add_match_to_list(
-          new_match,
-          &string->matches[tidx],
-          STRING_IS_GREEDY_REGEXP(string)));
-    }
+    result = yr_scan_add_match(
+        callback_args->context,
+        string,
+        callback_args->data_base,
+        match_offset,
+        match_length,
+        match_data);
   }
 
   return result;
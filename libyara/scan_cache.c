@@ -0,0 +1,564 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <string.h>
+#include <time.h>
+
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <yara/arena.h>
+#include <yara/error.h>
+#include <yara/mem.h>
+#include <yara/scan_cache.h>
+
+
+#define FNV_OFFSET_BASIS  0xcbf29ce484222325ULL
+#define FNV_PRIME         0x100000001b3ULL
+
+// Slots being written for longer than this number of seconds were left by
+// a process that died while writing them, and can be taken over.
+#define STALE_WRITE_SECONDS  10
+
+
+uint64_t _yr_scan_cache_hash(
+    uint64_t hash,
+    const void* data,
+    size_t size)
+{
+  const uint8_t* p = (const uint8_t*) data;
+
+  for (size_t i = 0; i < size; i++)
+  {
+    hash ^= p[i];
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
+
+
+//
+// _yr_scan_cache_fingerprint
+//
+// Computes a hash of the compiled rules. Pointers in the arena are hashed
+// as offsets, so the fingerprint doesn't depend on the address where the
+// rules are loaded. The values of the external variables are left out,
+// they are part of the key of each file instead. Can't be used while
+// scanning with the rules, because they hold the scan state too.
+//
+
+int _yr_scan_cache_fingerprint(
+    YR_RULES* rules,
+    uint64_t* fingerprint)
+{
+  YR_ARENA_PAGE* page = rules->arena->page_list_head;
+  YR_EXTERNAL_VARIABLE* external;
+  YR_RELOC* reloc;
+
+  uint64_t hash = FNV_OFFSET_BASIS;
+  uint8_t* data;
+
+  while (page != NULL)
+  {
+    data = (uint8_t*) yr_malloc(page->used);
+
+    if (data == NULL)
+      return ERROR_INSUFICIENT_MEMORY;
+
+    memcpy(data, page->address, page->used);
+
+    for (reloc = page->reloc_list_head; reloc != NULL; reloc = reloc->next)
+    {
+      uint8_t** reloc_address = (uint8_t**) (data + reloc->offset);
+      uint8_t* reloc_target = *reloc_address;
+
+      if (reloc_target >= page->address &&
+          reloc_target < page->address + page->used)
+        *reloc_address = (uint8_t*) (reloc_target - page->address);
+      else
+        *reloc_address = NULL;
+    }
+
+    external = rules->externals_list_head;
+
+    while (!EXTERNAL_VARIABLE_IS_NULL(external))
+    {
+      if ((uint8_t*) external >= page->address &&
+          (uint8_t*) external < page->address + page->used)
+      {
+        YR_EXTERNAL_VARIABLE* copy = (YR_EXTERNAL_VARIABLE*)
+            (data + ((uint8_t*) external - page->address));
+
+        copy->type = EXTERNAL_VARIABLE_TYPE_NULL;
+        memset(&copy->value, 0, sizeof(copy->value));
+      }
+
+      external++;
+    }
+
+    hash = _yr_scan_cache_hash(hash, data, page->used);
+
+    yr_free(data);
+    page = page->next;
+  }
+
+  *fingerprint = hash;
+
+  return ERROR_SUCCESS;
+}
+
+
+//
+// _yr_scan_cache_externals_hash
+//
+// Computes a hash of the current values of the external variables.
+//
+
+uint64_t _yr_scan_cache_externals_hash(
+    YR_RULES* rules)
+{
+  YR_EXTERNAL_VARIABLE* external = rules->externals_list_head;
+
+  uint64_t hash = FNV_OFFSET_BASIS;
+
+  while (!EXTERNAL_VARIABLE_IS_NULL(external))
+  {
+    // Strings assigned after compiling the rules live outside the arena,
+    // but are the same kind of value than the ones assigned while compiling.
+
+    if (external->type == EXTERNAL_VARIABLE_TYPE_STRING ||
+        external->type == EXTERNAL_VARIABLE_TYPE_MALLOC_STRING)
+    {
+      hash = _yr_scan_cache_hash(hash, "s", 1);
+
+      if (external->value.s != NULL)
+        hash = _yr_scan_cache_hash(
+            hash, external->value.s, strlen(external->value.s) + 1);
+    }
+    else
+    {
+      hash = _yr_scan_cache_hash(
+          hash, &external->type, sizeof(external->type));
+      hash = _yr_scan_cache_hash(
+          hash, &external->value.i, sizeof(external->value.i));
+    }
+
+    external++;
+  }
+
+  return hash;
+}
+
+
+uint64_t _yr_scan_cache_checksum(
+    YR_SCAN_CACHE_ENTRY* entry)
+{
+  uint64_t hash = FNV_OFFSET_BASIS;
+
+  hash = _yr_scan_cache_hash(
+      hash, &entry->matches_count, sizeof(entry->matches_count));
+  hash = _yr_scan_cache_hash(
+      hash, &entry->key, sizeof(entry->key));
+  hash = _yr_scan_cache_hash(
+      hash, entry->matches, sizeof(entry->matches));
+
+  return hash;
+}
+
+
+#if defined(_WIN32) || defined(__CYGWIN__)
+
+YR_API int yr_scan_cache_open(
+    const char* file_path,
+    YR_RULES* rules,
+    uint32_t capacity,
+    YR_SCAN_CACHE** cache)
+{
+  return ERROR_COULD_NOT_OPEN_FILE;
+}
+
+
+YR_API void yr_scan_cache_close(
+    YR_SCAN_CACHE* cache)
+{
+}
+
+
+int yr_scan_cache_get_key(
+    YR_RULES* rules,
+    YR_FILE_DESCRIPTOR fd,
+    int flags,
+    YR_SCAN_CACHE_KEY* key)
+{
+  return ERROR_COULD_NOT_OPEN_FILE;
+}
+
+
+int yr_scan_cache_lookup(
+    YR_SCAN_CACHE* cache,
+    YR_SCAN_CACHE_KEY* key,
+    YR_SCAN_CACHE_ENTRY* entry)
+{
+  return FALSE;
+}
+
+
+void yr_scan_cache_store(
+    YR_SCAN_CACHE* cache,
+    YR_SCAN_CACHE_ENTRY* entry)
+{
+}
+
+#else
+
+//
+// _yr_scan_cache_read_header
+//
+// Reads the header of the cache file and checks that it belongs to a cache
+// for the rules with the given fingerprint. Returns the size the file must
+// have, or zero if it's not a valid cache for those rules.
+//
+
+size_t _yr_scan_cache_read_header(
+    int fd,
+    uint64_t fingerprint,
+    YR_SCAN_CACHE_HEADER* header)
+{
+  struct stat st;
+
+  if (pread(fd, header, sizeof(*header), 0) != sizeof(*header) ||
+      memcmp(header->magic, "YRSC", 4) != 0 ||
+      header->version != YR_SCAN_CACHE_VERSION ||
+      header->fingerprint != fingerprint ||
+      header->capacity == 0 ||
+      fstat(fd, &st) != 0 ||
+      st.st_size != sizeof(*header) +
+          (off_t) header->capacity * sizeof(YR_SCAN_CACHE_ENTRY))
+    return 0;
+
+  return (size_t) st.st_size;
+}
+
+
+//
+// yr_scan_cache_open
+//
+// Opens the cache stored in file_path, creating it if it doesn't exist. If
+// the file contains a cache created for other rules it's emptied. The file
+// is locked while the cache is open: many processes using the same rules
+// can share it, but it can't be emptied while in use by others. The
+// capacity is the number of files that can be cached, it's only used when
+// the cache is created, and DEFAULT_SCAN_CACHE_CAPACITY is used if it's
+// zero. The cache file is sparse, the space needed by the files not cached
+// yet is not allocated.
+//
+
+YR_API int yr_scan_cache_open(
+    const char* file_path,
+    YR_RULES* rules,
+    uint32_t capacity,
+    YR_SCAN_CACHE** cache)
+{
+  YR_SCAN_CACHE_HEADER header;
+
+  uint64_t fingerprint;
+  size_t size;
+  void* data;
+  int fd;
+
+  FAIL_ON_ERROR(_yr_scan_cache_fingerprint(rules, &fingerprint));
+
+  if (capacity == 0)
+    capacity = DEFAULT_SCAN_CACHE_CAPACITY;
+
+  fd = open(file_path, O_RDWR | O_CREAT, 0644);
+
+  if (fd == -1)
+    return ERROR_COULD_NOT_OPEN_FILE;
+
+  if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+  {
+    // Nobody else has the cache open, it can be emptied if it's not valid
+    // for these rules. Others trying to open it meanwhile wait for the
+    // shared lock below.
+
+    size = _yr_scan_cache_read_header(fd, fingerprint, &header);
+
+    if (size == 0)
+    {
+      size = sizeof(header) + (size_t) capacity * sizeof(YR_SCAN_CACHE_ENTRY);
+
+      memcpy(header.magic, "YRSC", 4);
+      header.version = YR_SCAN_CACHE_VERSION;
+      header.fingerprint = fingerprint;
+      header.capacity = capacity;
+      header.reserved = 0;
+
+      if (ftruncate(fd, 0) != 0 ||
+          ftruncate(fd, size) != 0 ||
+          pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+      {
+        close(fd);
+        return ERROR_COULD_NOT_OPEN_FILE;
+      }
+    }
+
+    if (flock(fd, LOCK_SH) != 0)
+    {
+      close(fd);
+      return ERROR_COULD_NOT_OPEN_FILE;
+    }
+  }
+  else
+  {
+    // Others have the cache open, or are initializing it, in which case
+    // the shared lock is granted once they are done.
+
+    if (flock(fd, LOCK_SH) != 0)
+    {
+      close(fd);
+      return ERROR_COULD_NOT_OPEN_FILE;
+    }
+
+    size = _yr_scan_cache_read_header(fd, fingerprint, &header);
+
+    if (size == 0)
+    {
+      close(fd);
+      return ERROR_COULD_NOT_OPEN_FILE;
+    }
+  }
+
+  data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (data == MAP_FAILED)
+  {
+    close(fd);
+    return ERROR_COULD_NOT_MAP_FILE;
+  }
+
+  *cache = (YR_SCAN_CACHE*) yr_malloc(sizeof(YR_SCAN_CACHE));
+
+  if (*cache == NULL)
+  {
+    munmap(data, size);
+    close(fd);
+    return ERROR_INSUFICIENT_MEMORY;
+  }
+
+  (*cache)->file = fd;
+  (*cache)->size = size;
+  (*cache)->header = (YR_SCAN_CACHE_HEADER*) data;
+  (*cache)->entries = (YR_SCAN_CACHE_ENTRY*) ((uint8_t*) data + sizeof(header));
+  (*cache)->recent_change_seconds = DEFAULT_SCAN_CACHE_RECENT_CHANGE_SECONDS;
+
+  return ERROR_SUCCESS;
+}
+
+
+YR_API void yr_scan_cache_close(
+    YR_SCAN_CACHE* cache)
+{
+  munmap(cache->header, cache->size);
+  close(cache->file);
+  yr_free(cache);
+}
+
+
+int yr_scan_cache_get_key(
+    YR_RULES* rules,
+    YR_FILE_DESCRIPTOR fd,
+    int flags,
+    YR_SCAN_CACHE_KEY* key)
+{
+  struct stat st;
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    return ERROR_COULD_NOT_OPEN_FILE;
+
+  memset(key, 0, sizeof(YR_SCAN_CACHE_KEY));
+
+  key->device = st.st_dev;
+  key->inode = st.st_ino;
+  key->size = st.st_size;
+  key->externals = _yr_scan_cache_externals_hash(rules);
+  key->flags = flags;
+
+  #if defined(__APPLE__)
+  key->mtime = st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+  key->ctime = st.st_ctimespec.tv_sec * 1000000000LL + st.st_ctimespec.tv_nsec;
+  #else
+  key->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  key->ctime = st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec;
+  #endif
+
+  return ERROR_SUCCESS;
+}
+
+//
+// yr_scan_cache_lookup
+//
+// Looks for a file in the cache, returns TRUE and a copy of its entry if
+// found.
+//
+
+int yr_scan_cache_lookup(
+    YR_SCAN_CACHE* cache,
+    YR_SCAN_CACHE_KEY* key,
+    YR_SCAN_CACHE_ENTRY* entry)
+{
+  uint64_t hash = _yr_scan_cache_hash(FNV_OFFSET_BASIS, key, sizeof(*key));
+  uint32_t capacity = cache->header->capacity;
+
+  for (int i = 0; i < YR_SCAN_CACHE_MAX_PROBES; i++)
+  {
+    YR_SCAN_CACHE_ENTRY* slot = &cache->entries[(hash + i) % capacity];
+    uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+    // Slots are used in probing order and never freed, the file is not in
+    // the cache if an unused one is found.
+
+    if (sequence == 0)
+      return FALSE;
+
+    if (sequence & 1)
+      continue;
+
+    memcpy(entry, slot, sizeof(YR_SCAN_CACHE_ENTRY));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence)
+      continue;
+
+    if (memcmp(&entry->key, key, sizeof(*key)) == 0 &&
+        entry->matches_count <= YR_SCAN_CACHE_MAX_MATCHES &&
+        entry->checksum == _yr_scan_cache_checksum(entry))
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+//
+// yr_scan_cache_store
+//
+// Stores an entry in the cache. The entry replaces the one for the same
+// file if it exists, or takes the first unused slot. If all the slots
+// probed are in use the first one is overwritten. Storing is best effort:
+// nothing is stored if the slot is being written by someone else, unless
+// it has been for more than STALE_WRITE_SECONDS.
+//
+
+void yr_scan_cache_store(
+    YR_SCAN_CACHE* cache,
+    YR_SCAN_CACHE_ENTRY* entry)
+{
+  YR_SCAN_CACHE_ENTRY* slot = NULL;
+  struct timespec now;
+
+  uint64_t hash;
+  uint32_t capacity = cache->header->capacity;
+  uint32_t sequence;
+  uint32_t locked;
+  uint32_t published;
+
+  int64_t recent;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  recent = (now.tv_sec - cache->recent_change_seconds) * 1000000000LL +
+      now.tv_nsec;
+
+  if (entry->key.mtime > recent || entry->key.ctime > recent)
+    return;
+
+  hash = _yr_scan_cache_hash(FNV_OFFSET_BASIS, &entry->key, sizeof(entry->key));
+
+  for (int i = 0; i < YR_SCAN_CACHE_MAX_PROBES; i++)
+  {
+    YR_SCAN_CACHE_ENTRY* probed = &cache->entries[(hash + i) % capacity];
+
+    sequence = __atomic_load_n(&probed->sequence, __ATOMIC_ACQUIRE);
+
+    if (sequence == 0 ||
+        memcmp(&probed->key, &entry->key, sizeof(entry->key)) == 0)
+    {
+      slot = probed;
+      break;
+    }
+  }
+
+  if (slot == NULL)
+    slot = &cache->entries[hash % capacity];
+
+  sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+  if (sequence & 1)
+  {
+    // The write time is stored before locking the slot, so it's at least
+    // as recent as the lock.
+
+    if (now.tv_sec - __atomic_load_n(&slot->write_time, __ATOMIC_RELAXED) <
+        STALE_WRITE_SECONDS)
+      return;
+
+    // Taking over the slot keeps it odd, and makes the final update of the
+    // writer that left it fail in case it's still alive.
+
+    locked = sequence + 2;
+  }
+  else
+  {
+    locked = sequence + 1;
+  }
+
+  __atomic_store_n(&slot->write_time, (int64_t) now.tv_sec, __ATOMIC_RELAXED);
+
+  if (!__atomic_compare_exchange_n(
+          &slot->sequence, &sequence, locked, 0,
+          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    return;
+
+  slot->matches_count = entry->matches_count;
+  slot->key = entry->key;
+
+  memcpy(slot->matches, entry->matches, sizeof(slot->matches));
+
+  slot->checksum = _yr_scan_cache_checksum(slot);
+
+  // Zero means unused, skip it when the sequence number wraps around.
+
+  published = locked + 1;
+
+  if (published == 0)
+    published = 2;
+
+  // Fails if the slot was taken over meanwhile, and then the data written
+  // may be mixed with the other writer's, which the checksum detects.
+
+  __atomic_compare_exchange_n(
+      &slot->sequence, &locked, published, 0,
+      __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+#endif
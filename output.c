@@ -0,0 +1,224 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+
+
+#define OUTPUT_INITIAL_SIZE  4096
+
+
+int output_init(
+    OUTPUT_BUFFER* output,
+    MUTEX* mutex)
+{
+  output->data = (char*) malloc(OUTPUT_INITIAL_SIZE);
+
+  if (output->data == NULL)
+    return ENOMEM;
+
+  output->used = 0;
+  output->size = OUTPUT_INITIAL_SIZE;
+  output->mutex = mutex;
+
+  return 0;
+}
+
+
+void output_destroy(
+    OUTPUT_BUFFER* output)
+{
+  free(output->data);
+
+  output->data = NULL;
+  output->used = 0;
+  output->size = 0;
+}
+
+
+//
+// _output_reserve
+//
+// Makes sure there's room for at least length more bytes in the buffer.
+// Returns 0 if there's not enough memory.
+//
+
+static int _output_reserve(
+    OUTPUT_BUFFER* output,
+    size_t length)
+{
+  size_t new_size = output->size;
+  char* new_data;
+
+  if (output->used + length <= output->size)
+    return 1;
+
+  while (output->used + length > new_size)
+    new_size *= 2;
+
+  new_data = (char*) realloc(output->data, new_size);
+
+  if (new_data == NULL)
+    return 0;
+
+  output->data = new_data;
+  output->size = new_size;
+
+  return 1;
+}
+
+
+void output_printf(
+    OUTPUT_BUFFER* output,
+    const char* format,
+    ...)
+{
+  va_list args;
+  int length;
+
+  va_start(args, format);
+  length = vsnprintf(
+      output->data + output->used,
+      output->size - output->used,
+      format,
+      args);
+  va_end(args);
+
+  // Older vsnprintf implementations return -1 instead of the required
+  // length when the output doesn't fit, double the buffer until it does.
+
+  while (length < 0 || (size_t) length >= output->size - output->used)
+  {
+    if (!_output_reserve(output, length < 0 ? output->size : length + 1))
+      return;
+
+    va_start(args, format);
+    length = vsnprintf(
+        output->data + output->used,
+        output->size - output->used,
+        format,
+        args);
+    va_end(args);
+  }
+
+  output->used += length;
+}
+
+
+void output_putc(
+    OUTPUT_BUFFER* output,
+    char c)
+{
+  if (_output_reserve(output, 1))
+    output->data[output->used++] = c;
+}
+
+
+void output_write(
+    OUTPUT_BUFFER* output,
+    const char* data,
+    size_t length)
+{
+  if (_output_reserve(output, length))
+  {
+    memcpy(output->data + output->used, data, length);
+    output->used += length;
+  }
+}
+
+
+//
+// output_flush
+//
+// Appends the contents of the buffer to stdout at once and empties the
+// buffer.
+//
+
+void output_flush(
+    OUTPUT_BUFFER* output)
+{
+  if (output->used == 0)
+    return;
+
+  mutex_lock(output->mutex);
+
+  fwrite(output->data, 1, output->used, stdout);
+
+  mutex_unlock(output->mutex);
+
+  output->used = 0;
+}
+
+
+//
+// output_json_string
+//
+// Writes data as a quoted JSON string. Bytes outside the printable ASCII
+// range are escaped as \u00XX, which keeps the output valid UTF-8 even if
+// data isn't, and allows recovering the original bytes.
+//
+
+void output_json_string(
+    OUTPUT_BUFFER* output,
+    const uint8_t* data,
+    size_t length)
+{
+  static const char hex_digits[] = "0123456789abcdef";
+
+  char* p;
+
+  // Each byte takes at most six characters, plus the quotes.
+
+  if (!_output_reserve(output, length * 6 + 2))
+    return;
+
+  p = output->data + output->used;
+
+  *p++ = '"';
+
+  for (size_t i = 0; i < length; i++)
+  {
+    uint8_t c = data[i];
+
+    if (c == '"' || c == '\\')
+    {
+      *p++ = '\\';
+      *p++ = c;
+    }
+    else if (c >= 32 && c < 127)
+    {
+      *p++ = c;
+    }
+    else
+    {
+      *p++ = '\\';
+      *p++ = 'u';
+      *p++ = '0';
+      *p++ = '0';
+      *p++ = hex_digits[c >> 4];
+      *p++ = hex_digits[c & 0xF];
+    }
+  }
+
+  *p++ = '"';
+
+  output->used = p - output->data;
+}
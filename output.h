@@ -0,0 +1,73 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "threading.h"
+
+
+// Output produced by a scanning thread. Text is accumulated in the buffer
+// and written to stdout as a whole by output_flush, so that threads don't
+// need to hold a lock while formatting their results. The mutex is shared
+// by all the buffers writing to the same stream, and it's held only while
+// the buffer is written.
+
+typedef struct _OUTPUT_BUFFER
+{
+  char* data;
+
+  size_t used;
+  size_t size;
+
+  MUTEX* mutex;
+
+} OUTPUT_BUFFER;
+
+
+int output_init(
+    OUTPUT_BUFFER* output,
+    MUTEX* mutex);
+
+void output_destroy(
+    OUTPUT_BUFFER* output);
+
+void output_printf(
+    OUTPUT_BUFFER* output,
+    const char* format,
+    ...);
+
+void output_putc(
+    OUTPUT_BUFFER* output,
+    char c);
+
+void output_write(
+    OUTPUT_BUFFER* output,
+    const char* data,
+    size_t length);
+
+void output_flush(
+    OUTPUT_BUFFER* output);
+
+void output_json_string(
+    OUTPUT_BUFFER* output,
+    const uint8_t* data,
+    size_t length);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+//
+// Measures how long it takes to compile a large set of rules, which is
+// dominated by the compiler's hash tables of rules and identifiers. Half
+// of the rules have identifiers too long to be stored inline in the hash
+// table entries. Every rule has a string and refers to the rule declared
+// before it, so identifiers are looked up as well as added.
+//
+// Usage: bench-compile [rules] [rounds]
+//
+// Build it with "make bench-compile".
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <config.h>
+#include <yara.h>
+
+
+#define MAX_RULE_SIZE  160
+
+
+//
+// generate_rules
+//
+// Returns a string with the source of the given number of rules, which
+// must be freed by the caller.
+//
+
+static char* generate_rules(
+    int count)
+{
+  char* source = (char*) malloc((size_t) count * MAX_RULE_SIZE + 1);
+  char* p = source;
+
+  int i;
+
+  if (source == NULL)
+  {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  *p = '\0';
+
+  for (i = 0; i < count; i++)
+  {
+    const char* prefix = (i % 2 == 0) ?
+        "r" : "rule_with_a_long_identifier_";
+
+    p += sprintf(p, "rule %s%d { strings: $a = \"string %d\" ",
+        prefix, i, i);
+
+    if (i == 0)
+      p += sprintf(p, "condition: $a }\n");
+    else
+      p += sprintf(p, "condition: $a or %s%d }\n",
+          (i % 2 == 0) ? "rule_with_a_long_identifier_" : "r", i - 1);
+  }
+
+  return source;
+}
+
+
+static double compile(
+    const char* source)
+{
+  YR_COMPILER* compiler;
+  YR_RULES* rules;
+
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (yr_compiler_create(&compiler) != ERROR_SUCCESS ||
+      yr_compiler_add_string(compiler, source, NULL) != 0 ||
+      yr_compiler_get_rules(compiler, &rules) != ERROR_SUCCESS)
+  {
+    fprintf(stderr, "could not compile the rules\n");
+    exit(EXIT_FAILURE);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  yr_rules_destroy(rules);
+  yr_compiler_destroy(compiler);
+
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+
+int main(int argc, char** argv)
+{
+  char* source;
+
+  double total = 0;
+  double best = 0;
+  double elapsed;
+
+  int count = (argc > 1) ? atoi(argv[1]) : 100000;
+  int rounds = (argc > 2) ? atoi(argv[2]) : 3;
+  int i;
+
+  if (count < 1 || rounds < 1)
+  {
+    fprintf(stderr, "usage: %s [rules] [rounds]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  source = generate_rules(count);
+
+  yr_initialize();
+
+  for (i = 0; i < rounds; i++)
+  {
+    elapsed = compile(source);
+    total += elapsed;
+
+    if (i == 0 || elapsed < best)
+      best = elapsed;
+  }
+
+  printf("%d rules, %d rounds\n", count, rounds);
+  printf("best: %.3fs, average: %.3fs\n", best, total / rounds);
+
+  yr_finalize();
+  free(source);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,256 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+//
+// Compares the two ways of getting a file's data in yr_rules_scan_file:
+// mapping every file, and reading the files up to the threshold set with
+// YR_CONFIG_FILE_READ_THRESHOLD into a per-thread buffer. A set of small
+// files is generated in a temporary directory and scanned several times
+// with each method, using the given number of threads.
+//
+// Usage: bench-filemap [threads] [files] [rounds]
+//
+// Build it with "make bench-filemap".
+//
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <config.h>
+#include <yara.h>
+
+
+#define MAX_BENCH_THREADS   64
+#define MAX_FILE_SIZE       16384
+
+
+static YR_RULES* rules;
+
+static char** paths;
+static int paths_count;
+static int next_path;
+static int matches;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int count_matches(
+    int message,
+    void* message_data,
+    void* user_data)
+{
+  if (message == CALLBACK_MSG_RULE_MATCHING)
+    (*(int*) user_data)++;
+
+  return CALLBACK_CONTINUE;
+}
+
+
+static void* scan_files(
+    void* arg)
+{
+  int thread_matches = 0;
+  int i;
+
+  while (1)
+  {
+    pthread_mutex_lock(&mutex);
+    i = next_path++;
+    pthread_mutex_unlock(&mutex);
+
+    if (i >= paths_count)
+      break;
+
+    if (yr_rules_scan_file(
+            rules, paths[i], 0, count_matches, &thread_matches, 0) !=
+        ERROR_SUCCESS)
+    {
+      fprintf(stderr, "error scanning %s\n", paths[i]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  pthread_mutex_lock(&mutex);
+  matches += thread_matches;
+  pthread_mutex_unlock(&mutex);
+
+  yr_finalize_thread();
+
+  return NULL;
+}
+
+
+static double benchmark(
+    uint32_t threshold,
+    int threads,
+    int rounds)
+{
+  pthread_t thread[MAX_BENCH_THREADS];
+  struct timespec start, end;
+
+  int round;
+  int i;
+
+  yr_set_configuration(YR_CONFIG_FILE_READ_THRESHOLD, &threshold);
+
+  matches = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (round = 0; round < rounds; round++)
+  {
+    next_path = 0;
+
+    for (i = 0; i < threads; i++)
+      pthread_create(&thread[i], NULL, scan_files, NULL);
+
+    for (i = 0; i < threads; i++)
+      pthread_join(thread[i], NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+
+//
+// create_files
+//
+// Writes files of 100 bytes to MAX_FILE_SIZE with pseudo-random contents,
+// always the same ones, every seventh of them containing the string the
+// rule looks for.
+//
+
+static void create_files(
+    char* directory,
+    int count)
+{
+  uint8_t data[MAX_FILE_SIZE];
+  uint32_t seed = 1;
+
+  FILE* file;
+  size_t size;
+  size_t j;
+
+  int i;
+
+  paths = (char**) malloc(count * sizeof(char*));
+
+  for (i = 0; i < count; i++)
+  {
+    seed = seed * 1103515245 + 12345;
+    size = 100 + (seed >> 8) % (MAX_FILE_SIZE - 100);
+
+    for (j = 0; j < size; j++)
+    {
+      seed = seed * 1103515245 + 12345;
+      data[j] = (uint8_t) (seed >> 16);
+    }
+
+    if (i % 7 == 0)
+      memcpy(data + size / 2, "EVILSTRING", 10);
+
+    paths[i] = (char*) malloc(strlen(directory) + 16);
+    sprintf(paths[i], "%s/%d", directory, i);
+
+    file = fopen(paths[i], "wb");
+
+    if (file == NULL || fwrite(data, size, 1, file) != 1)
+    {
+      perror(paths[i]);
+      exit(EXIT_FAILURE);
+    }
+
+    fclose(file);
+  }
+
+  paths_count = count;
+}
+
+
+int main(int argc, char** argv)
+{
+  YR_COMPILER* compiler;
+
+  char directory[] = "/tmp/yara-bench-XXXXXX";
+
+  double map_time;
+  double read_time;
+  int map_matches;
+  int read_matches;
+
+  int threads = (argc > 1) ? atoi(argv[1]) : 1;
+  int files = (argc > 2) ? atoi(argv[2]) : 10000;
+  int rounds = (argc > 3) ? atoi(argv[3]) : 5;
+  int i;
+
+  if (threads < 1 || threads > MAX_BENCH_THREADS || files < 1 || rounds < 1)
+  {
+    fprintf(stderr, "usage: %s [threads] [files] [rounds]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (mkdtemp(directory) == NULL)
+  {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+
+  create_files(directory, files);
+
+  yr_initialize();
+
+  if (yr_compiler_create(&compiler) != ERROR_SUCCESS ||
+      yr_compiler_add_string(
+          compiler,
+          "rule test { strings: $a = \"EVILSTRING\" condition: $a }",
+          NULL) != 0 ||
+      yr_compiler_get_rules(compiler, &rules) != ERROR_SUCCESS)
+  {
+    fprintf(stderr, "could not compile the rule\n");
+    return EXIT_FAILURE;
+  }
+
+  map_time = benchmark(0, threads, rounds);
+  map_matches = matches;
+
+  read_time = benchmark(DEFAULT_FILE_READ_THRESHOLD, threads, rounds);
+  read_matches = matches;
+
+  printf("%d files, %d threads, %d rounds\n", files, threads, rounds);
+  printf("mapping: %.3fs, %d matches\n", map_time, map_matches);
+  printf("reading: %.3fs, %d matches\n", read_time, read_matches);
+
+  yr_rules_destroy(rules);
+  yr_compiler_destroy(compiler);
+  yr_finalize();
+
+  for (i = 0; i < paths_count; i++)
+  {
+    unlink(paths[i]);
+    free(paths[i]);
+  }
+
+  free(paths);
+  rmdir(directory);
+
+  return (map_matches == read_matches) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
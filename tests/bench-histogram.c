@@ -0,0 +1,138 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+//
+// Compares yr_histogram_update with a plain loop incrementing a single
+// table, on a buffer filled with the same byte and on a buffer of random
+// bytes. Both histograms are checked to be equal.
+//
+// Usage: bench-histogram [size] [rounds]
+//
+// Build it with "make bench-histogram".
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <config.h>
+#include <yara.h>
+#include <yara/histogram.h>
+
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void scalar_update(
+    uint32_t* histogram,
+    const uint8_t* data,
+    size_t length)
+{
+  size_t i;
+
+  for (i = 0; i < length; i++)
+    histogram[data[i]]++;
+}
+
+
+static void bench(
+    const char* name,
+    const uint8_t* data,
+    size_t size,
+    int rounds)
+{
+  uint32_t scalar[256];
+  uint32_t multi[256];
+
+  double start;
+  double scalar_time;
+  double multi_time;
+
+  int i;
+
+  memset(scalar, 0, sizeof(scalar));
+  memset(multi, 0, sizeof(multi));
+
+  start = now();
+
+  for (i = 0; i < rounds; i++)
+    scalar_update(scalar, data, size);
+
+  scalar_time = now() - start;
+  start = now();
+
+  for (i = 0; i < rounds; i++)
+    yr_histogram_update(multi, data, size);
+
+  multi_time = now() - start;
+
+  if (memcmp(scalar, multi, sizeof(scalar)) != 0)
+  {
+    fprintf(stderr, "%s: histograms differ\n", name);
+    exit(EXIT_FAILURE);
+  }
+
+  printf("%-8s scalar: %.3fs, yr_histogram_update: %.3fs (%.2fx)\n",
+      name, scalar_time, multi_time, scalar_time / multi_time);
+}
+
+
+int main(int argc, char** argv)
+{
+  uint8_t* data;
+
+  size_t size = (argc > 1) ? (size_t) atol(argv[1]) : 8 * 1024 * 1024;
+  int rounds = (argc > 2) ? atoi(argv[2]) : 20;
+  size_t i;
+
+  if (size < 1 || rounds < 1)
+  {
+    fprintf(stderr, "usage: %s [size] [rounds]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  data = (uint8_t*) malloc(size);
+
+  if (data == NULL)
+  {
+    perror("malloc");
+    return EXIT_FAILURE;
+  }
+
+  printf("%zu bytes, %d rounds\n", size, rounds);
+
+  memset(data, 'A', size);
+  bench("constant", data, size, rounds);
+
+  srand(1);
+
+  for (i = 0; i < size; i++)
+    data[i] = (uint8_t) rand();
+
+  bench("random", data, size, rounds);
+
+  free(data);
+
+  return EXIT_SUCCESS;
+}
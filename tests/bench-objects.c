@@ -0,0 +1,133 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+//
+// Measures how long modules take to fill and read large arrays and
+// dictionaries. Each round creates a structure with an integer array and
+// an integer dictionary, sets the given number of items in both one at a
+// time, as modules do, and reads every item back.
+//
+// Usage: bench-objects [items] [rounds]
+//
+// Build it with "make bench-objects".
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <config.h>
+#include <yara.h>
+#include <yara/object.h>
+
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static YR_OBJECT* create_objects()
+{
+  YR_OBJECT* root;
+  YR_OBJECT* array;
+  YR_OBJECT* dict;
+
+  if (yr_object_create(OBJECT_TYPE_STRUCTURE, "root", NULL, &root) ||
+      yr_object_create(OBJECT_TYPE_ARRAY, "array", root, &array) ||
+      yr_object_create(OBJECT_TYPE_INTEGER, "array", array, NULL) ||
+      yr_object_create(OBJECT_TYPE_DICTIONARY, "dict", root, &dict) ||
+      yr_object_create(OBJECT_TYPE_INTEGER, "dict", dict, NULL))
+  {
+    fprintf(stderr, "could not create the objects\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return root;
+}
+
+
+int main(int argc, char** argv)
+{
+  YR_OBJECT* root;
+
+  char key[32];
+
+  double start;
+  double set_time = 0;
+  double get_time = 0;
+
+  int64_t sum = 0;
+
+  int count = (argc > 1) ? atoi(argv[1]) : 10000;
+  int rounds = (argc > 2) ? atoi(argv[2]) : 10;
+  int i, j;
+
+  if (count < 1 || rounds < 1)
+  {
+    fprintf(stderr, "usage: %s [items] [rounds]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  yr_initialize();
+
+  for (i = 0; i < rounds; i++)
+  {
+    root = create_objects();
+    start = now();
+
+    for (j = 0; j < count; j++)
+    {
+      sprintf(key, "key%d", j);
+
+      yr_object_set_integer(j, root, "array[%i]", j);
+      yr_object_set_integer(j, root, "dict[%s]", key);
+    }
+
+    set_time += now() - start;
+    start = now();
+
+    for (j = 0; j < count; j++)
+    {
+      sprintf(key, "key%d", j);
+
+      sum += yr_object_get_integer(root, "array[%i]", j);
+      sum += yr_object_get_integer(root, "dict[%s]", key);
+    }
+
+    get_time += now() - start;
+
+    yr_object_destroy(root);
+  }
+
+  if (sum != (int64_t) count * (count - 1) * rounds)
+  {
+    fprintf(stderr, "wrong values read back\n");
+    return EXIT_FAILURE;
+  }
+
+  printf("%d items, %d rounds\n", count, rounds);
+  printf("set: %.3fs, get: %.3fs per round\n",
+      set_time / rounds, get_time / rounds);
+
+  yr_finalize();
+
+  return EXIT_SUCCESS;
+}
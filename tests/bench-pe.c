@@ -0,0 +1,239 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+//
+// Measures how long the pe module takes to parse a file with many sections
+// and imports, which is dominated by translating RVAs to file offsets. A
+// PE32 file with the maximum number of sections is generated in memory,
+// with the import directory in the last section, and scanned repeatedly
+// with a rule using pe.imports.
+//
+// Usage: bench-pe [dlls] [functions] [scans]
+//
+// Build it with "make bench-pe".
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <config.h>
+#include <yara.h>
+#include <yara/pe.h>
+
+
+#define SECTIONS          96
+#define FILE_ALIGNMENT    0x200
+#define HEADERS_SIZE      0x2000
+#define NAME_SIZE         20
+
+#define ALIGN(x, a)       (((x) + (a) - 1) & ~((a) - 1))
+
+
+//
+// generate_pe
+//
+// Returns a PE32 file importing the given number of functions from each
+// of the given number of DLLs, which must be freed by the caller.
+//
+
+static uint8_t* generate_pe(
+    int dlls,
+    int functions,
+    size_t* size)
+{
+  PIMAGE_DOS_HEADER mz_header;
+  PIMAGE_NT_HEADERS32 pe_header;
+  PIMAGE_SECTION_HEADER sections;
+  PIMAGE_IMPORT_DESCRIPTOR imports;
+  PIMAGE_THUNK_DATA32 thunks;
+
+  size_t thunks_size = (size_t) (functions + 1) * sizeof(IMAGE_THUNK_DATA32);
+  size_t dll_size = NAME_SIZE + thunks_size + (size_t) functions * NAME_SIZE;
+  size_t imports_size = (dlls + 1) * sizeof(IMAGE_IMPORT_DESCRIPTOR) + \
+                        dlls * dll_size;
+
+  DWORD imports_rva = SECTIONS * 0x1000;
+  DWORD imports_offset = HEADERS_SIZE + (SECTIONS - 1) * FILE_ALIGNMENT;
+  DWORD rva;
+
+  uint8_t* data;
+  int i, j;
+
+  *size = imports_offset + ALIGN(imports_size, FILE_ALIGNMENT);
+  data = (uint8_t*) calloc(1, *size);
+
+  if (data == NULL)
+  {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+
+  mz_header = (PIMAGE_DOS_HEADER) data;
+  mz_header->e_magic = IMAGE_DOS_SIGNATURE;
+  mz_header->e_lfanew = 0x40;
+
+  pe_header = (PIMAGE_NT_HEADERS32) (data + mz_header->e_lfanew);
+  pe_header->Signature = IMAGE_NT_SIGNATURE;
+  pe_header->FileHeader.Machine = IMAGE_FILE_MACHINE_I386;
+  pe_header->FileHeader.NumberOfSections = SECTIONS;
+  pe_header->FileHeader.SizeOfOptionalHeader = sizeof(IMAGE_OPTIONAL_HEADER32);
+  pe_header->FileHeader.Characteristics = IMAGE_FILE_EXECUTABLE_IMAGE;
+  pe_header->OptionalHeader.Magic = IMAGE_NT_OPTIONAL_HDR32_MAGIC;
+  pe_header->OptionalHeader.AddressOfEntryPoint = 0x1000;
+  pe_header->OptionalHeader.ImageBase = 0x400000;
+  pe_header->OptionalHeader.SectionAlignment = 0x1000;
+  pe_header->OptionalHeader.FileAlignment = FILE_ALIGNMENT;
+  pe_header->OptionalHeader.SizeOfImage = imports_rva + \
+      ALIGN(imports_size, 0x1000);
+  pe_header->OptionalHeader.SizeOfHeaders = HEADERS_SIZE;
+  pe_header->OptionalHeader.NumberOfRvaAndSizes = \
+      IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+  pe_header->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT]
+      .VirtualAddress = imports_rva;
+  pe_header->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_IMPORT]
+      .Size = (DWORD) imports_size;
+
+  sections = IMAGE_FIRST_SECTION(pe_header);
+
+  for (i = 0; i < SECTIONS; i++)
+  {
+    sprintf((char*) sections[i].Name, ".s%d", i);
+
+    sections[i].VirtualAddress = (i + 1) * 0x1000;
+    sections[i].PointerToRawData = HEADERS_SIZE + i * FILE_ALIGNMENT;
+    sections[i].SizeOfRawData = FILE_ALIGNMENT;
+    sections[i].Misc.VirtualSize = FILE_ALIGNMENT;
+  }
+
+  sections[SECTIONS - 1].SizeOfRawData = ALIGN(imports_size, FILE_ALIGNMENT);
+  sections[SECTIONS - 1].Misc.VirtualSize = (DWORD) imports_size;
+
+  imports = (PIMAGE_IMPORT_DESCRIPTOR) (data + imports_offset);
+  rva = imports_rva + (dlls + 1) * sizeof(IMAGE_IMPORT_DESCRIPTOR);
+
+  for (i = 0; i < dlls; i++)
+  {
+    sprintf((char*) data + imports_offset + (rva - imports_rva),
+        "dll%d.dll", i);
+
+    imports[i].Name = rva;
+    imports[i].FirstThunk = rva + NAME_SIZE;
+    imports[i].OriginalFirstThunk = rva + NAME_SIZE;
+
+    thunks = (PIMAGE_THUNK_DATA32) \
+        (data + imports_offset + (rva + NAME_SIZE - imports_rva));
+
+    rva += NAME_SIZE + thunks_size;
+
+    for (j = 0; j < functions; j++)
+    {
+      PIMAGE_IMPORT_BY_NAME import = (PIMAGE_IMPORT_BY_NAME) \
+          (data + imports_offset + (rva - imports_rva));
+
+      sprintf((char*) import->Name, "func%d", j);
+
+      thunks[j].u1.Function = rva;
+      rva += NAME_SIZE;
+    }
+  }
+
+  return data;
+}
+
+
+static int count_matches(
+    int message,
+    void* message_data,
+    void* user_data)
+{
+  if (message == CALLBACK_MSG_RULE_MATCHING)
+    (*(int*) user_data)++;
+
+  return CALLBACK_CONTINUE;
+}
+
+
+int main(int argc, char** argv)
+{
+  YR_COMPILER* compiler;
+  YR_RULES* rules;
+
+  struct timespec start, end;
+
+  char rule[128];
+  uint8_t* data;
+  size_t size;
+
+  double elapsed;
+
+  int dlls = (argc > 1) ? atoi(argv[1]) : 20;
+  int functions = (argc > 2) ? atoi(argv[2]) : 100;
+  int scans = (argc > 3) ? atoi(argv[3]) : 2000;
+  int matches = 0;
+  int i;
+
+  if (dlls < 1 || functions < 1 || scans < 1)
+  {
+    fprintf(stderr, "usage: %s [dlls] [functions] [scans]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  data = generate_pe(dlls, functions, &size);
+
+  snprintf(rule, sizeof(rule),
+      "import \"pe\" rule r { condition: pe.imports(\"dll%d.dll\", "
+      "\"func%d\") }", dlls - 1, functions - 1);
+
+  yr_initialize();
+
+  if (yr_compiler_create(&compiler) != ERROR_SUCCESS ||
+      yr_compiler_add_string(compiler, rule, NULL) != 0 ||
+      yr_compiler_get_rules(compiler, &rules) != ERROR_SUCCESS)
+  {
+    fprintf(stderr, "could not compile the rules\n");
+    return EXIT_FAILURE;
+  }
+
+  yr_compiler_destroy(compiler);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (i = 0; i < scans; i++)
+  {
+    if (yr_rules_scan_mem(
+            rules, data, size, 0, count_matches, &matches, 0) != ERROR_SUCCESS)
+    {
+      fprintf(stderr, "could not scan the file\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  printf("%d sections, %d imports, %zu bytes, %d scans, %d matches\n",
+      SECTIONS, dlls * functions, size, scans, matches);
+  printf("total: %.3fs, per scan: %.1fus\n", elapsed, elapsed * 1e6 / scans);
+
+  yr_rules_destroy(rules);
+  yr_finalize();
+  free(data);
+
+  return EXIT_SUCCESS;
+}
@@ -1,3 +1,4 @@
+#include <config.h>
 #include <yara.h>
 #include "util.h"
 
@@ -14,6 +15,85 @@ int main(int argc, char** argv)
   assert_false_rule_file("import \"pe\" rule test { condition: pe.imports(\"KERNEL32.dll\", \"DeleteCriticalSection\") }",
       "tests/data/tiny-idata-5200.exe");
 
+  assert_true_rule_file(
+      "import \"pe\" \
+       rule test { \
+        condition: \
+          pe.imports(\"kernel32.dll\", \"deletecriticalsection\") and \
+          pe.imports(\"KERNEL32.DLL\") and \
+          not pe.imports(\"KERNEL32.dll\", \"NonExistentFunction\") and \
+          not pe.imports(\"NONEXISTENT.dll\") and \
+          not pe.exports(\"main\") \
+      }",
+      "tests/data/tiny.exe");
+
+  assert_true_rule_file(
+      "import \"pe\" \
+       rule test { \
+        condition: \
+          pe.number_of_sections == 7 and \
+          pe.sections[0].name == \".text\" and \
+          pe.sections[1].name == \".data\" and \
+          pe.sections[1].virtual_address == 12288 \
+      }",
+      "tests/data/tiny.exe");
+
+  assert_true_rule_file(
+      "import \"pe\" rule test { condition: pe.entry_point == 0x14E0 }",
+      "tests/data/tiny.exe");
+
+  assert_true_rule_file(
+      "import \"pe\" rule test { condition: pe.entry_point == 24 }",
+      "tests/data/old_ArmaFP.exe");
+
+  assert_true_rule_file(
+      "import \"pe\" \
+       rule test { \
+        condition: \
+          pe.section_index(\".data\") == 1 and \
+          pe.section_index(12288) == 1 \
+      }",
+      "tests/data/tiny.exe");
+
+  assert_true_rule_file(
+      "import \"pe\" \
+       rule test { \
+        condition: \
+          pe.MACHINE_I386 == 0x14c and \
+          pe.machine == pe.MACHINE_I386 and \
+          pe.SECTION_MEM_EXECUTE == 0x20000000 \
+      }",
+      "tests/data/tiny.exe");
+
+  assert_true_rule_file(
+      "import \"pe\" \
+       rule test { \
+        condition: \
+          pe.language(0x19) and \
+          pe.locale(0x419) \
+      }",
+      "tests/data/old_ArmaFP.exe");
+
+  assert_true_rule_file(
+      "import \"pe\" \
+       rule test { \
+        condition: \
+          pe.number_of_resources == 3 and \
+          pe.resources[2].type == pe.RESOURCE_TYPE_MANIFEST \
+      }",
+      "tests/data/old_ArmaFP.exe");
+
+  #if defined(HAVE_LIBCRYPTO)
+  assert_true_rule_file(
+      "import \"pe\" \
+       rule test { \
+        condition: \
+          pe.imphash() == \"1720bf764274b7a4052bbef0a71adc0d\" and \
+          pe.imphash() == \"1720bf764274b7a4052bbef0a71adc0d\" \
+      }",
+      "tests/data/tiny.exe");
+  #endif
+
   yr_finalize();
   return 0;
 }
@@ -14,10 +14,20 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <config.h>
 #include <yara.h>
 #include "blob.h"
 #include "util.h"
 
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
 
 static void test_boolean_operators()
 {
@@ -1109,6 +1119,85 @@ static void test_global_rules()
 }
 
 
+static void test_many_rules()
+{
+  // Enough rules, some of them with identifiers too long for being stored
+  // inline, to make the compiler's hash tables grow a few times.
+
+  char* rules = (char*) malloc(5000 * 80 + 256);
+  char* p = rules;
+  int i;
+
+  for (i = 0; i < 5000; i++)
+  {
+    if (i % 2 == 0)
+      p += sprintf(p, "private rule r%d { condition: true } ", i);
+    else
+      p += sprintf(
+          p, "private rule rule_with_a_long_identifier_%d { condition: true } ",
+          i);
+  }
+
+  strcpy(p,
+      "rule test { \
+        condition: \
+          r0 and r2500 and r4998 and \
+          rule_with_a_long_identifier_1 and \
+          rule_with_a_long_identifier_4999 \
+      }");
+
+  assert_true_rule(rules, NULL);
+
+  strcpy(p, "rule r2500 { condition: true }");
+
+  assert_syntax_error(rules);
+
+  free(rules);
+}
+
+
+static int count_freed_values(
+    void* value)
+{
+  (*(int*) value)++;
+  return ERROR_SUCCESS;
+}
+
+
+static void test_hash_table_empty_key()
+{
+  YR_HASH_TABLE* table;
+  int freed = 0;
+
+  // Empty keys are valid, the pe module adds one for imports of DLLs
+  // without a name.
+
+  if (yr_hash_table_create(16, &table) != ERROR_SUCCESS ||
+      yr_hash_table_add(table, "", NULL, &freed) != ERROR_SUCCESS ||
+      yr_hash_table_add(table, "", "ns", &freed) != ERROR_SUCCESS)
+  {
+    fprintf(stderr, "failed to add empty keys\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (yr_hash_table_lookup(table, "", NULL) != &freed ||
+      yr_hash_table_lookup(table, "", "ns") != &freed ||
+      yr_hash_table_lookup(table, "", "other") != NULL)
+  {
+    fprintf(stderr, "empty keys not found\n");
+    exit(EXIT_FAILURE);
+  }
+
+  yr_hash_table_destroy(table, count_freed_values);
+
+  if (freed != 2)
+  {
+    fprintf(stderr, "%d values freed, expecting 2\n", freed);
+    exit(EXIT_FAILURE);
+  }
+}
+
+
 static void test_modules()
 {
   assert_true_rule(
@@ -1195,6 +1284,30 @@ static void test_modules()
       }",
       NULL);
 
+  assert_true_rule(
+      "import \"tests\" \
+       rule test { \
+        condition: tests.integer_array[256] == 256 \
+      }",
+      NULL);
+
+  assert_true_rule(
+      "import \"tests\" \
+       rule test { \
+        condition: \
+          tests.integer_dict[\"k0\"] == 0 and \
+          tests.integer_dict[\"k500\"] == 500 and \
+          tests.integer_dict[\"k999\"] == 999 \
+      }",
+      NULL);
+
+  assert_false_rule(
+      "import \"tests\" \
+       rule test { \
+        condition: tests.integer_dict[\"k1000\"] == 1000 \
+      }",
+      NULL);
+
   assert_true_rule(
       "import \"tests\" \
        rule test { \
@@ -1279,6 +1392,678 @@ void test_integer_functions()
 }
 
 
+static void test_elf_symbols()
+{
+  assert_true_rule_file(
+      "import \"elf\" \
+       rule test { \
+        condition: \
+          elf.has_symbol(\"do_evil\") and \
+          elf.has_symbol(\"puts\") and \
+          elf.has_symbol(\"secret_counter\") and \
+          not elf.has_symbol(\"do_good\") and \
+          not elf.has_symbol(\"\") \
+      }",
+      "tests/data/elf64-symbols");
+
+  assert_true_rule_file(
+      "import \"elf\" \
+       rule test { \
+        condition: \
+          for any i in (0..elf.number_of_symbols - 1) : ( \
+            elf.symbols[i].name == \"do_evil\" and \
+            elf.symbols[i].type == elf.STT_FUNC and \
+            elf.symbols[i].bind == elf.STB_GLOBAL and \
+            elf.symbols[i].size > 0) \
+      }",
+      "tests/data/elf64-symbols");
+
+  assert_true_rule_file(
+      "import \"elf\" \
+       rule test { \
+        condition: \
+          elf.has_symbol(\"do_evil\") and \
+          for any i in (0..elf.number_of_symbols - 1) : ( \
+            elf.symbols[i].name == \"secret_counter\" and \
+            elf.symbols[i].type == elf.STT_OBJECT and \
+            elf.symbols[i].size == 4) \
+      }",
+      "tests/data/elf32-symbols");
+
+  assert_false_rule_blob(
+      "import \"elf\" \
+       rule test { condition: elf.has_symbol(\"main\") }",
+      ELF64_FILE);
+}
+
+
+//
+// Blocks provided by a custom iterator and fetched on demand into a buffer
+// shared by all of them, as yr_rules_scan_mem_blocks allows. The data of the
+// matches must remain valid after the buffer is reused.
+//
+
+#define TEST_BLOCK_SIZE  1024
+#define TEST_BLOCK_COUNT 3
+
+typedef struct _TEST_BLOCKS
+{
+  uint8_t data[TEST_BLOCK_COUNT * TEST_BLOCK_SIZE];
+  uint8_t buffer[TEST_BLOCK_SIZE];
+
+  YR_MEMORY_BLOCK block;
+  int next;
+
+  int matches;
+  int matches_across_blocks;
+  int wrong_data;
+
+} TEST_BLOCKS;
+
+
+static uint8_t* fetch_test_block(
+    YR_MEMORY_BLOCK* block)
+{
+  TEST_BLOCKS* blocks = (TEST_BLOCKS*) block->context;
+
+  memcpy(blocks->buffer, blocks->data + block->base, block->size);
+
+  return blocks->buffer;
+}
+
+
+static YR_MEMORY_BLOCK* next_test_block(
+    YR_MEMORY_BLOCK_ITERATOR* iterator)
+{
+  TEST_BLOCKS* blocks = (TEST_BLOCKS*) iterator->context;
+
+  if (blocks->next == TEST_BLOCK_COUNT)
+    return NULL;
+
+  blocks->block.data = NULL;
+  blocks->block.size = TEST_BLOCK_SIZE;
+  blocks->block.base = blocks->next++ * TEST_BLOCK_SIZE;
+  blocks->block.fetch_data = fetch_test_block;
+  blocks->block.read_data = NULL;
+  blocks->block.context = blocks;
+
+  return &blocks->block;
+}
+
+
+static YR_MEMORY_BLOCK* first_test_block(
+    YR_MEMORY_BLOCK_ITERATOR* iterator)
+{
+  ((TEST_BLOCKS*) iterator->context)->next = 0;
+
+  return next_test_block(iterator);
+}
+
+
+static int check_test_block_matches(
+    int message,
+    void* message_data,
+    void* user_data)
+{
+  TEST_BLOCKS* blocks = (TEST_BLOCKS*) user_data;
+  YR_RULE* rule = (YR_RULE*) message_data;
+  YR_STRING* string;
+  YR_MATCH* match;
+
+  size_t begin;
+  size_t end;
+  size_t last_block;
+
+  if (message != CALLBACK_MSG_RULE_MATCHING)
+    return CALLBACK_CONTINUE;
+
+  yr_rule_strings_foreach(rule, string)
+  {
+    yr_string_matches_foreach(string, match)
+    {
+      begin = (size_t) (match->base + match->offset);
+      end = begin + match->length;
+      last_block = (end - 1) / TEST_BLOCK_SIZE * TEST_BLOCK_SIZE;
+
+      // Matches spanning two blocks only have the data in the last one.
+
+      if (last_block > begin)
+      {
+        begin = last_block;
+        blocks->matches_across_blocks++;
+      }
+
+      if (memcmp(match->data + match->length - (end - begin),
+                 blocks->data + begin, end - begin) != 0)
+        blocks->wrong_data++;
+
+      blocks->matches++;
+    }
+  }
+
+  return CALLBACK_CONTINUE;
+}
+
+
+static void test_fetched_blocks()
+{
+  YR_RULES* rules = compile_rule(
+      "rule test { \
+        strings: \
+          $a = \"EVIL\" \
+          $b = { 48 45 41 44 [250-350] 54 41 49 4C } \
+        condition: \
+          #a == 3 and #b == 1 \
+      }");
+
+  YR_MEMORY_BLOCK_ITERATOR iterator;
+  TEST_BLOCKS blocks;
+
+  int i;
+
+  if (rules == NULL)
+  {
+    fprintf(stderr, "failed to compile rule: %s\n", compile_error);
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < sizeof(blocks.data); i++)
+    blocks.data[i] = 'a' + i % 26;
+
+  // The strings are at different offsets within each block, so the data
+  // left in the buffer by the last block doesn't match them. "HEAD" and
+  // "TAIL" are in different blocks.
+
+  memcpy(blocks.data + 100, "EVIL", 4);
+  memcpy(blocks.data + 1200, "EVIL", 4);
+  memcpy(blocks.data + 2300, "EVIL", 4);
+  memcpy(blocks.data + 1000, "HEAD", 4);
+  memcpy(blocks.data + 1304, "TAIL", 4);
+
+  blocks.matches = 0;
+  blocks.matches_across_blocks = 0;
+  blocks.wrong_data = 0;
+
+  iterator.context = &blocks;
+  iterator.first = first_test_block;
+  iterator.next = next_test_block;
+  iterator.last_error = ERROR_SUCCESS;
+
+  if (yr_rules_scan_mem_blocks(
+          rules, &iterator, 0, check_test_block_matches, &blocks, 0) !=
+      ERROR_SUCCESS)
+  {
+    fprintf(stderr, "yr_rules_scan_mem_blocks: error\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (blocks.matches != 4 ||
+      blocks.matches_across_blocks != 1 ||
+      blocks.wrong_data != 0)
+  {
+    fprintf(stderr, "%s:%d: wrong matches in fetched blocks "
+            "(%d matches, %d across blocks, %d with wrong data)\n",
+            __FILE__, __LINE__, blocks.matches,
+            blocks.matches_across_blocks, blocks.wrong_data);
+    exit(EXIT_FAILURE);
+  }
+
+  yr_rules_destroy(rules);
+}
+
+
+static void test_math_module()
+{
+  uint8_t blob[65536];
+  int i;
+
+  for (i = 0; i < sizeof(blob); i++)
+    blob[i] = (uint8_t) i;
+
+  assert_true_rule_blob(
+      "import \"math\" \
+       rule test { \
+        condition: \
+          math.entropy(0, filesize) == 8.0 and \
+          math.entropy(1, 25600) == 8.0 and \
+          math.entropy(4095, 512) == 8.0 and \
+          math.mean(3, 25600) == 127.5 and \
+          math.mean(0, 2) == 0.5 and \
+          math.deviation(5, 25600, 127.5) == 64.0 \
+      }",
+      blob);
+
+  assert_true_rule_blob(
+      "import \"math\" \
+       rule test { \
+        condition: \
+          math.serial_correlation(100, 20000) == \
+          math.serial_correlation(356, 20000) \
+      }",
+      blob);
+}
+
+
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+
+typedef struct
+{
+  int64_t heap_at_start;
+  int64_t heap_growth;
+  int matches;
+
+} HEAP_GROWTH;
+
+
+static int64_t heap_in_use()
+{
+  struct mallinfo2 info = mallinfo2();
+  return (int64_t) (info.uordblks + info.hblkhd);
+}
+
+
+static int measure_heap_growth(
+    int message,
+    void* message_data,
+    void* user_data)
+{
+  HEAP_GROWTH* growth = (HEAP_GROWTH*) user_data;
+
+  if (message == CALLBACK_MSG_RULE_MATCHING)
+    growth->matches++;
+
+  // Modules are unloaded after this message, so the memory used by the math
+  // module during the scan is still allocated.
+
+  if (message == CALLBACK_MSG_SCAN_FINISHED)
+    growth->heap_growth = heap_in_use() - growth->heap_at_start;
+
+  return CALLBACK_CONTINUE;
+}
+
+
+static int64_t math_heap_growth(
+    char* rule,
+    uint8_t* data,
+    size_t size)
+{
+  HEAP_GROWTH growth = { 0, 0, 0 };
+  YR_RULES* rules = compile_rule(rule);
+
+  if (rules == NULL)
+  {
+    fprintf(stderr, "failed to compile rule << %s >>: %s\n", rule,
+            compile_error);
+    exit(EXIT_FAILURE);
+  }
+
+  growth.heap_at_start = heap_in_use();
+
+  if (yr_rules_scan_mem(
+          rules, data, size, 0, measure_heap_growth, &growth, 0) !=
+      ERROR_SUCCESS || growth.matches != 1)
+  {
+    fprintf(stderr, "rule does not match (but should) << %s >>\n", rule);
+    exit(EXIT_FAILURE);
+  }
+
+  yr_rules_destroy(rules);
+
+  return growth.heap_growth;
+}
+
+
+static void test_math_index_size()
+{
+  size_t size = 16 * 1024 * 1024;
+  uint8_t* data = (uint8_t*) malloc(size);
+  size_t i;
+
+  for (i = 0; i < size; i++)
+    data[i] = (uint8_t) i;
+
+  // A single query is answered by reading the range, without building the
+  // cumulative histograms, which would take about 6% of the data's size.
+
+  if (math_heap_growth(
+          "import \"math\" \
+           rule test { condition: math.entropy(0, filesize) == 8.0 }",
+          data, size) > 256 * 1024)
+  {
+    fprintf(stderr, "%s:%d: index built for a single query\n",
+            __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+
+  // Repeated queries build the index, but only as far as the ranges go.
+
+  if (math_heap_growth(
+          "import \"math\" \
+           rule test { \
+             condition: \
+               math.entropy(0, 65536) == 8.0 and \
+               math.entropy(256, 65536) == 8.0 and \
+               math.mean(512, 65536) == 127.5 \
+           }",
+          data, size) > 256 * 1024)
+  {
+    fprintf(stderr, "%s:%d: index built beyond the queried ranges\n",
+            __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+
+  if (math_heap_growth(
+          "import \"math\" \
+           rule test { \
+             condition: \
+               math.entropy(0, filesize) == 8.0 and \
+               math.mean(256, filesize - 256) == 127.5 \
+           }",
+          data, size) < size / 32)
+  {
+    fprintf(stderr, "%s:%d: index not built for repeated queries\n",
+            __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+
+  free(data);
+}
+
+#endif
+
+
+#if defined(MAGIC)
+static void test_magic_module()
+{
+  int i;
+
+  // The second iteration gets its results from the cache.
+
+  for (i = 0; i < 2; i++)
+  {
+    assert_true_rule(
+        "import \"magic\" \
+         rule test { \
+          condition: \
+            magic.mime_type() == \"text/plain\" and \
+            magic.type() contains \"ASCII text\" \
+        }",
+        "This is plain ASCII text.\n");
+
+    assert_true_rule(
+        "import \"magic\" \
+         rule test { \
+          condition: magic.mime_type() != \"text/plain\" \
+        }",
+        "\x89PNG\r\n\x1a\n");
+  }
+}
+#endif
+
+
+#if defined(HASH)
+static void test_hash_module()
+{
+  assert_true_rule(
+      "import \"hash\" \
+       rule test { \
+        condition: \
+          hash.md5(0, filesize) == \"900150983cd24fb0d6963f7d28e17f72\" and \
+          hash.md5(0, filesize) == hash.md5(\"abc\") and \
+          hash.sha1(0, filesize) == \"a9993e364706816aba3e25717850c26c9cd0d89d\" and \
+          hash.sha256(0, filesize) == hash.sha256(\"abc\") and \
+          hash.checksum32(0, filesize) == 0x126 and \
+          hash.md5(1, 1) == hash.md5(\"b\") and \
+          hash.sha1(1, 1) == hash.sha1(\"b\") \
+      }",
+      "abc");
+
+  assert_false_rule(
+      "import \"hash\" \
+       rule test { \
+        condition: hash.md5(10, 1) == hash.md5(\"\") \
+      }",
+      "abc");
+}
+#endif
+
+
+#if !defined(_WIN32) && !defined(__CYGWIN__)
+
+typedef struct
+{
+  int rules;
+  int strings;
+
+} CACHED_SCAN_RESULTS;
+
+
+static int count_cached_scan_results(
+    int message,
+    void* message_data,
+    void* user_data)
+{
+  CACHED_SCAN_RESULTS* results = (CACHED_SCAN_RESULTS*) user_data;
+  YR_RULE* rule = (YR_RULE*) message_data;
+  YR_STRING* string;
+  YR_MATCH* match;
+
+  if (message != CALLBACK_MSG_RULE_MATCHING)
+    return CALLBACK_CONTINUE;
+
+  results->rules++;
+
+  yr_rule_strings_foreach(rule, string)
+  {
+    yr_string_matches_foreach(string, match)
+    {
+      results->strings++;
+    }
+  }
+
+  return CALLBACK_CONTINUE;
+}
+
+
+static void assert_cached_scan(
+    YR_RULES* rules,
+    YR_SCAN_CACHE* cache,
+    const char* path,
+    int expected_rules,
+    int expected_strings)
+{
+  CACHED_SCAN_RESULTS results = { 0, 0 };
+
+  if (yr_rules_scan_file_cached(
+          rules, cache, path, 0, count_cached_scan_results, &results, 0) !=
+      ERROR_SUCCESS)
+  {
+    fprintf(stderr, "failed to scan %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  if (results.rules != expected_rules || results.strings != expected_strings)
+  {
+    fprintf(stderr, "%d rules and %d strings matched, expecting %d and %d\n",
+            results.rules, results.strings, expected_rules, expected_strings);
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+static YR_SCAN_CACHE* open_scan_cache(
+    const char* path,
+    YR_RULES* rules)
+{
+  YR_SCAN_CACHE* cache;
+
+  if (yr_scan_cache_open(path, rules, 64, &cache) != ERROR_SUCCESS)
+  {
+    fprintf(stderr, "failed to open scan cache %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  // The files are scanned right after writing them.
+  cache->recent_change_seconds = 0;
+
+  return cache;
+}
+
+
+static int create_temp_file(
+    char* path,
+    size_t size)
+{
+  const char* directory = getenv("TMPDIR");
+  int fd;
+
+  if (directory == NULL || *directory == '\0')
+    directory = "/tmp";
+
+  snprintf(path, size, "%s/yara-test-XXXXXX", directory);
+
+  fd = mkstemp(path);
+
+  if (fd == -1)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  return fd;
+}
+
+
+//
+// Replaces the content of a file and sets its modification time to the
+// given number of seconds ago, so that each write gives the file a
+// different key even if the file system stores times in whole seconds.
+//
+
+static void write_old_file(
+    int fd,
+    const char* data,
+    int age)
+{
+  struct timespec times[2];
+  size_t size = strlen(data);
+
+  times[0].tv_sec = time(NULL) - age;
+  times[0].tv_nsec = 0;
+  times[1] = times[0];
+
+  if (ftruncate(fd, 0) != 0 ||
+      pwrite(fd, data, size, 0) != (ssize_t) size ||
+      futimens(fd, times) != 0)
+  {
+    perror("write_old_file");
+    exit(EXIT_FAILURE);
+  }
+}
+
+
+static YR_RULES* compile_rule_with_external(
+    char* string,
+    int64_t value)
+{
+  YR_COMPILER* compiler;
+  YR_RULES* rules = NULL;
+
+  if (yr_compiler_create(&compiler) != ERROR_SUCCESS)
+    exit(EXIT_FAILURE);
+
+  if (yr_compiler_define_integer_variable(compiler, "x", value) !=
+          ERROR_SUCCESS ||
+      yr_compiler_add_string(compiler, string, NULL) != 0 ||
+      yr_compiler_get_rules(compiler, &rules) != ERROR_SUCCESS)
+  {
+    fprintf(stderr, "failed to compile rule << %s >>\n", string);
+    exit(EXIT_FAILURE);
+  }
+
+  yr_compiler_destroy(compiler);
+
+  return rules;
+}
+
+
+static void test_scan_cache()
+{
+  char cache_path[MAX_PATH];
+  char file_path[MAX_PATH];
+
+  YR_SCAN_CACHE* cache;
+
+  YR_RULES* rules = compile_rule(
+      "rule a { strings: $a = \"foo\" condition: $a } \
+       private rule b { condition: true } \
+       rule c { strings: $c = \"bar\" condition: $c and b }");
+
+  YR_RULES* other_rules = compile_rule(
+      "rule a { strings: $a = \"foo\" condition: $a }");
+
+  YR_RULES* external_rules = compile_rule_with_external(
+      "rule a { strings: $a = \"foo\" condition: $a and x == 1 }", 1);
+
+  int file = create_temp_file(file_path, sizeof(file_path));
+
+  close(create_temp_file(cache_path, sizeof(cache_path)));
+
+  write_old_file(file, "foo bar", 7200);
+
+  // The first scan stores the results, the second one takes them from the
+  // cache, which doesn't keep the matching strings.
+
+  cache = open_scan_cache(cache_path, rules);
+
+  assert_cached_scan(rules, cache, file_path, 2, 2);
+  assert_cached_scan(rules, cache, file_path, 2, 0);
+
+  write_old_file(file, "foo baz", 3600);
+
+  assert_cached_scan(rules, cache, file_path, 1, 1);
+  assert_cached_scan(rules, cache, file_path, 1, 0);
+
+  yr_scan_cache_close(cache);
+
+  // A cache created for other rules is emptied.
+
+  cache = open_scan_cache(cache_path, other_rules);
+
+  assert_cached_scan(other_rules, cache, file_path, 1, 1);
+
+  yr_scan_cache_close(cache);
+
+  // Changing the value of an external variable doesn't use the results
+  // obtained with the previous value.
+
+  cache = open_scan_cache(cache_path, external_rules);
+
+  assert_cached_scan(external_rules, cache, file_path, 1, 1);
+  assert_cached_scan(external_rules, cache, file_path, 1, 0);
+
+  yr_rules_define_integer_variable(external_rules, "x", 2);
+  assert_cached_scan(external_rules, cache, file_path, 0, 0);
+
+  yr_rules_define_integer_variable(external_rules, "x", 1);
+  assert_cached_scan(external_rules, cache, file_path, 1, 0);
+
+  yr_scan_cache_close(cache);
+
+  yr_rules_destroy(rules);
+  yr_rules_destroy(other_rules);
+  yr_rules_destroy(external_rules);
+
+  close(file);
+
+  unlink(cache_path);
+  unlink(file_path);
+}
+
+#endif
+
+
 int main(int argc, char** argv)
 {
   yr_initialize();
@@ -1313,6 +2098,28 @@ int main(int argc, char** argv)
   // test_string_io();
   test_entrypoint();
   test_global_rules();
+  test_many_rules();
+  test_hash_table_empty_key();
+  test_elf_symbols();
+  test_fetched_blocks();
+  test_math_module();
+
+  #if defined(__GLIBC__) && \
+      (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  test_math_index_size();
+  #endif
+
+  #if defined(MAGIC)
+  test_magic_module();
+  #endif
+
+  #if defined(HASH)
+  test_hash_module();
+  #endif
+
+  #if !defined(_WIN32) && !defined(__CYGWIN__)
+  test_scan_cache();
+  #endif
 
   yr_finalize();
 
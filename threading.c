@@ -119,6 +119,20 @@ void semaphore_wait(
 }
 
 
+int semaphore_try_wait(
+    SEMAPHORE* semaphore)
+{
+  #if defined(_WIN32) || defined(__CYGWIN__)
+  if (WaitForSingleObject(*semaphore, 0) == WAIT_OBJECT_0)
+    return 0;
+  else
+    return 1;
+  #else
+  return sem_trywait(*semaphore);
+  #endif
+}
+
+
 void semaphore_release(
     SEMAPHORE* semaphore)
 {
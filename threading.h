@@ -65,6 +65,9 @@ void semaphore_destroy(
 void semaphore_wait(
     SEMAPHORE* semaphore);
 
+int semaphore_try_wait(
+    SEMAPHORE* semaphore);
+
 void semaphore_release(
     SEMAPHORE* semaphore);
 
@@ -0,0 +1,571 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+
+#include "uring.h"
+
+
+#ifdef USE_IO_URING
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+
+// Every file being read needs up to two requests at once, one for opening
+// it and another one for getting its type and size.
+#define URING_ENTRIES  (2 * URING_MAX_READS)
+
+// Each request is identified by the address of its file, which is aligned
+// to at least four bytes, with the type of request in the lowest bits.
+#define URING_OP_OPEN   0
+#define URING_OP_STATX  1
+#define URING_OP_READ   2
+#define URING_OP_MASK   3
+
+#define URING_FILE_OPENING  0
+#define URING_FILE_READING  1
+#define URING_FILE_DONE     2
+
+
+int uring_init(
+    URING* uring)
+{
+  struct io_uring_params params;
+  struct io_uring_probe* probe;
+
+  size_t probe_size = sizeof(struct io_uring_probe) +
+      IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+
+  int result = 0;
+
+  memset(uring, 0, sizeof(URING));
+  memset(&params, 0, sizeof(params));
+
+  uring->fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+
+  if (uring->fd == -1)
+    return errno;
+
+  uring->sq_ring_size = params.sq_off.array +
+      params.sq_entries * sizeof(unsigned);
+
+  uring->cq_ring_size = params.cq_off.cqes +
+      params.cq_entries * sizeof(struct io_uring_cqe);
+
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  uring->sq_ring = mmap(
+      NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+
+  uring->cq_ring = mmap(
+      NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+
+  uring->sqes = (struct io_uring_sqe*) mmap(
+      NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+
+  if (uring->sq_ring == MAP_FAILED ||
+      uring->cq_ring == MAP_FAILED ||
+      uring->sqes == MAP_FAILED)
+  {
+    result = errno;
+    uring_destroy(uring);
+    return result;
+  }
+
+  uring->sq_head = (unsigned*) ((char*) uring->sq_ring + params.sq_off.head);
+  uring->sq_tail = (unsigned*) ((char*) uring->sq_ring + params.sq_off.tail);
+  uring->sq_mask = (unsigned*) ((char*) uring->sq_ring +
+      params.sq_off.ring_mask);
+  uring->sq_array = (unsigned*) ((char*) uring->sq_ring + params.sq_off.array);
+  uring->sq_pending_tail = *uring->sq_tail;
+
+  uring->cq_head = (unsigned*) ((char*) uring->cq_ring + params.cq_off.head);
+  uring->cq_tail = (unsigned*) ((char*) uring->cq_ring + params.cq_off.tail);
+  uring->cq_mask = (unsigned*) ((char*) uring->cq_ring +
+      params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe*) ((char*) uring->cq_ring +
+      params.cq_off.cqes);
+
+  // The kernel must support every operation used by uring_read_files,
+  // otherwise io_uring is not used at all.
+
+  probe = (struct io_uring_probe*) calloc(1, probe_size);
+
+  if (probe == NULL)
+  {
+    uring_destroy(uring);
+    return ENOMEM;
+  }
+
+  if (syscall(__NR_io_uring_register, uring->fd,
+              IORING_REGISTER_PROBE, probe, IORING_OP_LAST) != 0)
+    result = errno;
+  else if (probe->last_op < IORING_OP_READ ||
+           !(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) ||
+           !(probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED) ||
+           !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED))
+    result = EOPNOTSUPP;
+
+  free(probe);
+
+  if (result != 0)
+    uring_destroy(uring);
+
+  return result;
+}
+
+
+void uring_destroy(
+    URING* uring)
+{
+  if (uring->sqes != NULL && uring->sqes != MAP_FAILED)
+    munmap(uring->sqes, uring->sqes_size);
+
+  if (uring->cq_ring != NULL && uring->cq_ring != MAP_FAILED)
+    munmap(uring->cq_ring, uring->cq_ring_size);
+
+  if (uring->sq_ring != NULL && uring->sq_ring != MAP_FAILED)
+    munmap(uring->sq_ring, uring->sq_ring_size);
+
+  if (uring->fd != -1)
+    close(uring->fd);
+
+  memset(uring, 0, sizeof(URING));
+  uring->fd = -1;
+}
+
+
+//
+// _uring_get_sqe
+//
+// Returns a cleared entry of the submission queue for a request of the given
+// type on the given file. The kernel doesn't see the entry until
+// _uring_submit publishes the new tail of the queue, so it can be filled
+// after the call.
+//
+
+struct io_uring_sqe* _uring_get_sqe(
+    URING* uring,
+    URING_FILE* file,
+    int op)
+{
+  unsigned index = uring->sq_pending_tail++ & *uring->sq_mask;
+
+  struct io_uring_sqe* sqe = &uring->sqes[index];
+
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+  sqe->user_data = (uint64_t) (uintptr_t) file | op;
+  uring->sq_array[index] = index;
+
+  return sqe;
+}
+
+
+//
+// _uring_finish_file
+//
+// Releases everything but the data of a file that won't have any more
+// requests.
+//
+
+void _uring_finish_file(
+    URING_FILE* file)
+{
+  if (file->fd >= 0)
+    close(file->fd);
+
+  free(file->stx);
+
+  file->fd = -1;
+  file->stx = NULL;
+  file->state = URING_FILE_DONE;
+}
+
+
+//
+// _uring_start_read
+//
+// Called once a file is opened and its type and size are known. Regular
+// files not larger than their maximum size are read with a single request,
+// anything else is done.
+//
+
+void _uring_start_read(
+    URING* uring,
+    URING_FILE* file)
+{
+  struct io_uring_sqe* sqe;
+  struct statx* stx = (struct statx*) file->stx;
+
+  if (uring->error == 0 &&
+      file->fd >= 0 &&
+      stx != NULL &&
+      S_ISREG(stx->stx_mode) &&
+      stx->stx_size > 0 &&
+      stx->stx_size <= file->max_size)
+  {
+    file->data = (uint8_t*) malloc((size_t) stx->stx_size);
+
+    if (file->data != NULL)
+    {
+      file->size = (size_t) stx->stx_size;
+      file->state = URING_FILE_READING;
+      file->pending = 1;
+
+      sqe = _uring_get_sqe(uring, file, URING_OP_READ);
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = file->fd;
+      sqe->addr = (uint64_t) (uintptr_t) file->data;
+      sqe->len = (uint32_t) file->size;
+      sqe->off = 0;
+
+      return;
+    }
+  }
+
+  _uring_finish_file(file);
+}
+
+
+//
+// _uring_complete
+//
+// Handles the result of a request, starting the read of the file once it's
+// open and its size is known.
+//
+
+void _uring_complete(
+    URING* uring,
+    uint64_t user_data,
+    int32_t result)
+{
+  URING_FILE* file = (URING_FILE*) (uintptr_t) (user_data & ~URING_OP_MASK);
+
+  switch (user_data & URING_OP_MASK)
+  {
+    case URING_OP_OPEN:
+      file->fd = (result >= 0) ? result : -1;
+      break;
+
+    case URING_OP_STATX:
+      if (result != 0)
+      {
+        free(file->stx);
+        file->stx = NULL;
+      }
+      break;
+
+    case URING_OP_READ:
+      // Files that were modified while being read are scanned from their
+      // path later, like those that couldn't be read.
+
+      if (result != (int32_t) file->size)
+      {
+        free(file->data);
+        file->data = NULL;
+        file->size = 0;
+      }
+      break;
+  }
+
+  if (--file->pending > 0)
+    return;
+
+  if (file->state == URING_FILE_OPENING)
+    _uring_start_read(uring, file);
+  else
+    _uring_finish_file(file);
+}
+
+
+//
+// _uring_reap
+//
+// Handles every completed request. Once requests have been abandoned their
+// files could be gone, and their completions are ignored.
+//
+
+void _uring_reap(
+    URING* uring)
+{
+  struct io_uring_cqe* cqe;
+
+  unsigned head = *uring->cq_head;
+
+  if (uring->abandoned)
+    return;
+
+  while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+  {
+    cqe = &uring->cqes[head & *uring->cq_mask];
+    _uring_complete(uring, cqe->user_data, cqe->res);
+    head++;
+  }
+
+  __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+//
+// _uring_drop_unsubmitted
+//
+// Removes from the queue the requests that the kernel didn't take, after
+// submitting failed, and completes them with an error.
+//
+
+void _uring_drop_unsubmitted(
+    URING* uring)
+{
+  unsigned head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = uring->sq_pending_tail;
+
+  __atomic_store_n(uring->sq_tail, head, __ATOMIC_RELEASE);
+  uring->sq_pending_tail = head;
+
+  for (; head != tail; head++)
+    _uring_complete(
+        uring, uring->sqes[head & *uring->sq_mask].user_data, -ECANCELED);
+}
+
+
+//
+// _uring_submit
+//
+// Submits the requests queued with _uring_get_sqe, and waits until at least
+// one request completes if wait is non-zero. Returns zero or an errno
+// value.
+//
+
+int _uring_submit(
+    URING* uring,
+    int wait)
+{
+  unsigned to_submit;
+  long result;
+
+  __atomic_store_n(uring->sq_tail, uring->sq_pending_tail, __ATOMIC_RELEASE);
+
+  to_submit = uring->sq_pending_tail -
+      __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+
+  if (to_submit == 0 && !wait)
+    return 0;
+
+  result = syscall(
+      __NR_io_uring_enter,
+      uring->fd,
+      to_submit,
+      wait ? 1 : 0,
+      wait ? IORING_ENTER_GETEVENTS : 0,
+      NULL,
+      0);
+
+  if (result == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+    return errno;
+
+  return 0;
+}
+
+
+//
+// _uring_check
+//
+// Handles the result of _uring_submit. After the first error no more
+// requests are submitted, and after the second one the requests in flight
+// are abandoned.
+//
+
+void _uring_check(
+    URING* uring,
+    int result)
+{
+  if (result == 0)
+    return;
+
+  if (uring->error == 0)
+  {
+    uring->error = result;
+    _uring_drop_unsubmitted(uring);
+  }
+  else
+  {
+    uring->abandoned = 1;
+  }
+}
+
+
+//
+// uring_start_reads
+//
+// Starts reading the files whose paths are in files[0..count), up to
+// URING_MAX_FILES, and returns without waiting for them. Relative paths are
+// relative to the directory open as dir_fd, which can be AT_FDCWD, and must
+// remain valid until the files are read. Each file is opened and its size
+// obtained with a pair of requests, and if it's a regular file not larger
+// than max_size it's read with another request as soon as both complete.
+//
+// No more than URING_MAX_READS files can be being read at once, and every
+// file must be waited for with uring_wait_file. Returns an errno value if
+// the requests couldn't be submitted, the files are not read then.
+//
+
+int uring_start_reads(
+    URING* uring,
+    int dir_fd,
+    URING_FILE* files,
+    int count,
+    size_t max_size)
+{
+  struct io_uring_sqe* sqe;
+
+  int i;
+
+  for (i = 0; i < count; i++)
+  {
+    files[i].data = NULL;
+    files[i].size = 0;
+    files[i].max_size = max_size;
+    files[i].fd = -1;
+    files[i].stx = NULL;
+    files[i].state = URING_FILE_DONE;
+    files[i].pending = 0;
+
+    if (uring->error != 0)
+      continue;
+
+    files[i].stx = malloc(sizeof(struct statx));
+
+    if (files[i].stx == NULL)
+      continue;
+
+    files[i].state = URING_FILE_OPENING;
+    files[i].pending = 2;
+
+    sqe = _uring_get_sqe(uring, &files[i], URING_OP_OPEN);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dir_fd;
+    sqe->addr = (uint64_t) (uintptr_t) files[i].path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+
+    sqe = _uring_get_sqe(uring, &files[i], URING_OP_STATX);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dir_fd;
+    sqe->addr = (uint64_t) (uintptr_t) files[i].path;
+    sqe->len = STATX_TYPE | STATX_SIZE;
+    sqe->off = (uint64_t) (uintptr_t) files[i].stx;
+  }
+
+  if (uring->error != 0)
+    return uring->error;
+
+  _uring_check(uring, _uring_submit(uring, 0));
+
+  return uring->error;
+}
+
+
+//
+// uring_wait_file
+//
+// Waits until a file passed to uring_start_reads is read or known to be
+// unreadable. Other files are handled too, even if this one is done already,
+// so that their reads start as soon as they are opened.
+//
+// If waiting fails the requests in flight are abandoned, their buffers are
+// leaked as the kernel could still write to them, and the files are left
+// unread.
+//
+
+void uring_wait_file(
+    URING* uring,
+    URING_FILE* file)
+{
+  _uring_reap(uring);
+  _uring_check(uring, _uring_submit(uring, 0));
+
+  while (file->state != URING_FILE_DONE && !uring->abandoned)
+  {
+    _uring_check(uring, _uring_submit(uring, 1));
+    _uring_reap(uring);
+  }
+
+  if (file->state != URING_FILE_DONE)
+  {
+    if (file->fd >= 0)
+      close(file->fd);
+
+    file->fd = -1;
+    file->stx = NULL;
+    file->data = NULL;
+    file->size = 0;
+    file->state = URING_FILE_DONE;
+  }
+}
+
+#else
+
+int uring_init(
+    URING* uring)
+{
+  uring->fd = -1;
+  return ENOSYS;
+}
+
+
+void uring_destroy(
+    URING* uring)
+{
+}
+
+
+int uring_start_reads(
+    URING* uring,
+    int dir_fd,
+    URING_FILE* files,
+    int count,
+    size_t max_size)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+  {
+    files[i].data = NULL;
+    files[i].size = 0;
+  }
+
+  return ENOSYS;
+}
+
+
+void uring_wait_file(
+    URING* uring,
+    URING_FILE* file)
+{
+}
+
+#endif
@@ -0,0 +1,122 @@
+/*
+Copyright (c) 2016. The YARA Authors. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+   http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && HAVE_DECL_IORING_OP_STATX && \
+    defined(HAVE_STATX)
+#define USE_IO_URING 1
+#endif
+
+
+// Maximum number of files passed to a single call to uring_start_reads,
+// and maximum number of files being read at once.
+#define URING_MAX_FILES  32
+#define URING_MAX_READS  (2 * URING_MAX_FILES)
+
+
+typedef struct _URING_FILE
+{
+  const char* path;
+
+  // Contents of the file allocated with malloc, or NULL if the file couldn't
+  // be read or was larger than the maximum size. Valid once uring_wait_file
+  // returns.
+  uint8_t* data;
+  size_t size;
+
+  // Used by uring.c while the file is being read.
+  size_t max_size;
+  void* stx;
+  int fd;
+  int state;
+  int pending;
+
+} URING_FILE;
+
+
+#ifdef USE_IO_URING
+
+#include <linux/io_uring.h>
+
+typedef struct _URING
+{
+  int fd;
+
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+
+  // Tail of the submission queue including the entries being filled, which
+  // is published to the kernel when they are submitted.
+  unsigned sq_pending_tail;
+
+  // Error that stopped new requests from being submitted, zero if none.
+  // Once waiting fails too the requests in flight are abandoned.
+  int error;
+  int abandoned;
+
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+} URING;
+
+#else
+
+typedef struct _URING
+{
+  int fd;
+
+} URING;
+
+#endif
+
+
+int uring_init(
+    URING* uring);
+
+void uring_destroy(
+    URING* uring);
+
+int uring_start_reads(
+    URING* uring,
+    int dir_fd,
+    URING_FILE* files,
+    int count,
+    size_t max_size);
+
+void uring_wait_file(
+    URING* uring,
+    URING_FILE* file);
+
+#endif
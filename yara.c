@@ -17,7 +17,10 @@ limitations under the License.
 #if !defined(_WIN32) && !defined(__CYGWIN__)
 
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <unistd.h>
 #include <inttypes.h>
 
@@ -39,7 +42,10 @@ limitations under the License.
 #include <yara.h>
 
 #include "args.h"
+#include "deque.h"
+#include "output.h"
 #include "threading.h"
+#include "uring.h"
 #include "config.h"
 
 
@@ -65,6 +71,14 @@ typedef struct _MODULE_DATA
 {
   const char* module_name;
   YR_MAPPED_FILE mapped_file;
+
+  // Data passed to the module. It's usually the mapped file itself, but
+  // modules able to preprocess their data once for all the scanned files
+  // get a handle to the preprocessed data instead.
+
+  void* data;
+  size_t data_size;
+
   struct _MODULE_DATA* next;
 
 } MODULE_DATA;
@@ -77,6 +91,20 @@ typedef struct _THREAD_ARGS
 } THREAD_ARGS;
 
 
+// Passed as user data to the scanning functions, the results are formatted
+// into the output buffer of the thread scanning the target.
+
+typedef struct _SCAN_TARGET
+{
+  const char* name;
+  OUTPUT_BUFFER* output;
+
+  int rules_count;
+  double start_time;
+
+} SCAN_TARGET;
+
+
 typedef struct _QUEUED_FILE {
 
   char* path;
@@ -84,6 +112,26 @@ typedef struct _QUEUED_FILE {
 } QUEUED_FILE;
 
 
+// A size-limited queue stored as a circular array, files are removed from
+// the head position and new files are added at the tail position. The array
+// has room for one extra element to avoid head being equal to tail in a full
+// queue. The only situation where head == tail is when queue is empty.
+
+typedef struct _FILE_QUEUE {
+
+  QUEUED_FILE files[MAX_QUEUED_FILES + 1];
+
+  int head;
+  int tail;
+
+  SEMAPHORE used_slots;
+  SEMAPHORE unused_slots;
+
+  MUTEX mutex;
+
+} FILE_QUEUE;
+
+
 #define MAX_ARGS_TAG            32
 #define MAX_ARGS_IDENTIFIER     32
 #define MAX_ARGS_EXT_VAR        32
@@ -106,6 +154,12 @@ int show_version = FALSE;
 int show_help = FALSE;
 int ignore_warnings = FALSE;
 int fast_scan = FALSE;
+int use_io_uring = FALSE;
+int all_processes = FALSE;
+int skip_anonymous = FALSE;
+int skip_file_backed = FALSE;
+int writable_only = FALSE;
+int executable_only = FALSE;
 int negate = FALSE;
 int count = 0;
 int limit = 0;
@@ -113,9 +167,27 @@ int timeout = 1000000;
 int stack_size = DEFAULT_STACK_SIZE;
 int threads = 8;
 
+char* excluded_paths = NULL;
+char* scan_list_path = NULL;
+char* output_order = NULL;
+char* output_format = NULL;
+char* cache_path = NULL;
+
+// Results of previous scans, shared by all the scanning threads.
+YR_SCAN_CACHE* scan_cache = NULL;
+
+// Write one JSON object per scanned target instead of text.
+int json_lines = FALSE;
+
+// Write each rule's results as soon as they are ready instead of waiting
+// for the whole target to be scanned.
+int flush_each_rule = FALSE;
+
 
 #define USAGE_STRING \
-    "Usage: yara [OPTION]... RULES_FILE FILE | DIR | PID"
+    "Usage: yara [OPTION]... RULES_FILE FILE | DIR | PID\n" \
+    "       yara [OPTION]... --all-processes RULES_FILE\n" \
+    "       yara [OPTION]... --scan-list=LIST RULES_FILE"
 
 
 args_option_t options[] =
@@ -145,7 +217,8 @@ args_option_t options[] =
       "print rules' namespace"),
 
   OPT_INTEGER('p', "threads", &threads,
-      "use the specified NUMBER of threads to scan a directory", "NUMBER"),
+      "use the specified NUMBER of threads to scan a directory or all "
+      "processes", "NUMBER"),
 
   OPT_INTEGER('l', "max-rules", &limit,
       "abort scanning after matching a NUMBER of rules", "NUMBER"),
@@ -168,6 +241,44 @@ args_option_t options[] =
   OPT_BOOLEAN('f', "fast-scan", &fast_scan,
       "fast matching mode"),
 
+  OPT_BOOLEAN('\0', "io-uring", &use_io_uring,
+      "read files with io_uring while scanning a directory (Linux only)"),
+
+  OPT_BOOLEAN('\0', "all-processes", &all_processes,
+      "scan all running processes"),
+
+  OPT_STRING('\0', "scan-list", &scan_list_path,
+      "scan the files and directories listed in LIST, one per line or "
+      "separated by null characters, - reads the list from stdin", "LIST"),
+
+  OPT_BOOLEAN('\0', "skip-anonymous", &skip_anonymous,
+      "skip process memory not mapped from a file"),
+
+  OPT_BOOLEAN('\0', "skip-file-backed", &skip_file_backed,
+      "skip process memory mapped from a file"),
+
+  OPT_BOOLEAN('\0', "writable-only", &writable_only,
+      "scan only writable process memory"),
+
+  OPT_BOOLEAN('\0', "executable-only", &executable_only,
+      "scan only executable process memory"),
+
+  OPT_STRING('\0', "exclude-paths", &excluded_paths,
+      "skip process memory mapped from paths starting with any of PREFIXES",
+      "PREFIXES"),
+
+  OPT_STRING('\0', "cache", &cache_path,
+      "skip files whose results for the same rules are stored in FILE, "
+      "and store the results of the files scanned", "FILE"),
+
+  OPT_STRING('\0', "format", &output_format,
+      "write results as plain text (text) or as one JSON object per scanned "
+      "file (jsonl)", "FORMAT"),
+
+  OPT_STRING('\0', "output-order", &output_order,
+      "write results grouped by scanned file (file) or as they are found "
+      "(none)", "ORDER"),
+
   OPT_BOOLEAN('w', "no-warnings", &ignore_warnings,
       "disable warnings"),
 
@@ -181,102 +292,193 @@ args_option_t options[] =
 };
 
 
-// file_queue is size-limited queue stored as a circular array, files are
-// removed from queue_head position and new files are added at queue_tail
-// position. The array has room for one extra element to avoid queue_head
-// being equal to queue_tail in a full queue. The only situation where
-// queue_head == queue_tail is when queue is empty.
+FILE_QUEUE file_queue;
 
-QUEUED_FILE file_queue[MAX_QUEUED_FILES + 1];
-
-int queue_head;
-int queue_tail;
-
-SEMAPHORE used_slots;
-SEMAPHORE unused_slots;
-
-MUTEX queue_mutex;
 MUTEX output_mutex;
 
+// Protects the number of matching rules, shared by all the threads.
+MUTEX count_mutex;
+
 MODULE_DATA* modules_data_list = NULL;
 
 
-int file_queue_init()
+int file_queue_init(
+    FILE_QUEUE* queue)
 {
   int result;
 
-  queue_tail = 0;
-  queue_head = 0;
+  queue->tail = 0;
+  queue->head = 0;
 
-  result = mutex_init(&queue_mutex);
+  result = mutex_init(&queue->mutex);
 
   if (result != 0)
     return result;
 
-  result = semaphore_init(&used_slots, 0);
+  result = semaphore_init(&queue->used_slots, 0);
 
   if (result != 0)
     return result;
 
- return semaphore_init(&unused_slots, MAX_QUEUED_FILES);
+ return semaphore_init(&queue->unused_slots, MAX_QUEUED_FILES);
 }
 
 
-void file_queue_destroy()
+void file_queue_destroy(
+    FILE_QUEUE* queue)
 {
-  mutex_destroy(&queue_mutex);
-  semaphore_destroy(&unused_slots);
-  semaphore_destroy(&used_slots);
+  mutex_destroy(&queue->mutex);
+  semaphore_destroy(&queue->unused_slots);
+  semaphore_destroy(&queue->used_slots);
 }
 
 
-void file_queue_finish()
+void file_queue_finish(
+    FILE_QUEUE* queue)
 {
   int i;
 
   for (i = 0; i < MAX_THREADS; i++)
-    semaphore_release(&used_slots);
+    semaphore_release(&queue->used_slots);
 }
 
 
 void file_queue_put(
+    FILE_QUEUE* queue,
     const char* file_path)
 {
-  semaphore_wait(&unused_slots);
-  mutex_lock(&queue_mutex);
+  semaphore_wait(&queue->unused_slots);
+  mutex_lock(&queue->mutex);
 
-  file_queue[queue_tail].path = strdup(file_path);
-  queue_tail = (queue_tail + 1) % (MAX_QUEUED_FILES + 1);
+  queue->files[queue->tail].path = strdup(file_path);
+  queue->tail = (queue->tail + 1) % (MAX_QUEUED_FILES + 1);
 
-  mutex_unlock(&queue_mutex);
-  semaphore_release(&used_slots);
+  mutex_unlock(&queue->mutex);
+  semaphore_release(&queue->used_slots);
 }
 
 
-char* file_queue_get()
+int _file_queue_take(
+    FILE_QUEUE* queue,
+    QUEUED_FILE* file)
 {
-  char* result;
+  int result;
 
-  semaphore_wait(&used_slots);
-  mutex_lock(&queue_mutex);
+  mutex_lock(&queue->mutex);
 
-  if (queue_head == queue_tail) // queue is empty
+  if (queue->head == queue->tail) // queue is empty
   {
-    result = NULL;
+    result = FALSE;
   }
   else
   {
-    result = file_queue[queue_head].path;
-    queue_head = (queue_head + 1) % (MAX_QUEUED_FILES + 1);
+    *file = queue->files[queue->head];
+    queue->head = (queue->head + 1) % (MAX_QUEUED_FILES + 1);
+    result = TRUE;
   }
 
-  mutex_unlock(&queue_mutex);
-  semaphore_release(&unused_slots);
+  mutex_unlock(&queue->mutex);
+  semaphore_release(&queue->unused_slots);
 
   return result;
 }
 
 
+//
+// file_queue_get
+//
+// Waits for a file to be available in the queue and removes it. Returns
+// FALSE if the queue is finished, in which case no file is returned.
+//
+
+int file_queue_get(
+    FILE_QUEUE* queue,
+    QUEUED_FILE* file)
+{
+  semaphore_wait(&queue->used_slots);
+
+  return _file_queue_take(queue, file);
+}
+
+
+//
+// file_queue_try_get
+//
+// Like file_queue_get, but returns FALSE without waiting if the queue is
+// empty.
+//
+
+int file_queue_try_get(
+    FILE_QUEUE* queue,
+    QUEUED_FILE* file)
+{
+  if (semaphore_try_wait(&queue->used_slots) != 0)
+    return FALSE;
+
+  return _file_queue_take(queue, file);
+}
+
+
+//
+// read_listed_path
+//
+// Reads the next path from a list of paths separated by newlines or by null
+// characters, like the ones produced by "find -print0". The separator is the
+// first of them found in the list, separator must point to -1 before reading
+// the first path. Empty paths are skipped. Returns FALSE at the end of the
+// list.
+//
+
+int read_listed_path(
+    FILE* list,
+    char* path,
+    size_t path_size,
+    int* separator)
+{
+  size_t length;
+  int c;
+
+  do
+  {
+    length = 0;
+
+    while ((c = getc(list)) != EOF)
+    {
+      if (*separator == -1 && (c == '\n' || c == '\0'))
+        *separator = c;
+
+      if (c == *separator)
+        break;
+
+      if (length < path_size - 1)
+        path[length] = (char) c;
+
+      length++;
+    }
+
+    if (length >= path_size)
+    {
+      path[path_size - 1] = '\0';
+
+      mutex_lock(&output_mutex);
+      fprintf(stderr, "error: path too long: %s...\n", path);
+      mutex_unlock(&output_mutex);
+
+      length = 0;
+    }
+    else if (length > 0 && *separator == '\n' && path[length - 1] == '\r')
+    {
+      length--;
+    }
+  }
+  while (length == 0 && c != EOF);
+
+  path[length] = '\0';
+
+  return length > 0;
+}
+
+
 #if defined(_WIN32) || defined(__CYGWIN__)
 
 int is_directory(
@@ -292,6 +494,7 @@ int is_directory(
 }
 
 void scan_dir(
+    FILE_QUEUE* queue,
     const char* dir,
     int recursive,
     time_t start_time,
@@ -316,13 +519,13 @@ void scan_dir(
 
       if (!(FindFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
       {
-        file_queue_put(full_path);
+        file_queue_put(queue, full_path);
       }
       else if (recursive &&
                strcmp(FindFileData.cFileName, ".") != 0 &&
                strcmp(FindFileData.cFileName, "..") != 0)
       {
-        scan_dir(full_path, recursive, start_time, rules, callback);
+        scan_dir(queue, full_path, recursive, start_time, rules, callback);
       }
 
     } while (FindNextFile(hFind, &FindFileData));
@@ -344,55 +547,10 @@ int is_directory(
   return 0;
 }
 
-
-void scan_dir(
-    const char* dir,
-    int recursive,
-    time_t start_time,
-    YR_RULES* rules,
-    YR_CALLBACK_FUNC callback)
-{
-  DIR* dp = opendir(dir);
-
-  if (dp)
-  {
-    struct dirent* de = readdir(dp);
-
-    while (de && difftime(time(NULL), start_time) < timeout)
-    {
-      char full_path[MAX_PATH];
-      struct stat st;
-
-      snprintf(full_path, sizeof(full_path), "%s/%s", dir, de->d_name);
-
-      int err = lstat(full_path, &st);
-
-      if (err == 0)
-      {
-        if(S_ISREG(st.st_mode))
-        {
-          file_queue_put(full_path);
-        }
-        else if(recursive &&
-                S_ISDIR(st.st_mode) &&
-                !S_ISLNK(st.st_mode) &&
-                strcmp(de->d_name, ".") != 0 &&
-                strcmp(de->d_name, "..") != 0)
-        {
-          scan_dir(full_path, recursive, start_time, rules, callback);
-        }
-      }
-
-      de = readdir(dp);
-    }
-
-    closedir(dp);
-  }
-}
-
 #endif
 
 void print_string(
+    OUTPUT_BUFFER* output,
     uint8_t* data,
     int length)
 {
@@ -401,12 +559,12 @@ void print_string(
   for (int i = 0; i < length; i++)
   {
     if (str[i] >= 32 && str[i] <= 126)
-      printf("%c", str[i]);
+      output_putc(output, str[i]);
     else
-      printf("\\x%02X", (uint8_t) str[i]);
+      output_printf(output, "\\x%02X", (uint8_t) str[i]);
   }
 
-  printf("\n");
+  output_putc(output, '\n');
 }
 
 
@@ -420,6 +578,7 @@ static char cescapes[] =
 
 
 void print_escaped(
+    OUTPUT_BUFFER* output,
     uint8_t* data,
     size_t length)
 {
@@ -432,34 +591,35 @@ void print_escaped(
       case '\"':
       case '\'':
       case '\\':
-        printf("\\%c", data[i]);
+        output_printf(output, "\\%c", data[i]);
         break;
 
       default:
         if (data[i] >= 127)
-          printf("\\%03o", data[i]);
+          output_printf(output, "\\%03o", data[i]);
         else if (data[i] >= 32)
-          putchar(data[i]);
+          output_putc(output, data[i]);
         else if (cescapes[data[i]] != 0)
-          printf("\\%c", cescapes[data[i]]);
+          output_printf(output, "\\%c", cescapes[data[i]]);
         else
-          printf("\\%03o", data[i]);
+          output_printf(output, "\\%03o", data[i]);
     }
   }
 }
 
 
 void print_hex_string(
+    OUTPUT_BUFFER* output,
     uint8_t* data,
     int length)
 {
   for (int i = 0; i < min(32, length); i++)
-    printf("%02X ", (uint8_t) data[i]);
+    output_printf(output, "%02X ", (uint8_t) data[i]);
 
   if (length > 32)
-    printf("...");
+    output_write(output, "...", 3);
 
-  printf("\n");
+  output_putc(output, '\n');
 }
 
 
@@ -518,13 +678,171 @@ void print_compiler_error(
 }
 
 
+//
+// get_time
+//
+// Returns the time in seconds from an arbitrary point, only meaningful for
+// measuring durations.
+//
+
+double get_time()
+{
+  #if defined(_WIN32) || defined(__CYGWIN__)
+  LARGE_INTEGER frequency;
+  LARGE_INTEGER counter;
+
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+
+  return (double) counter.QuadPart / frequency.QuadPart;
+  #else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+  #endif
+}
+
+
+//
+// target_begin
+//
+// Must be called before scanning a target. In JSON Lines format it opens
+// the object describing the target, the rules are added to it as they are
+// reported by the callback.
+//
+
+void target_begin(
+    SCAN_TARGET* target,
+    const char* name)
+{
+  target->name = name;
+  target->rules_count = 0;
+  target->start_time = get_time();
+
+  if (json_lines)
+  {
+    output_write(target->output, "{\"target\":", 10);
+    output_json_string(
+        target->output, (const uint8_t*) name, strlen(name));
+    output_write(target->output, ",\"matches\":[", 12);
+  }
+}
+
+
+//
+// target_end
+//
+// Must be called after scanning a target with the result of the scan.
+// Writes the target's results.
+//
+
+void target_end(
+    SCAN_TARGET* target,
+    int result)
+{
+  if (json_lines)
+    output_printf(
+        target->output,
+        "],\"scan_time\":%.6f,\"error\":%d}\n",
+        get_time() - target->start_time,
+        result);
+
+  output_flush(target->output);
+}
+
+
+void print_rule_json(
+    OUTPUT_BUFFER* output,
+    YR_RULE* rule)
+{
+  YR_META* meta;
+  YR_STRING* string;
+  YR_MATCH* match;
+
+  const char* tag;
+  int first = TRUE;
+
+  output_write(output, "{\"rule\":", 8);
+  output_json_string(
+      output, (uint8_t*) rule->identifier, strlen(rule->identifier));
+
+  output_write(output, ",\"namespace\":", 13);
+  output_json_string(
+      output, (uint8_t*) rule->ns->name, strlen(rule->ns->name));
+
+  output_write(output, ",\"tags\":[", 9);
+
+  yr_rule_tags_foreach(rule, tag)
+  {
+    if (tag != rule->tags)
+      output_putc(output, ',');
+
+    output_json_string(output, (uint8_t*) tag, strlen(tag));
+  }
+
+  output_write(output, "],\"meta\":{", 10);
+
+  yr_rule_metas_foreach(rule, meta)
+  {
+    if (meta != rule->metas)
+      output_putc(output, ',');
+
+    output_json_string(
+        output, (uint8_t*) meta->identifier, strlen(meta->identifier));
+
+    output_putc(output, ':');
+
+    if (meta->type == META_TYPE_INTEGER)
+      output_printf(output, "%" PRId64, meta->integer);
+    else if (meta->type == META_TYPE_BOOLEAN)
+      output_printf(output, "%s", meta->integer ? "true" : "false");
+    else
+      output_json_string(
+          output, (uint8_t*) meta->string, strlen(meta->string));
+  }
+
+  output_write(output, "},\"strings\":[", 13);
+
+  yr_rule_strings_foreach(rule, string)
+  {
+    yr_string_matches_foreach(string, match)
+    {
+      if (!first)
+        output_putc(output, ',');
+
+      output_write(output, "{\"identifier\":", 14);
+      output_json_string(
+          output, (uint8_t*) string->identifier, strlen(string->identifier));
+
+      output_printf(
+          output,
+          ",\"offset\":%" PRId64 ",\"data\":",
+          (int64_t) (match->base + match->offset));
+
+      output_json_string(output, match->data, match->length);
+      output_putc(output, '}');
+
+      first = FALSE;
+    }
+  }
+
+  output_write(output, "]}", 2);
+}
+
+
 int handle_message(
     int message,
     YR_RULE* rule,
     void* data)
 {
+  SCAN_TARGET* target = (SCAN_TARGET*) data;
+  OUTPUT_BUFFER* output = target->output;
+
   const char* tag;
   int show = TRUE;
+  int limit_reached;
 
   if (tags[0] != NULL)
   {
@@ -567,29 +885,35 @@ int handle_message(
 
   show = show && ((!negate && is_matching) || (negate && !is_matching));
 
-  if (show)
+  if (show && json_lines)
   {
-    mutex_lock(&output_mutex);
+    if (target->rules_count > 0)
+      output_putc(output, ',');
 
+    print_rule_json(output, rule);
+    target->rules_count++;
+  }
+  else if (show)
+  {
     if (show_namespace)
-      printf("%s:", rule->ns->name);
+      output_printf(output, "%s:", rule->ns->name);
 
-    printf("%s ", rule->identifier);
+    output_printf(output, "%s ", rule->identifier);
 
     if (show_tags)
     {
-      printf("[");
+      output_putc(output, '[');
 
       yr_rule_tags_foreach(rule, tag)
       {
         // print a comma except for the first tag
         if (tag != rule->tags)
-          printf(",");
+          output_putc(output, ',');
 
-        printf("%s", tag);
+        output_printf(output, "%s", tag);
       }
 
-      printf("] ");
+      output_write(output, "] ", 2);
     }
 
     // Show meta-data.
@@ -598,33 +922,39 @@ int handle_message(
     {
       YR_META* meta;
 
-      printf("[");
+      output_putc(output, '[');
 
       yr_rule_metas_foreach(rule, meta)
       {
         if (meta != rule->metas)
-          printf(",");
+          output_putc(output, ',');
 
         if (meta->type == META_TYPE_INTEGER)
         {
-          printf("%s=%" PRId64, meta->identifier, meta->integer);
+          output_printf(
+              output, "%s=%" PRId64, meta->identifier, meta->integer);
         }
         else if (meta->type == META_TYPE_BOOLEAN)
         {
-          printf("%s=%s", meta->identifier, meta->integer ? "true" : "false");
+          output_printf(
+              output,
+              "%s=%s",
+              meta->identifier,
+              meta->integer ? "true" : "false");
         }
         else
         {
-          printf("%s=\"", meta->identifier);
-          print_escaped((uint8_t*) (meta->string), strlen(meta->string));
-          putchar('"');
+          output_printf(output, "%s=\"", meta->identifier);
+          print_escaped(
+              output, (uint8_t*) (meta->string), strlen(meta->string));
+          output_putc(output, '"');
         }
       }
 
-      printf("] ");
+      output_write(output, "] ", 2);
     }
 
-    printf("%s\n", (char*) data);
+    output_printf(output, "%s\n", target->name);
 
     // Show matched strings.
 
@@ -638,25 +968,32 @@ int handle_message(
 
         yr_string_matches_foreach(string, match)
         {
-          printf("0x%" PRIx64 ":%s: ",
+          output_printf(output, "0x%" PRIx64 ":%s: ",
               match->base + match->offset,
               string->identifier);
 
           if (STRING_IS_HEX(string))
-            print_hex_string(match->data, match->length);
+            print_hex_string(output, match->data, match->length);
           else
-            print_string(match->data, match->length);
+            print_string(output, match->data, match->length);
         }
       }
     }
 
-    mutex_unlock(&output_mutex);
+    if (flush_each_rule)
+      output_flush(output);
   }
 
+  mutex_lock(&count_mutex);
+
   if (is_matching)
     count++;
 
-  if (limit != 0 && count >= limit)
+  limit_reached = (limit != 0 && count >= limit);
+
+  mutex_unlock(&count_mutex);
+
+  if (limit_reached)
     return CALLBACK_ABORT;
 
   return CALLBACK_CONTINUE;
@@ -687,8 +1024,8 @@ int callback(
       {
         if (strcmp(module_data->module_name, mi->module_name) == 0)
         {
-          mi->module_data = module_data->mapped_file.data;
-          mi->module_data_size = module_data->mapped_file.size;
+          mi->module_data = module_data->data;
+          mi->module_data_size = module_data->data_size;
           break;
         }
 
@@ -703,6 +1040,10 @@ int callback(
       {
         object = (YR_OBJECT*) message_data;
 
+        // Module data is printed straight to stdout, results buffered for
+        // this target must be written first.
+
+        output_flush(((SCAN_TARGET*) user_data)->output);
         mutex_lock(&output_mutex);
 
         yr_object_print_data(object, 0, 1);
@@ -718,126 +1059,1259 @@ int callback(
 }
 
 
+int process_scan_flags()
+{
+  int flags = 0;
+
+  if (fast_scan)
+    flags |= SCAN_FLAGS_FAST_MODE;
+
+  if (skip_anonymous)
+    flags |= SCAN_FLAGS_PROCESS_SKIP_ANONYMOUS;
+
+  if (skip_file_backed)
+    flags |= SCAN_FLAGS_PROCESS_SKIP_FILE_BACKED;
+
+  if (writable_only)
+    flags |= SCAN_FLAGS_PROCESS_WRITABLE_ONLY;
+
+  if (executable_only)
+    flags |= SCAN_FLAGS_PROCESS_EXECUTABLE_ONLY;
+
+  return flags;
+}
+
+
 #if defined(_WIN32) || defined(__CYGWIN__)
+
 DWORD WINAPI scanning_thread(LPVOID param)
-#else
-void* scanning_thread(void* param)
-#endif
 {
   int result = ERROR_SUCCESS;
   THREAD_ARGS* args = (THREAD_ARGS*) param;
-  char* file_path = file_queue_get();
+  QUEUED_FILE file;
+  OUTPUT_BUFFER output;
+  SCAN_TARGET target;
 
   int flags = 0;
 
   if (fast_scan)
     flags |= SCAN_FLAGS_FAST_MODE;
 
-  while (file_path != NULL)
+  if (output_init(&output, &output_mutex) != 0)
+    exit(EXIT_FAILURE);
+
+  target.output = &output;
+
+  // Once the timeout expires the remaining files are taken from the queue
+  // without scanning them, so that the threads putting files in the queue
+  // don't wait forever.
+
+  while (file_queue_get(&file_queue, &file))
   {
     int elapsed_time = (int) difftime(time(NULL), args->start_time);
 
     if (elapsed_time < timeout)
     {
-      result = yr_rules_scan_file(
+      target_begin(&target, file.path);
+
+      result = yr_rules_scan_file_cached(
           args->rules,
-          file_path,
+          scan_cache,
+          file.path,
           flags,
           callback,
-          file_path,
+          &target,
           timeout - elapsed_time);
 
+      target_end(&target, result);
+
       if (result != ERROR_SUCCESS)
       {
         mutex_lock(&output_mutex);
-        fprintf(stderr, "error scanning %s: ", file_path);
+        fprintf(stderr, "error scanning %s: ", file.path);
         print_scanner_error(result);
         mutex_unlock(&output_mutex);
       }
-
-      free(file_path);
-      file_path = file_queue_get();
-    }
-    else
-    {
-      file_path = NULL;
     }
+
+    free(file.path);
   }
 
+  output_destroy(&output);
   yr_finalize_thread();
 
   return 0;
 }
 
 
-int is_integer(
-    const char *str)
+int scan_directory(
+    YR_RULES* rules,
+    const char* dir,
+    time_t start_time)
 {
-  if (*str == '-')
-    str++;
+  THREAD thread[MAX_THREADS];
+  THREAD_ARGS thread_args;
 
-  while(*str)
+  if (file_queue_init(&file_queue) != 0)
   {
-    if (!isdigit(*str))
-      return FALSE;
-    str++;
+    print_scanner_error(ERROR_INTERNAL_FATAL_ERROR);
+    return FALSE;
   }
 
+  thread_args.rules = rules;
+  thread_args.start_time = start_time;
+
+  for (int i = 0; i < threads; i++)
+  {
+    if (create_thread(&thread[i], scanning_thread, (void*) &thread_args))
+    {
+      print_scanner_error(ERROR_COULD_NOT_CREATE_THREAD);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  scan_dir(
+      &file_queue,
+      dir,
+      recursive_search,
+      start_time,
+      rules,
+      callback);
+
+  file_queue_finish(&file_queue);
+
+  // Wait for scan threads to finish
+  for (int i = 0; i < threads; i++)
+    thread_join(&thread[i]);
+
+  file_queue_destroy(&file_queue);
+
   return TRUE;
 }
 
 
-int is_float(
-    const char *str)
+int scan_list(
+    YR_RULES* rules,
+    FILE* list,
+    time_t start_time)
 {
-  int has_dot = FALSE;
+  THREAD thread[MAX_THREADS];
+  THREAD_ARGS thread_args;
 
-  if (*str == '-')      // skip the minus sign if present
-    str++;
+  char path[MAX_PATH];
+  int separator = -1;
 
-  if (*str == '.')      // float can't start with a dot
+  if (file_queue_init(&file_queue) != 0)
+  {
+    print_scanner_error(ERROR_INTERNAL_FATAL_ERROR);
     return FALSE;
+  }
 
-  while(*str)
-  {
-    if (*str == '.')
-    {
-      if (has_dot)      // two dots, not a float
-        return FALSE;
+  thread_args.rules = rules;
+  thread_args.start_time = start_time;
 
-      has_dot = TRUE;
-    }
-    else if (!isdigit(*str))
+  for (int i = 0; i < threads; i++)
+  {
+    if (create_thread(&thread[i], scanning_thread, (void*) &thread_args))
     {
-      return FALSE;
+      print_scanner_error(ERROR_COULD_NOT_CREATE_THREAD);
+      exit(EXIT_FAILURE);
     }
+  }
 
-    str++;
+  while (difftime(time(NULL), start_time) < timeout &&
+         read_listed_path(list, path, sizeof(path), &separator))
+  {
+    if (is_directory(path))
+      scan_dir(
+          &file_queue,
+          path,
+          recursive_search,
+          start_time,
+          rules,
+          callback);
+    else
+      file_queue_put(&file_queue, path);
   }
 
-  return has_dot; // to be float must contain a dot
+  file_queue_finish(&file_queue);
+
+  for (int i = 0; i < threads; i++)
+    thread_join(&thread[i]);
+
+  file_queue_destroy(&file_queue);
+
+  return TRUE;
 }
 
 
-int define_external_variables(
-    YR_RULES* rules,
-    YR_COMPILER* compiler)
-{
-  for (int i = 0; ext_vars[i] != NULL; i++)
-  {
-    char* equal_sign = strchr(ext_vars[i], '=');
+#else
 
-    if (!equal_sign)
-    {
-      fprintf(stderr, "error: wrong syntax for `-d` option.\n");
-      return FALSE;
-    }
+// Directories are scanned by a pool of workers. Each directory is a task,
+// and each worker keeps the tasks it creates in its own deque, taking the
+// most recent ones first. Idle workers steal the oldest tasks from the other
+// workers' deques. Entries are read in chunks of DIR_CHUNK_SIZE, so a large
+// directory is split in several tasks: the rest of the directory is made
+// available to other workers before scanning the files in each chunk. Paths
+// read from a scan list are put in file_queue by the main thread, workers
+// take them from there when their own deque is empty. With io_uring, each
+// worker starts reading the files in a chunk before scanning the files in
+// the chunk it took previously, so that reading and scanning overlap.
 
-    // Replace the equal sign with null character to split the external
-    // variable definition (i.e: myvar=somevalue) in two strings: identifier
-    // and value.
+#define DIR_CHUNK_SIZE  URING_MAX_FILES
 
-    *equal_sign = '\0';
+
+typedef struct _DIR_TASK
+{
+  char* path;
+
+  // Directory stream, NULL until the directory is opened. Once opened the
+  // task continues reading the directory where the previous chunk ended.
+  DIR* dir;
+
+} DIR_TASK;
+
+
+// Regular files found in a chunk of a directory's entries. The directory is
+// open as dir_fd, and files[i] is used for reading names[i] with io_uring if
+// reading is TRUE.
+
+typedef struct _FILE_CHUNK
+{
+  char* dir_path;
+  int dir_fd;
+  int reading;
+  int count;
+
+  char* names[DIR_CHUNK_SIZE];
+  URING_FILE files[DIR_CHUNK_SIZE];
+
+} FILE_CHUNK;
+
+
+typedef struct _SCAN_WORKER
+{
+  THREAD thread;
+  DEQUE deque;
+  URING uring;
+  OUTPUT_BUFFER output;
+
+  YR_RULES* rules;
+  time_t start_time;
+
+  unsigned int seed;
+  int use_uring;
+
+  // Chunk whose files are being read with io_uring. It's scanned when the
+  // worker takes another chunk or runs out of tasks.
+  FILE_CHUNK* queued_chunk;
+
+} SCAN_WORKER;
+
+
+SCAN_WORKER workers[MAX_THREADS];
+
+// Number of tasks created but not completed yet, the scan is finished when
+// it drops to zero.
+
+int64_t pending_tasks = 0;
+
+// Workers without anything to do wait on work_available, idle_workers is
+// the number of them waiting or about to wait.
+
+SEMAPHORE work_available;
+int idle_workers = 0;
+
+
+int timeout_expired(
+    time_t start_time)
+{
+  return difftime(time(NULL), start_time) >= timeout;
+}
+
+
+void scan_dir_task(
+    SCAN_WORKER* worker,
+    DIR_TASK* task);
+
+
+//
+// notify_work
+//
+// Wakes up a worker waiting for tasks, if any. Must be called after making
+// a new task available.
+//
+
+void notify_work()
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&idle_workers, __ATOMIC_SEQ_CST) > 0)
+    semaphore_release(&work_available);
+}
+
+
+//
+// task_done
+//
+// Called when a task is completed. After the last one every worker is woken
+// up so that they can finish.
+//
+
+void task_done()
+{
+  if (__atomic_sub_fetch(&pending_tasks, 1, __ATOMIC_SEQ_CST) == 0)
+  {
+    for (int i = 0; i < threads; i++)
+      semaphore_release(&work_available);
+  }
+}
+
+
+//
+// push_task
+//
+// Adds a task to the worker's deque. If the deque can't grow the task is
+// run right away instead.
+//
+
+void push_task(
+    SCAN_WORKER* worker,
+    DIR_TASK* task)
+{
+  __atomic_add_fetch(&pending_tasks, 1, __ATOMIC_SEQ_CST);
+
+  if (deque_push(&worker->deque, task) != 0)
+  {
+    scan_dir_task(worker, task);
+    task_done();
+  }
+  else
+  {
+    notify_work();
+  }
+}
+
+
+void push_dir(
+    SCAN_WORKER* worker,
+    const char* path)
+{
+  DIR_TASK* task = (DIR_TASK*) malloc(sizeof(DIR_TASK));
+
+  if (task == NULL)
+    return;
+
+  task->path = strdup(path);
+  task->dir = NULL;
+
+  if (task->path == NULL)
+  {
+    free(task);
+    return;
+  }
+
+  push_task(worker, task);
+}
+
+
+//
+// steal_task
+//
+// Tries to steal a task from every other worker, starting with a random
+// one. Returns NULL if all of them are empty.
+//
+
+DIR_TASK* steal_task(
+    SCAN_WORKER* worker)
+{
+  int first = rand_r(&worker->seed) % threads;
+
+  for (int i = 0; i < threads; i++)
+  {
+    SCAN_WORKER* victim = &workers[(first + i) % threads];
+    void* task;
+
+    if (victim == worker)
+      continue;
+
+    do
+    {
+      task = deque_steal(&victim->deque);
+    }
+    while (task == DEQUE_ABORT);
+
+    if (task != DEQUE_EMPTY)
+      return (DIR_TASK*) task;
+  }
+
+  return NULL;
+}
+
+
+void report_scan_error(
+    const char* path,
+    int error)
+{
+  mutex_lock(&output_mutex);
+  fprintf(stderr, "error scanning %s: ", path);
+  print_scanner_error(error);
+  mutex_unlock(&output_mutex);
+}
+
+
+//
+// scan_chunk
+//
+// Scans the files in a chunk and frees it. Files read with io_uring are
+// scanned from memory, files that couldn't be read that way are opened and
+// scanned as usual.
+//
+
+void scan_chunk(
+    SCAN_WORKER* worker,
+    FILE_CHUNK* chunk)
+{
+  URING_FILE* file;
+  SCAN_TARGET target;
+
+  char full_path[MAX_PATH];
+
+  int flags = 0;
+  int result;
+
+  if (fast_scan)
+    flags |= SCAN_FLAGS_FAST_MODE;
+
+  target.output = &worker->output;
+
+  for (int i = 0; i < chunk->count; i++)
+  {
+    int elapsed_time;
+
+    file = &chunk->files[i];
+
+    if (chunk->reading)
+      uring_wait_file(&worker->uring, file);
+
+    elapsed_time = (int) difftime(time(NULL), worker->start_time);
+
+    if (elapsed_time < timeout)
+    {
+      snprintf(full_path, sizeof(full_path), "%s/%s",
+          chunk->dir_path, chunk->names[i]);
+
+      target_begin(&target, full_path);
+
+      if (file->data != NULL)
+      {
+        result = yr_rules_scan_mem(
+            worker->rules,
+            file->data,
+            file->size,
+            flags,
+            callback,
+            &target,
+            timeout - elapsed_time);
+      }
+      else
+      {
+        int fd = openat(chunk->dir_fd, chunk->names[i], O_RDONLY);
+
+        if (fd != -1)
+        {
+          result = yr_rules_scan_fd_cached(
+              worker->rules,
+              scan_cache,
+              fd,
+              flags,
+              callback,
+              &target,
+              timeout - elapsed_time);
+
+          close(fd);
+        }
+        else
+        {
+          result = ERROR_COULD_NOT_OPEN_FILE;
+        }
+      }
+
+      target_end(&target, result);
+
+      if (result != ERROR_SUCCESS)
+        report_scan_error(full_path, result);
+    }
+
+    free(file->data);
+    free(chunk->names[i]);
+  }
+
+  close(chunk->dir_fd);
+  free(chunk->dir_path);
+  free(chunk);
+}
+
+
+//
+// queue_chunk
+//
+// Takes a chunk of files to scan. If the worker uses io_uring the files
+// start being read, and the chunk queued before is scanned meanwhile. The
+// chunk is scanned right away otherwise.
+//
+
+void queue_chunk(
+    SCAN_WORKER* worker,
+    FILE_CHUNK* chunk)
+{
+  FILE_CHUNK* previous = worker->queued_chunk;
+  uint32_t max_size;
+
+  for (int i = 0; i < chunk->count; i++)
+  {
+    chunk->files[i].path = chunk->names[i];
+    chunk->files[i].data = NULL;
+    chunk->files[i].size = 0;
+  }
+
+  chunk->reading = FALSE;
+
+  if (worker->use_uring)
+  {
+    yr_get_configuration(YR_CONFIG_FILE_READ_THRESHOLD, &max_size);
+
+    // If the reads can't be started the files are scanned from their paths,
+    // and the next chunks don't use io_uring.
+
+    if (uring_start_reads(
+            &worker->uring,
+            chunk->dir_fd,
+            chunk->files,
+            chunk->count,
+            max_size) != 0)
+      worker->use_uring = FALSE;
+
+    chunk->reading = TRUE;
+  }
+
+  worker->queued_chunk = chunk->reading ? chunk : NULL;
+
+  if (previous != NULL)
+    scan_chunk(worker, previous);
+
+  if (!chunk->reading)
+    scan_chunk(worker, chunk);
+}
+
+
+//
+// flush_chunk
+//
+// Scans the chunk queued by the worker, if any.
+//
+
+void flush_chunk(
+    SCAN_WORKER* worker)
+{
+  FILE_CHUNK* chunk = worker->queued_chunk;
+
+  if (chunk != NULL)
+  {
+    worker->queued_chunk = NULL;
+    scan_chunk(worker, chunk);
+  }
+}
+
+
+//
+// scan_dir_task
+//
+// Reads the next chunk of entries from the task's directory, creates tasks
+// for the subdirectories found and scans the regular files. Entry types are
+// taken from the directory entry when the file system provides them, and
+// files are opened relative to the directory, so that paths don't need to
+// be resolved again. Symbolic links are not followed.
+//
+
+void scan_dir_task(
+    SCAN_WORKER* worker,
+    DIR_TASK* task)
+{
+  FILE_CHUNK* chunk = NULL;
+
+  char full_path[MAX_PATH];
+
+  struct dirent* de = NULL;
+  struct stat st;
+
+  int is_dir;
+  int is_file;
+
+  if (task->dir == NULL && !timeout_expired(worker->start_time))
+    task->dir = opendir(task->path);
+
+  if (task->dir == NULL || timeout_expired(worker->start_time))
+    goto _exit;
+
+  chunk = (FILE_CHUNK*) malloc(sizeof(FILE_CHUNK));
+
+  if (chunk == NULL)
+    goto _exit;
+
+  chunk->dir_path = NULL;
+  chunk->count = 0;
+
+  // The rest of the directory could be read by another worker while files
+  // in this chunk are scanned, they need a descriptor of their own.
+
+  chunk->dir_fd = dup(dirfd(task->dir));
+
+  if (chunk->dir_fd == -1)
+    goto _exit;
+
+  while (chunk->count < DIR_CHUNK_SIZE && (de = readdir(task->dir)) != NULL)
+  {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+
+    if (de->d_type != DT_UNKNOWN)
+    {
+      is_dir = (de->d_type == DT_DIR);
+      is_file = (de->d_type == DT_REG);
+    }
+    else if (fstatat(
+        chunk->dir_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+    {
+      is_dir = S_ISDIR(st.st_mode);
+      is_file = S_ISREG(st.st_mode);
+    }
+    else
+    {
+      continue;
+    }
+
+    if (is_file)
+    {
+      chunk->names[chunk->count] = strdup(de->d_name);
+
+      if (chunk->names[chunk->count] != NULL)
+        chunk->count++;
+    }
+    else if (is_dir && recursive_search)
+    {
+      snprintf(full_path, sizeof(full_path), "%s/%s", task->path, de->d_name);
+      push_dir(worker, full_path);
+    }
+  }
+
+  chunk->dir_path = strdup(task->path);
+
+  if (de != NULL)
+  {
+    // There are more entries, the task goes back to the deque and can be
+    // stolen while this chunk is scanned.
+
+    push_task(worker, task);
+    task = NULL;
+  }
+
+  if (chunk->count > 0 && chunk->dir_path != NULL)
+  {
+    queue_chunk(worker, chunk);
+    chunk = NULL;
+  }
+
+_exit:
+
+  if (chunk != NULL)
+  {
+    for (int i = 0; i < chunk->count; i++)
+      free(chunk->names[i]);
+
+    if (chunk->dir_fd != -1)
+      close(chunk->dir_fd);
+
+    free(chunk->dir_path);
+    free(chunk);
+  }
+
+  if (task != NULL)
+  {
+    if (task->dir != NULL)
+      closedir(task->dir);
+
+    free(task->path);
+    free(task);
+  }
+}
+
+
+//
+// scan_listed_path
+//
+// Scans a path taken from a scan list. Directories become a new task,
+// anything else is scanned as a file, following symbolic links.
+//
+
+void scan_listed_path(
+    SCAN_WORKER* worker,
+    const char* path)
+{
+  SCAN_TARGET target;
+
+  int flags = 0;
+  int result;
+
+  int elapsed_time = (int) difftime(time(NULL), worker->start_time);
+
+  if (elapsed_time >= timeout)
+    return;
+
+  if (is_directory(path))
+  {
+    push_dir(worker, path);
+    return;
+  }
+
+  if (fast_scan)
+    flags |= SCAN_FLAGS_FAST_MODE;
+
+  target.output = &worker->output;
+  target_begin(&target, path);
+
+  result = yr_rules_scan_file_cached(
+      worker->rules,
+      scan_cache,
+      path,
+      flags,
+      callback,
+      &target,
+      timeout - elapsed_time);
+
+  target_end(&target, result);
+
+  if (result != ERROR_SUCCESS)
+    report_scan_error(path, result);
+}
+
+
+//
+// find_work
+//
+// Takes the next task from the worker's deque, or the next path from the
+// file queue while scanning a list, or steals a task from another worker.
+// Returns FALSE if there is nothing to do.
+//
+
+int find_work(
+    SCAN_WORKER* worker,
+    DIR_TASK** task,
+    QUEUED_FILE* file)
+{
+  *task = (DIR_TASK*) deque_pop(&worker->deque);
+
+  if (*task != NULL)
+    return TRUE;
+
+  // The file queue is used only while scanning a list of paths.
+
+  if (scan_list_path != NULL && file_queue_try_get(&file_queue, file))
+    return TRUE;
+
+  *task = steal_task(worker);
+
+  return *task != NULL;
+}
+
+
+void* worker_thread(void* param)
+{
+  SCAN_WORKER* worker = (SCAN_WORKER*) param;
+  QUEUED_FILE file;
+  DIR_TASK* task;
+
+  int found;
+
+  // Files found in the cache don't need to be read, so io_uring is not
+  // used together with the cache. The worker can stop using io_uring after
+  // an error, but it must be destroyed anyway.
+
+  int has_uring = use_io_uring && scan_cache == NULL &&
+      uring_init(&worker->uring) == 0;
+
+  worker->use_uring = has_uring;
+
+  while (__atomic_load_n(&pending_tasks, __ATOMIC_SEQ_CST) > 0)
+  {
+    found = find_work(worker, &task, &file);
+
+    if (!found && worker->queued_chunk != NULL)
+    {
+      // Scan the files being read before waiting for more tasks.
+
+      flush_chunk(worker);
+      continue;
+    }
+
+    if (!found)
+    {
+      // Other workers are still busy and could create more tasks. Wait
+      // until they do or all of them finish, looking once more after
+      // announcing it, as a task could have been created right before.
+
+      __atomic_add_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+
+      found = find_work(worker, &task, &file);
+
+      if (!found && __atomic_load_n(&pending_tasks, __ATOMIC_SEQ_CST) > 0)
+        semaphore_wait(&work_available);
+
+      __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+
+      if (!found)
+        continue;
+    }
+
+    if (task != NULL)
+    {
+      scan_dir_task(worker, task);
+    }
+    else
+    {
+      scan_listed_path(worker, file.path);
+      free(file.path);
+    }
+
+    task_done();
+  }
+
+  flush_chunk(worker);
+
+  if (has_uring)
+    uring_destroy(&worker->uring);
+
+  yr_finalize_thread();
+
+  return 0;
+}
+
+
+int init_workers(
+    YR_RULES* rules,
+    time_t start_time)
+{
+  if (semaphore_init(&work_available, 0) != 0)
+  {
+    print_scanner_error(ERROR_INTERNAL_FATAL_ERROR);
+    return FALSE;
+  }
+
+  for (int i = 0; i < threads; i++)
+  {
+    workers[i].rules = rules;
+    workers[i].start_time = start_time;
+    workers[i].seed = (unsigned int) (start_time + i);
+    workers[i].queued_chunk = NULL;
+
+    if (deque_init(&workers[i].deque) != 0 ||
+        output_init(&workers[i].output, &output_mutex) != 0)
+    {
+      print_scanner_error(ERROR_INSUFICIENT_MEMORY);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+
+//
+// run_workers
+//
+// Starts the workers. They run until there are no pending tasks, so at least
+// one task must exist before calling this function.
+//
+
+void run_workers()
+{
+  for (int i = 0; i < threads; i++)
+  {
+    if (create_thread(&workers[i].thread, worker_thread, &workers[i]))
+    {
+      print_scanner_error(ERROR_COULD_NOT_CREATE_THREAD);
+      exit(EXIT_FAILURE);
+    }
+  }
+}
+
+
+void join_workers()
+{
+  for (int i = 0; i < threads; i++)
+    thread_join(&workers[i].thread);
+
+  for (int i = 0; i < threads; i++)
+  {
+    deque_destroy(&workers[i].deque);
+    output_destroy(&workers[i].output);
+  }
+
+  semaphore_destroy(&work_available);
+}
+
+
+int scan_directory(
+    YR_RULES* rules,
+    const char* dir,
+    time_t start_time)
+{
+  if (!init_workers(rules, start_time))
+    return FALSE;
+
+  // The first worker starts with the top-level directory, the rest of them
+  // will steal from it.
+
+  push_dir(&workers[0], dir);
+
+  run_workers();
+  join_workers();
+
+  return TRUE;
+}
+
+
+//
+// scan_list
+//
+// Scans the files and directories listed in a file. Paths are read while
+// the workers scan the ones read before, the queue between them blocks
+// the reading when it's full.
+//
+
+int scan_list(
+    YR_RULES* rules,
+    FILE* list,
+    time_t start_time)
+{
+  char path[MAX_PATH];
+  int separator = -1;
+
+  if (!init_workers(rules, start_time))
+    return FALSE;
+
+  if (file_queue_init(&file_queue) != 0)
+  {
+    print_scanner_error(ERROR_INTERNAL_FATAL_ERROR);
+    return FALSE;
+  }
+
+  // Reading the list counts as a pending task, so that the workers don't
+  // finish while there are more paths to read.
+
+  __atomic_add_fetch(&pending_tasks, 1, __ATOMIC_SEQ_CST);
+
+  run_workers();
+
+  while (difftime(time(NULL), start_time) < timeout &&
+         read_listed_path(list, path, sizeof(path), &separator))
+  {
+    __atomic_add_fetch(&pending_tasks, 1, __ATOMIC_SEQ_CST);
+    file_queue_put(&file_queue, path);
+    notify_work();
+  }
+
+  task_done();
+
+  join_workers();
+  file_queue_destroy(&file_queue);
+
+  return TRUE;
+}
+
+#endif
+
+
+int is_integer(
+    const char *str)
+{
+  if (*str == '-')
+    str++;
+
+  while(*str)
+  {
+    if (!isdigit(*str))
+      return FALSE;
+    str++;
+  }
+
+  return TRUE;
+}
+
+
+int is_float(
+    const char *str)
+{
+  int has_dot = FALSE;
+
+  if (*str == '-')      // skip the minus sign if present
+    str++;
+
+  if (*str == '.')      // float can't start with a dot
+    return FALSE;
+
+  while(*str)
+  {
+    if (*str == '.')
+    {
+      if (has_dot)      // two dots, not a float
+        return FALSE;
+
+      has_dot = TRUE;
+    }
+    else if (!isdigit(*str))
+    {
+      return FALSE;
+    }
+
+    str++;
+  }
+
+  return has_dot; // to be float must contain a dot
+}
+
+
+#if defined(_WIN32) || defined(__CYGWIN__)
+
+int scan_processes(
+    YR_RULES* rules,
+    time_t start_time)
+{
+  fprintf(stderr, "yara: --all-processes is not supported on this platform\n");
+  return FALSE;
+}
+
+#else
+
+typedef struct _PROCESS_INFO
+{
+  int pid;
+  long resident_size;
+
+} PROCESS_INFO;
+
+
+int compare_processes(
+    const void* a,
+    const void* b)
+{
+  long size_a = ((PROCESS_INFO*) a)->resident_size;
+  long size_b = ((PROCESS_INFO*) b)->resident_size;
+
+  return (size_a < size_b) - (size_a > size_b);
+}
+
+
+void* process_scanning_thread(void* param)
+{
+  int result = ERROR_SUCCESS;
+  THREAD_ARGS* args = (THREAD_ARGS*) param;
+  QUEUED_FILE file;
+  OUTPUT_BUFFER output;
+  SCAN_TARGET target;
+
+  // All the processes are scanned with the same rules, matches in the
+  // libraries they have in common are found only once.
+
+  int flags = process_scan_flags() | SCAN_FLAGS_PROCESS_CACHE_MAPPINGS;
+
+  if (output_init(&output, &output_mutex) != 0)
+    exit(EXIT_FAILURE);
+
+  target.output = &output;
+
+  while (file_queue_get(&file_queue, &file))
+  {
+    char* pid = file.path;
+    int elapsed_time = (int) difftime(time(NULL), args->start_time);
+
+    if (elapsed_time < timeout)
+    {
+      target_begin(&target, pid);
+
+      result = yr_rules_scan_proc(
+          args->rules,
+          atoi(pid),
+          flags,
+          callback,
+          &target,
+          timeout - elapsed_time);
+
+      // In JSON Lines format the scan time is part of the target's object.
+
+      if (result == ERROR_SUCCESS && !json_lines)
+        output_printf(&output, "%s scanned in %.3f seconds\n",
+            pid, get_time() - target.start_time);
+
+      target_end(&target, result);
+
+      if (result != ERROR_SUCCESS)
+        report_scan_error(pid, result);
+    }
+
+    free(pid);
+  }
+
+  output_destroy(&output);
+  yr_finalize_thread();
+
+  return 0;
+}
+
+
+//
+// scan_processes
+//
+// Scans all the processes listed in /proc but this one. Processes are queued
+// from the largest resident size to the smallest, so that the largest ones
+// are not left for the end while the rest of the threads are idle. Kernel
+// threads, which don't have memory of their own, are skipped.
+//
+
+int scan_processes(
+    YR_RULES* rules,
+    time_t start_time)
+{
+  PROCESS_INFO* processes = NULL;
+  PROCESS_INFO* new_processes;
+
+  THREAD thread[MAX_THREADS];
+  THREAD_ARGS thread_args;
+
+  char path[MAX_PATH];
+  char pid[32];
+
+  int processes_count = 0;
+  int processes_size = 0;
+
+  struct dirent* de;
+  DIR* dp = opendir("/proc");
+
+  if (dp == NULL)
+  {
+    fprintf(stderr, "error: could not open /proc\n");
+    return FALSE;
+  }
+
+  while ((de = readdir(dp)) != NULL)
+  {
+    long size = 0;
+    long resident_size = 0;
+    FILE* statm;
+
+    if (!is_integer(de->d_name) || atoi(de->d_name) == getpid())
+      continue;
+
+    snprintf(path, sizeof(path), "/proc/%s/statm", de->d_name);
+
+    statm = fopen(path, "r");
+
+    if (statm == NULL)
+      continue;
+
+    if (fscanf(statm, "%ld %ld", &size, &resident_size) != 2)
+      size = 0;
+
+    fclose(statm);
+
+    if (size == 0)
+      continue;
+
+    if (processes_count == processes_size)
+    {
+      processes_size = processes_size == 0 ? 256 : processes_size * 2;
+
+      new_processes = (PROCESS_INFO*) realloc(
+          processes, processes_size * sizeof(PROCESS_INFO));
+
+      if (new_processes == NULL)
+      {
+        fprintf(stderr, "error: not enough memory\n");
+        free(processes);
+        closedir(dp);
+        return FALSE;
+      }
+
+      processes = new_processes;
+    }
+
+    processes[processes_count].pid = atoi(de->d_name);
+    processes[processes_count].resident_size = resident_size;
+    processes_count++;
+  }
+
+  closedir(dp);
+
+  qsort(processes, processes_count, sizeof(PROCESS_INFO), compare_processes);
+
+  if (file_queue_init(&file_queue) != 0)
+  {
+    print_scanner_error(ERROR_INTERNAL_FATAL_ERROR);
+    free(processes);
+    return FALSE;
+  }
+
+  thread_args.rules = rules;
+  thread_args.start_time = start_time;
+
+  for (int i = 0; i < threads; i++)
+  {
+    if (create_thread(&thread[i], process_scanning_thread, &thread_args))
+    {
+      print_scanner_error(ERROR_COULD_NOT_CREATE_THREAD);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (int i = 0; i < processes_count; i++)
+  {
+    snprintf(pid, sizeof(pid), "%d", processes[i].pid);
+    file_queue_put(&file_queue, pid);
+  }
+
+  file_queue_finish(&file_queue);
+
+  for (int i = 0; i < threads; i++)
+    thread_join(&thread[i]);
+
+  file_queue_destroy(&file_queue);
+  free(processes);
+
+  return TRUE;
+}
+
+#endif
+
+
+int define_external_variables(
+    YR_RULES* rules,
+    YR_COMPILER* compiler)
+{
+  for (int i = 0; ext_vars[i] != NULL; i++)
+  {
+    char* equal_sign = strchr(ext_vars[i], '=');
+
+    if (!equal_sign)
+    {
+      fprintf(stderr, "error: wrong syntax for `-d` option.\n");
+      return FALSE;
+    }
+
+    // Replace the equal sign with null character to split the external
+    // variable definition (i.e: myvar=somevalue) in two strings: identifier
+    // and value.
+
+    *equal_sign = '\0';
 
     char* identifier = ext_vars[i];
     char* value = equal_sign + 1;
@@ -934,6 +2408,37 @@ int load_modules_data()
         return FALSE;
       }
 
+      module_data->data = (void*) module_data->mapped_file.data;
+      module_data->data_size = module_data->mapped_file.size;
+
+      #if defined(CUCKOO)
+
+      // Parse and index the cuckoo report once, instead of doing it again
+      // for every scanned file.
+
+      if (strcmp(module_data->module_name, "cuckoo") == 0)
+      {
+        YR_CUCKOO_REPORT* report;
+
+        result = yr_cuckoo_report_create(
+            module_data->mapped_file.data,
+            module_data->mapped_file.size,
+            &report);
+
+        if (result != ERROR_SUCCESS)
+        {
+          yr_filemap_unmap(&module_data->mapped_file);
+          free(module_data);
+          fprintf(stderr, "error: invalid cuckoo report \"%s\".\n", equal_sign + 1);
+          return FALSE;
+        }
+
+        module_data->data = (void*) report;
+        module_data->data_size = sizeof(YR_CUCKOO_REPORT);
+      }
+
+      #endif
+
       module_data->next = modules_data_list;
       modules_data_list = module_data;
     }
@@ -951,6 +2456,13 @@ void unload_modules_data()
   {
     MODULE_DATA* next_module_data = module_data->next;
 
+    #if defined(CUCKOO)
+
+    if (strcmp(module_data->module_name, "cuckoo") == 0)
+      yr_cuckoo_report_destroy((YR_CUCKOO_REPORT*) module_data->data);
+
+    #endif
+
     yr_filemap_unmap(&module_data->mapped_file);
     free(module_data);
 
@@ -970,6 +2482,9 @@ int main(
   YR_COMPILER* compiler = NULL;
   YR_RULES* rules = NULL;
 
+  OUTPUT_BUFFER output;
+  SCAN_TARGET target;
+
   int result;
 
   argc = args_parse(options, argc, argv);
@@ -994,7 +2509,7 @@ int main(
     return EXIT_SUCCESS;
   }
 
-  if (argc != 2)
+  if (argc != ((all_processes || scan_list_path != NULL) ? 1 : 2))
   {
     // After parsing the command-line options we expect two additional
     // arguments, the rules file and the target file, directory or pid to
@@ -1007,6 +2522,60 @@ int main(
     return EXIT_FAILURE;
   }
 
+  if (output_format != NULL)
+  {
+    if (strcmp(output_format, "jsonl") == 0)
+    {
+      json_lines = TRUE;
+    }
+    else if (strcmp(output_format, "text") != 0)
+    {
+      fprintf(stderr, "yara: unknown output format: %s\n", output_format);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (json_lines && show_module_data)
+  {
+    fprintf(stderr, "yara: module data can't be printed in jsonl format\n");
+    return EXIT_FAILURE;
+  }
+
+  // Results coming from the cache have no matching strings, which the
+  // jsonl format always includes.
+
+  if (cache_path != NULL &&
+      (show_strings || show_module_data || modules_data[0] != NULL ||
+       json_lines))
+  {
+    fprintf(stderr,
+        "yara: --cache can't be used with -s, -D, -x or --format=jsonl\n");
+    return EXIT_FAILURE;
+  }
+
+  if (output_order != NULL)
+  {
+    if (strcmp(output_order, "none") == 0)
+    {
+      flush_each_rule = TRUE;
+    }
+    else if (strcmp(output_order, "file") != 0)
+    {
+      fprintf(stderr, "yara: unknown output order: %s\n", output_order);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Output buffer for the targets scanned by the main thread.
+
+  if (output_init(&output, &output_mutex) != 0)
+  {
+    fprintf(stderr, "error: not enough memory\n");
+    return EXIT_FAILURE;
+  }
+
+  target.output = &output;
+
   if (!load_modules_data())
     exit_with_code(EXIT_FAILURE);
 
@@ -1085,24 +2654,63 @@ int main(
       exit_with_code(EXIT_FAILURE);
   }
 
+  if (cache_path != NULL)
+  {
+    result = yr_scan_cache_open(cache_path, rules, 0, &scan_cache);
+
+    if (result != ERROR_SUCCESS && !ignore_warnings)
+      fprintf(stderr, "warning: could not open cache %s, scanning without "
+          "it\n", cache_path);
+  }
+
   mutex_init(&output_mutex);
+  mutex_init(&count_mutex);
+
+  if (excluded_paths != NULL)
+    yr_set_configuration(YR_CONFIG_PROCESS_EXCLUDED_PATHS, excluded_paths);
+
+  if (all_processes)
+  {
+    if (!scan_processes(rules, time(NULL)))
+      exit_with_code(EXIT_FAILURE);
+  }
+  else if (scan_list_path != NULL)
+  {
+    FILE* list = stdin;
+
+    if (strcmp(scan_list_path, "-") != 0)
+      list = fopen(scan_list_path, "rb");
+
+    if (list == NULL)
+    {
+      fprintf(stderr, "error: could not open file: %s\n", scan_list_path);
+      exit_with_code(EXIT_FAILURE);
+    }
+
+    result = scan_list(rules, list, time(NULL));
+
+    if (list != stdin)
+      fclose(list);
 
-  if (is_integer(argv[1]))
+    if (!result)
+      exit_with_code(EXIT_FAILURE);
+  }
+  else if (is_integer(argv[1]))
   {
     int pid = atoi(argv[1]);
-    int flags = 0;
 
-    if (fast_scan)
-      flags |= SCAN_FLAGS_FAST_MODE;
+    target_begin(&target, argv[1]);
 
     result = yr_rules_scan_proc(
         rules,
         pid,
-        flags,
+        process_scan_flags(),
         callback,
-        (void*) argv[1],
+        &target,
         timeout);
 
+    target_end(&target, result);
+
     if (result != ERROR_SUCCESS)
     {
       print_scanner_error(result);
@@ -1111,43 +2719,8 @@ int main(
   }
   else if (is_directory(argv[1]))
   {
-    if (file_queue_init() != 0)
-    {
-      print_scanner_error(ERROR_INTERNAL_FATAL_ERROR);
+    if (!scan_directory(rules, argv[1], time(NULL)))
       exit_with_code(EXIT_FAILURE);
-    }
-
-    THREAD thread[MAX_THREADS];
-    THREAD_ARGS thread_args;
-
-    time_t start_time = time(NULL);
-
-    thread_args.rules = rules;
-    thread_args.start_time = start_time;
-
-    for (int i = 0; i < threads; i++)
-    {
-      if (create_thread(&thread[i], scanning_thread, (void*) &thread_args))
-      {
-        print_scanner_error(ERROR_COULD_NOT_CREATE_THREAD);
-        exit_with_code(EXIT_FAILURE);
-      }
-    }
-
-    scan_dir(
-        argv[1],
-        recursive_search,
-        start_time,
-        rules,
-        callback);
-
-    file_queue_finish();
-
-    // Wait for scan threads to finish
-    for (int i = 0; i < threads; i++)
-      thread_join(&thread[i]);
-
-    file_queue_destroy();
   }
   else
   {
@@ -1156,14 +2729,19 @@ int main(
     if (fast_scan)
       flags |= SCAN_FLAGS_FAST_MODE;
 
-    result = yr_rules_scan_file(
+    target_begin(&target, argv[1]);
+
+    result = yr_rules_scan_file_cached(
         rules,
+        scan_cache,
         argv[1],
         flags,
         callback,
-        (void*) argv[1],
+        &target,
         timeout);
 
+    target_end(&target, result);
+
     if (result != ERROR_SUCCESS)
     {
       fprintf(stderr, "error scanning %s: ", argv[1]);
@@ -1180,8 +2758,12 @@ int main(
 
 _exit:
 
+  output_destroy(&output);
   unload_modules_data();
 
+  if (scan_cache != NULL)
+    yr_scan_cache_close(scan_cache);
+
   if (compiler != NULL)
     yr_compiler_destroy(compiler);
 